@@ -64,6 +64,13 @@ const etcd_tree = {
             // client and osd
             tcp_header_buffer_size: 65536,
             use_sync_send_recv: false,
+            use_zerocopy_send: false,
+            zerocopy_send_threshold: 32768,
+            use_multishot_recv: false,
+            multishot_recv_buffers: 256,
+            use_msg_batch: true,
+            use_shm: false,
+            shm_ring_size: 8388608,
             use_rdma: true,
             rdma_device: null, // for example, "rocep5s0f0"
             rdma_port_num: 1,
@@ -73,14 +80,25 @@ const etcd_tree = {
             rdma_max_send: 32,
             rdma_max_recv: 8,
             rdma_max_msg: 1048576,
+            rdma_rdv_threshold: 65536,
+            rdma_pool_size: 33554432,
             log_level: 0,
+            trace_sample: 0,
+            trace_file: null, // for example, "/var/log/vitastor/trace.jsonl"
+            trace_buffer_size: 65536,
             block_size: 131072,
             disk_alignment: 4096,
             bitmap_granularity: 4096,
             immediate_commit: false, // 'all' or 'small'
             client_dirty_limit: 33554432,
+            client_read_cache_size: 0,
+            client_read_cache_writable: false,
+            client_read_cache_writable_ttl: 1000, // ms
+            client_readahead_size: 0,
+            client_inmemory_flush_interval: 1000, // ms
             peer_connect_interval: 5, // seconds. min: 1
             peer_connect_timeout: 5, // seconds. min: 1
+            peer_connections: 1,
             osd_idle_timeout: 5, // seconds. min: 1
             osd_ping_timeout: 5, // seconds. min: 1
             up_wait_retry_interval: 500, // ms. min: 50
@@ -100,6 +118,11 @@ const etcd_tree = {
             client_queue_depth: 128, // unused
             recovery_queue_depth: 4,
             recovery_sync_batch: 16,
+            recovery_batch_size: 1,
+            recovery_bandwidth: 0, // bytes per second, 0 = unlimited
+            recovery_iops: 0, // 0 = unlimited
+            recovery_target_latency: 0, // usec, 0 = don't adapt to client load
+            recovery_tune_interval: 1, // seconds
             readonly: false,
             no_recovery: false,
             no_rebalance: false,
@@ -107,6 +130,7 @@ const etcd_tree = {
             slow_log_interval: 10,
             inode_vanish_time: 60,
             osd_memlock: false,
+            busy_poll_us: 0,
             // blockstore - fixed in superblock
             block_size,
             disk_alignment,
@@ -229,6 +253,23 @@ const etcd_tree = {
                     degraded: { count: uint64_t, bytes: uint64_t },
                     misplaced: { count: uint64_t, bytes: uint64_t },
                 },
+                recovery_qos: {
+                    bps: uint64_t,
+                    iops: uint64_t,
+                    client_latency: uint64_t, // usec
+                    tune_factor: float, // 0..1
+                    throttled: boolean,
+                },
+                zerocopy_stats: {
+                    bytes: uint64_t, // sent without copying
+                    copied_bytes: uint64_t, // sent with zero-copy sendmsg, but copied by the kernel
+                },
+                pool_stats: {
+                    // allocations and allocations served from the pool of freed objects
+                    op: { alloc: uint64_t, hit: uint64_t },
+                    op_data: { alloc: uint64_t, hit: uint64_t },
+                    buffer: { alloc: uint64_t, hit: uint64_t },
+                },
             }, */
         },
         inodestats: {
@@ -150,6 +150,10 @@ struct blockstore_op_t
     void *buf;
     void *bitmap;
     int retval;
+    // Tracing: if set by the caller, the blockstore saves the time of the first attempt
+    // to submit the operation to the disk into submit_time_us (real-time clock, microseconds)
+    bool trace_submit = false;
+    uint64_t submit_time_us = 0;
 
     uint8_t private_data[BS_OP_PRIVATE_DATA_SIZE];
 };
@@ -186,6 +190,10 @@ public:
     // Simplified synchronous operation: get object bitmap & current version
     int read_bitmap(object_id oid, uint64_t target_version, void *bitmap, uint64_t *result_version = NULL);
 
+    // Simplified synchronous operation: list versions of a single object like BS_OP_LIST does,
+    // returns the stable version (0 if there's none) and appends unstable versions to <unstable>
+    uint64_t list_object(object_id oid, std::vector<obj_ver_id> & unstable);
+
     // Get per-inode space usage statistics
     std::map<uint64_t, uint64_t> & get_inode_space_stats();
 
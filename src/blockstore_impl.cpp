@@ -131,6 +131,12 @@ void blockstore_impl_t::loop()
                     continue;
                 }
             }
+            if (op->trace_submit && !op->submit_time_us)
+            {
+                timespec tv;
+                clock_gettime(CLOCK_REALTIME, &tv);
+                op->submit_time_us = tv.tv_sec*1000000ul + tv.tv_nsec/1000;
+            }
             unsigned prev_sqe_pos = ringloop->save();
             // 0 = can't submit
             // 1 = in progress
@@ -667,6 +673,36 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
     FINISH_OP(op);
 }
 
+// Same as process_list(), but for a single object
+uint64_t blockstore_impl_t::list_object(object_id oid, std::vector<obj_ver_id> & unstable)
+{
+    uint64_t stable_version = 0;
+    auto & clean_db = clean_db_shard(oid);
+    auto clean_it = clean_db.find(oid);
+    if (clean_it != clean_db.end())
+    {
+        stable_version = clean_it->second.version;
+    }
+    auto dirty_it = dirty_db.lower_bound((obj_ver_id){ .oid = oid, .version = 0 });
+    for (; dirty_it != dirty_db.end() && dirty_it->first.oid == oid; dirty_it++)
+    {
+        if (IS_DELETE(dirty_it->second.state))
+        {
+            // Deletions are always stable
+            stable_version = 0;
+        }
+        else if (IS_STABLE(dirty_it->second.state) || (dirty_it->second.state & BS_ST_INSTANT))
+        {
+            stable_version = dirty_it->first.version;
+        }
+        else
+        {
+            unstable.push_back(dirty_it->first);
+        }
+    }
+    return stable_version;
+}
+
 void blockstore_impl_t::dump_diagnostics()
 {
     journal.dump_diagnostics();
@@ -47,10 +47,13 @@ static const char* help_text =
     "  Create a snapshot of image <name>. May be used live if only a single writer is active.\n"
     "\n"
     "vitastor-cli modify <name> [--rename <new-name>] [--resize <size>] [--readonly | --readwrite] [-f|--force]\n"
+    "    [--inmemory-commit on|off]\n"
     "  Rename, resize image or change its readonly status. Images with children can't be made read-write.\n"
     "  If the new size is smaller than the old size, extra data will be purged.\n"
     "  You should resize file system in the image, if present, before shrinking it.\n"
     "  -f|--force  Proceed with shrinking or setting readwrite flag even if the image has children.\n"
+    "  --inmemory-commit on|off  Acknowledge writes to the image as soon as they're copied into client\n"
+    "              memory. Fast, but unsynced data is lost if the client crashes. Use only for scratch disks.\n"
     "\n"
     "vitastor-cli rm <from> [<to>] [--writers-stopped]\n"
     "  Remove <from> or all layers between <from> and <to> (<to> must be a child of <from>),\n"
@@ -82,6 +85,14 @@ static const char* help_text =
     "  With --dry-run only checks if deletion is possible without data loss and\n"
     "  redundancy degradation.\n"
     "\n"
+    "vitastor-cli trace-merge [-l] [-n N] [--min-lat <us>] <file> [file...]\n"
+    "  Merge operation trace files saved by clients and OSDs with trace_file option\n"
+    "  and show where the time of sampled operations is spent, by intervals between\n"
+    "  consecutive processing stages.\n"
+    "  -l|--long       Also show the slowest traces stage by stage\n"
+    "  -n|--count N    Number of slowest traces to show (default 10)\n"
+    "  --min-lat US    Only include operations slower than US microseconds\n"
+    "\n"
     "Use vitastor-cli --help <command> for command details or vitastor-cli --help --all for all details.\n"
     "\n"
     "GLOBAL OPTIONS:\n"
@@ -281,6 +292,14 @@ static int run(cli_tool_t *p, json11::Json::object cfg)
         // Allocate a new OSD number
         action_cb = p->start_alloc_osd(cfg);
     }
+    else if (cmd[0] == "trace-merge")
+    {
+        // Merge trace files, doesn't connect to the cluster
+        cmd.erase(cmd.begin(), cmd.begin()+1);
+        cfg["files"] = cmd;
+        result = cmd.size() ? p->trace_merge(cfg)
+            : (cli_result_t){ .err = EINVAL, .text = "Please specify trace files to merge" };
+    }
     else
     {
         result = { .err = EINVAL, .text = "unknown command: "+cmd[0].string_value() };
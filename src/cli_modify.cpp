@@ -5,7 +5,7 @@
 #include "cluster_client.h"
 #include "str_util.h"
 
-// Rename, resize image (and purge extra data on shrink) or change its readonly status
+// Rename, resize image (and purge extra data on shrink), change its readonly status or in-memory commit mode
 struct image_changer_t
 {
     cli_tool_t *parent;
@@ -15,6 +15,8 @@ struct image_changer_t
     uint64_t new_size = 0;
     bool force_size = false;
     bool set_readonly = false, set_readwrite = false, force = false;
+    // -1 = no change, 0 = disable, 1 = enable
+    int set_inmemory = -1;
     // interval between fsyncs
     int fsync_interval = 128;
 
@@ -82,7 +84,8 @@ struct image_changer_t
         if ((!set_readwrite || !cfg.readonly) &&
             (!set_readonly || cfg.readonly) &&
             (!new_size && !force_size || cfg.size == new_size) &&
-            (new_name == "" || new_name == image_name))
+            (new_name == "" || new_name == image_name) &&
+            (set_inmemory < 0 || cfg.meta["inmemory_commit"].bool_value() == (set_inmemory > 0)))
         {
             result = (cli_result_t){ .text = "No change" };
             state = 100;
@@ -140,6 +143,15 @@ resume_1:
         {
             cfg.name = new_name;
         }
+        if (set_inmemory >= 0)
+        {
+            auto meta = cfg.meta.object_items();
+            if (set_inmemory)
+                meta["inmemory_commit"] = true;
+            else
+                meta.erase("inmemory_commit");
+            cfg.meta = meta.size() ? json11::Json(meta) : json11::Json();
+        }
         {
             std::string cur_cfg_key = base64_encode(parent->cli->st_cli.etcd_prefix+
                 "/config/inode/"+std::to_string(INODE_POOL(inode_num))+
@@ -239,6 +251,12 @@ std::function<bool(cli_result_t &)> cli_tool_t::start_modify(json11::Json cfg)
     changer->fsync_interval = cfg["fsync_interval"].uint64_value();
     if (!changer->fsync_interval)
         changer->fsync_interval = 128;
+    if (!cfg["inmemory_commit"].is_null())
+    {
+        std::string v = cfg["inmemory_commit"].string_value();
+        changer->set_inmemory = cfg["inmemory_commit"].bool_value() ||
+            v == "on" || v == "yes" || v == "true" || v == "1" ? 1 : 0;
+    }
     // FIXME Check that the image doesn't have children when shrinking
     return [changer](cli_result_t & result)
     {
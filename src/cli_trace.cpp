@@ -0,0 +1,184 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Merge operation trace spans saved by clients and OSDs (see osd_trace.h)
+// and show where the time of sampled operations is spent
+
+#include <fstream>
+#include <algorithm>
+
+#include "cli.h"
+#include "str_util.h"
+
+struct trace_span_t
+{
+    uint64_t time;
+    std::string stage;
+    uint64_t node;
+    std::string op;
+    uint64_t peer;
+};
+
+struct trace_interval_t
+{
+    std::vector<uint64_t> lat;
+    uint64_t sum = 0;
+};
+
+static std::string span_title(const trace_span_t & span)
+{
+    std::string s = span.stage;
+    if (span.node)
+        s += " @"+std::to_string(span.node);
+    if (span.peer && span.peer != span.node)
+        s += " ->"+std::to_string(span.peer);
+    return s;
+}
+
+cli_result_t cli_tool_t::trace_merge(json11::Json cfg)
+{
+    std::map<std::string, std::vector<trace_span_t>> traces;
+    for (auto & file: cfg["files"].array_items())
+    {
+        std::ifstream in(file.string_value());
+        if (!in)
+        {
+            return (cli_result_t){ .err = ENOENT, .text = "Failed to open "+file.string_value() };
+        }
+        std::string line, json_err;
+        while (std::getline(in, line))
+        {
+            json11::Json span = json11::Json::parse(line, json_err);
+            if (json_err != "" || span["trace"].string_value() == "")
+            {
+                // Skip partially written lines
+                continue;
+            }
+            traces[span["trace"].string_value()].push_back((trace_span_t){
+                .time = span["time"].uint64_value(),
+                .stage = span["stage"].string_value(),
+                .node = span["node"].uint64_value(),
+                .op = span["op"].string_value(),
+                .peer = span["peer"].uint64_value(),
+            });
+        }
+    }
+    // --min-lat is stored as is, also accept --min_lat like other options
+    uint64_t min_lat = (cfg["min-lat"].is_null() ? cfg["min_lat"] : cfg["min-lat"]).uint64_value();
+    uint64_t count = cfg["count"].uint64_value();
+    if (!count)
+        count = 10;
+    std::map<std::string, trace_interval_t> intervals;
+    std::vector<std::pair<uint64_t, std::string>> totals;
+    uint64_t total_sum = 0;
+    for (auto & tp: traces)
+    {
+        auto & spans = tp.second;
+        std::stable_sort(spans.begin(), spans.end(), [](const trace_span_t & a, const trace_span_t & b)
+        {
+            return a.time < b.time;
+        });
+        uint64_t total = spans.back().time - spans.front().time;
+        if (spans.size() < 2 || total < min_lat)
+        {
+            continue;
+        }
+        totals.push_back({ total, tp.first });
+        total_sum += total;
+        // Time between consecutive spans is attributed to the transition between them
+        for (size_t i = 1; i < spans.size(); i++)
+        {
+            auto & iv = intervals[spans[i-1].stage+" -> "+spans[i].stage];
+            iv.lat.push_back(spans[i].time - spans[i-1].time);
+            iv.sum += spans[i].time - spans[i-1].time;
+        }
+    }
+    if (!totals.size())
+    {
+        return (cli_result_t){ .err = ENOENT, .text = "No complete traces found" };
+    }
+    std::sort(totals.begin(), totals.end(), std::greater<std::pair<uint64_t, std::string>>());
+    json11::Json::array interval_list;
+    for (auto & ip: intervals)
+    {
+        auto & lat = ip.second.lat;
+        std::sort(lat.begin(), lat.end());
+        interval_list.push_back(json11::Json::object {
+            { "interval", ip.first },
+            { "count", (uint64_t)lat.size() },
+            { "avg", ip.second.sum / lat.size() },
+            { "p99", lat[(lat.size()-1)*99/100] },
+            { "max", lat.back() },
+            { "share", total_sum ? 100.0*ip.second.sum/total_sum : 0 },
+        });
+    }
+    std::sort(interval_list.begin(), interval_list.end(), [](const json11::Json & a, const json11::Json & b)
+    {
+        return a["share"].number_value() > b["share"].number_value();
+    });
+    json11::Json::array slowest;
+    for (size_t i = 0; i < totals.size() && i < count; i++)
+    {
+        auto & spans = traces.at(totals[i].second);
+        json11::Json::array span_list;
+        for (auto & span: spans)
+        {
+            span_list.push_back(json11::Json::object {
+                { "stage", span.stage },
+                { "node", span.node },
+                { "peer", span.peer },
+                { "op", span.op },
+                { "offset", span.time - spans.front().time },
+            });
+        }
+        slowest.push_back(json11::Json::object {
+            { "trace", totals[i].second },
+            { "op", spans.front().op },
+            { "total", totals[i].first },
+            { "spans", span_list },
+        });
+    }
+    cli_result_t result = { .err = 0 };
+    result.data = json11::Json::object {
+        { "traces", (uint64_t)totals.size() },
+        { "intervals", interval_list },
+        { "slowest", slowest },
+    };
+    if (json_output)
+    {
+        return result;
+    }
+    json11::Json::array cols;
+    cols.push_back(json11::Json::object{ { "key", "interval" }, { "title", "INTERVAL" } });
+    cols.push_back(json11::Json::object{ { "key", "count" }, { "title", "COUNT" }, { "right", true } });
+    cols.push_back(json11::Json::object{ { "key", "avg_f" }, { "title", "AVG" }, { "right", true } });
+    cols.push_back(json11::Json::object{ { "key", "p99_f" }, { "title", "P99" }, { "right", true } });
+    cols.push_back(json11::Json::object{ { "key", "max_f" }, { "title", "MAX" }, { "right", true } });
+    cols.push_back(json11::Json::object{ { "key", "share_f" }, { "title", "SHARE" }, { "right", true } });
+    for (auto & item: interval_list)
+    {
+        auto obj = item.object_items();
+        obj["avg_f"] = format_lat(item["avg"].uint64_value());
+        obj["p99_f"] = format_lat(item["p99"].uint64_value());
+        obj["max_f"] = format_lat(item["max"].uint64_value());
+        obj["share_f"] = format_q(item["share"].number_value())+"%";
+        item = obj;
+    }
+    result.text = std::to_string(totals.size())+" traces\n\n"+print_table(interval_list, cols, color);
+    if (cfg["long"].bool_value())
+    {
+        // Show the slowest traces stage by stage
+        for (auto & tr: slowest)
+        {
+            result.text += "\n"+tr["op"].string_value()+" "+tr["trace"].string_value()+
+                ": "+format_lat(tr["total"].uint64_value())+"\n";
+            auto & spans = traces.at(tr["trace"].string_value());
+            for (size_t i = 0; i < spans.size(); i++)
+            {
+                result.text += "  +"+format_lat(spans[i].time - spans.front().time)+"  "+span_title(spans[i])+
+                    (i > 0 ? "  (+"+format_lat(spans[i].time - spans[i-1].time)+")" : "")+"\n";
+            }
+        }
+    }
+    return result;
+}
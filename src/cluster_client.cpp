@@ -3,9 +3,12 @@
 
 #include <stdexcept>
 #include <assert.h>
+#include "pg_states.h"
 #include "cluster_client.h"
+#include "cluster_wb_cache.h"
 
 #define SCRAP_BUFFER_SIZE 4*1024*1024
+#define ZERO_BUFFER_SIZE 1024*1024
 #define PART_SENT 1
 #define PART_DONE 2
 #define PART_ERROR 4
@@ -16,13 +19,14 @@
 #define OP_FLUSH_BUFFER 0x02
 #define OP_IMMEDIATE_COMMIT 0x04
 
-cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config)
+cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config, bool shared_state)
 {
     config = osd_messenger_t::read_config(config);
 
     this->ringloop = ringloop;
     this->tfd = tfd;
     this->config = config;
+    this->shared_state = shared_state;
 
     msgr.osd_num = 0;
     msgr.tfd = tfd;
@@ -35,16 +39,40 @@ cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd
             continue_ops();
             continue_lists();
         }
-        else if (dirty_buffers.size())
+        else
         {
             // peer_osd just dropped connection
+            // forget read leases received from it
+            for (auto lease_it = read_leases.begin(); lease_it != read_leases.end(); )
+            {
+                if (lease_it->second.primary_osd == peer_osd)
+                    read_leases.erase(lease_it++);
+                else
+                    lease_it++;
+            }
+            if (!dirty_buffers.size())
+            {
+                return;
+            }
+            // merge all contiguous buffers to repeat them in larger parts
+            for (auto it = dirty_buffers.begin(); it != dirty_buffers.end(); )
+            {
+                auto pool_it = st_cli.pool_config.find(INODE_POOL(it->first.inode));
+                if (pool_it == st_cli.pool_config.end())
+                {
+                    it = dirty_buffers.lower_bound((object_id){ .inode = it->first.inode+1, .stripe = 0 });
+                    continue;
+                }
+                uint64_t object_size = pool_it->second.data_block_size *
+                    (pool_it->second.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_it->second.pg_size-pool_it->second.parity_chunks);
+                it = merge_dirty_buffers(dirty_buffers, it, it->first.inode, UINT64_MAX, object_size, true);
+            }
             // determine WHICH dirty_buffers are now obsolete and repeat them
             for (auto & wr: dirty_buffers)
             {
                 if (affects_osd(wr.first.inode, wr.first.stripe, wr.second.len, peer_osd) &&
                     wr.second.state != CACHE_REPEATING)
                 {
-                    // FIXME: Flush in larger parts
                     flush_buffer(wr.first, &wr.second);
                 }
             }
@@ -68,7 +96,10 @@ cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd
     st_cli.on_reload_hook = [this]() { st_cli.load_global_config(); };
 
     st_cli.parse_config(config);
-    st_cli.load_global_config();
+    if (!shared_state)
+    {
+        st_cli.load_global_config();
+    }
 
     scrap_buffer_size = SCRAP_BUFFER_SIZE;
     scrap_buffer = malloc_or_die(scrap_buffer_size);
@@ -81,11 +112,33 @@ cluster_client_t::~cluster_client_t()
         free(bp.second.buf);
     }
     dirty_buffers.clear();
+    for (auto & rp: readaheads)
+    {
+        free_readahead(rp.second, UINT64_MAX);
+    }
+    readaheads.clear();
+    if (wb_retry_timer_id)
+    {
+        tfd->clear_timer(wb_retry_timer_id);
+        wb_retry_timer_id = 0;
+    }
+    if (inmemory_timer_id)
+    {
+        tfd->clear_timer(inmemory_timer_id);
+        inmemory_timer_id = 0;
+    }
+    *wb_alive = false;
+    if (wb_cache)
+    {
+        delete wb_cache;
+        wb_cache = NULL;
+    }
     if (ringloop)
     {
         ringloop->unregister_consumer(&consumer);
     }
     free(scrap_buffer);
+    free(zero_buffer);
 }
 
 cluster_op_t::~cluster_op_t()
@@ -101,6 +154,11 @@ cluster_op_t::~cluster_op_t()
         part_bitmaps = NULL;
         bitmap_buf = NULL;
     }
+    if (inmemory_snap)
+    {
+        free(inmemory_snap);
+        inmemory_snap = NULL;
+    }
 }
 
 void cluster_client_t::init_msgr()
@@ -121,104 +179,113 @@ void cluster_client_t::init_msgr()
     }
 }
 
+// Operations are ordered with "sync generations" instead of per-operation dependency counters,
+// so that both enqueueing and completion are O(1) regardless of the queue depth:
+// - writes of generation N wait for all SYNCs of previous generations
+// - SYNC ending generation N waits for previous SYNCs and for writes of generation N
+// - non-immediate operations wait for buffer flushes (which are always at the queue head)
+bool cluster_client_t::is_blocked(cluster_op_t *op)
+{
+    if (op->flags & (OP_IMMEDIATE_COMMIT | OP_FLUSH_BUFFER))
+        return false;
+    if (flushes_inflight > 0)
+        return true;
+    if (OSD_OP_IS_WRITE(op->opcode))
+        return op->sync_gen != sync_gen_done;
+    if (op->opcode == OSD_OP_SYNC)
+        return op->sync_gen != sync_gen_done || sync_gens.front().writes > 0;
+    return false;
+}
+
 void cluster_client_t::calc_wait(cluster_op_t *op)
 {
-    op->prev_wait = 0;
-    if (op->opcode == OSD_OP_WRITE)
+    if (OSD_OP_IS_WRITE(op->opcode))
     {
-        for (auto prev = op->prev; prev; prev = prev->prev)
-        {
-            if (prev->opcode == OSD_OP_SYNC ||
-                prev->opcode == OSD_OP_WRITE && !(op->flags & OP_FLUSH_BUFFER) && (prev->flags & OP_FLUSH_BUFFER))
-            {
-                op->prev_wait++;
-            }
-        }
-        if (!op->prev_wait)
+        op->sync_gen = sync_gen_done + sync_gens.size() - 1;
+        sync_gens.back().writes++;
+        if (!is_blocked(op))
             continue_rw(op);
     }
     else if (op->opcode == OSD_OP_SYNC)
     {
-        for (auto prev = op->prev; prev; prev = prev->prev)
-        {
-            if (prev->opcode == OSD_OP_SYNC || prev->opcode == OSD_OP_WRITE && !(prev->flags & OP_IMMEDIATE_COMMIT))
-            {
-                op->prev_wait++;
-            }
-        }
-        if (!op->prev_wait)
+        op->sync_gen = sync_gen_done + sync_gens.size() - 1;
+        sync_gens.back().sync = op;
+        sync_gens.push_back((cluster_sync_gen_t){});
+        if (!is_blocked(op))
             continue_sync(op);
     }
     else /* if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP) */
     {
-        for (auto prev = op_queue_head; prev && prev != op; prev = prev->next)
-        {
-            if (prev->opcode == OSD_OP_WRITE && (prev->flags & OP_FLUSH_BUFFER))
-            {
-                op->prev_wait++;
-            }
-            else if (prev->opcode == OSD_OP_WRITE || prev->opcode == OSD_OP_READ ||
-                prev->opcode == OSD_OP_READ_BITMAP || prev->opcode == OSD_OP_READ_CHAIN_BITMAP)
-            {
-                // Flushes are always in the beginning (we're scanning from the beginning of the queue)
-                break;
-            }
-        }
-        if (!op->prev_wait)
+        if (!is_blocked(op))
             continue_rw(op);
     }
 }
 
-void cluster_client_t::inc_wait(uint64_t opcode, uint64_t flags, cluster_op_t *next, int inc)
+void cluster_client_t::release_wait(uint64_t opcode, uint64_t flags, uint64_t sync_gen, cluster_op_t *next)
 {
-    if (opcode == OSD_OP_WRITE)
+    if (flags & OP_FLUSH_BUFFER)
     {
-        while (next)
+        flushes_inflight--;
+        if (!flushes_inflight)
         {
-            auto n2 = next->next;
-            if (next->opcode == OSD_OP_SYNC && !(flags & OP_IMMEDIATE_COMMIT) ||
-                next->opcode == OSD_OP_WRITE && (flags & OP_FLUSH_BUFFER) && !(next->flags & OP_FLUSH_BUFFER) ||
-                (next->opcode == OSD_OP_READ || next->opcode == OSD_OP_READ_BITMAP ||
-                    next->opcode == OSD_OP_READ_CHAIN_BITMAP) && (flags & OP_FLUSH_BUFFER))
+            // Flushes are rare (they only happen after losing connections),
+            // so just recheck the whole queue when the last of them completes
+            std::vector<cluster_op_t*> unblocked;
+            for (auto cur = op_queue_head; cur; cur = cur->next)
             {
-                next->prev_wait += inc;
-                assert(next->prev_wait >= 0);
-                if (!next->prev_wait)
-                {
-                    if (next->opcode == OSD_OP_SYNC)
-                        continue_sync(next);
-                    else
-                        continue_rw(next);
-                }
+                if (!(cur->flags & (OP_IMMEDIATE_COMMIT | OP_FLUSH_BUFFER)) && !is_blocked(cur))
+                    unblocked.push_back(cur);
+            }
+            for (auto cur: unblocked)
+            {
+                if (cur->opcode == OSD_OP_SYNC)
+                    continue_sync(cur);
+                else
+                    continue_rw(cur);
             }
-            next = n2;
         }
     }
+    else if (OSD_OP_IS_WRITE(opcode))
+    {
+        auto & gen = sync_gens[sync_gen - sync_gen_done];
+        gen.writes--;
+        assert(gen.writes >= 0);
+        if (!gen.writes && gen.sync && !is_blocked(gen.sync))
+            continue_sync(gen.sync);
+    }
     else if (opcode == OSD_OP_SYNC)
     {
-        while (next)
+        // SYNCs always complete in order
+        assert(sync_gen == sync_gen_done && !sync_gens.front().writes);
+        sync_gens.pop_front();
+        sync_gen_done++;
+        if (flushes_inflight > 0)
+            return;
+        auto & gen = sync_gens.front();
+        if (!gen.writes)
+        {
+            if (gen.sync)
+                continue_sync(gen.sync);
+        }
+        else
         {
-            auto n2 = next->next;
-            if (next->opcode == OSD_OP_SYNC || next->opcode == OSD_OP_WRITE)
+            // Writes of the next generation directly follow the completed SYNC.
+            // Collect them first because they may complete synchronously
+            std::vector<cluster_op_t*> unblocked;
+            for (auto cur = next; cur && cur->opcode != OSD_OP_SYNC; cur = cur->next)
             {
-                next->prev_wait += inc;
-                assert(next->prev_wait >= 0);
-                if (!next->prev_wait)
-                {
-                    if (next->opcode == OSD_OP_SYNC)
-                        continue_sync(next);
-                    else
-                        continue_rw(next);
-                }
+                if (OSD_OP_IS_WRITE(cur->opcode) && !(cur->flags & (OP_IMMEDIATE_COMMIT | OP_FLUSH_BUFFER)))
+                    unblocked.push_back(cur);
             }
-            next = n2;
+            for (auto cur: unblocked)
+                continue_rw(cur);
         }
     }
 }
 
 void cluster_client_t::erase_op(cluster_op_t *op)
 {
-    uint64_t opcode = op->opcode, flags = op->flags;
+    uint64_t opcode = op->opcode, flags = op->flags, sync_gen = op->sync_gen;
     cluster_op_t *next = op->next;
     if (op->prev)
         op->prev->next = op->next;
@@ -229,11 +296,21 @@ void cluster_client_t::erase_op(cluster_op_t *op)
     if (op_queue_tail == op)
         op_queue_tail = op->prev;
     op->next = op->prev = NULL;
+    if (OSD_OP_IS_WRITE(opcode) && read_cache.max_size)
+    {
+        // Reads may be executed in parallel with the write, don't keep their results
+        read_cache.invalidate(op->inode, op->offset, op->len);
+    }
+    if (OSD_OP_IS_WRITE(opcode) && readaheads.size())
+    {
+        invalidate_readahead(op->inode, op->offset, op->len);
+    }
+    msgr.tracer.record(op->trace_id, OSD_TRACE_CLIENT_DONE, opcode);
     if (flags & OP_FLUSH_BUFFER)
         std::function<void(cluster_op_t*)>(op->callback)(op);
     if (!(flags & OP_IMMEDIATE_COMMIT))
-        inc_wait(opcode, flags, next, -1);
-    // Call callback at the end to avoid inconsistencies in prev_wait
+        release_wait(opcode, flags, sync_gen, next);
+    // Call callback at the end to avoid inconsistencies in sync generations
     // if the callback adds more operations itself
     if (!(flags & OP_FLUSH_BUFFER))
         std::function<void(cluster_op_t*)>(op->callback)(op);
@@ -259,7 +336,7 @@ restart:
         if (!op->up_wait || up_retry)
         {
             op->up_wait = false;
-            if (!op->prev_wait)
+            if (!is_blocked(op))
             {
                 if (op->opcode == OSD_OP_SYNC)
                     continue_sync(op);
@@ -313,9 +390,45 @@ void cluster_client_t::on_load_config_hook(json11::Json::object & config)
     {
         up_wait_retry_interval = 50;
     }
+    client_direct_read = config["client_direct_read"].bool_value() ||
+        config["client_direct_read"].uint64_value() != 0;
+    if (!client_direct_read)
+    {
+        read_leases.clear();
+    }
+    read_cache.set_max_size(config["client_read_cache_size"].uint64_value());
+    bool cache_writable = config["client_read_cache_writable"].bool_value() ||
+        config["client_read_cache_writable"].uint64_value() != 0;
+    if (client_read_cache_writable != cache_writable)
+    {
+        client_read_cache_writable = cache_writable;
+        read_cache.clear();
+    }
+    read_cache.version_ttl_ms = config["client_read_cache_writable_ttl"].is_null()
+        ? 1000 : config["client_read_cache_writable_ttl"].uint64_value();
+    if (!readahead_size_fixed)
+    {
+        client_readahead_size = merged_config["client_readahead_size"].uint64_value();
+    }
+    client_inmemory_flush_interval = merged_config.find("client_inmemory_flush_interval") != merged_config.end()
+        ? merged_config["client_inmemory_flush_interval"].uint64_value() : DEFAULT_CLIENT_INMEMORY_FLUSH_INTERVAL;
+    if (!wb_cache)
+    {
+        // The journal is local to the host, so it's usually set in the client configuration.
+        // It's only opened once, so changes require a restart
+        wb_cache_path = merged_config["client_writeback_cache"].string_value();
+        wb_cache_size = merged_config["client_writeback_cache_size"].uint64_value();
+        if (!wb_cache_size)
+        {
+            wb_cache_size = DEFAULT_CLIENT_WB_CACHE_SIZE;
+        }
+    }
     msgr.parse_config(config);
     msgr.parse_config(this->config);
-    st_cli.load_pgs();
+    if (!shared_state)
+    {
+        st_cli.load_pgs();
+    }
 }
 
 void cluster_client_t::on_load_pgs_hook(bool success)
@@ -325,6 +438,7 @@ void cluster_client_t::on_load_pgs_hook(bool success)
         pg_counts[pool_item.first] = pool_item.second.real_pg_count;
     }
     pgs_loaded = true;
+    open_wb_cache();
     for (auto fn: on_ready_hooks)
     {
         fn();
@@ -336,10 +450,68 @@ void cluster_client_t::on_load_pgs_hook(bool success)
     }
     offline_ops.clear();
     continue_ops();
+    wb_destage();
 }
 
 void cluster_client_t::on_change_hook(std::map<std::string, etcd_kv_t> & changes)
 {
+    if (read_cache.max_size || readaheads.size())
+    {
+        // Forget cached data of changed inodes, for example, when they're deleted or made writable
+        for (auto & chg: changes)
+        {
+            const std::string & key = chg.first;
+            if (key.substr(0, st_cli.etcd_prefix.length()+14) == st_cli.etcd_prefix+"/config/inode/")
+            {
+                // <etcd_prefix>/config/inode/%d/%d
+                pool_id_t pool_id = 0;
+                inode_t inode_num = 0;
+                char null_byte = 0;
+                int scanned = sscanf(key.c_str() + st_cli.etcd_prefix.length()+14, "%u/%lu%c", &pool_id, &inode_num, &null_byte);
+                if (scanned == 2)
+                {
+                    read_cache.invalidate_inode(INODE_WITH_POOL(pool_id, inode_num));
+                    invalidate_readahead(INODE_WITH_POOL(pool_id, inode_num), 0, UINT64_MAX);
+                }
+                else
+                {
+                    read_cache.clear();
+                    for (auto & rp: readaheads)
+                        invalidate_readahead(rp.first, 0, UINT64_MAX);
+                }
+            }
+        }
+    }
+    if (read_leases.size())
+    {
+        // Forget read leases of PGs whose state or OSD set has changed
+        for (auto & chg: changes)
+        {
+            if (chg.first == st_cli.etcd_prefix+"/config/pgs")
+            {
+                read_leases.clear();
+                break;
+            }
+            const std::string & key = chg.first;
+            int offset = 0;
+            if (key.substr(0, st_cli.etcd_prefix.length()+10) == st_cli.etcd_prefix+"/pg/state/")
+                offset = st_cli.etcd_prefix.length()+10;
+            else if (key.substr(0, st_cli.etcd_prefix.length()+12) == st_cli.etcd_prefix+"/pg/history/")
+                offset = st_cli.etcd_prefix.length()+12;
+            if (offset)
+            {
+                // <etcd_prefix>/pg/state/%d/%d or <etcd_prefix>/pg/history/%d/%d
+                pool_id_t pool_id = 0;
+                pg_num_t pg_num = 0;
+                char null_byte = 0;
+                int scanned = sscanf(key.c_str() + offset, "%u/%u%c", &pool_id, &pg_num, &null_byte);
+                if (scanned == 2)
+                    read_leases.erase({ .pool_id = pool_id, .pg_num = pg_num });
+                else
+                    read_leases.clear();
+            }
+        }
+    }
     for (auto pool_item: st_cli.pool_config)
     {
         if (pg_counts[pool_item.first] != pool_item.second.real_pg_count)
@@ -419,9 +591,23 @@ void cluster_client_t::on_ready(std::function<void(void)> fn)
  * 5) if any of them fail due to other errors, fail the SYNC operation
  */
 void cluster_client_t::execute(cluster_op_t *op)
+{
+    if (wb_cache && pgs_loaded && (OSD_OP_IS_WRITE(op->opcode) || op->opcode == OSD_OP_SYNC))
+    {
+        wb_execute(op);
+        return;
+    }
+    if (op->opcode == OSD_OP_SYNC)
+    {
+        inmemory_sync(op);
+    }
+    execute_raw(op);
+}
+
+void cluster_client_t::execute_raw(cluster_op_t *op)
 {
     if (op->opcode != OSD_OP_SYNC && op->opcode != OSD_OP_READ &&
-        op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && op->opcode != OSD_OP_WRITE)
+        op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && !OSD_OP_IS_WRITE(op->opcode))
     {
         op->retval = -EINVAL;
         std::function<void(cluster_op_t*)>(op->callback)(op);
@@ -434,6 +620,8 @@ void cluster_client_t::execute(cluster_op_t *op)
     }
     op->cur_inode = op->inode;
     op->retval = 0;
+    op->trace_id = msgr.tracer.sample();
+    msgr.tracer.record(op->trace_id, OSD_TRACE_CLIENT_SUBMIT, op->opcode);
     op->flags = op->flags & OSD_OP_IGNORE_READONLY; // single allowed flag
     if (op->opcode != OSD_OP_SYNC)
     {
@@ -453,7 +641,7 @@ void cluster_client_t::execute(cluster_op_t *op)
             return;
         }
         // Check alignment
-        if (!op->len && (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP || op->opcode == OSD_OP_WRITE) ||
+        if (!op->len && (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP || OSD_OP_IS_WRITE(op->opcode)) ||
             op->offset % pool_it->second.bitmap_granularity || op->len % pool_it->second.bitmap_granularity)
         {
             op->retval = -EINVAL;
@@ -465,7 +653,22 @@ void cluster_client_t::execute(cluster_op_t *op)
             op->flags |= OP_IMMEDIATE_COMMIT;
         }
     }
-    if (op->opcode == OSD_OP_WRITE && !(op->flags & OP_IMMEDIATE_COMMIT))
+    cluster_op_t *acked_op = NULL;
+    if (OSD_OP_IS_WRITE(op->opcode) && inmemory_allowed(op))
+    {
+        // Acknowledge the write after queueing its background copy
+        acked_op = op;
+        op = inmemory_write(op);
+    }
+    if (OSD_OP_IS_WRITE(op->opcode) && read_cache.max_size)
+    {
+        read_cache.invalidate(op->inode, op->offset, op->len);
+    }
+    if (OSD_OP_IS_WRITE(op->opcode) && readaheads.size())
+    {
+        invalidate_readahead(op->inode, op->offset, op->len);
+    }
+    if (OSD_OP_IS_WRITE(op->opcode) && !(op->flags & OP_IMMEDIATE_COMMIT))
     {
         if (dirty_bytes >= client_max_dirty_bytes || dirty_ops >= client_max_dirty_ops)
         {
@@ -486,15 +689,21 @@ void cluster_client_t::execute(cluster_op_t *op)
                 op_queue_tail = op_queue_head = sync_op;
             dirty_bytes = 0;
             dirty_ops = 0;
+            inmemory_unsynced = false;
             calc_wait(sync_op);
         }
-        dirty_bytes += op->len;
+        if (op->opcode == OSD_OP_WRITE)
+        {
+            // Zeroed ranges don't take memory
+            dirty_bytes += op->len;
+        }
         dirty_ops++;
     }
     else if (op->opcode == OSD_OP_SYNC)
     {
         dirty_bytes = 0;
         dirty_ops = 0;
+        inmemory_unsynced = false;
     }
     op->prev = op_queue_tail;
     if (op_queue_tail)
@@ -513,9 +722,58 @@ void cluster_client_t::execute(cluster_op_t *op)
         else
             continue_rw(op);
     }
+    if (acked_op)
+    {
+        acked_op->retval = acked_op->len;
+        std::function<void(cluster_op_t*)>(acked_op->callback)(acked_op);
+    }
+}
+
+// Merge contiguous buffers of <inode> starting with <it> and up to <end_offset> if they fit into one object.
+// Returns the iterator to the first buffer after the processed range
+std::map<object_id, cluster_buffer_t>::iterator cluster_client_t::merge_dirty_buffers(
+    std::map<object_id, cluster_buffer_t> & dirty_buffers, std::map<object_id, cluster_buffer_t>::iterator it,
+    uint64_t inode, uint64_t end_offset, uint64_t object_size, bool any_state)
+{
+    while (it != dirty_buffers.end() && it->first.inode == inode && it->first.stripe <= end_offset)
+    {
+        auto next_it = std::next(it);
+        if (next_it == dirty_buffers.end() || next_it->first.inode != inode || next_it->first.stripe > end_offset)
+        {
+            return next_it;
+        }
+        // Buffers which are being repeated are referenced by their flush operations.
+        // Buffers which are being synced are only merged with each other during normal operation,
+        // otherwise they wouldn't be freed after SYNC while writes continue
+        if (next_it->first.stripe == it->first.stripe + it->second.len &&
+            it->first.stripe / object_size == (next_it->first.stripe + next_it->second.len - 1) / object_size &&
+            it->second.state != CACHE_REPEATING && next_it->second.state != CACHE_REPEATING &&
+            (any_state || it->second.state == next_it->second.state) &&
+            // Zeroed ranges are only merged with each other
+            !it->second.buf == !next_it->second.buf)
+        {
+            if (it->second.buf)
+            {
+                it->second.buf = realloc_or_die(it->second.buf, it->second.len + next_it->second.len);
+                memcpy((uint8_t*)it->second.buf + it->second.len, next_it->second.buf, next_it->second.len);
+                free(next_it->second.buf);
+            }
+            it->second.len += next_it->second.len;
+            if (next_it->second.state == CACHE_DIRTY)
+            {
+                it->second.state = CACHE_DIRTY;
+            }
+            dirty_buffers.erase(next_it);
+        }
+        else
+        {
+            it = next_it;
+        }
+    }
+    return it;
 }
 
-void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers)
+void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers, uint64_t object_size)
 {
     // Save operation for replay when one of PGs goes out of sync
     // (primary OSD drops our connection in this case)
@@ -533,6 +791,9 @@ void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_
             break;
         }
     }
+    // Zeroed ranges are saved as buffers without data and replayed with WRITE_ZEROES.
+    // Discards are also replayed this way: discarded data may read as zeroes
+    bool zero = op->opcode != OSD_OP_WRITE;
     uint64_t pos = op->offset, len = op->len, iov_idx = 0, iov_pos = 0;
     while (len > 0)
     {
@@ -555,10 +816,14 @@ void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_
                 .inode = op->inode,
                 .stripe = pos,
             }, (cluster_buffer_t){
-                .buf = malloc_or_die(new_len),
+                .buf = zero ? NULL : malloc_or_die(new_len),
                 .len = new_len,
             });
         }
+        else if (!zero && !dirty_it->second.buf)
+        {
+            dirty_it = split_zero_buffer(dirty_buffers, dirty_it, pos, len);
+        }
         // FIXME: Split big buffers into smaller ones on overwrites. But this will require refcounting
         dirty_it->second.state = CACHE_DIRTY;
         uint64_t cur_len = (dirty_it->first.stripe + dirty_it->second.len - pos);
@@ -566,6 +831,16 @@ void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_
         {
             cur_len = len;
         }
+        if (zero)
+        {
+            if (dirty_it->second.buf)
+            {
+                memset((uint8_t*)dirty_it->second.buf + pos - dirty_it->first.stripe, 0, cur_len);
+            }
+            pos += cur_len;
+            len -= cur_len;
+            cur_len = 0;
+        }
         while (cur_len > 0 && iov_idx < op->iov.count)
         {
             unsigned iov_len = (op->iov.buf[iov_idx].iov_len - iov_pos);
@@ -591,6 +866,52 @@ void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_
         }
         dirty_it++;
     }
+    // Merge the new data with adjacent buffers to replay it with less operations
+    dirty_it = dirty_buffers.lower_bound((object_id){
+        .inode = op->inode,
+        .stripe = op->offset,
+    });
+    if (dirty_it != dirty_buffers.begin() && std::prev(dirty_it)->first.inode == op->inode)
+    {
+        dirty_it--;
+    }
+    merge_dirty_buffers(dirty_buffers, dirty_it, op->inode, op->offset+op->len, object_size, false);
+}
+
+// Cut the part starting at <pos> and at most <len> bytes long out of the zeroed range <it>
+// and allocate a data buffer for it. Other parts of the range stay zeroed.
+// Only the original entry may be referenced by a flush, so cut parts are always dirty
+std::map<object_id, cluster_buffer_t>::iterator cluster_client_t::split_zero_buffer(
+    std::map<object_id, cluster_buffer_t> & dirty_buffers, std::map<object_id, cluster_buffer_t>::iterator it,
+    uint64_t pos, uint64_t len)
+{
+    uint64_t end = it->first.stripe + it->second.len;
+    if (pos > it->first.stripe)
+    {
+        it->second.len = pos - it->first.stripe;
+        it = dirty_buffers.emplace_hint(std::next(it), (object_id){
+            .inode = it->first.inode,
+            .stripe = pos,
+        }, (cluster_buffer_t){
+            .buf = NULL,
+            .len = end - pos,
+            .state = CACHE_DIRTY,
+        });
+    }
+    if (end > pos + len)
+    {
+        it->second.len = len;
+        dirty_buffers.emplace_hint(std::next(it), (object_id){
+            .inode = it->first.inode,
+            .stripe = pos + len,
+        }, (cluster_buffer_t){
+            .buf = NULL,
+            .len = end - pos - len,
+            .state = CACHE_DIRTY,
+        });
+    }
+    it->second.buf = malloc_or_die(it->second.len);
+    return it;
 }
 
 void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
@@ -598,11 +919,14 @@ void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
     wr->state = CACHE_REPEATING;
     cluster_op_t *op = new cluster_op_t;
     op->flags = OSD_OP_IGNORE_READONLY|OP_FLUSH_BUFFER;
-    op->opcode = OSD_OP_WRITE;
+    op->opcode = wr->buf ? OSD_OP_WRITE : OSD_OP_WRITE_ZEROES;
     op->cur_inode = op->inode = oid.inode;
     op->offset = oid.stripe;
     op->len = wr->len;
-    op->iov.push_back(wr->buf, wr->len);
+    if (wr->buf)
+    {
+        op->iov.push_back(wr->buf, wr->len);
+    }
     op->callback = [wr](cluster_op_t* op)
     {
         if (wr->state == CACHE_REPEATING)
@@ -619,7 +943,7 @@ void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
     }
     else
         op_queue_tail = op_queue_head = op;
-    inc_wait(op->opcode, op->flags, op->next, 1);
+    flushes_inflight++;
     continue_rw(op);
 }
 
@@ -633,9 +957,16 @@ int cluster_client_t::continue_rw(cluster_op_t *op)
         goto resume_2;
     else if (op->state == 3)
         goto resume_3;
+    else if (op->state == 4)
+        return 0; // waiting for read-ahead
 resume_0:
-    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
+    if (OSD_OP_IS_WRITE(op->opcode) || op->opcode == OSD_OP_DELETE)
     {
+        if (op->flags & OP_INMEMORY)
+        {
+            // Its data goes to dirty_buffers now
+            inmemory_blocked--;
+        }
         if (!(op->flags & OSD_OP_IGNORE_READONLY))
         {
             auto ino_it = st_cli.inode_config.find(op->inode);
@@ -646,16 +977,43 @@ resume_0:
                 return 1;
             }
         }
-        if (op->opcode == OSD_OP_WRITE && !(op->flags & OP_IMMEDIATE_COMMIT) && !(op->flags & OP_FLUSH_BUFFER))
+        if (OSD_OP_IS_WRITE(op->opcode) && !(op->flags & OP_IMMEDIATE_COMMIT) && !(op->flags & OP_FLUSH_BUFFER))
+        {
+            auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
+            copy_write(op, dirty_buffers, pool_cfg.data_block_size *
+                (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks));
+        }
+    }
+    else if (op->opcode == OSD_OP_READ && get_inmemory_commit(op->inode) && read_from_dirty(op, true))
+    {
+        return 1;
+    }
+    else if (op->opcode == OSD_OP_READ && client_readahead_size && !(op->flags & OP_READAHEAD) &&
+        read_from_readahead(op))
+    {
+        return 1;
+    }
+    else if (read_cache_allowed(op))
+    {
+        if (read_from_cache(op))
+        {
+            return 1;
+        }
+        op->cache_seq = read_cache.invalidate_seq;
+    }
+    if (op->opcode == OSD_OP_READ)
+    {
+        op->wb_round = wb_rounds;
+        if (get_inmemory_commit(op->inode))
         {
-            copy_write(op, dirty_buffers);
+            snapshot_dirty(op);
         }
     }
 resume_1:
     // Slice the operation into parts
     slice_rw(op);
     op->needs_reslice = false;
-    if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && op->version && op->parts.size() > 1)
+    if ((OSD_OP_IS_WRITE(op->opcode) || op->opcode == OSD_OP_DELETE) && op->version && op->parts.size() > 1)
     {
         // Atomic writes to multiple stripes are unsupported
         op->retval = -EINVAL;
@@ -737,12 +1095,40 @@ resume_3:
                 goto resume_1;
             }
         }
+        if (op->opcode == OSD_OP_READ && get_inmemory_commit(op->inode))
+        {
+            read_from_dirty(op, false);
+        }
+        if (wb_cache && op->opcode == OSD_OP_READ)
+        {
+            if (op->wb_round != wb_rounds)
+            {
+                // Dirty data may have been destaged and forgotten while the read was in progress,
+                // in that case its result may be outdated
+                op->wb_round = wb_rounds;
+                op->cur_inode = op->inode;
+                op->parts.clear();
+                op->done_count = 0;
+                goto resume_1;
+            }
+            int r = wb_read(op);
+            if (r < 0)
+            {
+                op->retval = r;
+                erase_op(op);
+                return 1;
+            }
+        }
         op->retval = op->len;
         if (op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP)
         {
             auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
             op->retval = op->len / pool_cfg.bitmap_granularity;
         }
+        else if (op->cache_seq == read_cache.invalidate_seq && read_cache_allowed(op))
+        {
+            save_to_cache(op);
+        }
         erase_op(op);
         return 1;
     }
@@ -891,7 +1277,7 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
             if (end == begin)
                 op->done_count++;
         }
-        else if (op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && op->opcode != OSD_OP_DELETE)
+        else if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_WRITE)
         {
             add_iov(end-begin, false, op, iov_idx, iov_pos, op->parts[i].iov, NULL, 0);
         }
@@ -937,11 +1323,49 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
     if (pg_it != pool_cfg.pg_config.end() &&
         !pg_it->second.pause && pg_it->second.cur_primary)
     {
+        if (op->opcode == OSD_OP_READ && client_direct_read && try_send_direct_read(op, i))
+        {
+            return true;
+        }
         osd_num_t primary_osd = pg_it->second.cur_primary;
         auto peer_it = msgr.osd_peer_fds.find(primary_osd);
         if (peer_it != msgr.osd_peer_fds.end())
         {
-            int peer_fd = peer_it->second;
+            uint64_t pg_block_size = pool_cfg.data_block_size * (
+                pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
+            );
+            // Requests to the same object go through the same connection to keep their order
+            int peer_fd = msgr.object_peer_fd(primary_osd, peer_it->second, (object_id){
+                .inode = op->cur_inode,
+                .stripe = part->offset - part->offset % pg_block_size,
+            });
+            uint64_t opcode = op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP ? OSD_OP_READ : op->opcode;
+            if ((opcode == OSD_OP_WRITE_ZEROES || opcode == OSD_OP_DISCARD) && !msgr.clients.at(peer_fd)->write_zeroes)
+            {
+                // Older OSDs reject these operations and the client drops the connection then
+                if (opcode == OSD_OP_DISCARD)
+                {
+                    part->flags |= PART_SENT | PART_ERROR;
+                    if (!op->retval || op->retval == -EPIPE)
+                    {
+                        op->retval = -EOPNOTSUPP;
+                    }
+                    return true;
+                }
+                // Zeroes may still be written as usual data
+                if (!zero_buffer)
+                {
+                    zero_buffer_size = ZERO_BUFFER_SIZE;
+                    zero_buffer = malloc_or_die(zero_buffer_size);
+                    memset(zero_buffer, 0, zero_buffer_size);
+                }
+                opcode = OSD_OP_WRITE;
+                part->iov.reset();
+                for (uint64_t pos = 0; pos < part->len; pos += zero_buffer_size)
+                {
+                    part->iov.push_back(zero_buffer, part->len-pos > zero_buffer_size ? zero_buffer_size : part->len-pos);
+                }
+            }
             part->osd_num = primary_osd;
             part->flags |= PART_SENT;
             op->inflight_count++;
@@ -962,13 +1386,15 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
                     .header = {
                         .magic = SECONDARY_OSD_OP_MAGIC,
                         .id = next_op_id(),
-                        .opcode = op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP ? OSD_OP_READ : op->opcode,
+                        .opcode = opcode,
                     },
                     .inode = op->cur_inode,
                     .offset = part->offset,
                     .len = part->len,
+                    .flags = (uint32_t)(op->opcode == OSD_OP_READ && client_direct_read &&
+                        pool_cfg.scheme == POOL_SCHEME_REPLICATED ? OSD_OP_FLAG_READ_LEASE : 0),
                     .meta_revision = meta_rev,
-                    .version = op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE ? op->version : 0,
+                    .version = OSD_OP_IS_WRITE(op->opcode) || op->opcode == OSD_OP_DELETE ? op->version : 0,
                 } },
                 .bitmap = (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP
                     ? (uint8_t*)op->part_bitmaps + pg_bitmap_size*i : NULL),
@@ -980,6 +1406,8 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
                 },
             };
             part->op.iov = part->iov;
+            part->op.req.trace.trace_id = op->trace_id;
+            msgr.tracer.record(op->trace_id, OSD_TRACE_CLIENT_SEND, part->op.req.hdr.opcode, primary_osd);
             msgr.outbox_push(&part->op);
             return true;
         }
@@ -991,6 +1419,114 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
     return false;
 }
 
+// Read directly from one of the OSDs of a PG covered by a clean read lease
+bool cluster_client_t::try_send_direct_read(cluster_op_t *op, int i)
+{
+    auto part = &op->parts[i];
+    pool_id_t pool_id = INODE_POOL(op->cur_inode);
+    auto lease_it = read_leases.find({ .pool_id = pool_id, .pg_num = part->pg_num });
+    if (lease_it == read_leases.end())
+    {
+        return false;
+    }
+    auto & lease = lease_it->second;
+    auto & pool_cfg = st_cli.pool_config.at(pool_id);
+    auto & pg_cfg = pool_cfg.pg_config.at(part->pg_num);
+    timespec tv;
+    clock_gettime(CLOCK_REALTIME, &tv);
+    if (pg_cfg.cur_primary != lease.primary_osd || pg_cfg.cur_state != PG_ACTIVE ||
+        pool_cfg.scheme != POOL_SCHEME_REPLICATED || !lease.osd_set.size() ||
+        tv.tv_sec > lease.expire.tv_sec || tv.tv_sec == lease.expire.tv_sec && tv.tv_nsec >= lease.expire.tv_nsec)
+    {
+        read_leases.erase(lease_it);
+        return false;
+    }
+    // Parents from the same pool are read by the primary OSD in a single request
+    auto ino_it = st_cli.inode_config.find(op->cur_inode);
+    if (ino_it != st_cli.inode_config.end() && ino_it->second.parent_id &&
+        INODE_POOL(ino_it->second.parent_id) == pool_id)
+    {
+        return false;
+    }
+    // Spread objects between OSDs of the PG
+    uint64_t stripe = (part->offset / pool_cfg.data_block_size) * pool_cfg.data_block_size;
+    osd_num_t osd_num = lease.osd_set[(stripe / pool_cfg.data_block_size) % lease.osd_set.size()];
+    auto peer_it = msgr.osd_peer_fds.find(osd_num);
+    if (peer_it == msgr.osd_peer_fds.end())
+    {
+        // Read from the primary while we're connecting
+        if (msgr.wanted_peers.find(osd_num) == msgr.wanted_peers.end())
+        {
+            msgr.connect_peer(osd_num, st_cli.peer_states[osd_num]);
+        }
+        return false;
+    }
+    part->osd_num = osd_num;
+    part->flags |= PART_SENT;
+    op->inflight_count++;
+    uint64_t pg_bitmap_size = pool_cfg.data_block_size / pool_cfg.bitmap_granularity / 8;
+    part->op = (osd_op_t){
+        .op_type = OSD_OP_OUT,
+        .peer_fd = msgr.object_peer_fd(osd_num, peer_it->second, (object_id){ .inode = op->cur_inode, .stripe = stripe }),
+        .req = { .sec_rw = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = next_op_id(),
+                .opcode = OSD_OP_SEC_READ,
+            },
+            .oid = {
+                .inode = op->cur_inode,
+                .stripe = stripe,
+            },
+            .version = UINT64_MAX,
+            .offset = (uint32_t)(part->offset - stripe),
+            .len = part->len,
+        } },
+        .bitmap = (uint8_t*)op->part_bitmaps + pg_bitmap_size*i,
+        .bitmap_len = (unsigned)pg_bitmap_size,
+        .callback = [this, part](osd_op_t *op_part)
+        {
+            handle_op_part(part);
+        },
+    };
+    part->op.iov = part->iov;
+    part->op.req.trace.trace_id = op->trace_id;
+    msgr.tracer.record(op->trace_id, OSD_TRACE_CLIENT_SEND, OSD_OP_SEC_READ, osd_num);
+    msgr.outbox_push(&part->op);
+    return true;
+}
+
+void cluster_client_t::save_read_lease(cluster_op_part_t *part)
+{
+    auto & reply = part->op.reply.rw;
+    if (!reply.lease_osd_count || reply.lease_osd_count > OSD_READ_LEASE_MAX_OSDS)
+    {
+        return;
+    }
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(part->parent->cur_inode));
+    auto pg_it = pool_cfg.pg_config.find(part->pg_num);
+    if (pg_it == pool_cfg.pg_config.end() || pg_it->second.cur_primary != part->osd_num)
+    {
+        return;
+    }
+    // Count the lease from the moment when the request was sent
+    auto & lease = read_leases[{ .pool_id = INODE_POOL(part->parent->cur_inode), .pg_num = part->pg_num }];
+    lease.primary_osd = part->osd_num;
+    lease.expire = part->op.tv_begin;
+    lease.expire.tv_sec += reply.lease_ms / 1000;
+    lease.expire.tv_nsec += (reply.lease_ms % 1000) * 1000000;
+    if (lease.expire.tv_nsec >= 1000000000)
+    {
+        lease.expire.tv_sec++;
+        lease.expire.tv_nsec -= 1000000000;
+    }
+    lease.osd_set.resize(reply.lease_osd_count);
+    for (int i = 0; i < reply.lease_osd_count; i++)
+    {
+        lease.osd_set[i] = reply.lease_osds[i];
+    }
+}
+
 int cluster_client_t::continue_sync(cluster_op_t *op)
 {
     if (op->state == 1)
@@ -1100,6 +1636,8 @@ void cluster_client_t::send_sync(cluster_op_t *op, cluster_op_part_t *part)
             handle_op_part(part);
         },
     };
+    part->op.req.trace.trace_id = op->trace_id;
+    msgr.tracer.record(op->trace_id, OSD_TRACE_CLIENT_SEND, OSD_OP_SYNC, part->osd_num);
     msgr.outbox_push(&part->op);
 }
 
@@ -1117,8 +1655,25 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
 {
     cluster_op_t *op = part->parent;
     op->inflight_count--;
-    int expected = part->op.req.hdr.opcode == OSD_OP_SYNC ? 0 : part->op.req.rw.len;
-    if (part->op.reply.hdr.retval != expected)
+    msgr.tracer.record(op->trace_id, OSD_TRACE_CLIENT_REPLY, part->op.req.hdr.opcode, part->osd_num);
+    bool direct = part->op.req.hdr.opcode == OSD_OP_SEC_READ;
+    int expected = part->op.req.hdr.opcode == OSD_OP_SYNC ? 0
+        : (direct ? part->op.req.sec_rw.len : part->op.req.rw.len);
+    if (direct && part->op.reply.hdr.retval != expected)
+    {
+        // Direct read failed, forget the lease and retry through the primary OSD
+        fprintf(
+            stderr, "Direct read from OSD %lu failed: retval=%ld (expected %d), retrying through the primary OSD\n",
+            part->osd_num, part->op.reply.hdr.retval, expected
+        );
+        read_leases.erase({ .pool_id = INODE_POOL(op->cur_inode), .pg_num = part->pg_num });
+        if (!op->retval)
+        {
+            op->retval = -EPIPE;
+        }
+        part->flags |= PART_ERROR;
+    }
+    else if (part->op.reply.hdr.retval != expected)
     {
         // Operation failed, retry
         if (part->op.reply.hdr.retval == -EPIPE)
@@ -1152,14 +1707,27 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
     else
     {
         // OK
-        if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && !(op->flags & OP_IMMEDIATE_COMMIT))
+        if ((OSD_OP_IS_WRITE(op->opcode) || op->opcode == OSD_OP_DELETE) && !(op->flags & OP_IMMEDIATE_COMMIT))
             dirty_osds.insert(part->osd_num);
         part->flags |= PART_DONE;
         op->done_count++;
         if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP)
         {
             copy_part_bitmap(op, part);
-            op->version = op->parts.size() == 1 ? part->op.reply.rw.version : 0;
+            op->version = op->parts.size() == 1 ? (direct ? part->op.reply.sec_rw.version : part->op.reply.rw.version) : 0;
+            if (client_read_cache_writable && read_cache.max_size && op->cur_inode == op->inode)
+            {
+                // Drop cached data if the object is changed by another client
+                auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
+                uint64_t object_size = pool_cfg.data_block_size *
+                    (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+                read_cache.check_version(op->inode, part->offset - part->offset % object_size,
+                    direct ? part->op.reply.sec_rw.version : part->op.reply.rw.version);
+            }
+            if (!direct && part->op.reply.rw.lease_ms > 0 && client_direct_read)
+            {
+                save_read_lease(part);
+            }
         }
     }
     if (op->inflight_count == 0)
@@ -1171,6 +1739,73 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
     }
 }
 
+bool cluster_client_t::read_cache_allowed(cluster_op_t *op)
+{
+    if (!read_cache.max_size || op->opcode != OSD_OP_READ)
+        return false;
+    if (client_read_cache_writable)
+        return true;
+    // Only read-only inodes (snapshots) are cached by default because they can't change
+    auto ino_it = st_cli.inode_config.find(op->inode);
+    return ino_it != st_cli.inode_config.end() && ino_it->second.readonly;
+}
+
+bool cluster_client_t::read_from_cache(cluster_op_t *op)
+{
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
+    uint64_t object_size = pool_cfg.data_block_size *
+        (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    unsigned object_bitmap_size = ((op->len / pool_cfg.bitmap_granularity + 7) / 8);
+    object_bitmap_size = (object_bitmap_size < 8 ? 8 : object_bitmap_size);
+    if (!op->bitmap_buf || op->bitmap_buf_size < object_bitmap_size)
+    {
+        op->bitmap_buf = realloc_or_die(op->bitmap_buf, object_bitmap_size);
+        op->part_bitmaps = (uint8_t*)op->bitmap_buf + object_bitmap_size;
+        op->bitmap_buf_size = object_bitmap_size;
+    }
+    memset(op->bitmap_buf, 0, object_bitmap_size);
+    uint64_t version = 0;
+    if (!read_cache.read(op->inode, op->offset, op->len, object_size, pool_cfg.bitmap_granularity,
+        op->iov, (uint8_t*)op->bitmap_buf, &version))
+    {
+        return false;
+    }
+    op->version = version;
+    op->retval = op->len;
+    erase_op(op);
+    return true;
+}
+
+void cluster_client_t::save_to_cache(cluster_op_t *op)
+{
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
+    uint64_t object_size = pool_cfg.data_block_size *
+        (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    // Versions are only tracked for writable inodes
+    auto ino_it = st_cli.inode_config.find(op->inode);
+    bool track_versions = ino_it == st_cli.inode_config.end() || !ino_it->second.readonly;
+    if (op->cur_inode == op->inode)
+    {
+        // Parts are from the top layer so their versions are known
+        for (auto & part: op->parts)
+        {
+            uint64_t version = 0;
+            if (track_versions)
+            {
+                version = part.op.req.hdr.opcode == OSD_OP_SEC_READ
+                    ? part.op.reply.sec_rw.version : part.op.reply.rw.version;
+            }
+            read_cache.insert(op->inode, part.offset, part.len, object_size, pool_cfg.bitmap_granularity,
+                part.iov, (uint8_t*)op->bitmap_buf, (part.offset - op->offset) / pool_cfg.bitmap_granularity, version);
+        }
+    }
+    else
+    {
+        read_cache.insert(op->inode, op->offset, op->len, object_size, pool_cfg.bitmap_granularity,
+            op->iov, (uint8_t*)op->bitmap_buf, 0, track_versions ? UINT64_MAX : 0);
+    }
+}
+
 void cluster_client_t::copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *part)
 {
     // Copy (OR) bitmap
@@ -1178,8 +1813,8 @@ void cluster_client_t::copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *par
     uint32_t pg_block_size = pool_cfg.data_block_size * (
         pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
     );
-    uint32_t object_offset = (part->op.req.rw.offset - op->offset) / pool_cfg.bitmap_granularity;
-    uint32_t part_offset = (part->op.req.rw.offset % pg_block_size) / pool_cfg.bitmap_granularity;
+    uint32_t object_offset = (part->offset - op->offset) / pool_cfg.bitmap_granularity;
+    uint32_t part_offset = (part->offset % pg_block_size) / pool_cfg.bitmap_granularity;
     uint32_t op_len = op->len / pool_cfg.bitmap_granularity;
     uint32_t part_len = pg_block_size/pool_cfg.bitmap_granularity - part_offset;
     if (part_len > op_len-object_offset)
@@ -3,17 +3,28 @@
 
 #pragma once
 
+#include <memory>
+
 #include "messenger.h"
 #include "etcd_state_client.h"
+#include "cluster_read_cache.h"
 
 #define DEFAULT_CLIENT_MAX_DIRTY_BYTES 32*1024*1024
 #define DEFAULT_CLIENT_MAX_DIRTY_OPS 1024
+#define DEFAULT_CLIENT_WB_CACHE_SIZE 1024*1024*1024
+#define DEFAULT_CLIENT_INMEMORY_FLUSH_INTERVAL 1000
 #define INODE_LIST_DONE 1
 #define INODE_LIST_HAS_UNSTABLE 2
 #define OSD_OP_READ_BITMAP OSD_OP_SEC_READ_BMP
 #define OSD_OP_READ_CHAIN_BITMAP 0x102
+// WRITE_ZEROES and DISCARD don't carry data, but otherwise they're handled like writes
+#define OSD_OP_IS_WRITE(opcode) ((opcode) == OSD_OP_WRITE || (opcode) == OSD_OP_WRITE_ZEROES || (opcode) == OSD_OP_DISCARD)
 
 #define OSD_OP_IGNORE_READONLY 0x08
+// internal flag of read-ahead operations
+#define OP_READAHEAD 0x10
+// internal flag of background writes of acknowledged in-memory commit data
+#define OP_INMEMORY 0x20
 
 struct cluster_op_t;
 
@@ -31,7 +42,8 @@ struct cluster_op_part_t
 
 struct cluster_op_t
 {
-    uint64_t opcode; // OSD_OP_READ, OSD_OP_WRITE, OSD_OP_SYNC, OSD_OP_DELETE, OSD_OP_READ_BITMAP, OSD_OP_READ_CHAIN_BITMAP
+    uint64_t opcode; // OSD_OP_READ, OSD_OP_WRITE, OSD_OP_WRITE_ZEROES, OSD_OP_DISCARD, OSD_OP_SYNC, OSD_OP_DELETE,
+                     // OSD_OP_READ_BITMAP, OSD_OP_READ_CHAIN_BITMAP
     uint64_t inode;
     uint64_t offset;
     uint64_t len;
@@ -62,19 +74,82 @@ protected:
     void *part_bitmaps = NULL;
     unsigned bitmap_buf_size = 0;
     cluster_op_t *prev = NULL, *next = NULL;
-    int prev_wait = 0;
+    // sync generation, see cluster_client_t::is_blocked()
+    uint64_t sync_gen = 0;
+    // non-zero if the operation is sampled for tracing
+    uint64_t trace_id = 0;
+    // read cache invalidation counter at the start of the read
+    uint64_t cache_seq = 0;
+    // number of completed write-back cache destage rounds at the start of the read
+    uint64_t wb_round = 0;
+    // copy of acknowledged in-memory commit data overlapping the read at its start, and its ranges
+    uint8_t *inmemory_snap = NULL;
+    std::vector<std::pair<uint64_t,uint64_t>> inmemory_snap_ranges;
     friend class cluster_client_t;
 };
 
+// Operations between two SYNCs
+struct cluster_sync_gen_t
+{
+    // non-immediate writes of this generation which are not completed yet
+    int writes = 0;
+    // SYNC which ends this generation
+    cluster_op_t *sync = NULL;
+};
+
 struct cluster_buffer_t
 {
+    // NULL for zeroed ranges
     void *buf;
     uint64_t len;
     int state;
 };
 
+// Clean read lease of a PG received from its primary OSD.
+// Until it expires, reads may be sent directly to any OSD from osd_set
+struct cluster_read_lease_t
+{
+    osd_num_t primary_osd;
+    timespec expire;
+    std::vector<osd_num_t> osd_set;
+};
+
+// Data read ahead for a sequential reader
+struct cluster_readahead_chunk_t
+{
+    uint64_t len;
+    void *buf = NULL;
+    void *bitmap = NULL;
+    // versions of objects in the chunk, starting with the one containing its beginning
+    std::vector<uint64_t> versions;
+    // read-ahead operation, NULL when completed
+    cluster_op_t *op = NULL;
+    // overwritten while in progress, the result must be discarded
+    bool invalid = false;
+};
+
+// Sequential read stream of an inode
+struct cluster_readahead_t
+{
+    // end of the last read
+    uint64_t next_offset = 0;
+    // current read-ahead window, 0 if the stream is not sequential
+    uint64_t window = 0;
+    uint64_t last_used = 0;
+    // offset => chunk
+    std::map<uint64_t, cluster_readahead_chunk_t> chunks;
+    // reads waiting for chunks in progress
+    std::vector<cluster_op_t*> waiting;
+};
+
+struct cluster_readahead_stats_t
+{
+    uint64_t hits = 0, misses = 0, read_bytes = 0;
+};
+
 struct inode_list_t;
 struct inode_list_osd_t;
+class cluster_wb_cache_t;
 
 // FIXME: Split into public and private interfaces
 class cluster_client_t
@@ -83,23 +158,71 @@ class cluster_client_t
     ring_loop_t *ringloop;
 
     std::map<pool_id_t, uint64_t> pg_counts;
-    // FIXME: Implement inmemory_commit mode. Note that it requires to return overlapping reads from memory.
     uint64_t client_max_dirty_bytes = 0;
     uint64_t client_max_dirty_ops = 0;
     int log_level;
     int up_wait_retry_interval = 500; // ms
+    bool client_direct_read = false;
+    bool client_read_cache_writable = false;
+    uint64_t client_readahead_size = 0;
+    // set through set_readahead_size(), configuration changes are ignored then
+    bool readahead_size_fixed = false;
+    int client_inmemory_flush_interval = DEFAULT_CLIENT_INMEMORY_FLUSH_INTERVAL; // ms
 
     int retry_timeout_id = 0;
     std::vector<cluster_op_t*> offline_ops;
     cluster_op_t *op_queue_head = NULL, *op_queue_tail = NULL;
+    // generations from sync_gen_done to the current one, the first is always the oldest unsynced
+    std::deque<cluster_sync_gen_t> sync_gens = { cluster_sync_gen_t() };
+    uint64_t sync_gen_done = 0;
+    int flushes_inflight = 0;
     std::map<object_id, cluster_buffer_t> dirty_buffers;
     std::set<osd_num_t> dirty_osds;
     uint64_t dirty_bytes = 0, dirty_ops = 0;
+    std::map<pool_pg_num_t, cluster_read_lease_t> read_leases;
+    std::map<inode_t, cluster_readahead_t> readaheads;
+    uint64_t readahead_use_counter = 0;
+    // in-memory commit: acknowledged writes not written to OSDs yet and those of them
+    // which are still waiting for previous SYNCs, so their data isn't in dirty_buffers
+    uint64_t inmemory_bytes = 0;
+    int inmemory_blocked = 0;
+    bool inmemory_unsynced = false;
+    int inmemory_timer_id = 0;
+    // background writes are numbered, errors of failed ones are reported by the next SYNC
+    uint64_t inmemory_seq = 0, inmemory_inflight = 0;
+    std::map<uint64_t, int> inmemory_errors;
 
     void *scrap_buffer = NULL;
     unsigned scrap_buffer_size = 0;
+    // written instead of WRITE_ZEROES to OSDs which don't support it
+    void *zero_buffer = NULL;
+    unsigned zero_buffer_size = 0;
+
+    // Persistent write-back cache, see cluster_wb_cache.h
+    std::string wb_cache_path;
+    uint64_t wb_cache_size = 0;
+    cluster_wb_cache_t *wb_cache = NULL;
+    // writes and syncs waiting for journal space or for destaging of overlapping data, in order
+    std::deque<cluster_op_t*> wb_pending;
+    // writes sent directly to the cluster, destaging waits for them
+    int wb_bypass_inflight = 0;
+    bool wb_bypassed = false;
+    bool wb_destaging = false;
+    // current destage round: extents up to wb_round_seq are sent in key order starting from
+    // wb_destage_next, with limited amount of data read from the journal and in flight
+    uint64_t wb_round_seq = 0, wb_round_pos = 0;
+    object_id wb_destage_next = {};
+    bool wb_destage_sending = false;
+    int wb_destage_inflight = 0, wb_destage_error = 0;
+    uint64_t wb_destage_inflight_bytes = 0;
+    int wb_retry_timer_id = 0;
+    uint64_t wb_rounds = 0;
+    // cleared in the destructor so that journal syncs completed later are ignored
+    std::shared_ptr<bool> wb_alive = std::make_shared<bool>(true);
 
     bool pgs_loaded = false;
+    // cluster state is set by the owner instead of being loaded from etcd, see cluster_client_mt.h
+    bool shared_state = false;
     ring_consumer_t consumer;
     std::vector<std::function<void(void)>> on_ready_hooks;
     std::vector<inode_list_t*> lists;
@@ -112,18 +235,34 @@ public:
     osd_messenger_t msgr;
     void init_msgr();
 
+    cluster_read_cache_t read_cache;
+    cluster_readahead_stats_t readahead_stats;
+
     json11::Json config;
     json11::Json::object merged_config;
 
-    cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config);
+    cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config, bool shared_state = false);
     ~cluster_client_t();
     void execute(cluster_op_t *op);
     bool is_ready();
     void on_ready(std::function<void(void)> fn);
 
     bool get_immediate_commit(uint64_t inode);
+    // Writes of the inode are acknowledged after copying them into memory, see cluster_client_inmemory.cpp
+    bool get_inmemory_commit(uint64_t inode);
+    // Set the maximum read-ahead window, 0 disables read-ahead
+    void set_readahead_size(uint64_t size);
+    // Set by the multi-threaded client when this client only receives operations on some objects.
+    // Read-ahead streams then skip objects for which it returns false
+    std::function<bool(uint64_t inode, uint64_t object_num)> readahead_object_owned;
 
-    static void copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers);
+    static void copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers, uint64_t object_size);
+    static std::map<object_id, cluster_buffer_t>::iterator split_zero_buffer(
+        std::map<object_id, cluster_buffer_t> & dirty_buffers, std::map<object_id, cluster_buffer_t>::iterator it,
+        uint64_t pos, uint64_t len);
+    static std::map<object_id, cluster_buffer_t>::iterator merge_dirty_buffers(
+        std::map<object_id, cluster_buffer_t> & dirty_buffers, std::map<object_id, cluster_buffer_t>::iterator it,
+        uint64_t inode, uint64_t end_offset, uint64_t object_size, bool any_state);
     void continue_ops(bool up_retry = false);
     inode_list_t *list_inode_start(inode_t inode,
         std::function<void(inode_list_t* lst, std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)> callback);
@@ -134,6 +273,7 @@ public:
     uint64_t next_op_id();
 
 protected:
+    void execute_raw(cluster_op_t *op);
     bool affects_osd(uint64_t inode, uint64_t offset, uint64_t len, osd_num_t osd);
     void flush_buffer(const object_id & oid, cluster_buffer_t *wr);
     void on_load_config_hook(json11::Json::object & config);
@@ -143,13 +283,44 @@ protected:
     int continue_rw(cluster_op_t *op);
     void slice_rw(cluster_op_t *op);
     bool try_send(cluster_op_t *op, int i);
+    bool try_send_direct_read(cluster_op_t *op, int i);
+    void save_read_lease(cluster_op_part_t *part);
     int continue_sync(cluster_op_t *op);
     void send_sync(cluster_op_t *op, cluster_op_part_t *part);
     void handle_op_part(cluster_op_part_t *part);
     void copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *part);
+    bool read_cache_allowed(cluster_op_t *op);
+    bool read_from_cache(cluster_op_t *op);
+    void save_to_cache(cluster_op_t *op);
+    bool read_from_readahead(cluster_op_t *op);
+    bool copy_from_readahead(cluster_readahead_t & ra, cluster_op_t *op);
+    void start_readahead(cluster_readahead_t & ra, uint64_t inode);
+    void finish_readahead(cluster_op_t *rop);
+    void invalidate_readahead(uint64_t inode, uint64_t offset, uint64_t len);
+    void free_readahead(cluster_readahead_t & ra, uint64_t end_offset);
+    uint64_t skip_foreign_objects(uint64_t inode, uint64_t offset);
     void erase_op(cluster_op_t *op);
+    bool inmemory_allowed(cluster_op_t *op);
+    cluster_op_t *inmemory_write(cluster_op_t *op);
+    void inmemory_sync(cluster_op_t *op);
+    void inmemory_flush_later();
+    void scan_dirty(cluster_op_t *op, std::function<void(uint64_t start, uint64_t end, uint8_t *src)> fn);
+    bool read_from_dirty(cluster_op_t *op, bool only_full);
+    void snapshot_dirty(cluster_op_t *op);
+    void open_wb_cache();
+    void wb_execute(cluster_op_t *op);
+    bool wb_try_execute(cluster_op_t *op);
+    bool wb_cacheable(cluster_op_t *op);
+    void wb_continue();
+    void wb_destage();
+    void wb_destage_send();
+    void wb_destage_sync();
+    void wb_fsync(std::function<void(int)> cb);
+    void wb_retry_later();
+    int wb_read(cluster_op_t *op);
+    bool is_blocked(cluster_op_t *op);
     void calc_wait(cluster_op_t *op);
-    void inc_wait(uint64_t opcode, uint64_t flags, cluster_op_t *next, int inc);
+    void release_wait(uint64_t opcode, uint64_t flags, uint64_t sync_gen, cluster_op_t *next);
     void continue_lists();
     void continue_listing(inode_list_t *lst);
     void send_list(inode_list_osd_t *cur_list);
@@ -0,0 +1,286 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// In-memory commit mode for inodes with "inmemory_commit": true in their metadata:
+// - writes are acknowledged right after being queued, a copy of each write is then
+//   executed in background as a usual write and kept in dirty buffers until the next SYNC
+// - the same applies to WRITE_ZEROES and DISCARD, which are kept as zeroed ranges without data
+// - reads overlapping acknowledged data take it from dirty buffers or from background writes
+//   still waiting for previous SYNCs, fully covered reads don't go to OSDs at all. Reads sent
+//   to OSDs copy such data at start because it may be synced and freed before they complete
+// - data is synced after client_max_dirty_bytes/ops, after client_inmemory_flush_interval
+//   and on every SYNC, which still waits for all previous writes to be committed
+// - when acknowledged data not written to OSDs yet exceeds client_max_dirty_bytes,
+//   further writes are only acknowledged after being written, as usual
+// - if a background write fails, the error is returned by the next SYNC
+// Data which isn't synced yet is lost if the client crashes.
+
+#include <string.h>
+#include <algorithm>
+#include "cluster_client.h"
+
+bool cluster_client_t::get_inmemory_commit(uint64_t inode)
+{
+    auto ino_it = st_cli.inode_config.find(inode);
+    return ino_it != st_cli.inode_config.end() && ino_it->second.meta["inmemory_commit"].bool_value();
+}
+
+bool cluster_client_t::inmemory_allowed(cluster_op_t *op)
+{
+    // CAS writes need real versions, writes with IGNORE_READONLY are internal.
+    // The persistent write-back cache already acknowledges writes early, and pools
+    // with immediate_commit=all don't keep dirty buffers at all
+    if (wb_cache || op->version || (op->flags & OSD_OP_IGNORE_READONLY) || inmemory_bytes >= client_max_dirty_bytes ||
+        get_immediate_commit(op->inode))
+    {
+        return false;
+    }
+    auto ino_it = st_cli.inode_config.find(op->inode);
+    // Writes to read-only inodes should fail, and they can't fail after being acknowledged
+    return ino_it != st_cli.inode_config.end() && !ino_it->second.readonly &&
+        ino_it->second.meta["inmemory_commit"].bool_value();
+}
+
+// Returns the background copy of the write to execute instead of it
+cluster_op_t *cluster_client_t::inmemory_write(cluster_op_t *op)
+{
+    cluster_op_t *bg = new cluster_op_t;
+    bg->opcode = op->opcode;
+    bg->cur_inode = bg->inode = op->inode;
+    bg->offset = op->offset;
+    bg->len = op->len;
+    bg->flags = OP_INMEMORY;
+    bg->retval = 0;
+    bg->trace_id = op->trace_id;
+    if (op->opcode == OSD_OP_WRITE)
+    {
+        bg->buf = malloc_or_die(op->len);
+        uint64_t pos = 0;
+        for (int i = 0; i < op->iov.count && pos < op->len; i++)
+        {
+            uint64_t cur = op->iov.buf[i].iov_len;
+            cur = cur > op->len-pos ? op->len-pos : cur;
+            memcpy((uint8_t*)bg->buf + pos, op->iov.buf[i].iov_base, cur);
+            pos += cur;
+        }
+        bg->iov.push_back(bg->buf, op->len);
+        inmemory_bytes += op->len;
+    }
+    uint64_t seq = ++inmemory_seq;
+    inmemory_inflight++;
+    bg->callback = [this, seq](cluster_op_t *bg)
+    {
+        inmemory_inflight--;
+        if (bg->retval != bg->len)
+        {
+            fprintf(stderr, "Failed to write in-memory committed data of inode 0x%lx at 0x%lx+0x%lx: %s\n",
+                bg->inode, bg->offset, bg->len, strerror(-bg->retval));
+            // The write is already acknowledged, so fail the SYNC following it instead
+            inmemory_errors[seq] = bg->retval < 0 ? bg->retval : -EIO;
+        }
+        if (bg->buf)
+        {
+            inmemory_bytes -= bg->len;
+        }
+        delete bg;
+    };
+    // Until continue_rw() copies it into dirty_buffers
+    inmemory_blocked++;
+    inmemory_unsynced = true;
+    inmemory_flush_later();
+    return bg;
+}
+
+// Make the SYNC fail if any background write submitted before it fails
+void cluster_client_t::inmemory_sync(cluster_op_t *op)
+{
+    if (!inmemory_inflight && !inmemory_errors.size())
+    {
+        return;
+    }
+    uint64_t seq = inmemory_seq;
+    auto cb = std::move(op->callback);
+    op->callback = [this, seq, cb](cluster_op_t *op)
+    {
+        auto err_it = inmemory_errors.begin();
+        if (err_it != inmemory_errors.end() && err_it->first <= seq)
+        {
+            if (op->retval == 0)
+            {
+                op->retval = err_it->second;
+            }
+            inmemory_errors.erase(err_it, inmemory_errors.upper_bound(seq));
+        }
+        op->callback = cb;
+        cb(op);
+    };
+}
+
+void cluster_client_t::inmemory_flush_later()
+{
+    if (inmemory_timer_id || !client_inmemory_flush_interval)
+    {
+        return;
+    }
+    inmemory_timer_id = tfd->set_timer(client_inmemory_flush_interval, false, [this](int)
+    {
+        inmemory_timer_id = 0;
+        if (inmemory_unsynced)
+        {
+            cluster_op_t *sync_op = new cluster_op_t;
+            sync_op->opcode = OSD_OP_SYNC;
+            sync_op->callback = [](cluster_op_t* sync_op)
+            {
+                delete sync_op;
+            };
+            execute_raw(sync_op);
+        }
+    });
+}
+
+// <src> is NULL for zeroed ranges
+static void copy_to_read(cluster_op_t *op, uint64_t start, uint64_t end, uint8_t *src, uint8_t *bitmap, uint32_t granularity)
+{
+    uint64_t skip = start-op->offset, done = 0;
+    for (int i = 0; i < op->iov.count && done < end-start; i++)
+    {
+        if (skip >= op->iov.buf[i].iov_len)
+        {
+            skip -= op->iov.buf[i].iov_len;
+            continue;
+        }
+        uint64_t cur = op->iov.buf[i].iov_len-skip;
+        cur = cur > end-start-done ? end-start-done : cur;
+        if (src)
+            memcpy((uint8_t*)op->iov.buf[i].iov_base + skip, src+done, cur);
+        else
+            memset((uint8_t*)op->iov.buf[i].iov_base + skip, 0, cur);
+        done += cur;
+        skip = 0;
+    }
+    for (uint64_t b = (start-op->offset)/granularity; b < (end-op->offset)/granularity; b++)
+    {
+        bitmap[b >> 3] |= (1 << (b & 7));
+    }
+}
+
+// Call <fn> for every range of acknowledged data overlapping the read, older ranges first.
+// <src> points to the data of the beginning of the range, it's NULL for zeroed ranges
+void cluster_client_t::scan_dirty(cluster_op_t *op, std::function<void(uint64_t start, uint64_t end, uint8_t *src)> fn)
+{
+    uint64_t end = op->offset+op->len;
+    auto dirty_it = dirty_buffers.lower_bound((object_id){ .inode = op->inode, .stripe = op->offset });
+    if (dirty_it != dirty_buffers.begin())
+    {
+        auto prev_it = std::prev(dirty_it);
+        if (prev_it->first.inode == op->inode && prev_it->first.stripe + prev_it->second.len > op->offset)
+            dirty_it = prev_it;
+    }
+    for (; dirty_it != dirty_buffers.end() && dirty_it->first.inode == op->inode && dirty_it->first.stripe < end; dirty_it++)
+    {
+        uint64_t start = dirty_it->first.stripe < op->offset ? op->offset : dirty_it->first.stripe;
+        uint64_t cur_end = dirty_it->first.stripe + dirty_it->second.len;
+        cur_end = cur_end > end ? end : cur_end;
+        fn(start, cur_end, dirty_it->second.buf ? (uint8_t*)dirty_it->second.buf + (start - dirty_it->first.stripe) : NULL);
+    }
+    // Background writes waiting for previous SYNCs are newer than dirty buffers
+    int seen = 0;
+    for (cluster_op_t *cur = op_queue_head; cur && seen < inmemory_blocked; cur = cur->next)
+    {
+        if ((cur->flags & OP_INMEMORY) && cur->state == 0)
+        {
+            seen++;
+            if (cur->inode == op->inode && cur->offset < end && cur->offset+cur->len > op->offset)
+            {
+                uint64_t start = cur->offset < op->offset ? op->offset : cur->offset;
+                uint64_t cur_end = cur->offset + cur->len > end ? end : cur->offset + cur->len;
+                fn(start, cur_end, cur->buf ? (uint8_t*)cur->buf + (start - cur->offset) : NULL);
+            }
+        }
+    }
+}
+
+// Copy acknowledged data over the read and set bits of the corresponding blocks.
+// Data copied at the start of the read goes first, current data is newer.
+// With <only_full>, only do it if the whole read is covered and return true then
+bool cluster_client_t::read_from_dirty(cluster_op_t *op, bool only_full)
+{
+    uint64_t end = op->offset+op->len;
+    if (only_full)
+    {
+        std::vector<std::pair<uint64_t,uint64_t>> covered;
+        scan_dirty(op, [&](uint64_t start, uint64_t cur_end, uint8_t *src)
+        {
+            covered.push_back({ start, cur_end });
+        });
+        std::sort(covered.begin(), covered.end());
+        uint64_t pos = op->offset;
+        for (auto & c: covered)
+        {
+            if (c.first > pos)
+                break;
+            pos = c.second > pos ? c.second : pos;
+        }
+        if (pos < end)
+        {
+            return false;
+        }
+    }
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
+    if (only_full)
+    {
+        unsigned bitmap_size = ((op->len / pool_cfg.bitmap_granularity + 7) / 8);
+        bitmap_size = (bitmap_size < 8 ? 8 : bitmap_size);
+        if (!op->bitmap_buf || op->bitmap_buf_size < bitmap_size)
+        {
+            op->bitmap_buf = realloc_or_die(op->bitmap_buf, bitmap_size);
+            op->part_bitmaps = (uint8_t*)op->bitmap_buf + bitmap_size;
+            op->bitmap_buf_size = bitmap_size;
+        }
+        memset(op->bitmap_buf, 0, bitmap_size);
+    }
+    if (op->inmemory_snap)
+    {
+        for (auto & r: op->inmemory_snap_ranges)
+        {
+            copy_to_read(op, r.first, r.second, op->inmemory_snap + (r.first - op->offset),
+                (uint8_t*)op->bitmap_buf, pool_cfg.bitmap_granularity);
+        }
+        free(op->inmemory_snap);
+        op->inmemory_snap = NULL;
+        op->inmemory_snap_ranges.clear();
+    }
+    scan_dirty(op, [&](uint64_t start, uint64_t cur_end, uint8_t *src)
+    {
+        copy_to_read(op, start, cur_end, src, (uint8_t*)op->bitmap_buf, pool_cfg.bitmap_granularity);
+    });
+    if (only_full)
+    {
+        op->version = 0;
+        op->retval = op->len;
+        erase_op(op);
+    }
+    return true;
+}
+
+// Copy acknowledged data overlapping the read before sending it to OSDs. It may be synced
+// and freed while the read is in progress, and the read may then miss it
+void cluster_client_t::snapshot_dirty(cluster_op_t *op)
+{
+    if (op->inmemory_snap)
+    {
+        return;
+    }
+    scan_dirty(op, [&](uint64_t start, uint64_t cur_end, uint8_t *src)
+    {
+        if (!op->inmemory_snap)
+        {
+            op->inmemory_snap = (uint8_t*)malloc_or_die(op->len);
+        }
+        if (src)
+            memcpy(op->inmemory_snap + (start - op->offset), src, cur_end-start);
+        else
+            memset(op->inmemory_snap + (start - op->offset), 0, cur_end-start);
+        op->inmemory_snap_ranges.push_back({ start, cur_end });
+    });
+}
@@ -0,0 +1,450 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <sys/eventfd.h>
+#include <stdexcept>
+#include <string.h>
+#include <unistd.h>
+
+#include "cluster_client_mt.h"
+
+// Operation split between several threads
+struct cluster_mt_split_t
+{
+    cluster_op_t *op;
+    int ok_retval;
+    std::atomic<int> left;
+    std::atomic<int> error { 0 };
+};
+
+static void slice_iov(osd_op_buf_list_t & src, uint64_t skip, uint64_t len, osd_op_buf_list_t & dst)
+{
+    for (int i = 0; i < src.count && len > 0; i++)
+    {
+        if (skip >= src.buf[i].iov_len)
+        {
+            skip -= src.buf[i].iov_len;
+            continue;
+        }
+        uint64_t n = src.buf[i].iov_len-skip;
+        if (n > len)
+            n = len;
+        dst.push_back((uint8_t*)src.buf[i].iov_base + skip, n);
+        skip = 0;
+        len -= n;
+    }
+}
+
+static cluster_op_t *split_part(cluster_mt_split_t *split)
+{
+    cluster_op_t *sub = new cluster_op_t;
+    sub->opcode = split->op->opcode;
+    sub->inode = split->op->inode;
+    sub->offset = 0;
+    sub->len = 0;
+    sub->flags = split->op->flags;
+    sub->callback = [split](cluster_op_t *sub)
+    {
+        if (sub->retval < 0)
+        {
+            int expected = 0;
+            split->error.compare_exchange_strong(expected, sub->retval);
+        }
+        delete sub;
+        if (--split->left == 0)
+        {
+            cluster_op_t *op = split->op;
+            int error = split->error;
+            op->retval = error ? error : split->ok_retval;
+            op->version = 0;
+            delete split;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+        }
+    };
+    return sub;
+}
+
+cluster_client_mt_t::cluster_client_mt_t(json11::Json & config, int thread_count)
+{
+    this->config = osd_messenger_t::read_config(config);
+    if (thread_count < 1)
+    {
+        thread_count = 1;
+    }
+    // The write-back cache journal is locked and may only be used by one client
+    json11::Json::object thread_config = this->config.object_items();
+    thread_config["client_writeback_cache"] = "";
+    json11::Json thread_config_json(thread_config);
+    for (int i = 0; i < thread_count; i++)
+    {
+        auto thr = new cluster_client_thread_t;
+        thr->parent = this;
+        thr->ringloop = new ring_loop_t(512);
+        thr->epmgr = new epoll_manager_t(thr->ringloop);
+        thr->cli = new cluster_client_t(thr->ringloop, thr->epmgr->tfd, thread_config_json, true);
+        if (thread_count > 1)
+        {
+            // Sequential streams go through all threads, every thread reads ahead its own objects
+            thr->cli->readahead_object_owned = [this, thr](uint64_t inode, uint64_t object_num)
+            {
+                return get_thread(inode, object_num) == thr;
+            };
+        }
+        thr->notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (thr->notify_fd < 0)
+        {
+            throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+        }
+        thr->epmgr->set_fd_handler(thr->notify_fd, false, [thr](int fd, int events)
+        {
+            thr->handle_queue();
+        });
+        threads.push_back(thr);
+    }
+    ringloop = new ring_loop_t(512);
+    epmgr = new epoll_manager_t(ringloop);
+    control_notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (control_notify_fd < 0)
+    {
+        throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+    }
+    epmgr->set_fd_handler(control_notify_fd, false, [](int fd, int events)
+    {
+        // Only wakes up the control thread on exit
+        eventfd_t value;
+        eventfd_read(fd, &value);
+    });
+    st_cli = new etcd_state_client_t;
+    st_cli->tfd = epmgr->tfd;
+    st_cli->on_load_config_hook = [this](json11::Json::object & cfg)
+    {
+        global_config = cfg;
+        st_cli->load_pgs();
+    };
+    st_cli->on_load_pgs_hook = [this](bool success) { send_state(NULL); };
+    st_cli->on_change_hook = [this](std::map<std::string, etcd_kv_t> & changes) { send_state(&changes); };
+    st_cli->on_reload_hook = [this]() { st_cli->load_global_config(); };
+    st_cli->parse_config(this->config);
+    st_cli->load_global_config();
+    for (auto thr: threads)
+    {
+        thr->thread = std::thread(&cluster_client_thread_t::run, thr);
+    }
+    control_thread = std::thread(&cluster_client_mt_t::run_control, this);
+}
+
+cluster_client_mt_t::~cluster_client_mt_t()
+{
+    stopping = true;
+    eventfd_write(control_notify_fd, 1);
+    control_thread.join();
+    for (auto thr: threads)
+    {
+        eventfd_write(thr->notify_fd, 1);
+        thr->thread.join();
+    }
+    for (auto thr: threads)
+    {
+        delete thr->cli;
+        thr->epmgr->set_fd_handler(thr->notify_fd, false, NULL);
+        close(thr->notify_fd);
+        delete thr->epmgr;
+        delete thr->ringloop;
+        delete thr;
+    }
+    threads.clear();
+    delete st_cli;
+    st_cli = NULL;
+    epmgr->set_fd_handler(control_notify_fd, false, NULL);
+    close(control_notify_fd);
+    delete epmgr;
+    delete ringloop;
+}
+
+void cluster_client_mt_t::run_control()
+{
+    while (!stopping)
+    {
+        {
+            // All etcd events are handled inside loop()
+            std::lock_guard<std::mutex> lock(state_mutex);
+            ringloop->loop();
+        }
+        ringloop->wait();
+    }
+}
+
+// Called in the control thread with state_mutex locked
+void cluster_client_mt_t::send_state(std::map<std::string, etcd_kv_t> *changes)
+{
+    auto state = std::make_shared<cluster_state_snapshot_t>();
+    state->full = !changes;
+    if (changes)
+    {
+        state->changes = *changes;
+    }
+    else
+    {
+        state->global_config = global_config;
+        state->pool_config = st_cli->pool_config;
+        state->peer_states = st_cli->peer_states;
+        state->inode_config = st_cli->inode_config;
+        state->inode_by_name = st_cli->inode_by_name;
+    }
+    std::shared_ptr<const cluster_state_snapshot_t> snapshot = state;
+    for (auto thr: threads)
+    {
+        thr->submit_task([thr, snapshot]() { thr->apply_state(snapshot.get()); });
+    }
+    // Operations waiting for the state are submitted after it
+    update_layout();
+    if (!changes)
+    {
+        state_loaded = true;
+        for (auto & fn: on_ready_hooks)
+        {
+            fn();
+        }
+        on_ready_hooks.clear();
+    }
+}
+
+void cluster_client_mt_t::update_layout()
+{
+    std::vector<cluster_op_t*> ops;
+    {
+        std::unique_lock<std::shared_mutex> lock(layout_mutex);
+        object_sizes.clear();
+        for (auto & pool_item: st_cli->pool_config)
+        {
+            auto & pool_cfg = pool_item.second;
+            object_sizes[pool_item.first] = pool_cfg.data_block_size *
+                (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        }
+        layout_loaded = true;
+        ops.swap(offline_ops);
+    }
+    for (auto op: ops)
+    {
+        execute(op);
+    }
+}
+
+void cluster_client_mt_t::execute(cluster_op_t *op)
+{
+    if (op->opcode == OSD_OP_SYNC)
+    {
+        // Every thread has its own unsynced writes
+        auto split = new cluster_mt_split_t;
+        split->op = op;
+        split->ok_retval = 0;
+        split->left = threads.size();
+        for (auto thr: threads)
+        {
+            thr->submit(split_part(split));
+        }
+        return;
+    }
+    uint64_t object_size = 0;
+    {
+        std::shared_lock<std::shared_mutex> lock(layout_mutex);
+        if (layout_loaded)
+        {
+            auto it = object_sizes.find(INODE_POOL(op->inode));
+            object_size = it != object_sizes.end() ? it->second : 0;
+            lock.unlock();
+            dispatch(op, object_size);
+            return;
+        }
+    }
+    {
+        std::unique_lock<std::shared_mutex> lock(layout_mutex);
+        if (!layout_loaded)
+        {
+            offline_ops.push_back(op);
+            return;
+        }
+    }
+    execute(op);
+}
+
+void cluster_client_mt_t::dispatch(cluster_op_t *op, uint64_t object_size)
+{
+    if (!object_size || !op->len || op->opcode != OSD_OP_READ && !OSD_OP_IS_WRITE(op->opcode) || op->version)
+    {
+        // Bitmap reads don't use caches, CAS writes must fit into one object anyway,
+        // and invalid operations fail in the usual way
+        submit_to(op, object_size ? op->offset/object_size : 0);
+        return;
+    }
+    uint64_t first = op->offset/object_size, last = (op->offset+op->len-1)/object_size;
+    if (first == last)
+    {
+        submit_to(op, first);
+        return;
+    }
+    auto split = new cluster_mt_split_t;
+    split->op = op;
+    split->ok_retval = op->len;
+    split->left = last-first+1;
+    // Parts may complete before the loop ends, so <op> isn't touched after submitting the last one
+    uint64_t inode = op->inode, offset = op->offset, end = op->offset+op->len;
+    for (uint64_t obj = first; obj <= last; obj++)
+    {
+        cluster_op_t *sub = split_part(split);
+        sub->offset = obj == first ? offset : obj*object_size;
+        sub->len = (obj == last ? end : (obj+1)*object_size) - sub->offset;
+        slice_iov(op->iov, sub->offset-offset, sub->len, sub->iov);
+        get_thread(inode, obj)->submit(sub);
+    }
+}
+
+void cluster_client_mt_t::submit_to(cluster_op_t *op, uint64_t object_num)
+{
+    get_thread(op->inode, object_num)->submit(op);
+}
+
+cluster_client_thread_t *cluster_client_mt_t::get_thread(uint64_t inode, uint64_t object_num)
+{
+    // Objects of an inode are distributed between threads round-robin
+    uint64_t h = (inode * 0x9E3779B97F4A7C15ul) >> 32;
+    return threads[(h + object_num) % threads.size()];
+}
+
+void cluster_client_mt_t::run_in_threads(std::function<void(cluster_client_t *cli)> fn)
+{
+    for (auto thr: threads)
+    {
+        thr->submit_task([thr, fn]() { fn(thr->cli); });
+    }
+}
+
+void cluster_client_mt_t::thread_ready()
+{
+    std::lock_guard<std::mutex> lock(ready_mutex);
+    threads_ready++;
+    ready_cv.notify_all();
+}
+
+bool cluster_client_mt_t::is_ready()
+{
+    std::lock_guard<std::mutex> lock(ready_mutex);
+    return threads_ready == (int)threads.size();
+}
+
+void cluster_client_mt_t::wait_ready()
+{
+    std::unique_lock<std::mutex> lock(ready_mutex);
+    ready_cv.wait(lock, [this]() { return threads_ready == (int)threads.size(); });
+}
+
+void cluster_client_mt_t::on_ready(std::function<void(void)> fn)
+{
+    std::lock_guard<std::mutex> lock(state_mutex);
+    if (state_loaded)
+        fn();
+    else
+        on_ready_hooks.push_back(fn);
+}
+
+int cluster_client_mt_t::thread_count()
+{
+    return threads.size();
+}
+
+cluster_client_t *cluster_client_mt_t::get_thread_client(int i)
+{
+    return threads[i]->cli;
+}
+
+void cluster_client_thread_t::run()
+{
+    while (!parent->stopping)
+    {
+        ringloop->loop();
+        ringloop->wait();
+    }
+}
+
+void cluster_client_thread_t::submit(cluster_op_t *op)
+{
+    bool wakeup = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ops.push_back(op);
+        wakeup = !notified;
+        notified = true;
+    }
+    if (wakeup)
+    {
+        eventfd_write(notify_fd, 1);
+    }
+}
+
+void cluster_client_thread_t::submit_task(std::function<void()> fn)
+{
+    bool wakeup = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(fn);
+        wakeup = !notified;
+        notified = true;
+    }
+    if (wakeup)
+    {
+        eventfd_write(notify_fd, 1);
+    }
+}
+
+void cluster_client_thread_t::handle_queue()
+{
+    eventfd_t value;
+    eventfd_read(notify_fd, &value);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        notified = false;
+        ops_run.swap(ops);
+        tasks_run.swap(tasks);
+    }
+    // State updates go before operations submitted after them
+    for (auto & fn: tasks_run)
+    {
+        fn();
+    }
+    tasks_run.clear();
+    for (auto op: ops_run)
+    {
+        cli->execute(op);
+    }
+    ops_run.clear();
+}
+
+void cluster_client_thread_t::apply_state(const cluster_state_snapshot_t *state)
+{
+    auto & st_cli = cli->st_cli;
+    if (state->full)
+    {
+        st_cli.pool_config = state->pool_config;
+        st_cli.peer_states = state->peer_states;
+        st_cli.inode_config = state->inode_config;
+        st_cli.inode_by_name = state->inode_by_name;
+        json11::Json::object cfg = state->global_config;
+        st_cli.on_load_config_hook(cfg);
+        st_cli.on_load_pgs_hook(true);
+        if (!loaded)
+        {
+            loaded = true;
+            parent->thread_ready();
+        }
+    }
+    else
+    {
+        // Parse changes like the etcd watcher does, it also calls on_change_osd_state_hook
+        for (auto & kv: state->changes)
+        {
+            st_cli.parse_state(kv.second);
+        }
+        std::map<std::string, etcd_kv_t> changes = state->changes;
+        st_cli.on_change_hook(changes);
+    }
+}
@@ -0,0 +1,114 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Multi-threaded cluster client.
+// The control thread owns the only etcd_state_client_t and sends copies of the cluster
+// state to N I/O threads, each with its own ring loop, OSD connections and cluster_client_t.
+// Operations are split at object boundaries and every part is executed by the thread
+// owning the object, so threads never share dirty buffers, caches or read-ahead data.
+// Read-ahead streams of a thread skip objects of other threads.
+// SYNC is executed by all threads. Operation callbacks are called in I/O threads.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+#include <epoll_manager.h>
+#include "cluster_client.h"
+
+// Cluster state published by the control thread. Snapshots are immutable and shared by all
+// I/O threads: threads copy the full state once after loading it and parse only changed keys
+// after that, so the whole state isn't copied into every thread on every change
+struct cluster_state_snapshot_t
+{
+    // true for the result of load_pgs(), false for a change
+    bool full = false;
+    // full state
+    json11::Json::object global_config;
+    std::map<pool_id_t, pool_config_t> pool_config;
+    std::map<osd_num_t, json11::Json> peer_states;
+    std::map<inode_t, inode_config_t> inode_config;
+    std::map<std::string, inode_t> inode_by_name;
+    // change
+    std::map<std::string, etcd_kv_t> changes;
+};
+
+class cluster_client_mt_t;
+
+struct cluster_client_thread_t
+{
+    cluster_client_mt_t *parent = NULL;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    cluster_client_t *cli = NULL;
+    std::thread thread;
+    bool loaded = false;
+
+    // submission queue, protected by mutex
+    std::mutex mutex;
+    int notify_fd = -1;
+    bool notified = false;
+    std::vector<cluster_op_t*> ops, ops_run;
+    std::vector<std::function<void()>> tasks, tasks_run;
+
+    void run();
+    void submit(cluster_op_t *op);
+    void submit_task(std::function<void()> fn);
+    void handle_queue();
+    void apply_state(const cluster_state_snapshot_t *state);
+};
+
+class cluster_client_mt_t
+{
+    json11::Json config;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    std::thread control_thread;
+    int control_notify_fd = -1;
+    std::atomic<bool> stopping { false };
+    std::vector<cluster_client_thread_t*> threads;
+    json11::Json::object global_config;
+    bool state_loaded = false;
+    std::vector<std::function<void(void)>> on_ready_hooks;
+
+    // object sizes of pools and operations submitted before the state is loaded
+    std::shared_mutex layout_mutex;
+    bool layout_loaded = false;
+    std::map<pool_id_t, uint64_t> object_sizes;
+    std::vector<cluster_op_t*> offline_ops;
+
+    std::mutex ready_mutex;
+    std::condition_variable ready_cv;
+    int threads_ready = 0;
+
+    void run_control();
+    void send_state(std::map<std::string, etcd_kv_t> *changes);
+    void update_layout();
+    void dispatch(cluster_op_t *op, uint64_t object_size);
+    void submit_to(cluster_op_t *op, uint64_t object_num);
+    cluster_client_thread_t *get_thread(uint64_t inode, uint64_t object_num);
+    void thread_ready();
+    friend struct cluster_client_thread_t;
+
+public:
+    // Lock state_mutex to access st_cli from other threads
+    std::mutex state_mutex;
+    etcd_state_client_t *st_cli = NULL;
+
+    cluster_client_mt_t(json11::Json & config, int thread_count);
+    ~cluster_client_mt_t();
+    // May be called from any thread
+    void execute(cluster_op_t *op);
+    // Run a function in every I/O thread with its cluster_client_t
+    void run_in_threads(std::function<void(cluster_client_t *cli)> fn);
+    bool is_ready();
+    void wait_ready();
+    // Call fn after loading the cluster state, with state_mutex locked
+    void on_ready(std::function<void(void)> fn);
+    int thread_count();
+    cluster_client_t *get_thread_client(int i);
+};
@@ -0,0 +1,388 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Sequential read-ahead.
+// A read continuing the previous read of the same inode is treated as a part of a sequential stream,
+// and data following it is read in advance by background reads into a bounded per-stream buffer.
+// The window starts at a few sizes of the read and doubles on every hit up to client_readahead_size.
+// Reads which get to the data being read ahead wait for it instead of being sent separately.
+// In the multi-threaded client every thread only reads objects it owns, so its streams skip
+// objects of other threads, and read-ahead only reads its own objects.
+
+#include <assert.h>
+#include <string.h>
+#include "cluster_client.h"
+
+#define CLIENT_READAHEAD_MAX_STREAMS 16
+#define CLIENT_READAHEAD_INITIAL_READS 4
+#define CLIENT_READAHEAD_MAX_SKIP 1024
+
+void cluster_client_t::set_readahead_size(uint64_t size)
+{
+    readahead_size_fixed = true;
+    client_readahead_size = size;
+    if (!size)
+    {
+        for (auto & rp: readaheads)
+        {
+            rp.second.window = 0;
+            free_readahead(rp.second, UINT64_MAX);
+        }
+    }
+}
+
+// Free completed chunks which end before <end_offset>
+void cluster_client_t::free_readahead(cluster_readahead_t & ra, uint64_t end_offset)
+{
+    for (auto it = ra.chunks.begin(); it != ra.chunks.end() && it->first < end_offset; )
+    {
+        if (!it->second.op && it->first + it->second.len <= end_offset)
+        {
+            free(it->second.buf);
+            free(it->second.bitmap);
+            ra.chunks.erase(it++);
+        }
+        else
+            it++;
+    }
+}
+
+void cluster_client_t::invalidate_readahead(uint64_t inode, uint64_t offset, uint64_t len)
+{
+    auto ra_it = readaheads.find(inode);
+    if (ra_it == readaheads.end())
+    {
+        return;
+    }
+    auto & chunks = ra_it->second.chunks;
+    for (auto it = chunks.begin(); it != chunks.end() && it->first < offset+len; )
+    {
+        if (it->first + it->second.len <= offset)
+            it++;
+        else if (it->second.op)
+        {
+            // Data may be read before or after the write, so it can't be used
+            it->second.invalid = true;
+            it++;
+        }
+        else
+        {
+            free(it->second.buf);
+            free(it->second.bitmap);
+            chunks.erase(it++);
+        }
+    }
+}
+
+// Move <offset> to the beginning of the next object owned by this client if it's in a foreign one
+uint64_t cluster_client_t::skip_foreign_objects(uint64_t inode, uint64_t offset)
+{
+    if (!readahead_object_owned)
+    {
+        return offset;
+    }
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(inode));
+    uint64_t object_size = pool_cfg.data_block_size *
+        (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    for (int i = 0; i < CLIENT_READAHEAD_MAX_SKIP && !readahead_object_owned(inode, offset/object_size); i++)
+    {
+        offset = (offset/object_size + 1) * object_size;
+    }
+    return offset;
+}
+
+// Returns true if the read is completed or waits for read-ahead
+bool cluster_client_t::read_from_readahead(cluster_op_t *op)
+{
+    auto ra_it = readaheads.find(op->inode);
+    if (ra_it == readaheads.end())
+    {
+        if (readaheads.size() >= CLIENT_READAHEAD_MAX_STREAMS)
+        {
+            // Forget the least recently used idle stream
+            auto lru_it = readaheads.end();
+            for (auto it = readaheads.begin(); it != readaheads.end(); it++)
+            {
+                bool idle = !it->second.waiting.size();
+                for (auto & cp: it->second.chunks)
+                    idle = idle && !cp.second.op;
+                if (idle && (lru_it == readaheads.end() || it->second.last_used < lru_it->second.last_used))
+                    lru_it = it;
+            }
+            if (lru_it == readaheads.end())
+            {
+                return false;
+            }
+            free_readahead(lru_it->second, UINT64_MAX);
+            readaheads.erase(lru_it);
+        }
+        ra_it = readaheads.emplace(op->inode, cluster_readahead_t()).first;
+    }
+    auto & ra = ra_it->second;
+    ra.last_used = ++readahead_use_counter;
+    // Reads of objects owned by other clients don't break the stream
+    bool sequential = op->offset == ra.next_offset ||
+        op->offset > ra.next_offset && skip_foreign_objects(op->inode, ra.next_offset) == op->offset;
+    ra.next_offset = op->offset + op->len;
+    if (!sequential)
+    {
+        // Random access, stop reading ahead
+        ra.window = 0;
+        free_readahead(ra, UINT64_MAX);
+        return false;
+    }
+    if (!ra.window)
+    {
+        ra.window = op->len * CLIENT_READAHEAD_INITIAL_READS;
+    }
+    else
+    {
+        ra.window *= 2;
+    }
+    if (ra.window > client_readahead_size)
+    {
+        ra.window = client_readahead_size;
+    }
+    bool done = false;
+    if (copy_from_readahead(ra, op))
+    {
+        done = true;
+        if (op->state != 4)
+        {
+            readahead_stats.hits++;
+            free_readahead(ra, op->offset+op->len);
+        }
+    }
+    else
+    {
+        readahead_stats.misses++;
+    }
+    start_readahead(ra, op->inode);
+    if (done && op->state != 4)
+    {
+        op->retval = op->len;
+        erase_op(op);
+    }
+    return done;
+}
+
+// Copy data into the read if it's fully covered by read-ahead chunks and return true.
+// If some of the chunks are in progress, add the read to the waiting list and set its state to 4
+bool cluster_client_t::copy_from_readahead(cluster_readahead_t & ra, cluster_op_t *op)
+{
+    auto first_it = ra.chunks.upper_bound(op->offset);
+    if (first_it == ra.chunks.begin())
+    {
+        return false;
+    }
+    first_it--;
+    bool in_progress = false;
+    uint64_t pos = op->offset;
+    for (auto it = first_it; pos < op->offset+op->len; it++)
+    {
+        if (it == ra.chunks.end() || it->first > pos || it->first + it->second.len <= pos || it->second.invalid)
+        {
+            return false;
+        }
+        in_progress = in_progress || it->second.op != NULL;
+        pos = it->first + it->second.len;
+    }
+    if (in_progress)
+    {
+        op->state = 4;
+        ra.waiting.push_back(op);
+        return true;
+    }
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
+    uint64_t object_size = pool_cfg.data_block_size *
+        (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    unsigned object_bitmap_size = ((op->len / pool_cfg.bitmap_granularity + 7) / 8);
+    object_bitmap_size = (object_bitmap_size < 8 ? 8 : object_bitmap_size);
+    if (!op->bitmap_buf || op->bitmap_buf_size < object_bitmap_size)
+    {
+        op->bitmap_buf = realloc_or_die(op->bitmap_buf, object_bitmap_size);
+        op->part_bitmaps = (uint8_t*)op->bitmap_buf + object_bitmap_size;
+        op->bitmap_buf_size = object_bitmap_size;
+    }
+    memset(op->bitmap_buf, 0, object_bitmap_size);
+    int iov_idx = 0;
+    size_t iov_pos = 0;
+    pos = op->offset;
+    for (auto it = first_it; pos < op->offset+op->len; it++)
+    {
+        uint64_t end = it->first + it->second.len;
+        end = end > op->offset+op->len ? op->offset+op->len : end;
+        uint8_t *src = (uint8_t*)it->second.buf + (pos - it->first);
+        for (uint64_t left = end-pos; left > 0 && iov_idx < op->iov.count; )
+        {
+            size_t cur = op->iov.buf[iov_idx].iov_len - iov_pos;
+            cur = cur > left ? left : cur;
+            memcpy((uint8_t*)op->iov.buf[iov_idx].iov_base + iov_pos, src, cur);
+            src += cur;
+            left -= cur;
+            iov_pos += cur;
+            if (iov_pos >= op->iov.buf[iov_idx].iov_len)
+            {
+                iov_pos = 0;
+                iov_idx++;
+            }
+        }
+        for (uint64_t b = pos; b < end; b += pool_cfg.bitmap_granularity)
+        {
+            uint64_t src_bit = (b - it->first) / pool_cfg.bitmap_granularity;
+            uint64_t dst_bit = (b - op->offset) / pool_cfg.bitmap_granularity;
+            if (((uint8_t*)it->second.bitmap)[src_bit >> 3] & (1 << (src_bit & 7)))
+                ((uint8_t*)op->bitmap_buf)[dst_bit >> 3] |= (1 << (dst_bit & 7));
+        }
+        pos = end;
+    }
+    op->version = 0;
+    if (op->offset/object_size == (op->offset+op->len-1)/object_size)
+    {
+        // Return the version of the object like a regular read
+        uint64_t idx = op->offset/object_size - first_it->first/object_size;
+        if (idx < first_it->second.versions.size())
+            op->version = first_it->second.versions[idx];
+    }
+    return true;
+}
+
+void cluster_client_t::start_readahead(cluster_readahead_t & ra, uint64_t inode)
+{
+    if (!ra.window)
+    {
+        return;
+    }
+    // Find the end of data already read ahead
+    uint64_t start = skip_foreign_objects(inode, ra.next_offset);
+    auto it = ra.chunks.upper_bound(start);
+    if (it != ra.chunks.begin())
+        it--;
+    for (; it != ra.chunks.end() && it->first <= start; it++)
+    {
+        if (it->first + it->second.len > start)
+            start = skip_foreign_objects(inode, it->first + it->second.len);
+    }
+    if (start - ra.next_offset >= ra.window/2)
+    {
+        return;
+    }
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(inode));
+    uint64_t len = (ra.next_offset + ra.window - start) / pool_cfg.bitmap_granularity * pool_cfg.bitmap_granularity;
+    if (it != ra.chunks.end() && it->first < start+len)
+    {
+        // Fill the gap before the next chunk, the rest will be read after it
+        len = it->first - start;
+    }
+    if (readahead_object_owned)
+    {
+        // The next object belongs to another client
+        uint64_t object_size = pool_cfg.data_block_size *
+            (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        uint64_t object_end = (start/object_size + 1) * object_size;
+        len = start+len > object_end ? object_end-start : len;
+    }
+    auto ino_it = st_cli.inode_config.find(inode);
+    if (ino_it != st_cli.inode_config.end() && ino_it->second.size > 0)
+    {
+        // Don't read past the end of the inode
+        uint64_t size = (ino_it->second.size + pool_cfg.bitmap_granularity - 1) / pool_cfg.bitmap_granularity * pool_cfg.bitmap_granularity;
+        len = start >= size ? 0 : (start+len > size ? size-start : len);
+    }
+    if (!len)
+    {
+        return;
+    }
+    cluster_op_t *rop = new cluster_op_t;
+    rop->opcode = OSD_OP_READ;
+    rop->cur_inode = rop->inode = inode;
+    rop->offset = start;
+    rop->len = len;
+    rop->flags = OP_READAHEAD;
+    rop->retval = 0;
+    void *buf = malloc_or_die(len);
+    rop->iov.push_back(buf, len);
+    rop->callback = [this](cluster_op_t *rop)
+    {
+        finish_readahead(rop);
+    };
+    auto & chunk = ra.chunks[start];
+    chunk.len = len;
+    chunk.buf = buf;
+    chunk.op = rop;
+    readahead_stats.read_bytes += len;
+    rop->prev = op_queue_tail;
+    if (op_queue_tail)
+    {
+        op_queue_tail->next = rop;
+        op_queue_tail = rop;
+    }
+    else
+        op_queue_tail = op_queue_head = rop;
+    if (!is_blocked(rop))
+        continue_rw(rop);
+}
+
+void cluster_client_t::finish_readahead(cluster_op_t *rop)
+{
+    uint64_t inode = rop->inode;
+    auto & ra = readaheads.at(inode);
+    auto chunk_it = ra.chunks.find(rop->offset);
+    assert(chunk_it != ra.chunks.end() && chunk_it->second.op == rop);
+    auto & chunk = chunk_it->second;
+    if (rop->retval != rop->len || chunk.invalid || !client_readahead_size)
+    {
+        free(chunk.buf);
+        ra.chunks.erase(chunk_it);
+    }
+    else
+    {
+        chunk.op = NULL;
+        // Take the bitmap from the operation
+        chunk.bitmap = rop->bitmap_buf;
+        rop->bitmap_buf = NULL;
+        rop->part_bitmaps = NULL;
+        auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(inode));
+        uint64_t object_size = pool_cfg.data_block_size *
+            (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        chunk.versions.resize((rop->offset+rop->len-1)/object_size - rop->offset/object_size + 1);
+        for (auto & part: rop->parts)
+        {
+            chunk.versions[part.offset/object_size - rop->offset/object_size] = part.op.req.hdr.opcode == OSD_OP_SEC_READ
+                ? part.op.reply.sec_rw.version : part.op.reply.rw.version;
+        }
+    }
+    delete rop;
+    // Resume waiting reads. Callbacks may add more reads, so look up the stream every time
+    std::vector<cluster_op_t*> waiting;
+    waiting.swap(ra.waiting);
+    for (auto op: waiting)
+    {
+        op->state = 0;
+        auto ra_it = readaheads.find(inode);
+        if (ra_it != readaheads.end() && copy_from_readahead(ra_it->second, op))
+        {
+            if (op->state != 4)
+            {
+                readahead_stats.hits++;
+                free_readahead(ra_it->second, op->offset+op->len);
+                op->retval = op->len;
+                erase_op(op);
+            }
+        }
+        else
+        {
+            // Read-ahead failed or was invalidated, send the read itself
+            readahead_stats.misses++;
+            op->state = 1;
+            op->wb_round = wb_rounds;
+            if (!is_blocked(op))
+                continue_rw(op);
+        }
+    }
+    auto ra_it = readaheads.find(inode);
+    if (ra_it != readaheads.end())
+    {
+        start_readahead(ra_it->second, inode);
+    }
+}
@@ -0,0 +1,331 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Integration of the persistent write-back cache (cluster_wb_cache.h) into the client:
+// - writes are journaled and acknowledged immediately, syncs only fdatasync() the journal,
+//   through io_uring when the client has a ring so that the event loop isn't blocked
+// - writes which can't be journaled (CAS, IGNORE_READONLY, too large, WRITE_ZEROES, DISCARD) bypass the journal,
+//   but wait until overlapping dirty data is destaged
+// - dirty data is destaged in rounds by regular writes followed by a SYNC, the journal is read
+//   just before sending each write, and the amount of data in flight is limited
+// - reads are overlaid with dirty data from the journal
+
+#include <string.h>
+#include <ringloop.h>
+#include "cluster_client.h"
+#include "cluster_wb_cache.h"
+
+#define WB_MAX_DESTAGE_WRITE 4*1024*1024
+#define WB_MAX_DESTAGE_INFLIGHT_BYTES 32*1024*1024
+#define WB_MAX_DESTAGE_INFLIGHT_OPS 16
+
+void cluster_client_t::open_wb_cache()
+{
+    if (wb_cache || wb_cache_path == "")
+    {
+        return;
+    }
+    wb_cache = new cluster_wb_cache_t;
+    std::string error;
+    if (wb_cache->open(wb_cache_path, wb_cache_size, error) != 0)
+    {
+        fprintf(stderr, "%s, write-back cache is disabled\n", error.c_str());
+        delete wb_cache;
+        wb_cache = NULL;
+        // Don't try again on every PG reload
+        wb_cache_path = "";
+        return;
+    }
+    if (wb_cache->extents.size() > 0 && log_level > 0)
+    {
+        fprintf(stderr, "Loaded %lu dirty extents from write-back cache %s\n", wb_cache->extents.size(), wb_cache_path.c_str());
+    }
+}
+
+void cluster_client_t::wb_execute(cluster_op_t *op)
+{
+    if (wb_pending.size() > 0 || !wb_try_execute(op))
+    {
+        // Keep the order of writes
+        wb_pending.push_back(op);
+    }
+}
+
+void cluster_client_t::wb_continue()
+{
+    while (wb_pending.size() > 0)
+    {
+        cluster_op_t *op = wb_pending.front();
+        wb_pending.pop_front();
+        if (!wb_try_execute(op))
+        {
+            wb_pending.push_front(op);
+            break;
+        }
+    }
+}
+
+bool cluster_client_t::wb_cacheable(cluster_op_t *op)
+{
+    // Invalid operations are also passed to execute_raw() to fail them in the usual way
+    if (op->opcode != OSD_OP_WRITE || op->version || (op->flags & OSD_OP_IGNORE_READONLY) || !op->len)
+        return false;
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->inode));
+    if (pool_it == st_cli.pool_config.end() || pool_it->second.real_pg_count == 0 ||
+        op->offset % pool_it->second.bitmap_granularity || op->len % pool_it->second.bitmap_granularity)
+        return false;
+    auto ino_it = st_cli.inode_config.find(op->inode);
+    if (ino_it != st_cli.inode_config.end() && ino_it->second.readonly)
+        return false;
+    return true;
+}
+
+// Returns false if the operation should wait for destaging
+bool cluster_client_t::wb_try_execute(cluster_op_t *op)
+{
+    if (op->opcode == OSD_OP_SYNC)
+    {
+        // Also sync writes sent directly to the cluster
+        bool bypassed = wb_bypassed;
+        wb_bypassed = false;
+        wb_fsync([this, op, bypassed](int r)
+        {
+            if (r == 0 && bypassed)
+            {
+                execute_raw(op);
+                return;
+            }
+            if (bypassed)
+            {
+                wb_bypassed = true;
+            }
+            op->retval = r;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+        });
+        return true;
+    }
+    int r = -EFBIG;
+    if (wb_cacheable(op))
+    {
+        if (read_cache.max_size)
+        {
+            read_cache.invalidate(op->inode, op->offset, op->len);
+        }
+        if (readaheads.size())
+        {
+            invalidate_readahead(op->inode, op->offset, op->len);
+        }
+        r = wb_cache->write(op->inode, op->offset, op->len, op->iov);
+        if (r == -ENOSPC)
+        {
+            wb_destage();
+            return false;
+        }
+        if (r != -EFBIG)
+        {
+            op->retval = r == 0 ? op->len : r;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+            wb_destage();
+            return true;
+        }
+    }
+    // Send the write directly, but only after destaging older overlapping data
+    if (wb_cache->overlaps(op->inode, op->offset, op->len))
+    {
+        wb_destage();
+        return false;
+    }
+    wb_bypass_inflight++;
+    wb_bypassed = true;
+    auto cb = std::move(op->callback);
+    op->callback = [this, cb](cluster_op_t *op)
+    {
+        wb_bypass_inflight--;
+        op->callback = cb;
+        cb(op);
+        wb_destage();
+    };
+    execute_raw(op);
+    return true;
+}
+
+int cluster_client_t::wb_read(cluster_op_t *op)
+{
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
+    return wb_cache->read(op->inode, op->offset, op->len, op->iov, (uint8_t*)op->bitmap_buf, pool_cfg.bitmap_granularity);
+}
+
+// Sync the journal through io_uring if possible so the event loop doesn't block in fdatasync()
+void cluster_client_t::wb_fsync(std::function<void(int)> cb)
+{
+#ifndef __MOCK__
+    io_uring_sqe *sqe = ringloop ? ringloop->get_sqe() : NULL;
+    if (sqe)
+    {
+        ring_data_t *data = ((ring_data_t*)sqe->user_data);
+        my_uring_prep_fsync(sqe, wb_cache->get_fd(), IORING_FSYNC_DATASYNC);
+        data->callback = [alive = wb_alive, cb](ring_data_t *data)
+        {
+            if (*alive)
+            {
+                cb(data->res < 0 ? data->res : 0);
+            }
+        };
+        ringloop->submit();
+        return;
+    }
+#endif
+    cb(wb_cache->sync());
+}
+
+void cluster_client_t::wb_destage()
+{
+    if (!wb_cache || !pgs_loaded || wb_destaging || wb_retry_timer_id ||
+        wb_bypass_inflight > 0 || !wb_cache->extents.size())
+    {
+        return;
+    }
+    wb_destaging = true;
+    wb_cache->start_round(wb_round_seq, wb_round_pos);
+    wb_destage_next = {};
+    wb_destage_error = 0;
+    wb_destage_inflight = 0;
+    wb_destage_inflight_bytes = 0;
+    wb_destage_send();
+}
+
+void cluster_client_t::wb_destage_send()
+{
+    if (wb_destage_sending)
+    {
+        // Called from the callback of a write completed immediately
+        return;
+    }
+    wb_destage_sending = true;
+    auto & extents = wb_cache->extents;
+    while (!wb_destage_error && wb_destage_inflight < WB_MAX_DESTAGE_INFLIGHT_OPS &&
+        wb_destage_inflight_bytes < WB_MAX_DESTAGE_INFLIGHT_BYTES)
+    {
+        // Extents written after the start of the round are destaged in the next one
+        auto it = extents.lower_bound(wb_destage_next);
+        while (it != extents.end() && it->second.seq > wb_round_seq)
+        {
+            it++;
+        }
+        if (it == extents.end())
+        {
+            break;
+        }
+        // Coalesce adjacent extents into larger writes
+        uint64_t inode = it->first.inode, offset = it->first.stripe, len = 0;
+        auto start_it = it;
+        while (it != extents.end() && it->first.inode == inode && it->first.stripe == offset+len &&
+            it->second.seq <= wb_round_seq && (!len || len+it->second.len <= WB_MAX_DESTAGE_WRITE))
+        {
+            len += it->second.len;
+            it++;
+        }
+        uint8_t *buf = (uint8_t*)malloc_or_die(len);
+        for (auto ext_it = start_it; ext_it != it; ext_it++)
+        {
+            int r = wb_cache->read_extent(ext_it->second, 0, ext_it->second.len, buf + (ext_it->first.stripe - offset));
+            if (r != 0)
+            {
+                fprintf(stderr, "Failed to read write-back cache: %s\n", strerror(-r));
+                wb_destage_error = r;
+                break;
+            }
+        }
+        if (wb_destage_error)
+        {
+            free(buf);
+            break;
+        }
+        wb_destage_next = (object_id){ .inode = inode, .stripe = offset+len };
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_WRITE;
+        op->inode = inode;
+        op->offset = offset;
+        op->len = len;
+        // Data was acknowledged before the inode could become read-only (for example, snapshotted)
+        op->flags = OSD_OP_IGNORE_READONLY;
+        op->iov.push_back(buf, len);
+        op->callback = [this](cluster_op_t *op)
+        {
+            if (op->retval != op->len)
+            {
+                wb_destage_error = op->retval;
+            }
+            wb_destage_inflight--;
+            wb_destage_inflight_bytes -= op->len;
+            free(op->iov.buf[0].iov_base);
+            delete op;
+            wb_destage_send();
+        };
+        wb_destage_inflight++;
+        wb_destage_inflight_bytes += len;
+        execute_raw(op);
+    }
+    wb_destage_sending = false;
+    if (!wb_destage_inflight)
+    {
+        // All writes of the round are completed or it failed
+        wb_destage_sync();
+    }
+}
+
+void cluster_client_t::wb_destage_sync()
+{
+    if (wb_destage_error != 0)
+    {
+        fprintf(stderr, "Failed to destage write-back cache: %s\n", strerror(-wb_destage_error));
+        wb_destaging = false;
+        wb_retry_later();
+        return;
+    }
+    cluster_op_t *sync_op = new cluster_op_t;
+    sync_op->opcode = OSD_OP_SYNC;
+    sync_op->callback = [this](cluster_op_t *sync_op)
+    {
+        int r = sync_op->retval;
+        delete sync_op;
+        if (r == 0)
+        {
+            r = wb_cache->commit_round(wb_round_seq, wb_round_pos);
+        }
+        if (r != 0)
+        {
+            fprintf(stderr, "Failed to destage write-back cache: %s\n", strerror(-r));
+            wb_destaging = false;
+            wb_retry_later();
+            return;
+        }
+        wb_fsync([this](int r)
+        {
+            wb_destaging = false;
+            if (r != 0)
+            {
+                fprintf(stderr, "Failed to sync write-back cache: %s\n", strerror(-r));
+                wb_retry_later();
+                return;
+            }
+            wb_cache->finish_round(wb_round_seq, wb_round_pos);
+            wb_rounds++;
+            wb_continue();
+            wb_destage();
+        });
+    };
+    execute_raw(sync_op);
+}
+
+void cluster_client_t::wb_retry_later()
+{
+    if (!wb_retry_timer_id)
+    {
+        wb_retry_timer_id = tfd->set_timer(up_wait_retry_interval, false, [this](int)
+        {
+            wb_retry_timer_id = 0;
+            wb_destage();
+        });
+    }
+}
@@ -0,0 +1,247 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "malloc_or_die.h"
+#include "cluster_read_cache.h"
+
+// Copy <len> bytes between <buf> and <iov> starting at (iov_idx, iov_pos) and advance the position
+static void iov_copy(osd_op_buf_list_t & iov, int & iov_idx, size_t & iov_pos, uint8_t *buf, size_t len, bool to_iov)
+{
+    while (len > 0 && iov_idx < iov.count)
+    {
+        size_t cur = iov.buf[iov_idx].iov_len - iov_pos;
+        if (cur > len)
+            cur = len;
+        if (to_iov)
+            memcpy((uint8_t*)iov.buf[iov_idx].iov_base + iov_pos, buf, cur);
+        else
+            memcpy(buf, (uint8_t*)iov.buf[iov_idx].iov_base + iov_pos, cur);
+        buf += cur;
+        len -= cur;
+        iov_pos += cur;
+        if (iov_pos >= iov.buf[iov_idx].iov_len)
+        {
+            iov_pos = 0;
+            iov_idx++;
+        }
+    }
+}
+
+static uint64_t monotonic_ms()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000 + tv.tv_nsec/1000000;
+}
+
+cluster_read_cache_t::~cluster_read_cache_t()
+{
+    clear();
+}
+
+void cluster_read_cache_t::set_max_size(uint64_t size)
+{
+    max_size = size;
+    evict();
+}
+
+void cluster_read_cache_t::free_block(cluster_read_cache_object_t & obj, std::map<uint32_t, cluster_read_cache_block_t>::iterator block_it)
+{
+    free(block_it->second.buf);
+    used_size -= block_it->second.len;
+    lru.erase(block_it->second.lru_it);
+    obj.blocks.erase(block_it);
+}
+
+void cluster_read_cache_t::evict()
+{
+    while (used_size > max_size && lru.size())
+    {
+        auto obj_it = objects.find(lru.back().first);
+        free_block(obj_it->second, obj_it->second.blocks.find(lru.back().second));
+        if (!obj_it->second.blocks.size())
+            objects.erase(obj_it);
+    }
+}
+
+bool cluster_read_cache_t::read(uint64_t inode, uint64_t offset, uint64_t len, uint64_t object_size, uint32_t granularity,
+    osd_op_buf_list_t & iov, uint8_t *bitmap, uint64_t *version)
+{
+    // Only serve reads which are fully cached, partial hits would still require a round trip
+    *version = 0;
+    std::vector<cluster_read_cache_block_t*> found;
+    uint64_t now_ms = version_ttl_ms ? monotonic_ms() : 0;
+    auto obj_it = objects.end();
+    for (uint64_t pos = offset; pos < offset+len; pos += granularity)
+    {
+        uint64_t stripe = pos - pos % object_size;
+        if (obj_it == objects.end() || obj_it->first.stripe != stripe)
+        {
+            obj_it = objects.find((object_id){ .inode = inode, .stripe = stripe });
+            if (obj_it == objects.end() || obj_it->second.version != 0 && version_ttl_ms &&
+                now_ms - obj_it->second.validated_ms >= version_ttl_ms)
+            {
+                // Writable objects have to be revalidated from time to time,
+                // the read from OSDs will drop them if their version changes
+                stats.misses++;
+                return false;
+            }
+        }
+        auto block_it = obj_it->second.blocks.find(pos - stripe);
+        if (block_it == obj_it->second.blocks.end() || block_it->second.len != granularity)
+        {
+            stats.misses++;
+            return false;
+        }
+        found.push_back(&block_it->second);
+    }
+    if (offset/object_size == (offset+len-1)/object_size)
+    {
+        // Reads within a single object return its version which may be used for CAS writes
+        if (obj_it->second.version == UINT64_MAX)
+        {
+            stats.misses++;
+            return false;
+        }
+        *version = obj_it->second.version;
+    }
+    int iov_idx = 0;
+    size_t iov_pos = 0;
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        iov_copy(iov, iov_idx, iov_pos, (uint8_t*)found[i]->buf, granularity, true);
+        if (found[i]->bit)
+            bitmap[i >> 3] |= (1 << (i & 7));
+        lru.splice(lru.begin(), lru, found[i]->lru_it);
+    }
+    stats.hits++;
+    stats.hit_bytes += len;
+    return true;
+}
+
+void cluster_read_cache_t::insert(uint64_t inode, uint64_t offset, uint64_t len, uint64_t object_size, uint32_t granularity,
+    osd_op_buf_list_t & iov, uint8_t *bitmap, uint32_t bit_offset, uint64_t version)
+{
+    if (len > max_size)
+    {
+        return;
+    }
+    int iov_idx = 0;
+    size_t iov_pos = 0;
+    uint64_t now_ms = version_ttl_ms ? monotonic_ms() : 0;
+    auto obj_it = objects.end();
+    for (uint64_t pos = offset, i = bit_offset; pos < offset+len; pos += granularity, i++)
+    {
+        uint64_t stripe = pos - pos % object_size;
+        if (obj_it == objects.end() || obj_it->first.stripe != stripe)
+        {
+            obj_it = objects.find((object_id){ .inode = inode, .stripe = stripe });
+            if (obj_it == objects.end())
+            {
+                obj_it = objects.emplace((object_id){ .inode = inode, .stripe = stripe }, cluster_read_cache_object_t()).first;
+            }
+            else if (obj_it->second.version != version)
+            {
+                // Other cached blocks may be outdated
+                while (obj_it->second.blocks.size())
+                    free_block(obj_it->second, obj_it->second.blocks.begin());
+            }
+            obj_it->second.version = version;
+            obj_it->second.validated_ms = now_ms;
+        }
+        auto & blocks = obj_it->second.blocks;
+        auto block_it = blocks.find(pos - stripe);
+        if (block_it == blocks.end())
+        {
+            lru.push_front({ obj_it->first, (uint32_t)(pos - stripe) });
+            block_it = blocks.emplace(pos - stripe, (cluster_read_cache_block_t){
+                .buf = malloc_or_die(granularity),
+                .len = granularity,
+                .lru_it = lru.begin(),
+            }).first;
+            used_size += granularity;
+        }
+        else
+        {
+            lru.splice(lru.begin(), lru, block_it->second.lru_it);
+        }
+        block_it->second.bit = (bitmap[i >> 3] >> (i & 7)) & 1;
+        iov_copy(iov, iov_idx, iov_pos, (uint8_t*)block_it->second.buf, granularity, false);
+    }
+    evict();
+}
+
+void cluster_read_cache_t::invalidate(uint64_t inode, uint64_t offset, uint64_t len)
+{
+    invalidate_seq++;
+    // Start with the object containing <offset>
+    auto obj_it = objects.upper_bound((object_id){ .inode = inode, .stripe = offset });
+    if (obj_it != objects.begin() && std::prev(obj_it)->first.inode == inode)
+        obj_it--;
+    while (obj_it != objects.end() && obj_it->first.inode == inode && obj_it->first.stripe < offset+len)
+    {
+        auto & blocks = obj_it->second.blocks;
+        uint64_t stripe = obj_it->first.stripe;
+        auto block_it = blocks.lower_bound(offset > stripe ? offset-stripe : 0);
+        // Also drop a block which overlaps with the beginning of the range
+        if (block_it != blocks.begin())
+        {
+            auto prev_it = std::prev(block_it);
+            if (stripe + prev_it->first + prev_it->second.len > offset)
+                block_it = prev_it;
+        }
+        while (block_it != blocks.end() && stripe + block_it->first < offset+len)
+        {
+            free_block(obj_it->second, block_it++);
+        }
+        if (!blocks.size())
+            objects.erase(obj_it++);
+        else
+            obj_it++;
+    }
+}
+
+void cluster_read_cache_t::invalidate_inode(uint64_t inode)
+{
+    invalidate_seq++;
+    auto obj_it = objects.lower_bound((object_id){ .inode = inode, .stripe = 0 });
+    while (obj_it != objects.end() && obj_it->first.inode == inode)
+    {
+        while (obj_it->second.blocks.size())
+            free_block(obj_it->second, obj_it->second.blocks.begin());
+        objects.erase(obj_it++);
+    }
+}
+
+void cluster_read_cache_t::check_version(uint64_t inode, uint64_t stripe, uint64_t version)
+{
+    auto obj_it = objects.find((object_id){ .inode = inode, .stripe = stripe });
+    if (obj_it != objects.end() && obj_it->second.version == version)
+    {
+        obj_it->second.validated_ms = version_ttl_ms ? monotonic_ms() : 0;
+    }
+    else if (obj_it != objects.end())
+    {
+        // Object is modified by someone else (or the version of cached data is unknown)
+        while (obj_it->second.blocks.size())
+            free_block(obj_it->second, obj_it->second.blocks.begin());
+        objects.erase(obj_it);
+    }
+}
+
+void cluster_read_cache_t::clear()
+{
+    for (auto & op: objects)
+    {
+        for (auto & bp: op.second.blocks)
+            free(bp.second.buf);
+    }
+    objects.clear();
+    lru.clear();
+    used_size = 0;
+    invalidate_seq++;
+}
@@ -0,0 +1,75 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Client read cache: data blocks of <bitmap_granularity> size, evicted in LRU order.
+// Blocks are grouped by objects (stripes) to invalidate them when the version
+// of the object returned by an OSD changes
+
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <map>
+
+#include "object_id.h"
+#include "msgr_op.h"
+
+struct cluster_read_cache_stats_t
+{
+    uint64_t hits = 0, misses = 0, hit_bytes = 0;
+};
+
+struct cluster_read_cache_block_t
+{
+    void *buf;
+    uint32_t len;
+    // bit of the read bitmap for this block
+    bool bit;
+    std::list<std::pair<object_id, uint32_t>>::iterator lru_it;
+};
+
+struct cluster_read_cache_object_t
+{
+    // object version in the top layer of the inode,
+    // 0 if versions aren't tracked (for read-only inodes), UINT64_MAX if unknown
+    uint64_t version = 0;
+    // monotonic time of the last version check in milliseconds
+    uint64_t validated_ms = 0;
+    // offset in the object => block
+    std::map<uint32_t, cluster_read_cache_block_t> blocks;
+};
+
+class cluster_read_cache_t
+{
+    std::map<object_id, cluster_read_cache_object_t> objects;
+    // most recently used blocks first
+    std::list<std::pair<object_id, uint32_t>> lru;
+    uint64_t used_size = 0;
+
+    void free_block(cluster_read_cache_object_t & obj, std::map<uint32_t, cluster_read_cache_block_t>::iterator block_it);
+    void evict();
+
+public:
+    uint64_t max_size = 0;
+    // Objects with tracked versions are only served during <version_ttl_ms> after
+    // the last version check, then they're re-read from OSDs. 0 means forever
+    uint64_t version_ttl_ms = 0;
+    // Incremented on every invalidation. Reads started before it must not be cached
+    uint64_t invalidate_seq = 1;
+    cluster_read_cache_stats_t stats;
+
+    ~cluster_read_cache_t();
+    void set_max_size(uint64_t size);
+    // Copy data and bitmap bits into <iov> and <bitmap> if the whole range is cached,
+    // return the object version in <version> if the range is inside a single object
+    bool read(uint64_t inode, uint64_t offset, uint64_t len, uint64_t object_size, uint32_t granularity,
+        osd_op_buf_list_t & iov, uint8_t *bitmap, uint64_t *version);
+    // Save data from <iov> and bitmap bits starting with <bit_offset>
+    void insert(uint64_t inode, uint64_t offset, uint64_t len, uint64_t object_size, uint32_t granularity,
+        osd_op_buf_list_t & iov, uint8_t *bitmap, uint32_t bit_offset, uint64_t version);
+    void invalidate(uint64_t inode, uint64_t offset, uint64_t len);
+    void invalidate_inode(uint64_t inode);
+    // Drop cached blocks of the object if its version differs from the cached one
+    void check_version(uint64_t inode, uint64_t stripe, uint64_t version);
+    void clear();
+};
@@ -0,0 +1,416 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "malloc_or_die.h"
+#include "crc32c.h"
+#include "cluster_wb_cache.h"
+
+#define WB_ENTRY_SIZE(len) ((sizeof(wb_journal_entry_t) + (len) + WB_JOURNAL_ALIGN - 1) / WB_JOURNAL_ALIGN * WB_JOURNAL_ALIGN)
+
+static int pread_full(int fd, void *buf, size_t len, off_t pos)
+{
+    while (len > 0)
+    {
+        ssize_t r = pread(fd, buf, len, pos);
+        if (r < 0 && errno != EINTR)
+            return -errno;
+        else if (r == 0)
+            return -EIO;
+        else if (r > 0)
+        {
+            buf = (uint8_t*)buf + r;
+            len -= r;
+            pos += r;
+        }
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t pos)
+{
+    while (len > 0)
+    {
+        ssize_t r = pwrite(fd, buf, len, pos);
+        if (r < 0 && errno != EINTR)
+            return -errno;
+        else if (r > 0)
+        {
+            buf = (const uint8_t*)buf + r;
+            len -= r;
+            pos += r;
+        }
+    }
+    return 0;
+}
+
+cluster_wb_cache_t::~cluster_wb_cache_t()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+int cluster_wb_cache_t::open(const std::string & path, uint64_t create_size, std::string & error)
+{
+    fd = ::open(path.c_str(), O_RDWR|O_CREAT, 0600);
+    if (fd < 0)
+    {
+        error = "Failed to open "+path+": "+strerror(errno);
+        return -errno;
+    }
+    // Only one client may use the journal at a time
+    if (flock(fd, LOCK_EX|LOCK_NB) < 0)
+    {
+        int r = -errno;
+        error = path+" is used by another process: "+strerror(errno);
+        close(fd);
+        fd = -1;
+        return r;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        int r = -errno;
+        error = "Failed to stat "+path+": "+strerror(errno);
+        close(fd);
+        fd = -1;
+        return r;
+    }
+    int r = 0;
+    if (st.st_size == 0)
+    {
+        // Create a new journal
+        size = create_size / WB_JOURNAL_ALIGN * WB_JOURNAL_ALIGN;
+        if (size < WB_JOURNAL_DATA_START + 16*WB_JOURNAL_ALIGN)
+        {
+            error = "Write-back cache size is too small";
+            r = -EINVAL;
+        }
+        else if (ftruncate(fd, size) < 0)
+        {
+            r = -errno;
+            error = "Failed to resize "+path+": "+strerror(errno);
+        }
+        else
+        {
+            head_pos = tail_pos = WB_JOURNAL_DATA_START;
+            next_seq = tail_seq = 1;
+            r = write_sb(tail_pos, tail_seq);
+            if (r == 0)
+                r = sync();
+            if (r != 0)
+                error = "Failed to initialize "+path+": "+strerror(-r);
+        }
+    }
+    else
+    {
+        r = replay();
+        if (r != 0)
+            error = "Failed to load "+path+": "+(r == -EINVAL ? "invalid journal header" : strerror(-r));
+    }
+    if (r != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return r;
+}
+
+int cluster_wb_cache_t::write_sb(uint64_t sb_tail_pos, uint64_t sb_tail_seq)
+{
+    wb_journal_sb_t sb = {
+        .magic = WB_JOURNAL_MAGIC,
+        .crc32c = 0,
+        .version = WB_JOURNAL_VERSION,
+        .size = size,
+        .tail_pos = sb_tail_pos,
+        .tail_seq = sb_tail_seq,
+    };
+    sb.crc32c = crc32c(0, &sb, sizeof(sb));
+    return pwrite_full(fd, &sb, sizeof(sb), 0);
+}
+
+int cluster_wb_cache_t::replay()
+{
+    wb_journal_sb_t sb;
+    int r = pread_full(fd, &sb, sizeof(sb), 0);
+    if (r != 0)
+        return r;
+    uint32_t crc = sb.crc32c;
+    sb.crc32c = 0;
+    if (sb.magic != WB_JOURNAL_MAGIC || sb.version != WB_JOURNAL_VERSION || crc32c(0, &sb, sizeof(sb)) != crc ||
+        sb.tail_pos < WB_JOURNAL_DATA_START || sb.tail_pos >= sb.size)
+    {
+        return -EINVAL;
+    }
+    size = sb.size;
+    tail_pos = sb.tail_pos;
+    tail_seq = sb.tail_seq;
+    // Read entries until the first one with wrong sequence number or checksum
+    uint64_t pos = tail_pos, seq = tail_seq;
+    void *buf = NULL;
+    uint64_t buf_size = 0;
+    while (true)
+    {
+        wb_journal_entry_t je;
+        if (pos + sizeof(je) > size || pread_full(fd, &je, sizeof(je), pos) != 0 ||
+            je.magic != WB_JOURNAL_MAGIC || je.seq != seq)
+        {
+            break;
+        }
+        crc = je.crc32c;
+        je.crc32c = 0;
+        if (je.type == WB_ENTRY_WRAP)
+        {
+            if (crc32c(0, &je, sizeof(je)) != crc)
+                break;
+            pos = WB_JOURNAL_DATA_START;
+            seq++;
+            continue;
+        }
+        if (je.type != WB_ENTRY_WRITE || pos + WB_ENTRY_SIZE(je.len) > size)
+            break;
+        if (buf_size < je.len)
+        {
+            buf_size = je.len;
+            buf = realloc_or_die(buf, buf_size);
+        }
+        if (pread_full(fd, buf, je.len, pos + sizeof(je)) != 0 ||
+            crc32c(crc32c(0, &je, sizeof(je)), buf, je.len) != crc)
+        {
+            break;
+        }
+        add_extent(je.inode, je.offset, je.len, pos + sizeof(je), seq);
+        pos += WB_ENTRY_SIZE(je.len);
+        seq++;
+    }
+    free(buf);
+    head_pos = pos;
+    next_seq = seq;
+    return 0;
+}
+
+void cluster_wb_cache_t::add_extent(uint64_t inode, uint64_t offset, uint64_t len, uint64_t journal_pos, uint64_t seq)
+{
+    // Cut the new range out of previous extents
+    auto it = extents.lower_bound((object_id){ .inode = inode, .stripe = offset });
+    if (it != extents.begin())
+    {
+        auto prev_it = std::prev(it);
+        if (prev_it->first.inode == inode && prev_it->first.stripe + prev_it->second.len > offset)
+        {
+            uint64_t prev_end = prev_it->first.stripe + prev_it->second.len;
+            if (prev_end > offset+len)
+            {
+                extents[(object_id){ .inode = inode, .stripe = offset+len }] = (wb_extent_t){
+                    .len = prev_end - (offset+len),
+                    .journal_pos = prev_it->second.journal_pos + (offset+len - prev_it->first.stripe),
+                    .seq = prev_it->second.seq,
+                };
+            }
+            prev_it->second.len = offset - prev_it->first.stripe;
+        }
+    }
+    while (it != extents.end() && it->first.inode == inode && it->first.stripe < offset+len)
+    {
+        uint64_t ext_end = it->first.stripe + it->second.len;
+        if (ext_end > offset+len)
+        {
+            extents[(object_id){ .inode = inode, .stripe = offset+len }] = (wb_extent_t){
+                .len = ext_end - (offset+len),
+                .journal_pos = it->second.journal_pos + (offset+len - it->first.stripe),
+                .seq = it->second.seq,
+            };
+        }
+        extents.erase(it++);
+    }
+    extents[(object_id){ .inode = inode, .stripe = offset }] = (wb_extent_t){
+        .len = len,
+        .journal_pos = journal_pos,
+        .seq = seq,
+    };
+}
+
+int cluster_wb_cache_t::write(uint64_t inode, uint64_t offset, uint64_t len, osd_op_buf_list_t & iov)
+{
+    uint64_t entry_size = WB_ENTRY_SIZE(len);
+    if (entry_size + 2*WB_JOURNAL_ALIGN > size - WB_JOURNAL_DATA_START)
+    {
+        // Will never fit
+        return -EFBIG;
+    }
+    // Always leave space for a wrap entry at the end, and never let the head reach the tail
+    bool wrap = false;
+    if (head_pos >= tail_pos && head_pos + entry_size + WB_JOURNAL_ALIGN > size)
+    {
+        if (head_pos == tail_pos)
+        {
+            // Journal is empty, just restart it from the beginning
+            head_pos = tail_pos = WB_JOURNAL_DATA_START;
+            tail_seq = next_seq;
+            int r = write_sb(tail_pos, tail_seq);
+            if (r == 0)
+                r = sync();
+            if (r != 0)
+                return r;
+        }
+        else if (WB_JOURNAL_DATA_START + entry_size >= tail_pos)
+            return -ENOSPC;
+        else
+            wrap = true;
+    }
+    else if (head_pos < tail_pos && head_pos + entry_size >= tail_pos)
+    {
+        return -ENOSPC;
+    }
+    if (wrap)
+    {
+        wb_journal_entry_t je = {
+            .magic = WB_JOURNAL_MAGIC,
+            .crc32c = 0,
+            .type = WB_ENTRY_WRAP,
+            .seq = next_seq,
+        };
+        je.crc32c = crc32c(0, &je, sizeof(je));
+        int r = pwrite_full(fd, &je, sizeof(je), head_pos);
+        if (r != 0)
+            return r;
+        next_seq++;
+        head_pos = WB_JOURNAL_DATA_START;
+    }
+    uint8_t *buf = (uint8_t*)malloc_or_die(entry_size);
+    wb_journal_entry_t *je = (wb_journal_entry_t*)buf;
+    *je = (wb_journal_entry_t){
+        .magic = WB_JOURNAL_MAGIC,
+        .crc32c = 0,
+        .type = WB_ENTRY_WRITE,
+        .seq = next_seq,
+        .inode = inode,
+        .offset = offset,
+        .len = len,
+    };
+    uint64_t pos = sizeof(wb_journal_entry_t);
+    for (int i = 0; i < iov.count && pos < sizeof(wb_journal_entry_t)+len; i++)
+    {
+        uint64_t cur = iov.buf[i].iov_len;
+        if (cur > sizeof(wb_journal_entry_t)+len-pos)
+            cur = sizeof(wb_journal_entry_t)+len-pos;
+        memcpy(buf+pos, iov.buf[i].iov_base, cur);
+        pos += cur;
+    }
+    memset(buf+pos, 0, entry_size-pos);
+    je->crc32c = crc32c(0, buf, sizeof(wb_journal_entry_t)+len);
+    int r = pwrite_full(fd, buf, entry_size, head_pos);
+    free(buf);
+    if (r != 0)
+        return r;
+    add_extent(inode, offset, len, head_pos + sizeof(wb_journal_entry_t), next_seq);
+    next_seq++;
+    head_pos += entry_size;
+    return 0;
+}
+
+int cluster_wb_cache_t::sync()
+{
+    if (fdatasync(fd) < 0)
+        return -errno;
+    return 0;
+}
+
+bool cluster_wb_cache_t::overlaps(uint64_t inode, uint64_t offset, uint64_t len)
+{
+    auto it = extents.lower_bound((object_id){ .inode = inode, .stripe = offset });
+    if (it != extents.end() && it->first.inode == inode && it->first.stripe < offset+len)
+        return true;
+    if (it != extents.begin())
+    {
+        it--;
+        if (it->first.inode == inode && it->first.stripe + it->second.len > offset)
+            return true;
+    }
+    return false;
+}
+
+int cluster_wb_cache_t::read(uint64_t inode, uint64_t offset, uint64_t len, osd_op_buf_list_t & iov, uint8_t *bitmap, uint32_t granularity)
+{
+    auto it = extents.upper_bound((object_id){ .inode = inode, .stripe = offset });
+    if (it != extents.begin() && std::prev(it)->first.inode == inode &&
+        std::prev(it)->first.stripe + std::prev(it)->second.len > offset)
+    {
+        it--;
+    }
+    while (it != extents.end() && it->first.inode == inode && it->first.stripe < offset+len)
+    {
+        uint64_t start = it->first.stripe < offset ? offset : it->first.stripe;
+        uint64_t end = it->first.stripe + it->second.len;
+        end = end > offset+len ? offset+len : end;
+        uint8_t *buf = (uint8_t*)malloc_or_die(end-start);
+        int r = read_extent(it->second, start - it->first.stripe, end-start, buf);
+        if (r != 0)
+        {
+            free(buf);
+            return r;
+        }
+        // Copy it over the iovec
+        uint64_t skip = start-offset, done = 0;
+        for (int i = 0; i < iov.count && done < end-start; i++)
+        {
+            if (skip >= iov.buf[i].iov_len)
+            {
+                skip -= iov.buf[i].iov_len;
+                continue;
+            }
+            uint64_t cur = iov.buf[i].iov_len-skip;
+            cur = cur > end-start-done ? end-start-done : cur;
+            memcpy((uint8_t*)iov.buf[i].iov_base + skip, buf+done, cur);
+            done += cur;
+            skip = 0;
+        }
+        free(buf);
+        for (uint64_t b = (start-offset)/granularity; b < (end-offset+granularity-1)/granularity; b++)
+        {
+            bitmap[b >> 3] |= (1 << (b & 7));
+        }
+        it++;
+    }
+    return 0;
+}
+
+int cluster_wb_cache_t::read_extent(const wb_extent_t & ext, uint64_t skip, uint64_t len, void *buf)
+{
+    return pread_full(fd, buf, len, ext.journal_pos + skip);
+}
+
+void cluster_wb_cache_t::start_round(uint64_t & round_seq, uint64_t & round_pos)
+{
+    round_seq = next_seq-1;
+    round_pos = head_pos;
+}
+
+int cluster_wb_cache_t::commit_round(uint64_t round_seq, uint64_t round_pos)
+{
+    // Journal space isn't reused until the new superblock is synced
+    return write_sb(round_pos, round_seq+1);
+}
+
+void cluster_wb_cache_t::finish_round(uint64_t round_seq, uint64_t round_pos)
+{
+    for (auto it = extents.begin(); it != extents.end(); )
+    {
+        if (it->second.seq <= round_seq)
+            extents.erase(it++);
+        else
+            it++;
+    }
+    tail_pos = round_pos;
+    tail_seq = round_seq+1;
+}
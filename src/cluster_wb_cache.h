@@ -0,0 +1,93 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Persistent client write-back cache.
+// Writes are appended to a circular journal file on a local SSD and acknowledged
+// when written, syncs are acknowledged after fdatasync() of the journal.
+// Journal data is destaged to the cluster in the background in rounds: all dirty
+// extents are written (adjacent ones are coalesced), followed by a SYNC, after which
+// the journal space used before the start of the round is freed.
+// After a crash the journal is replayed on the next start of the client.
+
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include "object_id.h"
+#include "msgr_op.h"
+
+#define WB_JOURNAL_MAGIC 0x4c4e524a42575456ul // "VTWBJRNL"
+#define WB_JOURNAL_VERSION 1
+#define WB_JOURNAL_ALIGN 512
+#define WB_JOURNAL_DATA_START 4096
+#define WB_ENTRY_WRITE 1
+#define WB_ENTRY_WRAP 2
+
+struct __attribute__((__packed__)) wb_journal_sb_t
+{
+    uint64_t magic;
+    uint32_t crc32c;
+    uint32_t version;
+    uint64_t size;
+    // position and sequence number of the oldest entry not destaged yet
+    uint64_t tail_pos;
+    uint64_t tail_seq;
+};
+
+struct __attribute__((__packed__)) wb_journal_entry_t
+{
+    uint64_t magic;
+    // crc32c of the header (with crc32c = 0) and data
+    uint32_t crc32c;
+    uint32_t type;
+    uint64_t seq;
+    uint64_t inode;
+    uint64_t offset;
+    uint64_t len;
+};
+
+// Latest data of a dirty range in the journal
+struct wb_extent_t
+{
+    uint64_t len;
+    uint64_t journal_pos;
+    uint64_t seq;
+};
+
+class cluster_wb_cache_t
+{
+    int fd = -1;
+    uint64_t size = 0;
+    uint64_t head_pos = 0, tail_pos = 0;
+    uint64_t next_seq = 1, tail_seq = 1;
+
+    int write_sb(uint64_t sb_tail_pos, uint64_t sb_tail_seq);
+    int replay();
+    void add_extent(uint64_t inode, uint64_t offset, uint64_t len, uint64_t journal_pos, uint64_t seq);
+
+public:
+    // {inode, offset} => extent, extents don't overlap
+    std::map<object_id, wb_extent_t> extents;
+
+    ~cluster_wb_cache_t();
+    // Open or create the journal file and load unflushed writes from it
+    int open(const std::string & path, uint64_t create_size, std::string & error);
+    // Append a write to the journal, returns -ENOSPC when it should be retried after destaging
+    int write(uint64_t inode, uint64_t offset, uint64_t len, osd_op_buf_list_t & iov);
+    int sync();
+    // Check if the range intersects with dirty extents
+    bool overlaps(uint64_t inode, uint64_t offset, uint64_t len);
+    // Copy dirty data over the result of a read and set bits of the corresponding blocks
+    int read(uint64_t inode, uint64_t offset, uint64_t len, osd_op_buf_list_t & iov, uint8_t *bitmap, uint32_t granularity);
+    // Read data of an extent part from the journal
+    int read_extent(const wb_extent_t & ext, uint64_t skip, uint64_t len, void *buf);
+    // Start a destage round, return the sequence number and position of its end
+    void start_round(uint64_t & round_seq, uint64_t & round_pos);
+    // Write the superblock without data of the round. The journal must be synced after it
+    int commit_round(uint64_t round_seq, uint64_t round_pos);
+    // Forget extents destaged in the round and free journal space, called after syncing the commit
+    void finish_round(uint64_t round_seq, uint64_t round_pos);
+    int get_fd() { return fd; }
+};
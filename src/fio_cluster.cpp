@@ -19,6 +19,7 @@
 //     -etcd=127.0.0.1:2379 [-etcd_prefix=/vitastor] -image=testimg
 
 #include <sys/types.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -33,13 +34,21 @@ struct sec_data
     vitastor_c *cli = NULL;
     void *watch = NULL;
     bool last_sync = false;
-    /* The list of completed io_u structs. */
-    std::vector<io_u*> completed;
+    /* Operations queued since the last commit */
+    std::vector<vitastor_c_op*> queued;
+    /* Completed operations returned by the last getevents */
+    std::vector<vitastor_c_op*> events;
     uint64_t inflight = 0;
     int mirror_fd = -1;
     bool trace = false;
 };
 
+struct sec_io
+{
+    vitastor_c_op op;
+    struct iovec iov;
+};
+
 struct sec_options
 {
     int __pad;
@@ -57,6 +66,7 @@ struct sec_options
     int rdma_port_num = 0;
     int rdma_gid_index = 0;
     int rdma_mtu = 0;
+    int use_shm = 0;
 };
 
 static struct fio_option options[] = {
@@ -192,6 +202,16 @@ static struct fio_option options[] = {
         .category = FIO_OPT_C_ENGINE,
         .group  = FIO_OPT_G_FILENAME,
     },
+    {
+        .name   = "use_shm",
+        .lname  = "Use shared memory",
+        .type   = FIO_OPT_BOOL,
+        .off1   = offsetof(struct sec_options, use_shm),
+        .help   = "Use shared memory to talk to OSDs on the same host",
+        .def    = "-1",
+        .category = FIO_OPT_C_ENGINE,
+        .group  = FIO_OPT_G_FILENAME,
+    },
     {
         .name = NULL,
     },
@@ -254,8 +274,40 @@ static int sec_setup(struct thread_data *td)
     {
         o->inode = 0;
     }
-    bsd->cli = vitastor_c_create_uring(o->config_path, o->etcd_host, o->etcd_prefix,
-        o->use_rdma, o->rdma_device, o->rdma_port_num, o->rdma_gid_index, o->rdma_mtu, o->cluster_log);
+    if (o->use_shm >= 0)
+    {
+        // Options not supported by vitastor_c_create_uring() are only passed as JSON
+        std::vector<std::string> opt_values;
+        auto add_opt = [&](const char *name, std::string value) { opt_values.push_back(name); opt_values.push_back(value); };
+        if (o->config_path)
+            add_opt("config_path", o->config_path);
+        if (o->etcd_host)
+            add_opt("etcd_address", o->etcd_host);
+        if (o->etcd_prefix)
+            add_opt("etcd_prefix", o->etcd_prefix);
+        if (o->use_rdma >= 0)
+            add_opt("use_rdma", o->use_rdma > 0 ? "1" : "0");
+        if (o->rdma_device)
+            add_opt("rdma_device", o->rdma_device);
+        if (o->rdma_port_num)
+            add_opt("rdma_port_num", std::to_string(o->rdma_port_num));
+        if (o->rdma_gid_index)
+            add_opt("rdma_gid_index", std::to_string(o->rdma_gid_index));
+        if (o->rdma_mtu)
+            add_opt("rdma_mtu", std::to_string(o->rdma_mtu));
+        if (o->cluster_log)
+            add_opt("log_level", std::to_string(o->cluster_log));
+        add_opt("use_shm", o->use_shm > 0 ? "1" : "0");
+        std::vector<const char*> opt_ptrs;
+        for (auto & v: opt_values)
+            opt_ptrs.push_back(v.c_str());
+        bsd->cli = vitastor_c_create_uring_json(opt_ptrs.data(), opt_ptrs.size());
+    }
+    else
+    {
+        bsd->cli = vitastor_c_create_uring(o->config_path, o->etcd_host, o->etcd_prefix,
+            o->use_rdma, o->rdma_device, o->rdma_port_num, o->rdma_gid_index, o->rdma_mtu, o->cluster_log);
+    }
     if (o->image)
     {
         bsd->watch = NULL;
@@ -302,34 +354,18 @@ static void sec_cleanup(struct thread_data *td)
 /* Connect to the server from each thread. */
 static int sec_init(struct thread_data *td)
 {
+    sec_data *bsd = (sec_data*)td->io_ops_data;
+    bsd->events.resize(td->o.iodepth);
     return 0;
 }
 
-static void io_callback(void *opaque, long retval)
-{
-    struct io_u *io = (struct io_u*)opaque;
-    io->error = retval < 0 ? -retval : 0;
-    sec_data *bsd = (sec_data*)io->engine_data;
-    bsd->inflight--;
-    bsd->completed.push_back(io);
-    if (bsd->trace)
-    {
-        printf("--- %s 0x%lx retval=%ld\n", io->ddir == DDIR_READ ? "READ" :
-            (io->ddir == DDIR_WRITE ? "WRITE" : "SYNC"), (uint64_t)io, retval);
-    }
-}
-
-static void read_callback(void *opaque, long retval, uint64_t version)
-{
-    io_callback(opaque, retval);
-}
-
 /* Begin read or write request. */
 static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
 {
     sec_options *opt = (sec_options*)td->eo;
     sec_data *bsd = (sec_data*)td->io_ops_data;
-    struct iovec iov;
+    sec_io *sio = (sec_io*)io->engine_data;
+    vitastor_c_op *op = &sio->op;
 
     fio_ro_check(td, io);
     if (io->ddir == DDIR_SYNC && bsd->last_sync)
@@ -337,16 +373,18 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
         return FIO_Q_COMPLETED;
     }
 
-    io->engine_data = bsd;
     io->error = 0;
-    bsd->inflight++;
-
-    uint64_t inode = opt->image ? vitastor_c_inode_get_num(bsd->watch) : opt->inode;
+    op->inode = opt->image ? vitastor_c_inode_get_num(bsd->watch) : opt->inode;
+    op->offset = io->offset;
+    op->len = io->xfer_buflen;
+    op->version = 0;
+    sio->iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
+    op->iov = &sio->iov;
+    op->iovcnt = 1;
     switch (io->ddir)
     {
     case DDIR_READ:
-        iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
-        vitastor_c_read(bsd->cli, inode, io->offset, io->xfer_buflen, &iov, 1, read_callback, io);
+        op->opcode = VITASTOR_OP_READ;
         bsd->last_sync = false;
         break;
     case DDIR_WRITE:
@@ -373,12 +411,27 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
             io->error = EROFS;
             return FIO_Q_COMPLETED;
         }
-        iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
-        vitastor_c_write(bsd->cli, inode, io->offset, io->xfer_buflen, 0, &iov, 1, io_callback, io);
+        op->opcode = VITASTOR_OP_WRITE;
+        bsd->last_sync = false;
+        break;
+    case DDIR_TRIM:
+        if (opt->mirror_file && fallocate(bsd->mirror_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, io->offset, io->xfer_buflen) < 0)
+        {
+            fprintf(stderr, "Error discarding mirror file data: %s\n", strerror(errno));
+            io->error = errno;
+            return FIO_Q_COMPLETED;
+        }
+        if (opt->image && vitastor_c_inode_get_readonly(bsd->watch))
+        {
+            io->error = EROFS;
+            return FIO_Q_COMPLETED;
+        }
+        op->opcode = VITASTOR_OP_DISCARD;
+        op->iovcnt = 0;
         bsd->last_sync = false;
         break;
     case DDIR_SYNC:
-        vitastor_c_sync(bsd->cli, io_callback, io);
+        op->opcode = VITASTOR_OP_SYNC;
         bsd->last_sync = true;
         break;
     default:
@@ -395,48 +448,70 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
         else
         {
             printf("+++ %s 0x%lx 0x%llx+%lx\n",
-                io->ddir == DDIR_READ ? "READ" : "WRITE",
+                io->ddir == DDIR_READ ? "READ" : (io->ddir == DDIR_TRIM ? "TRIM" : "WRITE"),
                 (uint64_t)io, io->offset, (uint64_t)io->xfer_buflen);
         }
     }
 
-    if (io->error != 0)
-        return FIO_Q_COMPLETED;
+    bsd->queued.push_back(op);
     return FIO_Q_QUEUED;
 }
 
+/* Submit all queued requests in one batch. */
+static int sec_commit(struct thread_data *td)
+{
+    sec_data *bsd = (sec_data*)td->io_ops_data;
+    if (bsd->queued.size())
+    {
+        bsd->inflight += bsd->queued.size();
+        vitastor_c_submit(bsd->cli, bsd->queued.data(), bsd->queued.size());
+        bsd->queued.clear();
+    }
+    return 0;
+}
+
 static int sec_getevents(struct thread_data *td, unsigned int min, unsigned int max, const struct timespec *t)
 {
     sec_data *bsd = (sec_data*)td->io_ops_data;
-    while (true)
+    if (max > bsd->events.size())
+        max = bsd->events.size();
+    int n = vitastor_c_uring_wait_completions(bsd->cli, bsd->events.data(), min, max);
+    for (int i = 0; i < n; i++)
     {
-        vitastor_c_uring_handle_events(bsd->cli);
-        if (bsd->completed.size() >= min)
-            break;
-        vitastor_c_uring_wait_events(bsd->cli);
+        struct io_u *io = (struct io_u*)bsd->events[i]->opaque;
+        long retval = bsd->events[i]->retval;
+        io->error = retval < 0 ? -retval : 0;
+        bsd->inflight--;
+        if (bsd->trace)
+        {
+            printf("--- %s 0x%lx retval=%ld\n", io->ddir == DDIR_READ ? "READ" :
+                (io->ddir == DDIR_WRITE ? "WRITE" : (io->ddir == DDIR_TRIM ? "TRIM" : "SYNC")), (uint64_t)io, retval);
+        }
     }
-    return bsd->completed.size();
+    return n;
 }
 
 static struct io_u *sec_event(struct thread_data *td, int event)
 {
     sec_data *bsd = (sec_data*)td->io_ops_data;
-    if (bsd->completed.size() == 0)
-        return NULL;
-    /* FIXME We ignore the event number and assume fio calls us exactly once for [0..nr_events-1] */
-    struct io_u *ev = bsd->completed.back();
-    bsd->completed.pop_back();
-    return ev;
+    return (struct io_u*)bsd->events[event]->opaque;
 }
 
 static int sec_io_u_init(struct thread_data *td, struct io_u *io)
 {
-    io->engine_data = NULL;
+    sec_io *sio = new sec_io;
+    sio->op.opaque = io;
+    io->engine_data = sio;
     return 0;
 }
 
 static void sec_io_u_free(struct thread_data *td, struct io_u *io)
 {
+    if (io->engine_data)
+    {
+        delete (sec_io*)io->engine_data;
+        io->engine_data = NULL;
+    }
 }
 
 static int sec_open_file(struct thread_data *td, struct fio_file *f)
@@ -456,6 +531,7 @@ struct ioengine_ops ioengine = {
     .setup              = sec_setup,
     .init               = sec_init,
     .queue              = sec_queue,
+    .commit             = sec_commit,
     .getevents          = sec_getevents,
     .event              = sec_event,
     .cleanup            = sec_cleanup,
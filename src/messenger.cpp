@@ -19,7 +19,7 @@ void osd_messenger_t::init()
     {
         rdma_context = msgr_rdma_context_t::create(
             rdma_device != "" ? rdma_device.c_str() : NULL,
-            rdma_port_num, rdma_gid_index, rdma_mtu, log_level
+            rdma_port_num, rdma_gid_index, rdma_mtu, rdma_rdv_threshold ? rdma_pool_size : 0, log_level
         );
         if (!rdma_context)
         {
@@ -40,6 +40,50 @@ void osd_messenger_t::init()
         }
     }
 #endif
+    if (use_zerocopy_send)
+    {
+#ifdef IORING_CQE_F_NOTIF
+        if (!ringloop || use_sync_send_recv || !ringloop->has_opcode(IORING_OP_SENDMSG_ZC))
+#endif
+        {
+            if (log_level > 0)
+                fprintf(stderr, "[OSD %lu] Zero-copy send is not supported, using regular sendmsg\n", osd_num);
+            use_zerocopy_send = false;
+        }
+    }
+#ifdef IORING_RECV_MULTISHOT
+    if (use_multishot_recv && ringloop && !use_sync_send_recv)
+    {
+        // Buffer ring size must be a power of 2
+        uint32_t n = 1;
+        while (n < multishot_recv_buffers)
+            n *= 2;
+        multishot_recv_buffers = n;
+        recv_buf_ring = (struct io_uring_buf_ring*)memalign_or_die(4096, sizeof(struct io_uring_buf) * n);
+        int r = ringloop->register_buf_ring(recv_buf_ring, n, MSGR_RECV_BUF_GROUP);
+        if (r < 0)
+        {
+            free(recv_buf_ring);
+            recv_buf_ring = NULL;
+        }
+        else
+        {
+            recv_buffers = (uint8_t*)memalign_or_die(4096, (size_t)n * receive_buffer_size);
+            for (uint32_t i = 0; i < n; i++)
+            {
+                io_uring_buf_ring_add(recv_buf_ring, recv_buffers + (size_t)i*receive_buffer_size,
+                    receive_buffer_size, i, io_uring_buf_ring_mask(n), i);
+            }
+            io_uring_buf_ring_advance(recv_buf_ring, n);
+        }
+    }
+#endif
+    if (use_multishot_recv && !recv_buf_ring)
+    {
+        if (log_level > 0)
+            fprintf(stderr, "[OSD %lu] Provided buffer rings are not supported, using regular recvmsg\n", osd_num);
+        use_multishot_recv = false;
+    }
     keepalive_timer_id = tfd->set_timer(1000, true, [this](int)
     {
         std::vector<int> to_stop;
@@ -47,7 +91,7 @@ void osd_messenger_t::init()
         for (auto cl_it = clients.begin(); cl_it != clients.end(); cl_it++)
         {
             auto cl = cl_it->second;
-            if (!cl->osd_num || cl->peer_state != PEER_CONNECTED && cl->peer_state != PEER_RDMA)
+            if (!cl->osd_num || cl->peer_state != PEER_CONNECTED && cl->peer_state != PEER_RDMA && cl->peer_state != PEER_SHM)
             {
                 // Do not run keepalive on regular clients
                 continue;
@@ -130,6 +174,26 @@ osd_messenger_t::~osd_messenger_t()
     {
         stop_client(clients.begin()->first, true, true);
     }
+    if (shm_listen_fd >= 0)
+    {
+        close(shm_listen_fd);
+        shm_listen_fd = -1;
+    }
+    for (auto & p: shm_pending)
+    {
+        close(p.second.fd);
+    }
+    shm_pending.clear();
+#ifdef IORING_RECV_MULTISHOT
+    if (recv_buf_ring)
+    {
+        ringloop->unregister_buf_ring(MSGR_RECV_BUF_GROUP);
+        free(recv_buf_ring);
+        recv_buf_ring = NULL;
+        free(recv_buffers);
+        recv_buffers = NULL;
+    }
+#endif
 #ifdef WITH_RDMA
     if (rdma_context)
     {
@@ -164,12 +228,47 @@ void osd_messenger_t::parse_config(const json11::Json & config)
     this->rdma_max_msg = config["rdma_max_msg"].uint64_value();
     if (!this->rdma_max_msg || this->rdma_max_msg > 128*1024*1024)
         this->rdma_max_msg = 129*1024;
+    this->rdma_rdv_threshold = 65536;
+    if (!config["rdma_rdv_threshold"].is_null())
+    {
+        // 0 disables rendezvous transfers
+        this->rdma_rdv_threshold = config["rdma_rdv_threshold"].uint64_value();
+    }
+    this->rdma_pool_size = config["rdma_pool_size"].uint64_value();
+    if (!this->rdma_pool_size)
+        this->rdma_pool_size = 32*1024*1024;
 #endif
     this->receive_buffer_size = (uint32_t)config["tcp_header_buffer_size"].uint64_value();
     if (!this->receive_buffer_size || this->receive_buffer_size > 1024*1024*1024)
         this->receive_buffer_size = 65536;
     this->use_sync_send_recv = config["use_sync_send_recv"].bool_value() ||
         config["use_sync_send_recv"].uint64_value();
+    this->use_zerocopy_send = config["use_zerocopy_send"].bool_value() ||
+        config["use_zerocopy_send"].uint64_value();
+    this->zerocopy_send_threshold = config["zerocopy_send_threshold"].uint64_value();
+    if (!this->zerocopy_send_threshold)
+        this->zerocopy_send_threshold = 32768;
+    this->use_multishot_recv = config["use_multishot_recv"].bool_value() ||
+        config["use_multishot_recv"].uint64_value();
+    this->multishot_recv_buffers = config["multishot_recv_buffers"].uint64_value();
+    if (!this->multishot_recv_buffers || this->multishot_recv_buffers > 32768)
+        this->multishot_recv_buffers = 256;
+    if (!config["use_msg_batch"].is_null())
+    {
+        // Batching is on by default and is negotiated with each peer
+        this->use_msg_batch = config["use_msg_batch"].bool_value() || config["use_msg_batch"].uint64_value() != 0;
+    }
+    if (!config["use_shm"].is_null())
+    {
+        // Shared memory is off by default: it takes 2*shm_ring_size of RAM per connection
+        this->use_shm = config["use_shm"].bool_value() || config["use_shm"].uint64_value() != 0;
+    }
+    this->shm_ring_size = config["shm_ring_size"].uint64_value();
+    if (!this->shm_ring_size || this->shm_ring_size > 1024*1024*1024)
+        this->shm_ring_size = 8*1024*1024;
+    // Ring size must be a power of 2
+    while (this->shm_ring_size & (this->shm_ring_size-1))
+        this->shm_ring_size += (this->shm_ring_size & -this->shm_ring_size);
     this->peer_connect_interval = config["peer_connect_interval"].uint64_value();
     if (!this->peer_connect_interval)
         this->peer_connect_interval = 5;
@@ -182,7 +281,11 @@ void osd_messenger_t::parse_config(const json11::Json & config)
     this->osd_ping_timeout = config["osd_ping_timeout"].uint64_value();
     if (!this->osd_ping_timeout)
         this->osd_ping_timeout = 5;
+    this->peer_connections = config["peer_connections"].uint64_value();
+    if (!this->peer_connections || this->peer_connections > 64)
+        this->peer_connections = 1;
     this->log_level = config["log_level"].uint64_value();
+    tracer.parse_config(config);
 }
 
 void osd_messenger_t::connect_peer(uint64_t peer_osd, json11::Json peer_state)
@@ -199,6 +302,8 @@ void osd_messenger_t::connect_peer(uint64_t peer_osd, json11::Json peer_state)
         wanted_peers[peer_osd].address_list = peer_state["addresses"];
         wanted_peers[peer_osd].port = (int)peer_state["port"].int64_value();
     }
+    wanted_peers[peer_osd].shm_socket = peer_state["shm_socket"].string_value();
+    wanted_peers[peer_osd].shm_pid = peer_state["pid"].uint64_value();
     wanted_peers[peer_osd].address_changed = true;
     try_connect_peer(peer_osd);
 }
@@ -227,7 +332,7 @@ void osd_messenger_t::try_connect_peer(uint64_t peer_osd)
     try_connect_peer_addr(peer_osd, wp.cur_addr.c_str(), wp.cur_port);
 }
 
-void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port)
+void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port, int stripe)
 {
     assert(peer_osd != this->osd_num);
     struct sockaddr_storage addr;
@@ -257,7 +362,7 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
     clients[peer_fd]->peer_state = PEER_CONNECTING;
     clients[peer_fd]->connect_timeout_id = -1;
     clients[peer_fd]->osd_num = peer_osd;
-    clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
+    clients[peer_fd]->stripe = stripe;
     tfd->set_fd_handler(peer_fd, true, [this](int peer_fd, int epoll_events)
     {
         // Either OUT (connected) or HUP
@@ -303,6 +408,10 @@ void osd_messenger_t::handle_connect_epoll(int peer_fd)
     {
         handle_peer_epoll(peer_fd, epoll_events);
     });
+    if (use_multishot_recv)
+    {
+        arm_recv_multishot(cl);
+    }
     // Check OSD number
     check_peer_config(cl);
 }
@@ -316,9 +425,10 @@ void osd_messenger_t::handle_peer_epoll(int peer_fd, int epoll_events)
         fprintf(stderr, "[OSD %lu] client %d disconnected\n", this->osd_num, peer_fd);
         stop_client(peer_fd, true);
     }
-    else if (epoll_events & EPOLLIN)
+    else if ((epoll_events & EPOLLIN) && !clients[peer_fd]->recv_data)
     {
         // Mark client as ready (i.e. some data is available)
+        // Clients with an armed multishot receive don't need it
         auto cl = clients[peer_fd];
         cl->read_ready++;
         if (cl->read_ready == 1)
@@ -335,9 +445,18 @@ void osd_messenger_t::handle_peer_epoll(int peer_fd, int epoll_events)
 void osd_messenger_t::on_connect_peer(osd_num_t peer_osd, int peer_fd)
 {
     auto & wp = wanted_peers.at(peer_osd);
-    wp.connecting = false;
     if (peer_fd < 0)
     {
+        // Parallel connections are established as a unit, so drop already connected ones
+        std::vector<int> group_fds;
+        group_fds.swap(wp.group_fds);
+        wp.conn_group = 0;
+        wp.conn_group_token = "";
+        for (int group_fd: group_fds)
+        {
+            stop_client(group_fd, true);
+        }
+        wp.connecting = false;
         fprintf(stderr, "Failed to connect to peer OSD %lu address %s port %d: %s\n", peer_osd, wp.cur_addr.c_str(), wp.cur_port, strerror(-peer_fd));
         if (wp.address_changed)
         {
@@ -363,9 +482,23 @@ void osd_messenger_t::on_connect_peer(osd_num_t peer_osd, int peer_fd)
         }
         return;
     }
+    wp.group_fds.push_back(peer_fd);
+    if (wp.group_fds.size() < peer_connections && wp.conn_group)
+    {
+        // Open the next parallel connection to the same address
+        try_connect_peer_addr(peer_osd, wp.cur_addr.c_str(), wp.cur_port, wp.group_fds.size());
+        return;
+    }
+    wp.connecting = false;
+    osd_peer_fds[peer_osd] = wp.group_fds[0];
+    if (wp.group_fds.size() > 1)
+    {
+        osd_peer_stripes[peer_osd] = wp.group_fds;
+    }
     if (log_level > 0)
     {
-        fprintf(stderr, "[OSD %lu] Connected with peer OSD %lu (client %d)\n", osd_num, peer_osd, peer_fd);
+        fprintf(stderr, "[OSD %lu] Connected with peer OSD %lu (client %d, %lu connection(s))\n",
+            osd_num, peer_osd, wp.group_fds[0], wp.group_fds.size());
     }
     wanted_peers.erase(peer_osd);
     repeer_pgs(peer_osd);
@@ -385,25 +518,53 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
             },
         },
     };
+    json11::Json::object payload;
+    // Peers on the same host don't need RDMA, they use shared memory
+    std::string shm_token;
+    msgr_shm_connection_t *shm_conn = create_shm(cl, shm_token);
+    if (shm_conn)
+    {
+        payload["connect_shm"] = shm_token;
+        payload["shm_ring_size"] = shm_conn->ring_size;
+    }
 #ifdef WITH_RDMA
-    if (rdma_context)
+    if (rdma_context && !shm_conn)
     {
         cl->rdma_conn = msgr_rdma_connection_t::create(rdma_context, rdma_max_send, rdma_max_recv, rdma_max_sge, rdma_max_msg);
         if (cl->rdma_conn)
         {
-            json11::Json payload = json11::Json::object {
-                { "connect_rdma", cl->rdma_conn->addr.to_string() },
-                { "rdma_max_msg", cl->rdma_conn->max_msg },
-            };
-            std::string payload_str = payload.dump();
-            op->req.show_conf.json_len = payload_str.size();
-            op->buf = malloc_or_die(payload_str.size());
-            op->iov.push_back(op->buf, payload_str.size());
-            memcpy(op->buf, payload_str.c_str(), payload_str.size());
+            payload["connect_rdma"] = cl->rdma_conn->addr.to_string();
+            payload["rdma_max_msg"] = cl->rdma_conn->max_msg;
+            if (rdma_context->pool_mr)
+                payload["rdma_rdv_threshold"] = rdma_rdv_threshold;
         }
     }
 #endif
-    op->callback = [this, cl](osd_op_t *op)
+    if (peer_connections > 1)
+    {
+        // The first connection asks the peer to start a connection group, others join it
+        if (!cl->stripe)
+            payload["peer_connections"] = (uint64_t)peer_connections;
+        else
+        {
+            payload["conn_group"] = wanted_peers.at(cl->osd_num).conn_group;
+            payload["conn_group_token"] = wanted_peers.at(cl->osd_num).conn_group_token;
+        }
+    }
+    if (use_msg_batch)
+    {
+        // We understand batch frames, and the peer may send replies in them
+        payload["msg_batch"] = true;
+    }
+    if (payload.size())
+    {
+        std::string payload_str = json11::Json(payload).dump();
+        op->req.show_conf.json_len = payload_str.size();
+        op->buf = malloc_or_die(payload_str.size());
+        op->iov.push_back(op->buf, payload_str.size());
+        memcpy(op->buf, payload_str.c_str(), payload_str.size());
+    }
+    op->callback = [this, cl, shm_conn](osd_op_t *op)
     {
         std::string json_err;
         json11::Json config;
@@ -442,12 +603,29 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
         }
         if (err)
         {
+            if (shm_conn)
+            {
+                delete shm_conn;
+            }
             osd_num_t peer_osd = cl->osd_num;
             stop_client(op->peer_fd);
             on_connect_peer(peer_osd, -1);
             delete op;
             return;
         }
+        if (shm_conn && config["shm_ok"].bool_value())
+        {
+            if (log_level > 0)
+            {
+                fprintf(stderr, "Connected to OSD %lu using shared memory\n", cl->osd_num);
+            }
+            cl->shm_conn = shm_conn;
+            cl->peer_state = PEER_SHM;
+        }
+        else if (shm_conn)
+        {
+            delete shm_conn;
+        }
 #ifdef WITH_RDMA
         if (config["rdma_address"].is_string())
         {
@@ -475,6 +653,8 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
                 {
                     cl->rdma_conn->max_msg = server_max_msg;
                 }
+                // Servers without rendezvous support don't return the threshold
+                cl->rdma_conn->rdv_threshold = config["rdma_rdv_threshold"].uint64_value();
                 if (log_level > 0)
                 {
                     fprintf(stderr, "Connected to OSD %lu using RDMA\n", cl->osd_num);
@@ -486,7 +666,16 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
             }
         }
 #endif
-        osd_peer_fds[cl->osd_num] = cl->peer_fd;
+        // Send batch frames only to peers which understand them
+        cl->msg_batch = use_msg_batch && config["msg_batch"].bool_value();
+        // Older OSDs reject WRITE_ZEROES and DISCARD with -EINVAL
+        cl->write_zeroes = config["write_zeroes"].bool_value();
+        if (!cl->stripe)
+        {
+            // Peers which don't support parallel connections don't return the group ID
+            wanted_peers.at(cl->osd_num).conn_group = config["conn_group"].uint64_value();
+            wanted_peers.at(cl->osd_num).conn_group_token = config["conn_group_token"].string_value();
+        }
         on_connect_peer(cl->osd_num, cl->peer_fd);
         delete op;
     };
@@ -512,12 +701,15 @@ void osd_messenger_t::accept_connections(int listen_fd)
         clients[peer_fd]->peer_port = ntohs(((sockaddr_in*)&addr)->sin_port);
         clients[peer_fd]->peer_fd = peer_fd;
         clients[peer_fd]->peer_state = PEER_CONNECTED;
-        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
         // Add FD to epoll
         tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
         {
             handle_peer_epoll(peer_fd, epoll_events);
         });
+        if (use_multishot_recv)
+        {
+            arm_recv_multishot(clients[peer_fd]);
+        }
         // Try to accept next connection
         peer_addr_size = sizeof(addr);
     }
@@ -527,6 +719,17 @@ void osd_messenger_t::accept_connections(int listen_fd)
     }
 }
 
+bool osd_messenger_t::accept_msg_batch(int peer_fd)
+{
+    // Called when the peer reports that it understands batch frames
+    if (!use_msg_batch)
+    {
+        return false;
+    }
+    clients.at(peer_fd)->msg_batch = true;
+    return true;
+}
+
 #ifdef WITH_RDMA
 bool osd_messenger_t::is_rdma_enabled()
 {
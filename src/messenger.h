@@ -15,6 +15,9 @@
 #include "malloc_or_die.h"
 #include "json11/json11.hpp"
 #include "msgr_op.h"
+#include "msgr_shm.h"
+#include "open_hash_map.h"
+#include "osd_trace.h"
 #include "timerfd_manager.h"
 #include <ringloop.h>
 
@@ -25,6 +28,7 @@
 #define CL_READ_HDR 1
 #define CL_READ_DATA 2
 #define CL_READ_REPLY_DATA 3
+#define CL_READ_BATCH 4
 #define CL_WRITE_READY 1
 
 #define PEER_CONNECTING 1
@@ -32,11 +36,20 @@
 #define PEER_RDMA_CONNECTING 3
 #define PEER_RDMA 4
 #define PEER_STOPPED 5
+#define PEER_SHM_CONNECTING 6
+#define PEER_SHM 7
 
 #define VITASTOR_CONFIG_PATH "/etc/vitastor/vitastor.conf"
 
 #define MSGR_SENDP_HDR 1
 #define MSGR_SENDP_FREE 2
+// Payload which may be sent using RDMA rendezvous
+#define MSGR_SENDP_DATA 4
+
+// Maximum size of a batch frame including its header
+#define MSGR_BATCH_MAX 4096
+
+#define MSGR_RECV_BUF_GROUP 1
 
 struct msgr_sendp_t
 {
@@ -56,12 +69,26 @@ struct osd_client_t
     int ping_time_remaining = 0;
     int idle_time_remaining = 0;
     osd_num_t osd_num = 0;
+    // Index of the connection among parallel connections to the same peer OSD
+    int stripe = 0;
+    // Server side: ID of the group of parallel connections of the same client
+    // and the random token required to join it
+    uint64_t conn_group = 0;
+    std::string conn_group_token;
+    // Peer accepts batch frames
+    bool msg_batch = false;
+    // Peer supports OSD_OP_WRITE_ZEROES and OSD_OP_DISCARD
+    bool write_zeroes = false;
 
     void *in_buf = NULL;
+    // Multishot receive request, if armed
+    struct ring_data_t *recv_data = NULL;
 
 #ifdef WITH_RDMA
     msgr_rdma_connection_t *rdma_conn = NULL;
 #endif
+    // Shared memory rings for peers on the same host
+    msgr_shm_connection_t *shm_conn = NULL;
 
     // Read state
     int read_ready = 0;
@@ -72,11 +99,11 @@ struct osd_client_t
     int read_state = 0;
     osd_op_buf_list_t recv_list;
 
-    // Incoming operations
-    std::vector<osd_op_t*> received_ops;
+    // Incoming operations (the value is unused)
+    open_hash_map_t<osd_op_t*, bool> received_ops;
 
     // Outbound operations
-    std::map<uint64_t, osd_op_t*> sent_ops;
+    open_hash_map_t<uint64_t, osd_op_t*> sent_ops;
 
     // PGs dirtied by this client's primary-writes
     std::set<pool_pg_num_t> dirty_pgs;
@@ -103,6 +130,13 @@ struct osd_wanted_peer_t
     int address_index;
     std::string cur_addr;
     int cur_port;
+    // Already configured parallel connections, published when all of them are ready
+    std::vector<int> group_fds;
+    uint64_t conn_group;
+    std::string conn_group_token;
+    // Unix socket for passing shared memory and the PID of the OSD process listening on it
+    std::string shm_socket;
+    uint64_t shm_pid;
 };
 
 struct osd_op_stats_t
@@ -112,6 +146,9 @@ struct osd_op_stats_t
     uint64_t op_stat_bytes[OSD_OP_MAX+1] = { 0 };
     uint64_t subop_stat_sum[OSD_OP_MAX+1] = { 0 };
     uint64_t subop_stat_count[OSD_OP_MAX+1] = { 0 };
+    // bytes sent without copying and bytes which the kernel copied anyway
+    uint64_t zerocopy_bytes = 0;
+    uint64_t zerocopy_copied_bytes = 0;
 };
 
 struct osd_messenger_t
@@ -124,8 +161,23 @@ protected:
     int peer_connect_timeout = 0;
     int osd_idle_timeout = 0;
     int osd_ping_timeout = 0;
+    int peer_connections = 1;
     int log_level = 0;
     bool use_sync_send_recv = false;
+    bool use_zerocopy_send = false;
+    uint64_t zerocopy_send_threshold = 0;
+    // Cleared if the kernel doesn't support IORING_SEND_ZC_REPORT_USAGE
+    bool zerocopy_report_usage = true;
+    bool use_multishot_recv = false;
+    uint32_t multishot_recv_buffers = 0;
+    struct io_uring_buf_ring *recv_buf_ring = NULL;
+    uint8_t *recv_buffers = NULL;
+    bool use_msg_batch = true;
+    bool use_shm = false;
+    uint64_t shm_ring_size = 0;
+    // Server side: abstract Unix socket receiving shared memory from clients
+    int shm_listen_fd = -1;
+    std::map<std::string, msgr_shm_pending_t> shm_pending;
 
 #ifdef WITH_RDMA
     bool use_rdma = true;
@@ -134,6 +186,7 @@ protected:
     msgr_rdma_context_t *rdma_context = NULL;
     uint64_t rdma_max_sge = 0, rdma_max_send = 0, rdma_max_recv = 0;
     uint64_t rdma_max_msg = 0;
+    uint64_t rdma_rdv_threshold = 0, rdma_pool_size = 0;
 #endif
 
     std::vector<int> read_ready_clients;
@@ -147,11 +200,19 @@ public:
     // osd_num_t is only for logging and asserts
     osd_num_t osd_num;
     uint64_t next_subop_id = 1;
-    std::map<int, osd_client_t*> clients;
+    open_hash_map_t<int, osd_client_t*> clients;
     std::map<osd_num_t, osd_wanted_peer_t> wanted_peers;
     std::map<uint64_t, int> osd_peer_fds;
+    // All parallel connections to peer OSDs, only when there are more than one
+    std::map<osd_num_t, std::vector<int>> osd_peer_stripes;
+    // Server side: last assigned connection group ID
+    uint64_t last_conn_group = 0;
+    // Server side: name of the shared memory socket, published in the OSD state
+    std::string shm_socket_name;
     // op statistics
     osd_op_stats_t stats;
+    // sampled operation tracing
+    osd_tracer_t tracer;
 
     void init();
     void parse_config(const json11::Json & config);
@@ -168,14 +229,36 @@ public:
 
     static json11::Json read_config(const json11::Json & config);
 
+    // Select one of the parallel connections to a peer OSD by object so that
+    // operations on the same object are always sent through the same connection
+    inline int object_peer_fd(osd_num_t peer_osd, int peer_fd, const object_id & oid)
+    {
+        if (peer_connections <= 1)
+        {
+            return peer_fd;
+        }
+        auto it = osd_peer_stripes.find(peer_osd);
+        if (it == osd_peer_stripes.end())
+        {
+            return peer_fd;
+        }
+        uint64_t h = oid.inode*0x9E3779B97F4A7C15ull ^ oid.stripe*0xC2B2AE3D27D4EB4Full;
+        h ^= h >> 29;
+        return it->second[h % it->second.size()];
+    }
+
+    void listen_shm();
+    bool connect_shm(int peer_fd, const std::string & token, uint64_t ring_size);
+    bool accept_msg_batch(int peer_fd);
+
 #ifdef WITH_RDMA
     bool is_rdma_enabled();
-    bool connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg);
+    bool connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg, uint64_t client_rdv_threshold);
 #endif
 
 protected:
     void try_connect_peer(uint64_t osd_num);
-    void try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port);
+    void try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port, int stripe = 0);
     void handle_peer_epoll(int peer_fd, int epoll_events);
     void handle_connect_epoll(int peer_fd);
     void on_connect_peer(osd_num_t peer_osd, int peer_fd);
@@ -185,18 +268,40 @@ protected:
 
     bool try_send(osd_client_t *cl);
     void measure_exec(osd_op_t *cur_op);
-    void handle_send(int result, osd_client_t *cl);
+    void batch_last_msg(std::vector<iovec> & send_list, std::vector<msgr_sendp_t> & outbox);
+    void handle_send(int result, osd_client_t *cl, std::vector<osd_op_t*> *defer_free = NULL);
+    void handle_send_zc(struct ring_data_t *data, osd_client_t *cl, std::vector<osd_op_t*> & defer_free, uint64_t & sent);
 
     bool handle_read(int result, osd_client_t *cl);
+    bool arm_recv_multishot(osd_client_t *cl);
+    void handle_read_multishot(struct ring_data_t *data, osd_client_t *cl);
     bool handle_read_buffer(osd_client_t *cl, void *curbuf, int remain);
     bool handle_finished_read(osd_client_t *cl);
     void handle_op_hdr(osd_client_t *cl);
     bool handle_reply_hdr(osd_client_t *cl);
+    bool handle_batch_hdr(osd_client_t *cl);
+    bool handle_batch(osd_client_t *cl);
+    void handle_op_ready(osd_client_t *cl, osd_op_t *op);
+    void handle_reply_received(osd_client_t *cl, osd_op_t *op);
     void handle_reply_ready(osd_op_t *op);
 
+    bool is_local_peer(int peer_fd);
+    msgr_shm_connection_t *create_shm(osd_client_t *cl, std::string & token);
+    void accept_shm();
+    void ring_shm_doorbell(osd_client_t *cl);
+    bool try_send_shm(osd_client_t *cl);
+    void read_shm(osd_client_t *cl);
+    void break_shm(osd_client_t *cl);
+
 #ifdef WITH_RDMA
     bool try_send_rdma(osd_client_t *cl);
     bool try_recv_rdma(osd_client_t *cl);
     void handle_rdma_events();
+    void rdma_expect_rdv(osd_client_t *cl, osd_op_t *op, uint64_t data_len, bool is_reply);
+    bool rdma_start_rdv(osd_client_t *cl);
+    bool rdma_post_reads(osd_client_t *cl);
+    void rdma_finish_read(osd_client_t *cl);
+    bool rdma_hold_ready(osd_client_t *cl, osd_op_t *op, bool is_reply);
+    bool handle_rdma_fin(osd_client_t *cl);
 #endif
 };
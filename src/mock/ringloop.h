@@ -3,23 +3,67 @@
 
 #pragma once
 
+#include <poll.h>
+
 #include <functional>
+#include <vector>
 
 struct ring_consumer_t
 {
     std::function<void(void)> loop;
 };
 
+// Runs consumers in loop() and sleeps on the epoll FD of the mock epoll_manager_t in wait()
 class ring_loop_t
 {
+    std::vector<ring_consumer_t*> consumers;
+    bool loop_again = false;
 public:
+    int wait_fd = -1;
+
+    ring_loop_t(int qd = 0)
+    {
+    }
     void register_consumer(ring_consumer_t *consumer)
     {
+        unregister_consumer(consumer);
+        consumers.push_back(consumer);
     }
     void unregister_consumer(ring_consumer_t *consumer)
     {
+        for (int i = 0; i < consumers.size(); i++)
+        {
+            if (consumers[i] == consumer)
+            {
+                consumers.erase(consumers.begin()+i, consumers.begin()+i+1);
+                break;
+            }
+        }
     }
     void submit()
     {
     }
+    void wakeup()
+    {
+        loop_again = true;
+    }
+    void loop()
+    {
+        do
+        {
+            loop_again = false;
+            for (int i = 0; i < consumers.size(); i++)
+            {
+                consumers[i]->loop();
+            }
+        } while (loop_again);
+    }
+    void wait()
+    {
+        if (wait_fd >= 0)
+        {
+            pollfd pfd = { .fd = wait_fd, .events = POLLIN };
+            poll(&pfd, 1, -1);
+        }
+    }
 };
@@ -3,8 +3,141 @@
 
 #include <assert.h>
 
+#include <vector>
+#include <unordered_map>
+
+#include "malloc_or_die.h"
 #include "msgr_op.h"
 
+thread_local op_pool_stats_t op_pool_stats;
+
+// Per-thread pools, free memory is returned to the system when the thread exits
+struct op_pools_t
+{
+    std::vector<void*> op_pool;
+    std::vector<void*> op_data_pool[OP_DATA_POOL_MAX_SHIFT-OP_DATA_POOL_MIN_SHIFT+1];
+    std::vector<void*> op_buf_pool[OP_BUF_POOL_MAX_SHIFT-OP_BUF_POOL_MIN_SHIFT+1];
+    // Size classes of all pooled buffers, either in use or free
+    std::unordered_map<void*, uint8_t> op_buf_classes;
+
+    ~op_pools_t()
+    {
+        for (void *ptr: op_pool)
+            free(ptr);
+        for (auto & pool: op_data_pool)
+            for (void *ptr: pool)
+                free(ptr);
+        for (auto & pool: op_buf_pool)
+            for (void *ptr: pool)
+                free(ptr);
+    }
+};
+
+static thread_local op_pools_t op_pools;
+
+// Index of the smallest class of 2^min_shift..2^max_shift which fits <size>, or -1
+static inline int pool_size_class(size_t size, int min_shift, int max_shift)
+{
+    int c = 0;
+    while (((size_t)1 << (min_shift+c)) < size)
+        c++;
+    return c > max_shift-min_shift ? -1 : c;
+}
+
+void *osd_op_t::operator new(size_t size)
+{
+    op_pool_stats.op_alloc++;
+    if (op_pools.op_pool.size())
+    {
+        op_pool_stats.op_hit++;
+        void *ptr = op_pools.op_pool.back();
+        op_pools.op_pool.pop_back();
+        return ptr;
+    }
+    return malloc_or_die(size);
+}
+
+void osd_op_t::operator delete(void *ptr)
+{
+    if (op_pools.op_pool.size() < OP_POOL_MAX_FREE)
+        op_pools.op_pool.push_back(ptr);
+    else
+        free(ptr);
+}
+
+void *op_data_alloc(size_t size)
+{
+    // Size class is saved in the header before data
+    op_pool_stats.op_data_alloc++;
+    int c = pool_size_class(size+16, OP_DATA_POOL_MIN_SHIFT, OP_DATA_POOL_MAX_SHIFT);
+    uint8_t *ptr;
+    if (c >= 0 && op_pools.op_data_pool[c].size())
+    {
+        op_pool_stats.op_data_hit++;
+        ptr = (uint8_t*)op_pools.op_data_pool[c].back();
+        op_pools.op_data_pool[c].pop_back();
+        memset(ptr+16, 0, size);
+    }
+    else
+    {
+        ptr = (uint8_t*)calloc_or_die(1, c >= 0 ? ((size_t)1 << (OP_DATA_POOL_MIN_SHIFT+c)) : size+16);
+        *((int*)ptr) = c;
+    }
+    return ptr+16;
+}
+
+void op_data_free(void *data)
+{
+    if (!data)
+        return;
+    uint8_t *ptr = (uint8_t*)data - 16;
+    int c = *((int*)ptr);
+    if (c >= 0 && op_pools.op_data_pool[c].size() < OP_POOL_MAX_FREE)
+        op_pools.op_data_pool[c].push_back(ptr);
+    else
+        free(ptr);
+}
+
+void *op_buf_alloc(size_t size)
+{
+    op_pool_stats.buf_alloc++;
+    int c = pool_size_class(size, OP_BUF_POOL_MIN_SHIFT, OP_BUF_POOL_MAX_SHIFT);
+    if (c < 0)
+    {
+        return memalign_or_die(MEM_ALIGNMENT, size);
+    }
+    if (op_pools.op_buf_pool[c].size())
+    {
+        op_pool_stats.buf_hit++;
+        void *buf = op_pools.op_buf_pool[c].back();
+        op_pools.op_buf_pool[c].pop_back();
+        return buf;
+    }
+    void *buf = memalign_or_die(MEM_ALIGNMENT, (size_t)1 << (OP_BUF_POOL_MIN_SHIFT+c));
+    op_pools.op_buf_classes[buf] = c;
+    return buf;
+}
+
+void op_buf_free(void *buf)
+{
+    auto it = buf ? op_pools.op_buf_classes.find(buf) : op_pools.op_buf_classes.end();
+    if (it == op_pools.op_buf_classes.end())
+    {
+        free(buf);
+        return;
+    }
+    int c = it->second;
+    if ((op_pools.op_buf_pool[c].size()+1) << (OP_BUF_POOL_MIN_SHIFT+c) <= OP_BUF_POOL_MAX_BYTES)
+    {
+        op_pools.op_buf_pool[c].push_back(buf);
+    }
+    else
+    {
+        op_pools.op_buf_classes.erase(it);
+        free(buf);
+    }
+}
+
 osd_op_t::~osd_op_t()
 {
     assert(!bs_op);
@@ -16,7 +149,7 @@ osd_op_t::~osd_op_t()
     if (buf)
     {
         // Note: reusing osd_op_t WILL currently lead to memory leaks
-        // So we don't reuse it, but free it every time
-        free(buf);
+        // So we don't reuse it, but destroy it and return the memory to the pool every time
+        op_buf_free(buf);
     }
 }
@@ -152,6 +152,32 @@ struct blockstore_op_t;
 
 struct osd_primary_op_data_t;
 
+// Recently freed operations, op_data and payload buffers are kept in thread-local pools
+// and reused to avoid allocator calls in hot paths
+#define OP_POOL_MAX_FREE 1024
+#define OP_DATA_POOL_MIN_SHIFT 9
+#define OP_DATA_POOL_MAX_SHIFT 14
+#define OP_BUF_POOL_MIN_SHIFT 12
+#define OP_BUF_POOL_MAX_SHIFT 17
+#define OP_BUF_POOL_MAX_BYTES 16*1024*1024
+
+struct op_pool_stats_t
+{
+    uint64_t op_alloc = 0, op_hit = 0;
+    uint64_t op_data_alloc = 0, op_data_hit = 0;
+    uint64_t buf_alloc = 0, buf_hit = 0;
+};
+
+extern thread_local op_pool_stats_t op_pool_stats;
+
+// Zero-filled, for osd_primary_op_data_t. Must be freed with op_data_free()
+void *op_data_alloc(size_t size);
+void op_data_free(void *data);
+// Aligned to MEM_ALIGNMENT, sizes from 4 KB to 128 KB are pooled.
+// op_buf_free() also accepts any other buffer allocated with malloc()
+void *op_buf_alloc(size_t size);
+void op_buf_free(void *buf);
+
 struct osd_op_t
 {
     timespec tv_begin = { 0 }, tv_end = { 0 };
@@ -172,4 +198,7 @@ struct osd_op_t
     osd_op_buf_list_t iov;
 
     ~osd_op_t();
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
 };
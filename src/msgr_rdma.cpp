@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include "msgr_rdma.h"
 #include "messenger.h"
 
@@ -35,6 +36,10 @@ msgr_rdma_context_t::~msgr_rdma_context_t()
         ibv_destroy_comp_channel(channel);
     if (mr)
         ibv_dereg_mr(mr);
+    if (pool_mr)
+        ibv_dereg_mr(pool_mr);
+    if (pool_buf)
+        free(pool_buf);
     if (pd)
         ibv_dealloc_pd(pd);
     if (context)
@@ -43,15 +48,135 @@ msgr_rdma_context_t::~msgr_rdma_context_t()
 
 msgr_rdma_connection_t::~msgr_rdma_connection_t()
 {
-    ctx->used_max_cqe -= max_send+max_recv;
+    ctx->used_max_cqe -= max_send+MSGR_RDMA_MAX_READS+MSGR_RDMA_MAX_RDV_SENDS+max_recv;
     if (qp)
         ibv_destroy_qp(qp);
     if (recv_buffers.size())
         for (auto b: recv_buffers)
-            free(b);
+            free_recv_buffer(b);
+    if (buf_mr)
+        ibv_dereg_mr(buf_mr);
+    if (bufs)
+        free(bufs);
+    for (auto & rd: rdv_reads)
+    {
+        if (rd.bounce_mr)
+        {
+            ibv_dereg_mr(rd.bounce_mr);
+            free(rd.bounce);
+        }
+        else if (rd.bounce)
+            ctx->pool_free(rd.bounce, rd.desc.len);
+    }
+    // Windows are unbound when the queue pair is destroyed
+    for (auto & sp: rdv_sends)
+    {
+        ibv_dealloc_mw(sp.second.mw);
+        ctx->pool_free(sp.second.buf, sp.second.len);
+    }
+    for (auto & sp: rdv_invalidating)
+    {
+        ibv_dealloc_mw(sp.mw);
+        ctx->pool_free(sp.buf, sp.len);
+    }
+    for (auto mw: free_mws)
+        ibv_dealloc_mw(mw);
+}
+
+static int pool_class(uint64_t size)
+{
+    int cls = 0;
+    while (((uint64_t)1 << (cls+MSGR_RDMA_POOL_MIN_SHIFT)) < size)
+        cls++;
+    return cls;
+}
+
+void msgr_rdma_context_t::pool_init(uint64_t size)
+{
+    pool_size = size;
+    pool_top_class = 0;
+    while (pool_top_class < MSGR_RDMA_POOL_CLASSES-1 &&
+        ((uint64_t)2 << (pool_top_class+MSGR_RDMA_POOL_MIN_SHIFT)) <= pool_size)
+    {
+        pool_top_class++;
+    }
+    // The tail of the pool smaller than the top block size is split into smaller blocks
+    uint64_t pos = 0;
+    for (int cls = pool_top_class; cls >= 0; cls--)
+    {
+        uint64_t block_size = (uint64_t)1 << (cls+MSGR_RDMA_POOL_MIN_SHIFT);
+        while (pos + block_size <= pool_size && (cls == pool_top_class || !(pos & block_size)))
+        {
+            pool_free_blocks[cls].insert(pos);
+            pos += block_size;
+        }
+    }
+}
+
+void *msgr_rdma_context_t::pool_alloc(uint64_t size)
+{
+    // Pool memory is only used for rendezvous payloads, so it's fine to fail and fall back to regular sends
+    int cls = pool_class(size);
+    if (!pool_mr || cls > pool_top_class)
+        return NULL;
+    int found = cls;
+    while (found <= pool_top_class && !pool_free_blocks[found].size())
+        found++;
+    if (found > pool_top_class)
+        return NULL;
+    uint64_t pos = *pool_free_blocks[found].begin();
+    pool_free_blocks[found].erase(pool_free_blocks[found].begin());
+    // Split the block, keeping the first half and freeing the second one
+    while (found > cls)
+    {
+        found--;
+        pool_free_blocks[found].insert(pos + ((uint64_t)1 << (found+MSGR_RDMA_POOL_MIN_SHIFT)));
+    }
+    return pool_buf + pos;
+}
+
+void msgr_rdma_context_t::pool_free(void *buf, uint64_t size)
+{
+    int cls = pool_class(size);
+    uint64_t pos = (uint8_t*)buf - pool_buf;
+    // Merge the block with its free buddies
+    while (cls < pool_top_class)
+    {
+        uint64_t buddy = pos ^ ((uint64_t)1 << (cls+MSGR_RDMA_POOL_MIN_SHIFT));
+        auto buddy_it = pool_free_blocks[cls].find(buddy);
+        if (buddy_it == pool_free_blocks[cls].end())
+            break;
+        pool_free_blocks[cls].erase(buddy_it);
+        pos = pos < buddy ? pos : buddy;
+        cls++;
+    }
+    pool_free_blocks[cls].insert(pos);
+}
+
+uint32_t msgr_rdma_connection_t::lkey()
+{
+    return ctx->odp ? ctx->mr->lkey : buf_mr->lkey;
+}
+
+void *msgr_rdma_connection_t::alloc_recv_buffer()
+{
+    if (ctx->odp)
+        return malloc_or_die(max_msg);
+    void *buf = free_recv_buffers.back();
+    free_recv_buffers.pop_back();
+    return buf;
+}
+
+void msgr_rdma_connection_t::free_recv_buffer(void *buf)
+{
+    if (ctx->odp)
+        free(buf);
+    else
+        free_recv_buffers.push_back(buf);
 }
 
-msgr_rdma_context_t *msgr_rdma_context_t::create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu, int log_level)
+msgr_rdma_context_t *msgr_rdma_context_t::create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu,
+    uint64_t pool_size, int log_level)
 {
     int res;
     ibv_device **dev_list = NULL;
@@ -136,21 +261,58 @@ msgr_rdma_context_t *msgr_rdma_context_t::create(const char *ib_devname, uint8_t
             fprintf(stderr, "Couldn't query RDMA device for its features\n");
             goto cleanup;
         }
-        if (!(ctx->attrx.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
-            !(ctx->attrx.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) ||
-            !(ctx->attrx.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_SEND) ||
-            !(ctx->attrx.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_RECV))
+        ctx->odp = (ctx->attrx.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+            (ctx->attrx.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) &&
+            (ctx->attrx.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_SEND) &&
+            (ctx->attrx.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_RECV);
+        ctx->odp_read = ctx->odp && (ctx->attrx.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_READ);
+        ctx->max_rd_atomic = MSGR_RDMA_MAX_READS;
+        if (ctx->max_rd_atomic > ctx->attrx.orig_attr.max_qp_rd_atom)
+            ctx->max_rd_atomic = ctx->attrx.orig_attr.max_qp_rd_atom;
+        if (ctx->max_rd_atomic > ctx->attrx.orig_attr.max_qp_init_rd_atom)
+            ctx->max_rd_atomic = ctx->attrx.orig_attr.max_qp_init_rd_atom;
+        if (ctx->max_rd_atomic < 1)
+            ctx->max_rd_atomic = 1;
+        ctx->mw = (ctx->attrx.orig_attr.device_cap_flags & (IBV_DEVICE_MEM_WINDOW_TYPE_2A | IBV_DEVICE_MEM_WINDOW_TYPE_2B)) != 0;
+    }
+
+    if (ctx->odp)
+    {
+        ctx->mr = ibv_reg_mr(ctx->pd, NULL, SIZE_MAX, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND);
+        if (!ctx->mr)
         {
-            fprintf(stderr, "The RDMA device isn't implicit ODP (On-Demand Paging) capable or does not support RC send and receive with ODP\n");
+            fprintf(stderr, "Couldn't register RDMA memory region\n");
             goto cleanup;
         }
     }
+    else if (log_level > 0)
+    {
+        // For example, SoftRoCE (rxe) doesn't support implicit ODP
+        fprintf(stderr, "The RDMA device isn't implicit ODP (On-Demand Paging) capable, using registered buffers\n");
+    }
 
-    ctx->mr = ibv_reg_mr(ctx->pd, NULL, SIZE_MAX, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND);
-    if (!ctx->mr)
+    if (pool_size > 0 && !ctx->mw)
     {
-        fprintf(stderr, "Couldn't register RDMA memory region\n");
-        goto cleanup;
+        fprintf(stderr, "The RDMA device doesn't support type 2 memory windows, rendezvous transfers are disabled\n");
+    }
+    else if (pool_size > 0)
+    {
+        ctx->pool_buf = (uint8_t*)memalign(4096, pool_size);
+        if (ctx->pool_buf)
+        {
+            // Not remotely accessible by itself, only through memory windows
+            ctx->pool_mr = ibv_reg_mr(ctx->pd, ctx->pool_buf, pool_size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_MW_BIND);
+        }
+        if (!ctx->pool_mr)
+        {
+            fprintf(stderr, "Couldn't register %lu byte RDMA memory pool, rendezvous transfers are disabled\n", pool_size);
+            free(ctx->pool_buf);
+            ctx->pool_buf = NULL;
+        }
+        else
+        {
+            ctx->pool_init(pool_size);
+        }
     }
 
     ctx->channel = ibv_create_comp_channel(ctx->context);
@@ -192,7 +354,7 @@ msgr_rdma_connection_t *msgr_rdma_connection_t::create(msgr_rdma_context_t *ctx,
     conn->max_sge = max_sge;
     conn->max_msg = max_msg;
 
-    ctx->used_max_cqe += max_send+max_recv;
+    ctx->used_max_cqe += max_send+MSGR_RDMA_MAX_READS+MSGR_RDMA_MAX_RDV_SENDS+max_recv;
     if (ctx->used_max_cqe > ctx->max_cqe)
     {
         // Resize CQ
@@ -215,7 +377,8 @@ msgr_rdma_connection_t *msgr_rdma_connection_t::create(msgr_rdma_context_t *ctx,
         .send_cq = ctx->cq,
         .recv_cq = ctx->cq,
         .cap     = {
-            .max_send_wr  = max_send,
+            // Rendezvous reads, memory window binds and invalidations are posted to the send queue too
+            .max_send_wr  = max_send+MSGR_RDMA_MAX_READS+2*MSGR_RDMA_MAX_RDV_SENDS,
             .max_recv_wr  = max_recv,
             .max_send_sge = max_sge,
             .max_recv_sge = max_sge,
@@ -230,6 +393,27 @@ msgr_rdma_connection_t *msgr_rdma_connection_t::create(msgr_rdma_context_t *ctx,
         return NULL;
     }
 
+    if (!ctx->odp)
+    {
+        // Without ODP, messages are sent and received only through registered buffers
+        conn->buf_size = max_msg;
+        conn->bufs = (uint8_t*)memalign(4096, (max_send+max_recv)*conn->buf_size);
+        if (conn->bufs)
+        {
+            conn->buf_mr = ibv_reg_mr(ctx->pd, conn->bufs, (max_send+max_recv)*conn->buf_size, IBV_ACCESS_LOCAL_WRITE);
+        }
+        if (!conn->buf_mr)
+        {
+            fprintf(stderr, "Couldn't register RDMA send and receive buffers\n");
+            delete conn;
+            return NULL;
+        }
+        for (uint32_t i = 0; i < max_recv; i++)
+        {
+            conn->free_recv_buffers.push_back(conn->bufs + (max_send+i)*conn->buf_size);
+        }
+    }
+
     conn->addr.lid = ctx->my_lid;
     conn->addr.gid = ctx->my_gid;
     conn->addr.qpn = conn->qp->qp_num;
@@ -237,7 +421,8 @@ msgr_rdma_connection_t *msgr_rdma_connection_t::create(msgr_rdma_context_t *ctx,
 
     ibv_qp_attr attr = {
         .qp_state        = IBV_QPS_INIT,
-        .qp_access_flags = 0,
+        // Peers read rendezvous payloads through memory windows
+        .qp_access_flags = IBV_ACCESS_REMOTE_READ,
         .pkey_index      = 0,
         .port_num        = ctx->ib_port,
     };
@@ -286,8 +471,8 @@ int msgr_rdma_connection_t::connect(msgr_rdma_address_t *dest)
             .is_global  = (uint8_t)(dest->gid.global.interface_id ? 1 : 0),
             .port_num   = conn->ctx->ib_port,
         },
-        .max_rd_atomic  = 1,
-        .max_dest_rd_atomic = 1,
+        .max_rd_atomic  = (uint8_t)conn->ctx->max_rd_atomic,
+        .max_dest_rd_atomic = (uint8_t)conn->ctx->max_rd_atomic,
         // Timeout and min_rnr_timer actual values seem to be 4.096us*2^(timeout+1)
         .min_rnr_timer  = 1,
         .timeout        = 14,
@@ -311,7 +496,7 @@ int msgr_rdma_connection_t::connect(msgr_rdma_address_t *dest)
     return 0;
 }
 
-bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg)
+bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg, uint64_t client_rdv_threshold)
 {
     // Try to connect to the peer using RDMA
     msgr_rdma_address_t addr;
@@ -335,6 +520,12 @@ bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64
             }
             else
             {
+                // Both sides must use the same threshold, so take the larger one
+                if (client_rdv_threshold && rdma_rdv_threshold && rdma_context->pool_mr)
+                {
+                    rdma_conn->rdv_threshold = client_rdv_threshold > rdma_rdv_threshold
+                        ? client_rdv_threshold : rdma_rdv_threshold;
+                }
                 // Remember connection, but switch to RDMA only after sending the configuration response
                 auto cl = clients.at(peer_fd);
                 cl->rdma_conn = rdma_conn;
@@ -348,21 +539,134 @@ bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64
 
 static void try_send_rdma_wr(osd_client_t *cl, ibv_sge *sge, int op_sge)
 {
+    auto rc = cl->rdma_conn;
+    ibv_sge copy_sge;
+    if (!rc->ctx->odp)
+    {
+        // Copy the message into a registered buffer. All sends of the batch complete
+        // before the next batch is started, so cur_send is a free buffer index
+        uint8_t *buf = rc->bufs + rc->cur_send*rc->buf_size;
+        uint32_t len = 0;
+        for (int i = 0; i < op_sge; i++)
+        {
+            memcpy(buf+len, (void*)sge[i].addr, sge[i].length);
+            len += sge[i].length;
+        }
+        copy_sge = {
+            .addr = (uintptr_t)buf,
+            .length = len,
+            .lkey = rc->buf_mr->lkey,
+        };
+        sge = &copy_sge;
+        op_sge = 1;
+    }
     ibv_send_wr *bad_wr = NULL;
     ibv_send_wr wr = {
-        .wr_id = (uint64_t)(cl->peer_fd*2+1),
+        .wr_id = (uint64_t)(cl->peer_fd*4+MSGR_RDMA_WR_SEND),
         .sg_list = sge,
         .num_sge = op_sge,
         .opcode = IBV_WR_SEND,
         .send_flags = IBV_SEND_SIGNALED,
     };
-    int err = ibv_post_send(cl->rdma_conn->qp, &wr, &bad_wr);
+    int err = ibv_post_send(rc->qp, &wr, &bad_wr);
     if (err || bad_wr)
     {
         fprintf(stderr, "RDMA send failed: %s\n", strerror(err));
         exit(1);
     }
-    cl->rdma_conn->cur_send++;
+    rc->cur_send++;
+}
+
+// Expose a pool buffer to the peer through a memory window bound to the connection's
+// queue pair. The bind is posted before the send with the descriptor, so it's
+// executed first. Returns false if no window could be allocated
+static bool bind_rdv_window(osd_client_t *cl, void *buf, uint64_t len, msgr_rdma_rdv_t *desc)
+{
+    auto rc = cl->rdma_conn;
+    ibv_mw *mw = NULL;
+    if (rc->free_mws.size())
+    {
+        mw = rc->free_mws.back();
+        rc->free_mws.pop_back();
+    }
+    else
+    {
+        mw = ibv_alloc_mw(rc->ctx->pd, IBV_MW_TYPE_2);
+        if (!mw)
+            return false;
+    }
+    // A new key for every bind, so the previous one can't be reused
+    uint32_t rkey = ibv_inc_rkey(mw->rkey);
+    ibv_send_wr *bad_wr = NULL;
+    ibv_send_wr wr = {
+        .wr_id = (uint64_t)(cl->peer_fd*4+MSGR_RDMA_WR_MW),
+        .opcode = IBV_WR_BIND_MW,
+        .send_flags = 0,
+    };
+    wr.bind_mw.mw = mw;
+    wr.bind_mw.rkey = rkey;
+    wr.bind_mw.bind_info = {
+        .mr = rc->ctx->pool_mr,
+        .addr = (uintptr_t)buf,
+        .length = len,
+        .mw_access_flags = IBV_ACCESS_REMOTE_READ,
+    };
+    int err = ibv_post_send(rc->qp, &wr, &bad_wr);
+    if (err || bad_wr)
+    {
+        fprintf(stderr, "RDMA memory window bind failed: %s\n", strerror(err));
+        exit(1);
+    }
+    mw->rkey = rkey;
+    desc->addr = (uintptr_t)buf;
+    desc->rkey = rkey;
+    desc->cookie = ++rc->rdv_next_cookie;
+    rc->rdv_sends[desc->cookie] = (msgr_rdma_rdv_send_t){ .buf = buf, .len = len, .mw = mw };
+    return true;
+}
+
+// Called for the first payload part of a message which isn't sent yet. Returns NULL if
+// the payload should be sent as is, or a rendezvous descriptor to send instead of it
+static msgr_rdma_rdv_t *prepare_rdv(osd_client_t *cl)
+{
+    auto rc = cl->rdma_conn;
+    osd_op_t *op = cl->outbox[rc->send_pos].op;
+    int end = rc->send_pos;
+    uint64_t len = 0;
+    while (end < cl->send_list.size() && cl->outbox[end].op == op && (cl->outbox[end].flags & MSGR_SENDP_DATA))
+    {
+        // The decision is made once per message
+        cl->outbox[end].flags &= ~MSGR_SENDP_DATA;
+        len += cl->send_list[end].iov_len;
+        end++;
+    }
+    if (len < rc->rdv_threshold)
+    {
+        return NULL;
+    }
+    // The receiver expects a descriptor for every large payload, so send it even
+    // when the pool is full, with the payload following inline
+    rc->rdv_send_descs.push_back((msgr_rdma_rdv_t){ .addr = 0, .cookie = 0, .rkey = 0, .len = (uint32_t)len });
+    msgr_rdma_rdv_t *desc = &rc->rdv_send_descs.back();
+    void *buf = len <= UINT32_MAX && rc->rdv_sends.size()+rc->rdv_invalidating.size() < MSGR_RDMA_MAX_RDV_SENDS
+        ? rc->ctx->pool_alloc(len) : NULL;
+    if (buf && !bind_rdv_window(cl, buf, len, desc))
+    {
+        rc->ctx->pool_free(buf, len);
+        buf = NULL;
+    }
+    if (buf)
+    {
+        uint64_t pos = 0;
+        for (int i = rc->send_pos; i < end; i++)
+        {
+            memcpy((uint8_t*)buf + pos, cl->send_list[i].iov_base, cl->send_list[i].iov_len);
+            pos += cl->send_list[i].iov_len;
+        }
+        // Payload is copied, skip it
+        rc->send_pos = end;
+    }
+    return desc;
 }
 
 bool osd_messenger_t::try_send_rdma(osd_client_t *cl)
@@ -378,7 +682,9 @@ bool osd_messenger_t::try_send_rdma(osd_client_t *cl)
     while (rc->send_pos < cl->send_list.size())
     {
         iovec & iov = cl->send_list[rc->send_pos];
-        if (op_size >= rc->max_msg || op_sge >= rc->max_sge)
+        bool rdv_start = rc->rdv_threshold && !rc->send_buf_pos && (cl->outbox[rc->send_pos].flags & MSGR_SENDP_DATA);
+        if (op_size >= rc->max_msg || op_sge >= rc->max_sge ||
+            rdv_start && op_size+sizeof(msgr_rdma_rdv_t) > rc->max_msg)
         {
             try_send_rdma_wr(cl, sge, op_sge);
             op_sge = 0;
@@ -388,12 +694,26 @@ bool osd_messenger_t::try_send_rdma(osd_client_t *cl)
                 break;
             }
         }
+        if (rdv_start)
+        {
+            msgr_rdma_rdv_t *desc = prepare_rdv(cl);
+            if (desc)
+            {
+                sge[op_sge++] = {
+                    .addr = (uintptr_t)desc,
+                    .length = sizeof(msgr_rdma_rdv_t),
+                    .lkey = rc->lkey(),
+                };
+                op_size += sizeof(msgr_rdma_rdv_t);
+            }
+            continue;
+        }
         uint32_t len = (uint32_t)(op_size+iov.iov_len-rc->send_buf_pos < rc->max_msg
             ? iov.iov_len-rc->send_buf_pos : rc->max_msg-op_size);
         sge[op_sge++] = {
             .addr = (uintptr_t)((uint8_t*)iov.iov_base+rc->send_buf_pos),
             .length = len,
-            .lkey = rc->ctx->mr->lkey,
+            .lkey = rc->lkey(),
         };
         op_size += len;
         rc->send_buf_pos += len;
@@ -414,7 +734,7 @@ static void try_recv_rdma_wr(osd_client_t *cl, ibv_sge *sge, int op_sge)
 {
     ibv_recv_wr *bad_wr = NULL;
     ibv_recv_wr wr = {
-        .wr_id = (uint64_t)(cl->peer_fd*2),
+        .wr_id = (uint64_t)(cl->peer_fd*4+MSGR_RDMA_WR_RECV),
         .sg_list = sge,
         .num_sge = op_sge,
     };
@@ -432,18 +752,274 @@ bool osd_messenger_t::try_recv_rdma(osd_client_t *cl)
     auto rc = cl->rdma_conn;
     while (rc->cur_recv < rc->max_recv)
     {
-        void *buf = malloc_or_die(rc->max_msg);
+        void *buf = rc->alloc_recv_buffer();
         rc->recv_buffers.push_back(buf);
         ibv_sge sge = {
             .addr = (uintptr_t)buf,
             .length = (uint32_t)rc->max_msg,
-            .lkey = rc->ctx->mr->lkey,
+            .lkey = rc->lkey(),
         };
         try_recv_rdma_wr(cl, &sge, 1);
     }
     return true;
 }
 
+void osd_messenger_t::rdma_expect_rdv(osd_client_t *cl, osd_op_t *op, uint64_t data_len, bool is_reply)
+{
+    auto rc = cl->rdma_conn;
+    if (cl->peer_state != PEER_RDMA || !rc->rdv_threshold || data_len < rc->rdv_threshold)
+    {
+        return;
+    }
+    // Payload buffers are at the end of the receive list, receive the descriptor instead
+    int i = cl->recv_list.count;
+    uint64_t found = 0;
+    while (found < data_len && i > 0)
+    {
+        i--;
+        found += cl->recv_list.buf[i].iov_len;
+    }
+    assert(found == data_len);
+    rc->rdv_iov.assign(cl->recv_list.buf+i, cl->recv_list.buf+cl->recv_list.count);
+    cl->recv_list.count = i;
+    cl->recv_list.push_back(&rc->rdv_desc, sizeof(msgr_rdma_rdv_t));
+    cl->read_remaining += sizeof(msgr_rdma_rdv_t) - data_len;
+    rc->rdv_op = op;
+    rc->rdv_is_reply = is_reply;
+}
+
+bool osd_messenger_t::rdma_start_rdv(osd_client_t *cl)
+{
+    auto rc = cl->rdma_conn;
+    osd_op_t *op = rc->rdv_op;
+    rc->rdv_op = NULL;
+    uint64_t data_len = 0;
+    for (auto & v: rc->rdv_iov)
+    {
+        data_len += v.iov_len;
+    }
+    if (rc->rdv_desc.len != data_len)
+    {
+        fprintf(stderr, "Client %d sent a bad rendezvous descriptor: %u bytes instead of %lu\n",
+            cl->peer_fd, rc->rdv_desc.len, data_len);
+        stop_client(cl->peer_fd);
+        return false;
+    }
+    if (!rc->rdv_desc.addr)
+    {
+        // The peer sends the payload inline
+        for (auto & v: rc->rdv_iov)
+        {
+            cl->recv_list.push_back(v.iov_base, v.iov_len);
+        }
+        cl->read_remaining = data_len;
+        return true;
+    }
+    // The operation is ready when the payload is read
+    rc->rdv_reads.push_back((msgr_rdma_rdv_read_t){
+        .op = op,
+        .is_reply = rc->rdv_is_reply,
+        .posted = false,
+        .ready = false,
+        .desc = rc->rdv_desc,
+        .bounce = NULL,
+        .bounce_mr = NULL,
+    });
+    rc->rdv_reads.back().iov.swap(rc->rdv_iov);
+    cl->read_op = NULL;
+    cl->read_state = 0;
+    return rdma_post_reads(cl);
+}
+
+bool osd_messenger_t::rdma_post_reads(osd_client_t *cl)
+{
+    auto rc = cl->rdma_conn;
+    for (auto & rd: rc->rdv_reads)
+    {
+        if (rc->cur_read >= MSGR_RDMA_MAX_READS)
+        {
+            break;
+        }
+        if (rd.posted)
+        {
+            continue;
+        }
+        ibv_sge sge[rc->max_sge];
+        int op_sge = 0;
+        if (rc->ctx->odp_read && rd.iov.size() <= (size_t)rc->max_sge)
+        {
+            // Read directly into the operation buffer
+            for (auto & v: rd.iov)
+            {
+                sge[op_sge++] = {
+                    .addr = (uintptr_t)v.iov_base,
+                    .length = (uint32_t)v.iov_len,
+                    .lkey = rc->ctx->mr->lkey,
+                };
+            }
+        }
+        else
+        {
+            rd.bounce = rc->ctx->pool_alloc(rd.desc.len);
+            uint32_t lkey = rd.bounce ? rc->ctx->pool_mr->lkey : 0;
+            if (!rd.bounce)
+            {
+                // Pool is full, register a temporary buffer
+                rd.bounce = malloc_or_die(rd.desc.len);
+                rd.bounce_mr = ibv_reg_mr(rc->ctx->pd, rd.bounce, rd.desc.len, IBV_ACCESS_LOCAL_WRITE);
+                if (!rd.bounce_mr)
+                {
+                    fprintf(stderr, "Couldn't register %u byte RDMA buffer, stopping client %d\n", rd.desc.len, cl->peer_fd);
+                    free(rd.bounce);
+                    rd.bounce = NULL;
+                    stop_client(cl->peer_fd);
+                    return false;
+                }
+                lkey = rd.bounce_mr->lkey;
+            }
+            sge[op_sge++] = {
+                .addr = (uintptr_t)rd.bounce,
+                .length = rd.desc.len,
+                .lkey = lkey,
+            };
+        }
+        ibv_send_wr *bad_wr = NULL;
+        ibv_send_wr wr = {
+            .wr_id = (uint64_t)(cl->peer_fd*4+MSGR_RDMA_WR_READ),
+            .sg_list = sge,
+            .num_sge = op_sge,
+            .opcode = IBV_WR_RDMA_READ,
+            .send_flags = IBV_SEND_SIGNALED,
+            .wr = {
+                .rdma = {
+                    .remote_addr = rd.desc.addr,
+                    .rkey = rd.desc.rkey,
+                },
+            },
+        };
+        int err = ibv_post_send(rc->qp, &wr, &bad_wr);
+        if (err || bad_wr)
+        {
+            fprintf(stderr, "RDMA read failed: %s\n", strerror(err));
+            exit(1);
+        }
+        rd.posted = true;
+        rc->cur_read++;
+    }
+    return true;
+}
+
+void osd_messenger_t::rdma_finish_read(osd_client_t *cl)
+{
+    auto rc = cl->rdma_conn;
+    // Reads complete in the order of submission
+    auto rd_it = rc->rdv_reads.begin();
+    while (rd_it->ready)
+    {
+        rd_it++;
+    }
+    auto & rd = *rd_it;
+    rc->cur_read--;
+    if (rd.bounce)
+    {
+        uint64_t pos = 0;
+        for (auto & v: rd.iov)
+        {
+            memcpy(v.iov_base, (uint8_t*)rd.bounce + pos, v.iov_len);
+            pos += v.iov_len;
+        }
+        if (rd.bounce_mr)
+        {
+            ibv_dereg_mr(rd.bounce_mr);
+            free(rd.bounce);
+        }
+        else
+            rc->ctx->pool_free(rd.bounce, rd.desc.len);
+        rd.bounce = NULL;
+        rd.bounce_mr = NULL;
+    }
+    rd.ready = true;
+    // Let the peer release its buffer
+    osd_op_t *fin_op = new osd_op_t;
+    fin_op->op_type = OSD_OP_IN;
+    fin_op->peer_fd = cl->peer_fd;
+    fin_op->req.hdr.magic = SECONDARY_OSD_RDV_FIN_MAGIC;
+    fin_op->req.hdr.id = rd.desc.cookie;
+    cl->send_list.push_back((iovec){ .iov_base = fin_op->req.buf, .iov_len = OSD_PACKET_SIZE });
+    cl->outbox.push_back((msgr_sendp_t){ .op = fin_op, .flags = MSGR_SENDP_HDR|MSGR_SENDP_FREE });
+    try_send_rdma(cl);
+    // Complete operations in the order of receiving, so that a later write
+    // to the same object can't overtake an earlier one
+    while (rc->rdv_reads.size() && rc->rdv_reads.front().ready)
+    {
+        auto & ready = rc->rdv_reads.front();
+        if (ready.is_reply)
+        {
+            handle_reply_ready(ready.op);
+        }
+        else
+        {
+            cl->received_ops[ready.op] = true;
+            set_immediate.push_back([this, op = ready.op]() { exec_op(op); });
+        }
+        rc->rdv_reads.pop_front();
+    }
+    rdma_post_reads(cl);
+}
+
+// Hold an operation received after a rendezvous one until the payload of the latter is read
+bool osd_messenger_t::rdma_hold_ready(osd_client_t *cl, osd_op_t *op, bool is_reply)
+{
+    auto rc = cl->rdma_conn;
+    if (!rc || !rc->rdv_reads.size())
+    {
+        return false;
+    }
+    rc->rdv_reads.push_back((msgr_rdma_rdv_read_t){
+        .op = op,
+        .is_reply = is_reply,
+        .posted = true,
+        .ready = true,
+        .desc = {},
+        .bounce = NULL,
+        .bounce_mr = NULL,
+    });
+    return true;
+}
+
+bool osd_messenger_t::handle_rdma_fin(osd_client_t *cl)
+{
+    auto rc = cl->rdma_conn;
+    auto it = rc->rdv_sends.find(cl->read_op->req.hdr.id);
+    if (it == rc->rdv_sends.end())
+    {
+        fprintf(stderr, "Client %d released unknown rendezvous buffer %lu\n", cl->peer_fd, cl->read_op->req.hdr.id);
+        stop_client(cl->peer_fd);
+        return false;
+    }
+    // The buffer is only reused after the peer loses access to it
+    ibv_send_wr *bad_wr = NULL;
+    ibv_send_wr wr = {
+        .wr_id = (uint64_t)(cl->peer_fd*4+MSGR_RDMA_WR_MW),
+        .opcode = IBV_WR_LOCAL_INV,
+        .send_flags = IBV_SEND_SIGNALED,
+        .invalidate_rkey = it->second.mw->rkey,
+    };
+    int err = ibv_post_send(rc->qp, &wr, &bad_wr);
+    if (err || bad_wr)
+    {
+        fprintf(stderr, "RDMA memory window invalidation failed: %s\n", strerror(err));
+        exit(1);
+    }
+    rc->rdv_invalidating.push_back(it->second);
+    rc->rdv_sends.erase(it);
+    // Reuse the header buffer
+    cl->recv_list.push_back(cl->read_op->req.buf, OSD_PACKET_SIZE);
+    cl->read_remaining = OSD_PACKET_SIZE;
+    cl->read_state = CL_READ_HDR;
+    return true;
+}
+
 #define RDMA_EVENTS_AT_ONCE 32
 
 void osd_messenger_t::handle_rdma_events()
@@ -468,8 +1044,8 @@ void osd_messenger_t::handle_rdma_events()
         event_count = ibv_poll_cq(rdma_context->cq, RDMA_EVENTS_AT_ONCE, wc);
         for (int i = 0; i < event_count; i++)
         {
-            int client_id = wc[i].wr_id >> 1;
-            bool is_send = wc[i].wr_id & 1;
+            int client_id = wc[i].wr_id >> 2;
+            int wr_kind = wc[i].wr_id & 3;
             auto cl_it = clients.find(client_id);
             if (cl_it == clients.end())
             {
@@ -487,7 +1063,7 @@ void osd_messenger_t::handle_rdma_events()
                 stop_client(client_id);
                 continue;
             }
-            if (!is_send)
+            if (wr_kind == MSGR_RDMA_WR_RECV)
             {
                 cl->rdma_conn->cur_recv--;
                 if (!handle_read_buffer(cl, cl->rdma_conn->recv_buffers[0], wc[i].byte_len))
@@ -495,10 +1071,23 @@ void osd_messenger_t::handle_rdma_events()
                     // handle_read_buffer may stop the client
                     continue;
                 }
-                free(cl->rdma_conn->recv_buffers[0]);
+                cl->rdma_conn->free_recv_buffer(cl->rdma_conn->recv_buffers[0]);
                 cl->rdma_conn->recv_buffers.erase(cl->rdma_conn->recv_buffers.begin(), cl->rdma_conn->recv_buffers.begin()+1);
                 try_recv_rdma(cl);
             }
+            else if (wr_kind == MSGR_RDMA_WR_READ)
+            {
+                rdma_finish_read(cl);
+            }
+            else if (wr_kind == MSGR_RDMA_WR_MW)
+            {
+                // Memory window is invalidated, binds are unsignaled. Invalidations complete in order
+                auto rc = cl->rdma_conn;
+                auto & sp = rc->rdv_invalidating.front();
+                rc->ctx->pool_free(sp.buf, sp.len);
+                rc->free_mws.push_back(sp.mw);
+                rc->rdv_invalidating.pop_front();
+            }
             else
             {
                 cl->rdma_conn->cur_send--;
@@ -525,6 +1114,7 @@ void osd_messenger_t::handle_rdma_events()
                         cl->send_list[0].iov_len -= cl->rdma_conn->send_buf_pos;
                         cl->rdma_conn->send_buf_pos = 0;
                     }
+                    cl->rdma_conn->rdv_send_descs.clear();
                     try_send_rdma(cl);
                 }
             }
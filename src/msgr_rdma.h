@@ -2,9 +2,32 @@
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
 #pragma once
+#include <sys/uio.h>
 #include <infiniband/verbs.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <set>
+
+// Work request kinds, stored in the lowest 2 bits of wr_id
+#define MSGR_RDMA_WR_RECV 0
+#define MSGR_RDMA_WR_SEND 1
+#define MSGR_RDMA_WR_READ 2
+// Memory window bind (unsignaled) or invalidation
+#define MSGR_RDMA_WR_MW 3
+
+// Maximum number of parallel rendezvous RDMA reads per connection
+#define MSGR_RDMA_MAX_READS 16
+// Maximum number of rendezvous payloads exposed to the peer at once per connection
+#define MSGR_RDMA_MAX_RDV_SENDS 64
+
+// Smallest rendezvous pool allocation is 4 KB, allocations are rounded up to powers of 2
+// and served by a buddy allocator, so freed blocks are merged back into larger ones
+#define MSGR_RDMA_POOL_MIN_SHIFT 12
+#define MSGR_RDMA_POOL_CLASSES 40
+
+struct osd_op_t;
 
 struct msgr_rdma_address_t
 {
@@ -34,9 +57,69 @@ struct msgr_rdma_context_t
     uint32_t mtu;
     int max_cqe = 0;
     int used_max_cqe = 0;
+    // Implicit ODP is available: any memory can be used in RDMA operations.
+    // Otherwise, only registered buffers are used, like with SoftRoCE (rxe)
+    bool odp = false;
+    // RDMA reads into ODP memory are supported
+    bool odp_read = false;
+    int max_rd_atomic = 1;
+    // Type 2 memory windows are supported
+    bool mw = false;
 
-    static msgr_rdma_context_t *create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu, int log_level);
+    // Registered memory pool for rendezvous transfers. The pool itself isn't
+    // remotely accessible: each payload is exposed to the peer through a type 2
+    // memory window bound to the connection's queue pair, so other peers can't
+    // read it even if they guess the rkey, and the window is invalidated when
+    // the peer releases the payload
+    ibv_mr *pool_mr = NULL;
+    uint8_t *pool_buf = NULL;
+    uint64_t pool_size = 0;
+    // Offsets of free pool blocks by size class. Blocks of <pool_top_class> aren't merged
+    std::set<uint64_t> pool_free_blocks[MSGR_RDMA_POOL_CLASSES];
+    int pool_top_class = 0;
+
+    static msgr_rdma_context_t *create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu,
+        uint64_t pool_size, int log_level);
     ~msgr_rdma_context_t();
+    void pool_init(uint64_t size);
+    // Return NULL if the pool has no free block of the required size
+    void *pool_alloc(uint64_t size);
+    void pool_free(void *buf, uint64_t size);
+};
+
+// Rendezvous descriptor sent instead of a large payload. The receiver reads
+// the payload using RDMA READ directly into the operation buffer and then
+// releases it with a SECONDARY_OSD_RDV_FIN_MAGIC message
+struct __attribute__((__packed__)) msgr_rdma_rdv_t
+{
+    // 0 means that the sender couldn't expose the payload and it follows inline
+    uint64_t addr;
+    uint64_t cookie;
+    uint32_t rkey;
+    uint32_t len;
+};
+
+// Payload exposed to the peer through a memory window
+struct msgr_rdma_rdv_send_t
+{
+    void *buf;
+    uint64_t len;
+    ibv_mw *mw;
+};
+
+struct msgr_rdma_rdv_read_t
+{
+    osd_op_t *op;
+    bool is_reply;
+    bool posted;
+    // Payload is read or the operation has no rendezvous payload and just waits for the previous ones
+    bool ready;
+    msgr_rdma_rdv_t desc;
+    // Buffer used when reading directly into the operation buffer isn't possible.
+    // It's allocated from the pool or registered separately (bounce_mr) if the pool is full
+    void *bounce;
+    ibv_mr *bounce_mr;
+    std::vector<iovec> iov;
 };
 
 struct msgr_rdma_connection_t
@@ -52,7 +135,35 @@ struct msgr_rdma_connection_t
     int recv_pos = 0, recv_buf_pos = 0;
     std::vector<void*> recv_buffers;
 
+    // Without ODP: registered send and receive buffers of buf_size bytes each
+    ibv_mr *buf_mr = NULL;
+    uint8_t *bufs = NULL;
+    uint64_t buf_size = 0;
+    std::vector<void*> free_recv_buffers;
+
+    // Payloads of this size and larger are transferred using rendezvous, 0 = disabled
+    uint64_t rdv_threshold = 0;
+    // Rendezvous descriptor of the message being received
+    osd_op_t *rdv_op = NULL;
+    bool rdv_is_reply = false;
+    msgr_rdma_rdv_t rdv_desc;
+    std::vector<iovec> rdv_iov;
+    // Rendezvous reads in the order of submission
+    std::deque<msgr_rdma_rdv_read_t> rdv_reads;
+    int cur_read = 0;
+    // Descriptors in the current send batch
+    std::deque<msgr_rdma_rdv_t> rdv_send_descs;
+    // Pool buffers exposed to the peer, by cookie
+    std::map<uint64_t, msgr_rdma_rdv_send_t> rdv_sends;
+    uint64_t rdv_next_cookie = 0;
+    // Buffers released by the peer, waiting for the invalidation of their windows
+    std::deque<msgr_rdma_rdv_send_t> rdv_invalidating;
+    std::vector<ibv_mw*> free_mws;
+
     ~msgr_rdma_connection_t();
     static msgr_rdma_connection_t *create(msgr_rdma_context_t *ctx, uint32_t max_send, uint32_t max_recv, uint32_t max_sge, uint32_t max_msg);
     int connect(msgr_rdma_address_t *dest);
+    uint32_t lkey();
+    void *alloc_recv_buffer();
+    void free_recv_buffer(void *buf);
 };
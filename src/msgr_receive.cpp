@@ -13,8 +13,14 @@ void osd_messenger_t::read_requests()
         {
             continue;
         }
-        if (cl->read_remaining < receive_buffer_size)
+        if (!cl->in_buf)
         {
+            // Clients with multishot receive don't need the buffer
+            cl->in_buf = malloc_or_die(receive_buffer_size);
+        }
+        if (cl->shm_conn || cl->read_remaining < receive_buffer_size)
+        {
+            // Shared memory clients only receive doorbells over TCP
             cl->read_iov.iov_base = cl->in_buf;
             cl->read_iov.iov_len = receive_buffer_size;
             cl->read_msg.msg_iov = &cl->read_iov;
@@ -87,6 +93,12 @@ bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
     {
         read_ready_clients.push_back(cl->peer_fd);
     }
+    if (result > 0 && cl->shm_conn)
+    {
+        // Data is in shared memory, the socket only wakes us up
+        read_shm(cl);
+        goto fin;
+    }
     if (result > 0)
     {
         if (cl->read_iov.iov_base == cl->in_buf)
@@ -120,6 +132,98 @@ fin:
     return ret;
 }
 
+bool osd_messenger_t::arm_recv_multishot(osd_client_t *cl)
+{
+#ifdef IORING_RECV_MULTISHOT
+    // The request lives until the connection is closed, so it doesn't take an item from the ring_data pool
+    ring_data_t *data = new ring_data_t();
+    io_uring_sqe *sqe = ringloop->get_sqe(data);
+    if (!sqe)
+    {
+        delete data;
+        return false;
+    }
+    data->callback = [this, cl](ring_data_t *data) { handle_read_multishot(data, cl); };
+    my_uring_prep_recv_multishot(sqe, cl->peer_fd, MSGR_RECV_BUF_GROUP, 0);
+    cl->recv_data = data;
+    cl->refs++;
+    ringloop->wakeup();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void osd_messenger_t::handle_read_multishot(ring_data_t *data, osd_client_t *cl)
+{
+#ifdef IORING_RECV_MULTISHOT
+    int result = data->res;
+    if (data->flags & IORING_CQE_F_BUFFER)
+    {
+        int bid = data->flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t *buf = recv_buffers + (size_t)bid*receive_buffer_size;
+        if (result > 0 && cl->peer_state != PEER_STOPPED)
+        {
+            if (cl->shm_conn)
+                read_shm(cl);
+            else
+                handle_read_buffer(cl, buf, result);
+        }
+        // Return the buffer to the ring
+        io_uring_buf_ring_add(recv_buf_ring, buf, receive_buffer_size, bid, io_uring_buf_ring_mask(multishot_recv_buffers), 0);
+        io_uring_buf_ring_advance(recv_buf_ring, 1);
+    }
+    if (!(data->flags & IORING_CQE_F_MORE))
+    {
+        // Request is finished. ring_loop_t has already moved the callback out of it
+        delete cl->recv_data;
+        cl->recv_data = NULL;
+        cl->refs--;
+        if (cl->peer_state == PEER_STOPPED)
+        {
+            if (cl->refs <= 0)
+            {
+                delete cl;
+            }
+            return;
+        }
+        if (result == 0 || result < 0 && result != -ENOBUFS && result != -EINVAL)
+        {
+            if (result != 0)
+            {
+                fprintf(stderr, "Client %d socket read error: %d (%s). Disconnecting client\n", cl->peer_fd, -result, strerror(-result));
+            }
+            stop_client(cl->peer_fd);
+            return;
+        }
+        if (result == -EINVAL)
+        {
+            // Multishot recv is not supported by the kernel
+            if (log_level > 0)
+            {
+                fprintf(stderr, "[OSD %lu] Multishot recv is not supported, using regular recvmsg\n", osd_num);
+            }
+            use_multishot_recv = false;
+        }
+        // Multishot recv also stops when the buffer ring is empty, rearm it or fall back to recvmsg
+        if (!use_multishot_recv || !arm_recv_multishot(cl))
+        {
+            cl->read_ready++;
+            if (cl->read_ready == 1)
+            {
+                read_ready_clients.push_back(cl->peer_fd);
+            }
+            ringloop->wakeup();
+        }
+    }
+    for (auto cb: set_immediate)
+    {
+        cb();
+    }
+    set_immediate.clear();
+#endif
+}
+
 bool osd_messenger_t::handle_read_buffer(osd_client_t *cl, void *curbuf, int remain)
 {
     // Compose operation(s) from the buffer
@@ -175,6 +279,12 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
             return handle_reply_hdr(cl);
         else if (cl->read_op->req.hdr.magic == SECONDARY_OSD_OP_MAGIC)
             handle_op_hdr(cl);
+        else if (cl->read_op->req.hdr.magic == SECONDARY_OSD_BATCH_MAGIC)
+            return handle_batch_hdr(cl);
+#ifdef WITH_RDMA
+        else if (cl->read_op->req.hdr.magic == SECONDARY_OSD_RDV_FIN_MAGIC && cl->rdma_conn)
+            return handle_rdma_fin(cl);
+#endif
         else
         {
             fprintf(stderr, "Received garbage: magic=%lx id=%lu opcode=%lx from %d\n", cl->read_op->req.hdr.magic, cl->read_op->req.hdr.id, cl->read_op->req.hdr.opcode, cl->peer_fd);
@@ -182,21 +292,31 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
             return false;
         }
     }
+#ifdef WITH_RDMA
+    else if (cl->rdma_conn && cl->rdma_conn->rdv_op && cl->rdma_conn->rdv_op == cl->read_op)
+    {
+        // Rendezvous descriptor is received instead of the payload
+        return rdma_start_rdv(cl);
+    }
+#endif
     else if (cl->read_state == CL_READ_DATA)
     {
         // Operation is ready
-        cl->received_ops.push_back(cl->read_op);
-        set_immediate.push_back([this, op = cl->read_op]() { exec_op(op); });
+        handle_op_ready(cl, cl->read_op);
         cl->read_op = NULL;
         cl->read_state = 0;
     }
     else if (cl->read_state == CL_READ_REPLY_DATA)
     {
         // Reply is ready
-        handle_reply_ready(cl->read_op);
+        handle_reply_received(cl, cl->read_op);
         cl->read_op = NULL;
         cl->read_state = 0;
     }
+    else if (cl->read_state == CL_READ_BATCH)
+    {
+        return handle_batch(cl);
+    }
     else
     {
         assert(0);
@@ -224,7 +344,7 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         }
         if (cur_op->req.sec_rw.len > 0)
         {
-            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_rw.len);
+            cur_op->buf = op_buf_alloc(cur_op->req.sec_rw.len);
             cl->recv_list.push_back(cur_op->buf, cur_op->req.sec_rw.len);
         }
         cl->read_remaining = cur_op->req.sec_rw.len + cur_op->req.sec_rw.attr_len;
@@ -239,8 +359,10 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         }
         cl->read_remaining = cur_op->req.sec_stab.len;
     }
-    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ_BMP)
+    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ_BMP ||
+        cur_op->req.hdr.opcode == OSD_OP_SEC_READ_MULTI)
     {
+        // osd_op_sec_read_multi_t has the same layout
         if (cur_op->req.sec_read_bmp.len > 0)
         {
             cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_read_bmp.len);
@@ -256,7 +378,7 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
     {
         if (cur_op->req.rw.len > 0)
         {
-            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.rw.len);
+            cur_op->buf = op_buf_alloc(cur_op->req.rw.len);
             cl->recv_list.push_back(cur_op->buf, cur_op->req.rw.len);
         }
         cl->read_remaining = cur_op->req.rw.len;
@@ -271,6 +393,12 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         }
         cl->read_remaining = cur_op->req.show_conf.json_len;
     }
+#ifdef WITH_RDMA
+    if (cl->rdma_conn && (cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE))
+        rdma_expect_rdv(cl, cur_op, cur_op->req.sec_rw.len, false);
+    else if (cl->rdma_conn && cur_op->req.hdr.opcode == OSD_OP_WRITE)
+        rdma_expect_rdv(cl, cur_op, cur_op->req.rw.len, false);
+#endif
     if (cl->read_remaining > 0)
     {
         // Read data
@@ -279,8 +407,7 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
     else
     {
         // Operation is ready
-        cl->received_ops.push_back(cur_op);
-        set_immediate.push_back([this, cur_op]() { exec_op(cur_op); });
+        handle_op_ready(cl, cur_op);
         cl->read_op = NULL;
         cl->read_state = 0;
     }
@@ -331,6 +458,10 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         delete cl->read_op;
         cl->read_op = op;
         cl->read_state = CL_READ_REPLY_DATA;
+#ifdef WITH_RDMA
+        if (cl->rdma_conn && op->reply.hdr.retval > 0)
+            rdma_expect_rdv(cl, op, op->reply.hdr.retval, true);
+#endif
     }
     else if (op->reply.hdr.opcode == OSD_OP_SEC_LIST && op->reply.hdr.retval > 0)
     {
@@ -342,7 +473,8 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         op->buf = memalign_or_die(MEM_ALIGNMENT, cl->read_remaining);
         cl->recv_list.push_back(op->buf, cl->read_remaining);
     }
-    else if (op->reply.hdr.opcode == OSD_OP_SEC_READ_BMP && op->reply.hdr.retval > 0)
+    else if ((op->reply.hdr.opcode == OSD_OP_SEC_READ_BMP ||
+        op->reply.hdr.opcode == OSD_OP_SEC_READ_MULTI) && op->reply.hdr.retval > 0)
     {
         assert(!op->iov.count);
         delete cl->read_op;
@@ -367,7 +499,7 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
     {
 reuse:
         // It's fine to reuse cl->read_op for the next reply
-        handle_reply_ready(op);
+        handle_reply_received(cl, op);
         cl->recv_list.push_back(cl->read_op->req.buf, OSD_PACKET_SIZE);
         cl->read_remaining = OSD_PACKET_SIZE;
         cl->read_state = CL_READ_HDR;
@@ -375,6 +507,101 @@ reuse:
     return true;
 }
 
+bool osd_messenger_t::handle_batch_hdr(osd_client_t *cl)
+{
+    osd_op_t *batch_op = cl->read_op;
+    if (batch_op->req.batch.len > 1024*1024 || !batch_op->req.batch.len != !batch_op->req.batch.count)
+    {
+        fprintf(stderr, "Client %d sent a bad batch: %u entries, %u bytes\n",
+            cl->peer_fd, batch_op->req.batch.count, batch_op->req.batch.len);
+        stop_client(cl->peer_fd);
+        return false;
+    }
+    if (!batch_op->req.batch.len)
+    {
+        delete batch_op;
+        cl->read_op = NULL;
+        cl->read_state = 0;
+        return true;
+    }
+    batch_op->buf = malloc_or_die(batch_op->req.batch.len);
+    cl->recv_list.push_back(batch_op->buf, batch_op->req.batch.len);
+    cl->read_remaining = batch_op->req.batch.len;
+    cl->read_state = CL_READ_BATCH;
+    return true;
+}
+
+bool osd_messenger_t::handle_batch(osd_client_t *cl)
+{
+    osd_op_t *batch_op = cl->read_op;
+    uint8_t *pos = (uint8_t*)batch_op->buf, *end = pos + batch_op->req.batch.len;
+    uint32_t count = batch_op->req.batch.count;
+    cl->read_op = NULL;
+    cl->read_state = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        unsigned hdr_len = pos < end ? *pos : 0;
+        if (!hdr_len || hdr_len > OSD_PACKET_SIZE || pos+1+hdr_len > end)
+        {
+            fprintf(stderr, "Client %d sent a bad batch entry\n", cl->peer_fd);
+            delete batch_op;
+            stop_client(cl->peer_fd);
+            return false;
+        }
+        // Dispatch each entry as a separate message without data
+        cl->read_op = new osd_op_t;
+        cl->read_op->peer_fd = cl->peer_fd;
+        cl->read_op->op_type = OSD_OP_IN;
+        memcpy(cl->read_op->req.buf, pos+1, hdr_len);
+        memset(cl->read_op->req.buf+hdr_len, 0, OSD_PACKET_SIZE-hdr_len);
+        pos += 1+hdr_len;
+        cl->read_state = CL_READ_HDR;
+        if (!handle_finished_read(cl))
+        {
+            delete batch_op;
+            return false;
+        }
+        if (cl->read_state == CL_READ_HDR)
+        {
+            // Reply is handled and the header buffer is prepared for reuse, drop it
+            cl->recv_list.reset();
+            delete cl->read_op;
+            cl->read_op = NULL;
+            cl->read_state = 0;
+            cl->read_remaining = 0;
+        }
+        else if (cl->read_op)
+        {
+            // Batched messages can't have data
+            fprintf(stderr, "Client %d sent a batch entry with data\n", cl->peer_fd);
+            delete batch_op;
+            stop_client(cl->peer_fd);
+            return false;
+        }
+    }
+    delete batch_op;
+    return true;
+}
+
+void osd_messenger_t::handle_op_ready(osd_client_t *cl, osd_op_t *op)
+{
+#ifdef WITH_RDMA
+    if (rdma_hold_ready(cl, op, false))
+        return;
+#endif
+    cl->received_ops[op] = true;
+    set_immediate.push_back([this, op]() { exec_op(op); });
+}
+
+void osd_messenger_t::handle_reply_received(osd_client_t *cl, osd_op_t *op)
+{
+#ifdef WITH_RDMA
+    if (rdma_hold_ready(cl, op, true))
+        return;
+#endif
+    handle_reply_ready(op);
+}
+
 void osd_messenger_t::handle_reply_ready(osd_op_t *op)
 {
     // Measure subop latency
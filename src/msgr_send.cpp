@@ -18,24 +18,20 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
     {
         // Check that operation actually belongs to this client
         // FIXME: Review if this is still needed
-        bool found = false;
-        for (auto it = cl->received_ops.begin(); it != cl->received_ops.end(); it++)
-        {
-            if (*it == cur_op)
-            {
-                found = true;
-                cl->received_ops.erase(it, it+1);
-                break;
-            }
-        }
-        if (!found)
+        auto it = cl->received_ops.find(cur_op);
+        if (it == cl->received_ops.end())
         {
             delete cur_op;
             return;
         }
+        cl->received_ops.erase(it);
     }
-    auto & to_send_list = cl->write_msg.msg_iovlen ? cl->next_send_list : cl->send_list;
-    auto & to_outbox = cl->write_msg.msg_iovlen ? cl->next_outbox : cl->outbox;
+    // While switching to shared memory, only the configuration response goes over TCP,
+    // everything else waits for the switch in the next_* lists
+    bool shm_wait = cl->peer_state == PEER_SHM_CONNECTING && cur_op->req.hdr.opcode != OSD_OP_SHOW_CONFIG;
+    auto & to_send_list = cl->write_msg.msg_iovlen || shm_wait ? cl->next_send_list : cl->send_list;
+    auto & to_outbox = cl->write_msg.msg_iovlen || shm_wait ? cl->next_outbox : cl->outbox;
+    size_t first_pos = to_send_list.size();
     if (cur_op->op_type == OSD_OP_IN)
     {
         measure_exec(cur_op);
@@ -81,15 +77,25 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
         cur_op->req.hdr.opcode == OSD_OP_SEC_ROLLBACK ||
         cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG)) && cur_op->iov.count > 0)
     {
+        // Read and write payloads may be sent using RDMA rendezvous
+        int data_flags = (cur_op->op_type == OSD_OP_IN
+            ? (cur_op->req.hdr.opcode == OSD_OP_READ || cur_op->req.hdr.opcode == OSD_OP_SEC_READ)
+            : (cur_op->req.hdr.opcode == OSD_OP_WRITE || cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
+            cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE)) ? MSGR_SENDP_DATA : 0;
+        // Primary read replies start with the bitmap which the receiver reads separately,
+        // so it must not be included into the rendezvous payload
+        int data_start = (cur_op->op_type == OSD_OP_IN && cur_op->req.hdr.opcode == OSD_OP_READ) ? 1 : 0;
         for (int i = 0; i < cur_op->iov.count; i++)
         {
             assert(cur_op->iov.buf[i].iov_base);
             to_send_list.push_back(cur_op->iov.buf[i]);
-            to_outbox.push_back((msgr_sendp_t){ .op = cur_op, .flags = 0 });
+            to_outbox.push_back((msgr_sendp_t){ .op = cur_op, .flags = i >= data_start ? data_flags : 0 });
         }
     }
-    if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ_BMP)
+    if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ_BMP ||
+        cur_op->req.hdr.opcode == OSD_OP_SEC_READ_MULTI)
     {
+        // osd_op_sec_read_multi_t has the same layout
         if (cur_op->op_type == OSD_OP_IN && cur_op->reply.hdr.retval > 0)
             to_send_list.push_back((iovec){ .iov_base = cur_op->buf, .iov_len = (size_t)cur_op->reply.hdr.retval });
         else if (cur_op->op_type == OSD_OP_OUT && cur_op->req.sec_read_bmp.len > 0)
@@ -100,6 +106,20 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
     {
         to_outbox[to_outbox.size()-1].flags |= MSGR_SENDP_FREE;
     }
+    bool can_batch = cl->msg_batch && to_send_list.size() == first_pos+1;
+#ifdef WITH_RDMA
+    if (can_batch && cl->peer_state == PEER_RDMA &&
+        (cl->rdma_conn->send_pos >= first_pos || cl->rdma_conn->send_pos == first_pos-1 && cl->rdma_conn->send_buf_pos > 0))
+    {
+        // Previous message is already posted to the RDMA queue and can't be changed
+        can_batch = false;
+    }
+#endif
+    if (can_batch)
+    {
+        // Message without data, try to pack it into one frame with previous ones
+        batch_last_msg(to_send_list, to_outbox);
+    }
 #ifdef WITH_RDMA
     if (cl->peer_state == PEER_RDMA)
     {
@@ -107,6 +127,15 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
         return;
     }
 #endif
+    if (cl->peer_state == PEER_SHM)
+    {
+        try_send_shm(cl);
+        return;
+    }
+    if (shm_wait)
+    {
+        return;
+    }
     if (!ringloop)
     {
         // FIXME: It's worse because it doesn't allow batching
@@ -149,7 +178,9 @@ void osd_messenger_t::measure_exec(osd_op_t *cur_op)
         (cur_op->tv_end.tv_nsec - cur_op->tv_begin.tv_nsec)/1000
     );
     if (cur_op->req.hdr.opcode == OSD_OP_READ ||
-        cur_op->req.hdr.opcode == OSD_OP_WRITE)
+        cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+        cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES ||
+        cur_op->req.hdr.opcode == OSD_OP_DISCARD)
     {
         stats.op_stat_bytes[cur_op->req.hdr.opcode] += cur_op->req.rw.len;
     }
@@ -161,6 +192,71 @@ void osd_messenger_t::measure_exec(osd_op_t *cur_op)
     }
 }
 
+static bool batch_append(osd_op_t *batch_op, iovec & iov, msgr_sendp_t & sendp)
+{
+    osd_op_batch_t *batch = (osd_op_batch_t*)batch_op->buf;
+    uint8_t *hdr = (uint8_t*)iov.iov_base;
+    unsigned hdr_len = OSD_PACKET_SIZE;
+    while (hdr_len > 0 && !hdr[hdr_len-1])
+        hdr_len--;
+    if (OSD_PACKET_SIZE + batch->len + 1 + hdr_len > MSGR_BATCH_MAX)
+    {
+        return false;
+    }
+    uint8_t *pos = (uint8_t*)batch_op->buf + OSD_PACKET_SIZE + batch->len;
+    *pos = hdr_len;
+    memcpy(pos+1, hdr, hdr_len);
+    batch->len += 1 + hdr_len;
+    batch->count++;
+    // The header is copied, so the reply isn't needed anymore
+    if (sendp.flags & MSGR_SENDP_FREE)
+    {
+        delete sendp.op;
+    }
+    return true;
+}
+
+void osd_messenger_t::batch_last_msg(std::vector<iovec> & send_list, std::vector<msgr_sendp_t> & outbox)
+{
+    size_t n = send_list.size();
+    if (n < 2)
+    {
+        return;
+    }
+    // Only pack messages which aren't partially sent yet
+    iovec & prev_iov = send_list[n-2];
+    msgr_sendp_t & prev = outbox[n-2];
+    if (prev.op->req.hdr.magic == SECONDARY_OSD_BATCH_MAGIC)
+    {
+        osd_op_batch_t *batch = (osd_op_batch_t*)prev.op->buf;
+        if (prev_iov.iov_base == prev.op->buf && prev_iov.iov_len == OSD_PACKET_SIZE + batch->len &&
+            batch_append(prev.op, send_list[n-1], outbox[n-1]))
+        {
+            prev_iov.iov_len = OSD_PACKET_SIZE + batch->len;
+            send_list.pop_back();
+            outbox.pop_back();
+        }
+        return;
+    }
+    if (!(prev.flags & MSGR_SENDP_HDR) || prev_iov.iov_len != OSD_PACKET_SIZE ||
+        prev_iov.iov_base != (prev.op->op_type == OSD_OP_IN ? prev.op->reply.buf : prev.op->req.buf))
+    {
+        return;
+    }
+    // Previous message is also header-only (the next one is a different operation), start a new batch
+    osd_op_t *batch_op = new osd_op_t();
+    batch_op->req.hdr.magic = SECONDARY_OSD_BATCH_MAGIC;
+    batch_op->buf = malloc_or_die(MSGR_BATCH_MAX);
+    memset(batch_op->buf, 0, OSD_PACKET_SIZE);
+    ((osd_op_batch_t*)batch_op->buf)->header.magic = SECONDARY_OSD_BATCH_MAGIC;
+    batch_append(batch_op, prev_iov, prev);
+    batch_append(batch_op, send_list[n-1], outbox[n-1]);
+    send_list.pop_back();
+    outbox.pop_back();
+    send_list[n-2] = (iovec){ .iov_base = batch_op->buf, .iov_len = OSD_PACKET_SIZE + ((osd_op_batch_t*)batch_op->buf)->len };
+    outbox[n-2] = (msgr_sendp_t){ .op = batch_op, .flags = MSGR_SENDP_HDR | MSGR_SENDP_FREE };
+}
+
 bool osd_messenger_t::try_send(osd_client_t *cl)
 {
     int peer_fd = cl->peer_fd;
@@ -168,6 +264,10 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
     {
         return true;
     }
+    if (cl->peer_state == PEER_SHM)
+    {
+        return try_send_shm(cl);
+    }
     if (ringloop && !use_sync_send_recv)
     {
         io_uring_sqe* sqe = ringloop->get_sqe();
@@ -179,6 +279,33 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
         cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
         cl->refs++;
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
+#ifdef IORING_CQE_F_NOTIF
+        bool zerocopy = false;
+        if (use_zerocopy_send)
+        {
+            // Zero-copy only pays off for large buffers, small ones are cheaper to copy
+            for (int i = 0; i < cl->write_msg.msg_iovlen; i++)
+            {
+                if (cl->send_list[i].iov_len >= zerocopy_send_threshold)
+                {
+                    zerocopy = true;
+                    break;
+                }
+            }
+        }
+        if (zerocopy)
+        {
+            // Hold an additional reference until the notification
+            cl->refs++;
+            data->callback = [this, cl, defer_free = std::vector<osd_op_t*>(), sent = (uint64_t)0](ring_data_t *data) mutable
+            {
+                handle_send_zc(data, cl, defer_free, sent);
+            };
+            my_uring_prep_sendmsg_zc(sqe, peer_fd, &cl->write_msg, 0,
+                zerocopy_report_usage ? IORING_SEND_ZC_REPORT_USAGE : 0);
+            return true;
+        }
+#endif
         data->callback = [this, cl](ring_data_t *data) { handle_send(data->res, cl); };
         my_uring_prep_sendmsg(sqe, peer_fd, &cl->write_msg, 0);
     }
@@ -212,7 +339,53 @@ void osd_messenger_t::send_replies()
     write_ready_clients.clear();
 }
 
-void osd_messenger_t::handle_send(int result, osd_client_t *cl)
+void osd_messenger_t::handle_send_zc(ring_data_t *data, osd_client_t *cl, std::vector<osd_op_t*> & defer_free, uint64_t & sent)
+{
+#ifdef IORING_CQE_F_NOTIF
+    if (!(data->flags & IORING_CQE_F_NOTIF))
+    {
+        // Send result. Buffers may still be referenced by the kernel until the notification,
+        // so replies are freed only after it. Outgoing operations aren't deferred: they are
+        // only freed after receiving the reply which means that the peer already got the data
+        sent = data->res > 0 ? data->res : 0;
+        bool more = (data->flags & IORING_CQE_F_MORE);
+        if (data->res == -EINVAL && zerocopy_report_usage)
+        {
+            // Nothing is sent, retry without the flag. Copied bytes are then counted as zero-copy
+            if (log_level > 0)
+                fprintf(stderr, "[OSD %lu] Zero-copy usage reporting is not supported by the kernel, disabling it\n", osd_num);
+            zerocopy_report_usage = false;
+            handle_send(-EAGAIN, cl);
+        }
+        else
+            handle_send(data->res, cl, more ? &defer_free : NULL);
+        if (more)
+        {
+            return;
+        }
+    }
+    else if (data->res & IORING_NOTIF_USAGE_ZC_COPIED)
+    {
+        stats.zerocopy_copied_bytes += sent;
+    }
+    else
+    {
+        stats.zerocopy_bytes += sent;
+    }
+    for (osd_op_t *op: defer_free)
+    {
+        delete op;
+    }
+    defer_free.clear();
+    cl->refs--;
+    if (cl->peer_state == PEER_STOPPED && cl->refs <= 0)
+    {
+        delete cl;
+    }
+#endif
+}
+
+void osd_messenger_t::handle_send(int result, osd_client_t *cl, std::vector<osd_op_t*> *defer_free)
 {
     cl->write_msg.msg_iovlen = 0;
     cl->refs--;
@@ -242,7 +415,10 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
                 if (cl->outbox[done].flags & MSGR_SENDP_FREE)
                 {
                     // Reply fully sent
-                    delete cl->outbox[done].op;
+                    if (defer_free)
+                        defer_free->push_back(cl->outbox[done].op);
+                    else
+                        delete cl->outbox[done].op;
                 }
                 result -= iov.iov_len;
                 done++;
@@ -259,7 +435,12 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
             cl->send_list.erase(cl->send_list.begin(), cl->send_list.begin()+done);
             cl->outbox.erase(cl->outbox.begin(), cl->outbox.begin()+done);
         }
-        if (cl->next_send_list.size())
+        if (cl->shm_conn && !cl->outbox.size() && cl->peer_state == PEER_SHM_CONNECTING)
+        {
+            // Configuration response is sent, send everything else using shared memory
+            cl->peer_state = PEER_SHM;
+        }
+        if (cl->next_send_list.size() && cl->peer_state != PEER_SHM_CONNECTING)
         {
             cl->send_list.insert(cl->send_list.end(), cl->next_send_list.begin(), cl->next_send_list.end());
             cl->outbox.insert(cl->outbox.end(), cl->next_outbox.begin(), cl->next_outbox.end());
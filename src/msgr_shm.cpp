@@ -0,0 +1,508 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "msgr_shm.h"
+#include "messenger.h"
+
+static msgr_shm_connection_t *map_shm(int fd, uint64_t ring_size, bool creator)
+{
+    uint64_t total = 2*MSGR_SHM_HDR_SIZE + 2*ring_size;
+    void *mem = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map shared memory: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    auto conn = new msgr_shm_connection_t();
+    conn->mem = mem;
+    conn->ring_size = ring_size;
+    conn->creator = creator;
+    if (creator)
+        conn->fd = fd;
+    else
+        close(fd);
+    // The creator (client) sends using the first ring, the server sends using the second one
+    msgr_shm_ring_t *rings[2] = { (msgr_shm_ring_t*)mem, (msgr_shm_ring_t*)((uint8_t*)mem + MSGR_SHM_HDR_SIZE) };
+    uint8_t *data[2] = { (uint8_t*)mem + 2*MSGR_SHM_HDR_SIZE, (uint8_t*)mem + 2*MSGR_SHM_HDR_SIZE + ring_size };
+    conn->send_ring = rings[creator ? 0 : 1];
+    conn->send_data = data[creator ? 0 : 1];
+    conn->recv_ring = rings[creator ? 1 : 0];
+    conn->recv_data = data[creator ? 1 : 0];
+    if (creator)
+    {
+        // Both sides start sleeping, so the first message is always followed by a doorbell
+        rings[0]->data_waiting = 1;
+        rings[1]->data_waiting = 1;
+    }
+    return conn;
+}
+
+msgr_shm_connection_t *msgr_shm_connection_t::create(uint64_t ring_size)
+{
+    // memfd has no name, so only processes which receive the FD can map it
+    int fd = memfd_create("vitastor-shm", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create shared memory: %s\n", strerror(errno));
+        return NULL;
+    }
+    // Seal the size so the server can't get SIGBUS on access
+    if (ftruncate(fd, 2*MSGR_SHM_HDR_SIZE + 2*ring_size) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) < 0)
+    {
+        fprintf(stderr, "Failed to resize shared memory: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    return map_shm(fd, ring_size, true);
+}
+
+msgr_shm_connection_t *msgr_shm_connection_t::open(int fd, uint64_t ring_size)
+{
+    struct stat st;
+    if (!ring_size || (ring_size & (ring_size-1)) || ring_size > 1024*1024*1024 ||
+        fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != 2*MSGR_SHM_HDR_SIZE + 2*ring_size ||
+        !(fcntl(fd, F_GET_SEALS) & F_SEAL_SHRINK))
+    {
+        // Unsealed memory could be shrunk by the peer under our feet
+        fprintf(stderr, "Received shared memory has unexpected size or isn't sealed\n");
+        close(fd);
+        return NULL;
+    }
+    return map_shm(fd, ring_size, false);
+}
+
+msgr_shm_connection_t::~msgr_shm_connection_t()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (mem)
+    {
+        munmap(mem, 2*MSGR_SHM_HDR_SIZE + 2*ring_size);
+        mem = NULL;
+    }
+}
+
+uint64_t msgr_shm_connection_t::send_used()
+{
+    // The tail is written by the peer, so it's loaded once and checked before use.
+    // Acquire pairs with the consumer's release of the tail: freed space is not read anymore
+    uint64_t used = send_head - send_ring->tail.load(std::memory_order_acquire);
+    if (used > ring_size)
+    {
+        broken = true;
+        return ring_size;
+    }
+    return used;
+}
+
+uint64_t msgr_shm_connection_t::write(const void *buf, uint64_t len)
+{
+    uint64_t free_space = ring_size - send_used();
+    if (len > free_space)
+        len = free_space;
+    uint64_t pos = send_head & (ring_size-1);
+    uint64_t first = ring_size-pos < len ? ring_size-pos : len;
+    memcpy(send_data + pos, buf, first);
+    if (first < len)
+        memcpy(send_data, (const uint8_t*)buf + first, len-first);
+    send_head += len;
+    return len;
+}
+
+bool msgr_shm_connection_t::commit_send()
+{
+    // Sequentially consistent store + exchange pair with sleep_recv(): either the consumer
+    // sees the new head, or we see its data_waiting flag and ring the doorbell
+    send_ring->head.store(send_head);
+    return send_ring->data_waiting.exchange(0) != 0;
+}
+
+bool msgr_shm_connection_t::sleep_send()
+{
+    send_ring->space_waiting.store(1);
+    if (send_used() < ring_size)
+    {
+        send_ring->space_waiting.store(0);
+        return false;
+    }
+    return true;
+}
+
+uint64_t msgr_shm_connection_t::peek_recv(void **buf)
+{
+    // The head is written by the peer, data past the ring must never be handed out
+    uint64_t avail = recv_ring->head.load(std::memory_order_acquire) - recv_tail;
+    if (avail > ring_size)
+    {
+        broken = true;
+        avail = 0;
+    }
+    uint64_t pos = recv_tail & (ring_size-1);
+    *buf = recv_data + pos;
+    return ring_size-pos < avail ? ring_size-pos : avail;
+}
+
+bool msgr_shm_connection_t::consume_recv(uint64_t len)
+{
+    recv_tail += len;
+    recv_ring->tail.store(recv_tail);
+    return recv_ring->space_waiting.exchange(0) != 0;
+}
+
+bool msgr_shm_connection_t::sleep_recv()
+{
+    recv_ring->data_waiting.store(1);
+    if (!broken && recv_ring->head.load() != recv_tail)
+    {
+        recv_ring->data_waiting.store(0);
+        return false;
+    }
+    return true;
+}
+
+bool osd_messenger_t::is_local_peer(int peer_fd)
+{
+    sockaddr_storage self = { 0 }, peer = { 0 };
+    socklen_t self_len = sizeof(self), peer_len = sizeof(peer);
+    if (getsockname(peer_fd, (sockaddr*)&self, &self_len) < 0 ||
+        getpeername(peer_fd, (sockaddr*)&peer, &peer_len) < 0 ||
+        self.ss_family != peer.ss_family)
+    {
+        return false;
+    }
+    if (self.ss_family == AF_INET)
+    {
+        return ((sockaddr_in*)&self)->sin_addr.s_addr == ((sockaddr_in*)&peer)->sin_addr.s_addr;
+    }
+    if (self.ss_family == AF_INET6)
+    {
+        return !memcmp(&((sockaddr_in6*)&self)->sin6_addr, &((sockaddr_in6*)&peer)->sin6_addr, sizeof(in6_addr));
+    }
+    return false;
+}
+
+static void shm_socket_addr(const std::string & name, sockaddr_un *addr, socklen_t *addr_len)
+{
+    // Abstract socket: no file to clean up, the name starts with a zero byte
+    *addr = { .sun_family = AF_UNIX };
+    int len = name.size() < sizeof(addr->sun_path)-1 ? name.size() : sizeof(addr->sun_path)-1;
+    memcpy(addr->sun_path+1, name.data(), len);
+    *addr_len = offsetof(sockaddr_un, sun_path) + 1 + len;
+}
+
+static std::string hex_token(const uint8_t *token)
+{
+    char buf[2*MSGR_SHM_TOKEN_SIZE+1];
+    for (int i = 0; i < MSGR_SHM_TOKEN_SIZE; i++)
+        snprintf(buf+2*i, 3, "%02x", token[i]);
+    return std::string(buf, 2*MSGR_SHM_TOKEN_SIZE);
+}
+
+void osd_messenger_t::listen_shm()
+{
+    if (!use_shm || shm_listen_fd >= 0)
+    {
+        return;
+    }
+    // The name is random, so it can't be occupied in advance by another local user
+    uint8_t rnd[8];
+    if (getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd))
+    {
+        fprintf(stderr, "Failed to get random bytes: %s, shared memory is disabled\n", strerror(errno));
+        return;
+    }
+    std::string name = "vitastor-osd"+std::to_string(osd_num)+"-"+hex_token(rnd).substr(0, 2*sizeof(rnd));
+    sockaddr_un addr;
+    socklen_t addr_len;
+    shm_socket_addr(name, &addr, &addr_len);
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (sockaddr*)&addr, addr_len) < 0 || listen(fd, 128) < 0)
+    {
+        fprintf(stderr, "Failed to listen on shared memory socket: %s, shared memory is disabled\n", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    shm_listen_fd = fd;
+    shm_socket_name = name;
+}
+
+void osd_messenger_t::accept_shm()
+{
+    time_t now = time(NULL);
+    for (auto it = shm_pending.begin(); it != shm_pending.end(); )
+    {
+        if (it->second.received < now-MSGR_SHM_PENDING_TIMEOUT)
+        {
+            close(it->second.fd);
+            shm_pending.erase(it++);
+        }
+        else
+            it++;
+    }
+    while (true)
+    {
+        int conn_fd = accept4(shm_listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (conn_fd < 0)
+        {
+            break;
+        }
+        // The client sends the token and the FD right after connecting
+        uint8_t token[MSGR_SHM_TOKEN_SIZE];
+        char control[CMSG_SPACE(sizeof(int))] = { 0 };
+        iovec iov = { .iov_base = token, .iov_len = sizeof(token) };
+        msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r = recvmsg(conn_fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+        close(conn_fd);
+        cmsghdr *cmsg = r > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        {
+            continue;
+        }
+        int shm_fd;
+        memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+        if (r != sizeof(token) || (msg.msg_flags & MSG_CTRUNC) || shm_pending.size() >= MSGR_SHM_MAX_PENDING)
+        {
+            close(shm_fd);
+            continue;
+        }
+        auto & pending = shm_pending[hex_token(token)];
+        if (pending.fd >= 0)
+        {
+            close(pending.fd);
+        }
+        pending = { .fd = shm_fd, .received = now };
+    }
+}
+
+bool osd_messenger_t::connect_shm(int peer_fd, const std::string & token, uint64_t ring_size)
+{
+    if (shm_listen_fd < 0)
+    {
+        return false;
+    }
+    // The client has already passed the FD when it sends SHOW_CONFIG, so it's queued in the socket
+    accept_shm();
+    auto it = shm_pending.find(token);
+    if (it == shm_pending.end())
+    {
+        return false;
+    }
+    int fd = it->second.fd;
+    shm_pending.erase(it);
+    auto shm_conn = msgr_shm_connection_t::open(fd, ring_size);
+    if (!shm_conn)
+    {
+        return false;
+    }
+    // Receive from shared memory immediately, but switch sending to it
+    // only after sending the configuration response over TCP
+    auto cl = clients.at(peer_fd);
+    cl->shm_conn = shm_conn;
+    cl->peer_state = PEER_SHM_CONNECTING;
+    if (log_level > 0)
+    {
+        fprintf(stderr, "Connected with client %d using shared memory\n", peer_fd);
+    }
+    return true;
+}
+
+// Client side: create shared memory and pass it to the peer OSD, return NULL if it's impossible
+msgr_shm_connection_t *osd_messenger_t::create_shm(osd_client_t *cl, std::string & token)
+{
+    auto wp_it = wanted_peers.find(cl->osd_num);
+    if (!use_shm || wp_it == wanted_peers.end() || wp_it->second.shm_socket == "" ||
+        !wp_it->second.shm_pid || !is_local_peer(cl->peer_fd))
+    {
+        return NULL;
+    }
+    uint8_t token_buf[MSGR_SHM_TOKEN_SIZE];
+    if (getrandom(token_buf, sizeof(token_buf), 0) != sizeof(token_buf))
+    {
+        return NULL;
+    }
+    sockaddr_un addr;
+    socklen_t addr_len;
+    shm_socket_addr(wp_it->second.shm_socket, &addr, &addr_len);
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    // Connecting to a local listening socket doesn't block, EAGAIN means that its backlog is full
+    ucred cred = { 0 };
+    socklen_t cred_len = sizeof(cred);
+    if (connect(fd, (sockaddr*)&addr, addr_len) < 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (cred.pid != wp_it->second.shm_pid)
+    {
+        // Don't give our memory to anyone except the OSD process itself.
+        // PIDs also differ if the OSD runs in another PID namespace, shared memory isn't used then
+        if (log_level > 0)
+        {
+            fprintf(stderr, "Shared memory socket of OSD %lu belongs to PID %d instead of %lu, not using shared memory\n",
+                cl->osd_num, cred.pid, wp_it->second.shm_pid);
+        }
+        close(fd);
+        return NULL;
+    }
+    auto shm_conn = msgr_shm_connection_t::create(shm_ring_size);
+    if (!shm_conn)
+    {
+        close(fd);
+        return NULL;
+    }
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    iovec iov = { .iov_base = token_buf, .iov_len = sizeof(token_buf) };
+    msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &shm_conn->fd, sizeof(int));
+    ssize_t r = sendmsg(fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+    close(fd);
+    // Our copy of the FD isn't needed anymore, the memory stays mapped
+    close(shm_conn->fd);
+    shm_conn->fd = -1;
+    if (r != sizeof(token_buf))
+    {
+        delete shm_conn;
+        return NULL;
+    }
+    token = hex_token(token_buf);
+    return shm_conn;
+}
+
+// The peer has corrupted the ring state. Shut the socket down so that the regular
+// socket read fails and the client is stopped in the usual way
+void osd_messenger_t::break_shm(osd_client_t *cl)
+{
+    fprintf(stderr, "Client %d broke the shared memory ring protocol, dropping connection\n", cl->peer_fd);
+    shutdown(cl->peer_fd, SHUT_RDWR);
+}
+
+void osd_messenger_t::ring_shm_doorbell(osd_client_t *cl)
+{
+    // Any byte wakes up the peer. Failures are detected by the regular socket read
+    char c = 0;
+    send(cl->peer_fd, &c, 1, MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+bool osd_messenger_t::try_send_shm(osd_client_t *cl)
+{
+    auto shm_conn = cl->shm_conn;
+    for (int attempt = 0; attempt < 2 && cl->send_list.size(); attempt++)
+    {
+        uint64_t written = 0;
+        for (int i = 0; i < cl->send_list.size(); i++)
+        {
+            uint64_t len = shm_conn->write(cl->send_list[i].iov_base, cl->send_list[i].iov_len);
+            written += len;
+            if (len < cl->send_list[i].iov_len)
+            {
+                break;
+            }
+        }
+        if (shm_conn->broken)
+        {
+            break_shm(cl);
+            return true;
+        }
+        if (written > 0)
+        {
+            if (shm_conn->commit_send())
+            {
+                ring_shm_doorbell(cl);
+            }
+            // Reuse the socket completion handler to free sent replies
+            cl->refs++;
+            handle_send(written, cl);
+            return true;
+        }
+        if (shm_conn->sleep_send())
+        {
+            // The ring is full, the peer will ring the doorbell after freeing some space
+            break;
+        }
+    }
+    return true;
+}
+
+void osd_messenger_t::read_shm(osd_client_t *cl)
+{
+    auto shm_conn = cl->shm_conn;
+    cl->refs++;
+    while (true)
+    {
+        void *buf = NULL;
+        uint64_t len = shm_conn->peek_recv(&buf);
+        if (!len)
+        {
+            if (shm_conn->broken)
+            {
+                break_shm(cl);
+                break;
+            }
+            if (shm_conn->sleep_recv())
+            {
+                break;
+            }
+            continue;
+        }
+        if (len > receive_buffer_size)
+        {
+            // Process data in portions to free ring space for the peer earlier
+            len = receive_buffer_size;
+        }
+        handle_read_buffer(cl, buf, len);
+        if (cl->peer_state == PEER_STOPPED)
+        {
+            break;
+        }
+        // Data is already copied into operation buffers
+        if (shm_conn->consume_recv(len))
+        {
+            ring_shm_doorbell(cl);
+        }
+    }
+    // The doorbell may also mean that the peer freed some space in our send ring
+    if (cl->peer_state == PEER_SHM && cl->send_list.size())
+    {
+        try_send_shm(cl);
+    }
+    cl->refs--;
+    if (cl->peer_state == PEER_STOPPED && cl->refs <= 0)
+    {
+        delete cl;
+    }
+}
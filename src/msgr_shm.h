@@ -0,0 +1,82 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <time.h>
+
+// Shared memory transport for peers running on the same host.
+// The connection is still set up over TCP. The client creates a sealed memfd with two
+// byte rings (one per direction) and passes it to the OSD over the abstract Unix socket
+// published in the OSD state, using SCM_RIGHTS, together with a random token. Then it
+// sends the token in the SHOW_CONFIG request over TCP, so the OSD can find the memory.
+// After that, the TCP socket is only used as a "doorbell" to wake up the other side
+// when it sleeps waiting for data or free ring space.
+
+#define MSGR_SHM_HDR_SIZE 4096
+#define MSGR_SHM_TOKEN_SIZE 16
+// Received FDs not claimed by a SHOW_CONFIG request are closed after this time or
+// when there are too many of them
+#define MSGR_SHM_PENDING_TIMEOUT 60
+#define MSGR_SHM_MAX_PENDING 256
+
+struct msgr_shm_ring_t
+{
+    // Bytes written by the producer
+    std::atomic<uint64_t> head;
+    uint8_t pad1[64-sizeof(std::atomic<uint64_t>)];
+    // Bytes read by the consumer
+    std::atomic<uint64_t> tail;
+    uint8_t pad2[64-sizeof(std::atomic<uint64_t>)];
+    // Consumer waits for data and wants a doorbell
+    std::atomic<uint32_t> data_waiting;
+    // Producer waits for free space and wants a doorbell
+    std::atomic<uint32_t> space_waiting;
+};
+
+struct msgr_shm_connection_t
+{
+    // memfd, only kept by the client until it's passed to the server
+    int fd = -1;
+    void *mem = NULL;
+    uint64_t ring_size = 0;
+    msgr_shm_ring_t *send_ring = NULL, *recv_ring = NULL;
+    uint8_t *send_data = NULL, *recv_data = NULL;
+    uint64_t send_head = 0, recv_tail = 0;
+    bool creator = false;
+    // Set when the peer writes an impossible head or tail into the shared memory.
+    // The connection then stops transferring data and has to be closed
+    bool broken = false;
+
+    ~msgr_shm_connection_t();
+    // Client side: create a new sealed memfd
+    static msgr_shm_connection_t *create(uint64_t ring_size);
+    // Server side: check and map the memfd received from the client, <fd> is always closed
+    static msgr_shm_connection_t *open(int fd, uint64_t ring_size);
+
+    // Copy up to <len> bytes into the send ring, return the number of bytes copied
+    uint64_t write(const void *buf, uint64_t len);
+    // Get the number of bytes in the send ring not yet consumed by the peer
+    uint64_t send_used();
+    // Publish written bytes, return true if the peer should be woken up
+    bool commit_send();
+    // Called when the send ring is full. Return true if the producer should sleep
+    // until the doorbell, false if some space became free meanwhile
+    bool sleep_send();
+    // Get the next contiguous chunk of received data
+    uint64_t peek_recv(void **buf);
+    // Free <len> bytes of received data, return true if the peer should be woken up
+    bool consume_recv(uint64_t len);
+    // Called when there's no data to read. Return true if the consumer should sleep
+    // until the doorbell, false if some data arrived meanwhile
+    bool sleep_recv();
+};
+
+// Memory received by the server, waiting for the SHOW_CONFIG request with the same token
+struct msgr_shm_pending_t
+{
+    int fd = -1;
+    time_t received = 0;
+};
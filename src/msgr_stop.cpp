@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include <algorithm>
+
 #include "messenger.h"
 
 void osd_messenger_t::cancel_osd_ops(osd_client_t *cl)
@@ -68,10 +70,25 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
     // First set state to STOPPED so another stop_client() call doesn't try to free it again
     cl->refs++;
     cl->peer_state = PEER_STOPPED;
+    std::vector<int> group_fds;
     if (cl->osd_num)
     {
         // ...and forget OSD peer
         osd_peer_fds.erase(cl->osd_num);
+        // Parallel connections to the same OSD are stopped together
+        auto group_it = osd_peer_stripes.find(cl->osd_num);
+        if (group_it != osd_peer_stripes.end() &&
+            std::find(group_it->second.begin(), group_it->second.end(), peer_fd) != group_it->second.end())
+        {
+            group_fds.swap(group_it->second);
+            osd_peer_stripes.erase(group_it);
+        }
+        auto wp_it = wanted_peers.find(cl->osd_num);
+        if (wp_it != wanted_peers.end())
+        {
+            auto & wp_fds = wp_it->second.group_fds;
+            wp_fds.erase(std::remove(wp_fds.begin(), wp_fds.end(), peer_fd), wp_fds.end());
+        }
     }
 #ifndef __MOCK__
     // Then remove FD from the eventloop so we don't accidentally read something
@@ -123,13 +140,36 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
         cancel_osd_ops(cl);
     }
 #ifndef __MOCK__
+    if (cl->recv_data)
+    {
+        // Closing the FD doesn't finish the multishot receive, shutting the socket down does
+        shutdown(peer_fd, SHUT_RDWR);
+    }
     // And close the FD only when everything is done
     // ...because peer_fd number can get reused after close()
     close(peer_fd);
+    if (cl->shm_conn)
+    {
+        delete cl->shm_conn;
+        cl->shm_conn = NULL;
+    }
 #ifdef WITH_RDMA
     if (cl->rdma_conn)
     {
+        std::vector<osd_op_t*> rdv_ops;
+        for (auto & rd: cl->rdma_conn->rdv_reads)
+        {
+            rdv_ops.push_back(rd.op);
+        }
+        // Destroying the queue pair also stops rendezvous reads into operation buffers
         delete cl->rdma_conn;
+        for (auto op: rdv_ops)
+        {
+            if (!op->callback)
+                delete op;
+            else
+                cancel_op(op);
+        }
     }
 #endif
 #endif
@@ -144,4 +184,11 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
     {
         delete cl;
     }
+    for (int group_fd: group_fds)
+    {
+        if (group_fd != peer_fd)
+        {
+            stop_client(group_fd, true, force_delete);
+        }
+    }
 }
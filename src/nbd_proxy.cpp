@@ -11,42 +11,72 @@
 #include <arpa/inet.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 
+#include <array>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "epoll_manager.h"
 #include "cluster_client.h"
+#include "cluster_client_mt.h"
 
 #ifndef MSG_ZEROCOPY
 #define MSG_ZEROCOPY 0
 #endif
 
+#ifndef NBD_FLAG_CAN_MULTI_CONN
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+#endif
+
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+// Missing in old kernel headers
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_CMD_WRITE_ZEROES 6
+#endif
+
+// Request type also contains command flags in upper bits
+#define NBD_CMD_MASK 0xffff
+
+#define NBD_PROXY_FLAGS (NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES)
+
 const char *exe_name = NULL;
 
-class nbd_proxy
+// One socket of the NBD device.
+// A single connection is handled in the main thread by a single-threaded client.
+// With several connections, every connection is handled by its own thread and they share
+// a multi-threaded client. MULTI_CONN requires a flush on any connection to also flush
+// writes completed on other connections, and SYNC of the multi-threaded client does that
+class nbd_conn_t
 {
-protected:
-    std::string image_name;
+public:
     uint64_t inode = 0;
-    uint64_t device_size = 0;
-    int nbd_timeout = 30;
-    int nbd_max_devices = 64;
-    int nbd_max_part = 3;
     inode_watch_t *watch = NULL;
-
+    cluster_client_t *cli = NULL;
+    cluster_client_mt_t *mt_cli = NULL;
     ring_loop_t *ringloop = NULL;
     epoll_manager_t *epmgr = NULL;
-    cluster_client_t *cli = NULL;
+    int nbd_fd = -1;
+    bool stopped = false;
+    // Operations submitted to the client and not completed yet, the connection
+    // can only be destroyed after all of them complete
+    int inflight = 0;
+    std::thread thread;
+
+protected:
     ring_consumer_t consumer;
 
     std::vector<iovec> send_list, next_send_list;
     std::vector<void*> to_free;
-    int nbd_fd = -1;
     void *recv_buf = NULL;
     int receive_buffer_size = 9000;
     nbd_request cur_req;
     cluster_op_t *cur_op = NULL;
+    bool cur_readonly = false;
     void *cur_buf = NULL;
     int cur_left = 0;
     int read_state = 0;
@@ -54,11 +84,30 @@ protected:
     msghdr read_msg = { 0 }, send_msg = { 0 };
     iovec read_iov = { 0 };
 
-    std::string logfile = "/dev/null";
+    // Replies of operations completed by I/O threads of the multi-threaded client
+    std::mutex reply_mutex;
+    std::vector<iovec> replies;
+    int notify_fd = -1;
+    bool own_loop = false;
 
 public:
-    ~nbd_proxy()
+    ~nbd_conn_t()
     {
+        if (ringloop)
+        {
+            ringloop->unregister_consumer(&consumer);
+        }
+        if (notify_fd >= 0)
+        {
+            epmgr->tfd->set_fd_handler(notify_fd, false, NULL);
+            close(notify_fd);
+            notify_fd = -1;
+        }
+        if (own_loop)
+        {
+            delete epmgr;
+            delete ringloop;
+        }
         if (recv_buf)
         {
             free(recv_buf);
@@ -66,6 +115,412 @@ public:
         }
     }
 
+    // Start handling the socket in the current ring loop
+    void start()
+    {
+        read_state = CL_READ_HDR;
+        recv_buf = malloc_or_die(receive_buffer_size);
+        cur_buf = &cur_req;
+        cur_left = sizeof(nbd_request);
+        consumer.loop = [this]()
+        {
+            submit_read();
+            submit_send();
+            ringloop->submit();
+        };
+        ringloop->register_consumer(&consumer);
+        // Add FD to epoll
+        epmgr->tfd->set_fd_handler(nbd_fd, false, [this](int peer_fd, int epoll_events)
+        {
+            if (stopped)
+            {
+                return;
+            }
+            if (epoll_events & EPOLLRDHUP)
+            {
+                stop();
+            }
+            else
+            {
+                read_ready++;
+                submit_read();
+            }
+        });
+        if (mt_cli)
+        {
+            notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+            if (notify_fd < 0)
+            {
+                perror("eventfd");
+                exit(1);
+            }
+            epmgr->tfd->set_fd_handler(notify_fd, false, [this](int fd, int epoll_events)
+            {
+                handle_replies();
+            });
+        }
+    }
+
+    // Thread of a connection sharing the multi-threaded client
+    void run()
+    {
+        own_loop = true;
+        ringloop = new ring_loop_t(512);
+        epmgr = new epoll_manager_t(ringloop);
+        start();
+        while (!is_finished())
+        {
+            ringloop->loop();
+            ringloop->wait();
+        }
+    }
+
+    bool is_finished()
+    {
+        if (!stopped)
+        {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock;
+        if (mt_cli)
+            lock = std::unique_lock<std::mutex>(reply_mutex);
+        return !inflight;
+    }
+
+protected:
+    uint64_t get_inode(bool *readonly)
+    {
+        if (!watch)
+        {
+            return inode;
+        }
+        std::unique_lock<std::mutex> lock;
+        if (mt_cli)
+            lock = std::unique_lock<std::mutex>(mt_cli->state_mutex);
+        *readonly = watch->cfg.readonly;
+        return watch->cfg.num;
+    }
+
+    // Stops only this connection, the process exits after all connections stop
+    // and the image is synced in nbd_proxy::start()
+    void stop()
+    {
+        close(nbd_fd);
+        stopped = true;
+        ringloop->wakeup();
+    }
+
+    void execute(cluster_op_t *op, bool readonly)
+    {
+        {
+            std::unique_lock<std::mutex> lock;
+            if (mt_cli)
+                lock = std::unique_lock<std::mutex>(reply_mutex);
+            inflight++;
+        }
+        if (op->opcode != OSD_OP_READ && op->opcode != OSD_OP_SYNC && readonly)
+        {
+            op->retval = -EROFS;
+            std::function<void(cluster_op_t*)>(op->callback)(op);
+        }
+        else if (mt_cli)
+            mt_cli->execute(op);
+        else
+            cli->execute(op);
+    }
+
+    // May be called from I/O threads of the multi-threaded client
+    void queue_reply(void *buf, size_t len)
+    {
+        if (!mt_cli)
+        {
+            inflight--;
+            add_reply(buf, len);
+            ringloop->wakeup();
+            return;
+        }
+        // Notify under the lock so that the connection can't be destroyed in between
+        std::lock_guard<std::mutex> lock(reply_mutex);
+        inflight--;
+        replies.push_back({ .iov_base = buf, .iov_len = len });
+        eventfd_write(notify_fd, 1);
+    }
+
+    void handle_replies()
+    {
+        eventfd_t value;
+        eventfd_read(notify_fd, &value);
+        std::vector<iovec> done;
+        {
+            std::lock_guard<std::mutex> lock(reply_mutex);
+            done.swap(replies);
+        }
+        for (auto & iov: done)
+        {
+            add_reply(iov.iov_base, iov.iov_len);
+        }
+        ringloop->wakeup();
+    }
+
+    void add_reply(void *buf, size_t len)
+    {
+        if (stopped)
+        {
+            free(buf);
+            return;
+        }
+        auto & to_list = send_msg.msg_iovlen > 0 ? next_send_list : send_list;
+        to_list.push_back({ .iov_base = buf, .iov_len = len });
+        to_free.push_back(buf);
+    }
+
+    void submit_send()
+    {
+        if (stopped || !send_list.size() || send_msg.msg_iovlen > 0)
+        {
+            return;
+        }
+        io_uring_sqe* sqe = ringloop->get_sqe();
+        if (!sqe)
+        {
+            return;
+        }
+        ring_data_t* data = ((ring_data_t*)sqe->user_data);
+        data->callback = [this](ring_data_t *data) { handle_send(data->res); };
+        send_msg.msg_iov = send_list.data();
+        send_msg.msg_iovlen = send_list.size();
+        my_uring_prep_sendmsg(sqe, nbd_fd, &send_msg, MSG_ZEROCOPY);
+    }
+
+    void handle_send(int result)
+    {
+        send_msg.msg_iovlen = 0;
+        if (stopped)
+        {
+            return;
+        }
+        if (result < 0 && result != -EAGAIN)
+        {
+            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
+            exit(1);
+        }
+        int to_eat = 0;
+        while (result > 0 && to_eat < send_list.size())
+        {
+            if (result >= send_list[to_eat].iov_len)
+            {
+                free(to_free[to_eat]);
+                result -= send_list[to_eat].iov_len;
+                to_eat++;
+            }
+            else
+            {
+                send_list[to_eat].iov_base = (uint8_t*)send_list[to_eat].iov_base + result;
+                send_list[to_eat].iov_len -= result;
+                break;
+            }
+        }
+        if (to_eat > 0)
+        {
+            send_list.erase(send_list.begin(), send_list.begin() + to_eat);
+            to_free.erase(to_free.begin(), to_free.begin() + to_eat);
+        }
+        for (int i = 0; i < next_send_list.size(); i++)
+        {
+            send_list.push_back(next_send_list[i]);
+        }
+        next_send_list.clear();
+        if (send_list.size() > 0)
+        {
+            ringloop->wakeup();
+        }
+    }
+
+    void submit_read()
+    {
+        if (stopped || !read_ready || read_msg.msg_iovlen > 0)
+        {
+            return;
+        }
+        io_uring_sqe* sqe = ringloop->get_sqe();
+        if (!sqe)
+        {
+            return;
+        }
+        ring_data_t* data = ((ring_data_t*)sqe->user_data);
+        data->callback = [this](ring_data_t *data) { handle_read(data->res); };
+        if (cur_left < receive_buffer_size)
+        {
+            read_iov.iov_base = recv_buf;
+            read_iov.iov_len = receive_buffer_size;
+        }
+        else
+        {
+            read_iov.iov_base = cur_buf;
+            read_iov.iov_len = cur_left;
+        }
+        read_msg.msg_iov = &read_iov;
+        read_msg.msg_iovlen = 1;
+        my_uring_prep_recvmsg(sqe, nbd_fd, &read_msg, 0);
+    }
+
+    void handle_read(int result)
+    {
+        read_msg.msg_iovlen = 0;
+        if (stopped)
+        {
+            return;
+        }
+        if (result < 0 && result != -EAGAIN)
+        {
+            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
+            exit(1);
+        }
+        if (result == -EAGAIN || result < read_iov.iov_len)
+        {
+            read_ready--;
+        }
+        if (read_ready > 0)
+        {
+            ringloop->wakeup();
+        }
+        void *b = recv_buf;
+        while (result > 0 && !stopped)
+        {
+            if (read_iov.iov_base == recv_buf)
+            {
+                int inc = result >= cur_left ? cur_left : result;
+                memcpy(cur_buf, b, inc);
+                cur_left -= inc;
+                result -= inc;
+                cur_buf = (uint8_t*)cur_buf + inc;
+                b = (uint8_t*)b + inc;
+            }
+            else
+            {
+                assert(result <= cur_left);
+                cur_left -= result;
+                cur_buf = (uint8_t*)cur_buf + result;
+                result = 0;
+            }
+            if (cur_left <= 0)
+            {
+                handle_finished_read();
+            }
+        }
+    }
+
+    void handle_finished_read()
+    {
+        if (read_state == CL_READ_HDR)
+        {
+            int req_type = be32toh(cur_req.type) & NBD_CMD_MASK;
+            if (be32toh(cur_req.magic) == NBD_REQUEST_MAGIC && req_type == NBD_CMD_DISC)
+            {
+                // Disconnect only this connection
+                stop();
+                return;
+            }
+            if (be32toh(cur_req.magic) != NBD_REQUEST_MAGIC ||
+                req_type != NBD_CMD_READ && req_type != NBD_CMD_WRITE && req_type != NBD_CMD_FLUSH &&
+                req_type != NBD_CMD_TRIM && req_type != NBD_CMD_WRITE_ZEROES)
+            {
+                printf("Unexpected request: magic=%x type=%x, terminating\n", cur_req.magic, req_type);
+                exit(1);
+            }
+            uint64_t handle = *((uint64_t*)cur_req.handle);
+#ifdef DEBUG
+            printf("request %lx +%x %lx\n", be64toh(cur_req.from), be32toh(cur_req.len), handle);
+#endif
+            void *buf = NULL;
+            bool readonly = false;
+            cluster_op_t *op = new cluster_op_t;
+            if (req_type == NBD_CMD_READ || req_type == NBD_CMD_WRITE)
+            {
+                op->opcode = req_type == NBD_CMD_READ ? OSD_OP_READ : OSD_OP_WRITE;
+                op->inode = get_inode(&readonly);
+                op->offset = be64toh(cur_req.from);
+                op->len = be32toh(cur_req.len);
+                buf = malloc_or_die(sizeof(nbd_reply) + op->len);
+                op->iov.push_back((uint8_t*)buf + sizeof(nbd_reply), op->len);
+            }
+            else if (req_type == NBD_CMD_TRIM || req_type == NBD_CMD_WRITE_ZEROES)
+            {
+                // Executed by OSDs without sending any data
+                op->opcode = req_type == NBD_CMD_TRIM ? OSD_OP_DISCARD : OSD_OP_WRITE_ZEROES;
+                op->inode = get_inode(&readonly);
+                op->offset = be64toh(cur_req.from);
+                op->len = be32toh(cur_req.len);
+                buf = malloc_or_die(sizeof(nbd_reply));
+            }
+            else if (req_type == NBD_CMD_FLUSH)
+            {
+                op->opcode = OSD_OP_SYNC;
+                buf = malloc_or_die(sizeof(nbd_reply));
+            }
+            op->callback = [this, buf, handle](cluster_op_t *op)
+            {
+#ifdef DEBUG
+                printf("reply %lx e=%d\n", handle, op->retval);
+#endif
+                nbd_reply *reply = (nbd_reply*)buf;
+                reply->magic = htobe32(NBD_REPLY_MAGIC);
+                memcpy(reply->handle, &handle, 8);
+                reply->error = htobe32(op->retval < 0 ? -op->retval : 0);
+                size_t len = op->retval < 0 || op->opcode != OSD_OP_READ ? sizeof(nbd_reply) : sizeof(nbd_reply) + op->len;
+                delete op;
+                queue_reply(buf, len);
+            };
+            if (req_type == NBD_CMD_WRITE)
+            {
+                cur_op = op;
+                cur_readonly = readonly;
+                cur_buf = (uint8_t*)buf + sizeof(nbd_reply);
+                cur_left = op->len;
+                read_state = CL_READ_DATA;
+            }
+            else
+            {
+                cur_op = NULL;
+                cur_buf = &cur_req;
+                cur_left = sizeof(nbd_request);
+                read_state = CL_READ_HDR;
+                execute(op, readonly);
+            }
+        }
+        else
+        {
+            execute(cur_op, cur_readonly);
+            cur_op = NULL;
+            cur_buf = &cur_req;
+            cur_left = sizeof(nbd_request);
+            read_state = CL_READ_HDR;
+        }
+    }
+};
+
+class nbd_proxy
+{
+protected:
+    std::string image_name;
+    uint64_t inode = 0;
+    uint64_t device_size = 0;
+    int nbd_timeout = 30;
+    int nbd_max_devices = 64;
+    int nbd_max_part = 3;
+    int nbd_connections = 1;
+    inode_watch_t *watch = NULL;
+
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    cluster_client_t *cli = NULL;
+    cluster_client_mt_t *mt_cli = NULL;
+    std::vector<nbd_conn_t*> conns;
+
+    std::string logfile = "/dev/null";
+
+public:
+
     static json11::Json::object parse_args(int narg, const char *args[])
     {
         json11::Json::object cfg;
@@ -142,7 +597,10 @@ public:
             "    if vitastor-nbd process dies\n"
             "  --nbd_max_devices 64 --nbd_max_part 3\n"
             "    options for the \"nbd\" kernel module when modprobing it (nbds_max and max_part).\n"
-            "    note that maximum allowed (nbds_max)*(1+max_part) is 256.\n",
+            "    note that maximum allowed (nbds_max)*(1+max_part) is 256.\n"
+            "  --nbd_connections 1\n"
+            "    number of connections (sockets) of the NBD device. every connection is handled\n"
+            "    by its own thread and has its own thread in the multi-threaded cluster client.\n",
             exe_name, exe_name, exe_name
         );
         exit(0);
@@ -209,6 +667,12 @@ public:
         {
             nbd_timeout = cfg["nbd_timeout"].uint64_value();
         }
+        if (cfg["nbd_connections"].is_number() || cfg["nbd_connections"].is_string())
+        {
+            nbd_connections = cfg["nbd_connections"].uint64_value();
+            if (nbd_connections < 1)
+                nbd_connections = 1;
+        }
         // Create client
         ringloop = new ring_loop_t(512);
         epmgr = new epoll_manager_t(ringloop);
@@ -233,19 +697,22 @@ public:
             }
         }
         // Initialize NBD
-        int sockfd[2];
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd) < 0)
+        std::vector<std::array<int, 2>> sockfd(nbd_connections);
+        for (auto & pair: sockfd)
         {
-            perror("socketpair");
-            exit(1);
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair.data()) < 0)
+            {
+                perror("socketpair");
+                exit(1);
+            }
+            fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
         }
-        fcntl(sockfd[0], F_SETFL, fcntl(sockfd[0], F_GETFL, 0) | O_NONBLOCK);
-        nbd_fd = sockfd[0];
+        uint64_t nbd_flags = NBD_PROXY_FLAGS | (nbd_connections > 1 ? NBD_FLAG_CAN_MULTI_CONN : 0);
         load_module();
         bool bg = cfg["foreground"].is_null();
         if (!cfg["dev_num"].is_null())
         {
-            if (run_nbd(sockfd, cfg["dev_num"].int64_value(), device_size, NBD_FLAG_SEND_FLUSH, nbd_timeout, bg) < 0)
+            if (run_nbd(sockfd, cfg["dev_num"].int64_value(), device_size, nbd_flags, nbd_timeout, bg) < 0)
             {
                 perror("run_nbd");
                 exit(1);
@@ -257,7 +724,7 @@ public:
             int i = 0;
             while (true)
             {
-                int r = run_nbd(sockfd, i, device_size, NBD_FLAG_SEND_FLUSH, 30, bg);
+                int r = run_nbd(sockfd, i, device_size, nbd_flags, 30, bg);
                 if (r == 0)
                 {
                     printf("/dev/nbd%d\n", i);
@@ -284,56 +751,102 @@ public:
         {
             logfile = cfg["logfile"].string_value();
         }
+        if (nbd_connections > 1)
+        {
+            // Threads don't survive daemonize(), so the multi-threaded client is created after it
+            delete cli;
+            delete epmgr;
+            delete ringloop;
+            cli = NULL;
+            epmgr = NULL;
+            ringloop = NULL;
+            watch = NULL;
+        }
         if (bg)
         {
             daemonize();
         }
-        // Initialize read state
-        read_state = CL_READ_HDR;
-        recv_buf = malloc_or_die(receive_buffer_size);
-        cur_buf = &cur_req;
-        cur_left = sizeof(nbd_request);
-        consumer.loop = [this]()
+        if (nbd_connections > 1)
         {
-            submit_read();
-            submit_send();
-            ringloop->submit();
-        };
-        ringloop->register_consumer(&consumer);
-        // Add FD to epoll
-        bool stop = false;
-        epmgr->tfd->set_fd_handler(sockfd[0], false, [this, &stop](int peer_fd, int epoll_events)
+            mt_cli = new cluster_client_mt_t(cfg, nbd_connections);
+            mt_cli->wait_ready();
+            if (!inode)
+            {
+                std::lock_guard<std::mutex> lock(mt_cli->state_mutex);
+                watch = mt_cli->st_cli->watch_inode(image_name);
+            }
+        }
+        for (auto & pair: sockfd)
         {
-            if (epoll_events & EPOLLRDHUP)
+            auto conn = new nbd_conn_t;
+            conn->inode = inode;
+            conn->watch = watch;
+            conn->cli = cli;
+            conn->mt_cli = mt_cli;
+            conn->nbd_fd = pair[0];
+            conns.push_back(conn);
+        }
+        if (mt_cli)
+        {
+            for (auto conn: conns)
             {
-                close(peer_fd);
-                stop = true;
+                conn->thread = std::thread(&nbd_conn_t::run, conn);
             }
-            else
+            for (auto conn: conns)
             {
-                read_ready++;
-                submit_read();
+                conn->thread.join();
             }
-        });
-        while (!stop)
-        {
-            ringloop->loop();
-            ringloop->wait();
+            std::mutex sync_mutex;
+            std::condition_variable sync_cv;
+            bool synced = false;
+            cluster_op_t *close_sync = new cluster_op_t;
+            close_sync->opcode = OSD_OP_SYNC;
+            close_sync->callback = [&](cluster_op_t *op)
+            {
+                delete op;
+                std::lock_guard<std::mutex> lock(sync_mutex);
+                synced = true;
+                sync_cv.notify_all();
+            };
+            mt_cli->execute(close_sync);
+            {
+                std::unique_lock<std::mutex> lock(sync_mutex);
+                sync_cv.wait(lock, [&]() { return synced; });
+            }
+            delete mt_cli;
+            mt_cli = NULL;
         }
-        stop = false;
-        cluster_op_t *close_sync = new cluster_op_t;
-        close_sync->opcode = OSD_OP_SYNC;
-        close_sync->callback = [&stop](cluster_op_t *op)
+        else
         {
-            stop = true;
-            delete op;
-        };
-        cli->execute(close_sync);
-        while (!stop)
+            auto conn = conns[0];
+            conn->ringloop = ringloop;
+            conn->epmgr = epmgr;
+            conn->start();
+            while (!conn->is_finished())
+            {
+                ringloop->loop();
+                ringloop->wait();
+            }
+            bool stop = false;
+            cluster_op_t *close_sync = new cluster_op_t;
+            close_sync->opcode = OSD_OP_SYNC;
+            close_sync->callback = [&stop](cluster_op_t *op)
+            {
+                stop = true;
+                delete op;
+            };
+            cli->execute(close_sync);
+            while (!stop)
+            {
+                ringloop->loop();
+                ringloop->wait();
+            }
+        }
+        for (auto conn: conns)
         {
-            ringloop->loop();
-            ringloop->wait();
+            delete conn;
         }
+        conns.clear();
         delete cli;
         delete epmgr;
         delete ringloop;
@@ -490,10 +1003,10 @@ public:
     }
 
 protected:
-    int run_nbd(int sockfd[2], int dev_num, uint64_t size, uint64_t flags, unsigned timeout, bool bg)
+    int run_nbd(std::vector<std::array<int, 2>> & sockfd, int dev_num, uint64_t size, uint64_t flags, unsigned timeout, bool bg)
     {
         // Check handle size
-        assert(sizeof(cur_req.handle) == 8);
+        assert(sizeof(nbd_request::handle) == 8);
         char path[64] = { 0 };
         sprintf(path, "/dev/nbd%d", dev_num);
         int r, nbd = open(path, O_RDWR), qd_fd;
@@ -501,11 +1014,21 @@ protected:
         {
             return -1;
         }
-        r = ioctl(nbd, NBD_SET_SOCK, sockfd[1]);
+        r = ioctl(nbd, NBD_SET_SOCK, sockfd[0][1]);
         if (r < 0)
         {
             goto end_close;
         }
+        for (int i = 1; i < sockfd.size(); i++)
+        {
+            // The kernel accepts additional sockets regardless of flags, NBD_FLAG_CAN_MULTI_CONN
+            // only tells it that a flush on one connection flushes writes completed on all of them
+            r = ioctl(nbd, NBD_SET_SOCK, sockfd[i][1]);
+            if (r < 0)
+            {
+                goto end_unmap;
+            }
+        }
         r = ioctl(nbd, NBD_SET_BLKSIZE, 4096);
         if (r < 0)
         {
@@ -541,7 +1064,10 @@ protected:
         if (!fork())
         {
             // Run in child
-            close(sockfd[0]);
+            for (auto & pair: sockfd)
+            {
+                close(pair[0]);
+            }
             if (bg)
             {
                 daemonize();
@@ -551,12 +1077,18 @@ protected:
             {
                 fprintf(stderr, "NBD device terminated with error: %s\n", strerror(errno));
             }
-            close(sockfd[1]);
+            for (auto & pair: sockfd)
+            {
+                close(pair[1]);
+            }
             ioctl(nbd, NBD_CLEAR_QUE);
             ioctl(nbd, NBD_CLEAR_SOCK);
             exit(0);
         }
-        close(sockfd[1]);
+        for (auto & pair: sockfd)
+        {
+            close(pair[1]);
+        }
         close(nbd);
         return 0;
     end_close:
@@ -571,223 +1103,6 @@ protected:
         errno = r;
         return -3;
     }
-
-    void submit_send()
-    {
-        if (!send_list.size() || send_msg.msg_iovlen > 0)
-        {
-            return;
-        }
-        io_uring_sqe* sqe = ringloop->get_sqe();
-        if (!sqe)
-        {
-            return;
-        }
-        ring_data_t* data = ((ring_data_t*)sqe->user_data);
-        data->callback = [this](ring_data_t *data) { handle_send(data->res); };
-        send_msg.msg_iov = send_list.data();
-        send_msg.msg_iovlen = send_list.size();
-        my_uring_prep_sendmsg(sqe, nbd_fd, &send_msg, MSG_ZEROCOPY);
-    }
-
-    void handle_send(int result)
-    {
-        send_msg.msg_iovlen = 0;
-        if (result < 0 && result != -EAGAIN)
-        {
-            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
-            exit(1);
-        }
-        int to_eat = 0;
-        while (result > 0 && to_eat < send_list.size())
-        {
-            if (result >= send_list[to_eat].iov_len)
-            {
-                free(to_free[to_eat]);
-                result -= send_list[to_eat].iov_len;
-                to_eat++;
-            }
-            else
-            {
-                send_list[to_eat].iov_base = (uint8_t*)send_list[to_eat].iov_base + result;
-                send_list[to_eat].iov_len -= result;
-                break;
-            }
-        }
-        if (to_eat > 0)
-        {
-            send_list.erase(send_list.begin(), send_list.begin() + to_eat);
-            to_free.erase(to_free.begin(), to_free.begin() + to_eat);
-        }
-        for (int i = 0; i < next_send_list.size(); i++)
-        {
-            send_list.push_back(next_send_list[i]);
-        }
-        next_send_list.clear();
-        if (send_list.size() > 0)
-        {
-            ringloop->wakeup();
-        }
-    }
-
-    void submit_read()
-    {
-        if (!read_ready || read_msg.msg_iovlen > 0)
-        {
-            return;
-        }
-        io_uring_sqe* sqe = ringloop->get_sqe();
-        if (!sqe)
-        {
-            return;
-        }
-        ring_data_t* data = ((ring_data_t*)sqe->user_data);
-        data->callback = [this](ring_data_t *data) { handle_read(data->res); };
-        if (cur_left < receive_buffer_size)
-        {
-            read_iov.iov_base = recv_buf;
-            read_iov.iov_len = receive_buffer_size;
-        }
-        else
-        {
-            read_iov.iov_base = cur_buf;
-            read_iov.iov_len = cur_left;
-        }
-        read_msg.msg_iov = &read_iov;
-        read_msg.msg_iovlen = 1;
-        my_uring_prep_recvmsg(sqe, nbd_fd, &read_msg, 0);
-    }
-
-    void handle_read(int result)
-    {
-        read_msg.msg_iovlen = 0;
-        if (result < 0 && result != -EAGAIN)
-        {
-            fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
-            exit(1);
-        }
-        if (result == -EAGAIN || result < read_iov.iov_len)
-        {
-            read_ready--;
-        }
-        if (read_ready > 0)
-        {
-            ringloop->wakeup();
-        }
-        void *b = recv_buf;
-        while (result > 0)
-        {
-            if (read_iov.iov_base == recv_buf)
-            {
-                int inc = result >= cur_left ? cur_left : result;
-                memcpy(cur_buf, b, inc);
-                cur_left -= inc;
-                result -= inc;
-                cur_buf = (uint8_t*)cur_buf + inc;
-                b = (uint8_t*)b + inc;
-            }
-            else
-            {
-                assert(result <= cur_left);
-                cur_left -= result;
-                cur_buf = (uint8_t*)cur_buf + result;
-                result = 0;
-            }
-            if (cur_left <= 0)
-            {
-                handle_finished_read();
-            }
-        }
-    }
-
-    void handle_finished_read()
-    {
-        if (read_state == CL_READ_HDR)
-        {
-            int req_type = be32toh(cur_req.type);
-            if (be32toh(cur_req.magic) == NBD_REQUEST_MAGIC && req_type == NBD_CMD_DISC)
-            {
-                // Disconnect
-                close(nbd_fd);
-                exit(0);
-            }
-            if (be32toh(cur_req.magic) != NBD_REQUEST_MAGIC ||
-                req_type != NBD_CMD_READ && req_type != NBD_CMD_WRITE && req_type != NBD_CMD_FLUSH)
-            {
-                printf("Unexpected request: magic=%x type=%x, terminating\n", cur_req.magic, req_type);
-                exit(1);
-            }
-            uint64_t handle = *((uint64_t*)cur_req.handle);
-#ifdef DEBUG
-            printf("request %lx +%x %lx\n", be64toh(cur_req.from), be32toh(cur_req.len), handle);
-#endif
-            void *buf = NULL;
-            cluster_op_t *op = new cluster_op_t;
-            if (req_type == NBD_CMD_READ || req_type == NBD_CMD_WRITE)
-            {
-                op->opcode = req_type == NBD_CMD_READ ? OSD_OP_READ : OSD_OP_WRITE;
-                op->inode = inode ? inode : watch->cfg.num;
-                op->offset = be64toh(cur_req.from);
-                op->len = be32toh(cur_req.len);
-                buf = malloc_or_die(sizeof(nbd_reply) + op->len);
-                op->iov.push_back((uint8_t*)buf + sizeof(nbd_reply), op->len);
-            }
-            else if (req_type == NBD_CMD_FLUSH)
-            {
-                op->opcode = OSD_OP_SYNC;
-                buf = malloc_or_die(sizeof(nbd_reply));
-            }
-            op->callback = [this, buf, handle](cluster_op_t *op)
-            {
-#ifdef DEBUG
-                printf("reply %lx e=%d\n", handle, op->retval);
-#endif
-                nbd_reply *reply = (nbd_reply*)buf;
-                reply->magic = htobe32(NBD_REPLY_MAGIC);
-                memcpy(reply->handle, &handle, 8);
-                reply->error = htobe32(op->retval < 0 ? -op->retval : 0);
-                auto & to_list = send_msg.msg_iovlen > 0 ? next_send_list : send_list;
-                if (op->retval < 0 || op->opcode != OSD_OP_READ)
-                    to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) });
-                else
-                    to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) + op->len });
-                to_free.push_back(buf);
-                delete op;
-                ringloop->wakeup();
-            };
-            if (req_type == NBD_CMD_WRITE)
-            {
-                cur_op = op;
-                cur_buf = (uint8_t*)buf + sizeof(nbd_reply);
-                cur_left = op->len;
-                read_state = CL_READ_DATA;
-            }
-            else
-            {
-                cur_op = NULL;
-                cur_buf = &cur_req;
-                cur_left = sizeof(nbd_request);
-                read_state = CL_READ_HDR;
-                cli->execute(op);
-            }
-        }
-        else
-        {
-            if (cur_op->opcode == OSD_OP_WRITE && watch->cfg.readonly)
-            {
-                cur_op->retval = -EROFS;
-                std::function<void(cluster_op_t*)>(cur_op->callback)(cur_op);
-            }
-            else
-            {
-                cli->execute(cur_op);
-            }
-            cur_op = NULL;
-            cur_buf = &cur_req;
-            cur_left = sizeof(nbd_request);
-            read_state = CL_READ_HDR;
-        }
-    }
 };
 
 int main(int narg, const char *args[])
@@ -0,0 +1,218 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Open-addressing hash map with linear probing for integer and pointer keys.
+// Used instead of std::map for lookups in messenger hot paths (clients by FD,
+// in-flight operations by ID). Supports a subset of the std::map interface.
+// Iteration order is arbitrary, and erase() or insertion invalidates iterators.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template<class K, class V> class open_hash_map_t
+{
+public:
+    typedef std::pair<K, V> value_type;
+
+private:
+    std::vector<value_type> items;
+    std::vector<uint8_t> used;
+    size_t count = 0;
+    unsigned bits = 0;
+
+    inline size_t slot_of(const K & key) const
+    {
+        // Fibonacci hashing
+        return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+    }
+
+    size_t find_slot(const K & key) const
+    {
+        if (!count)
+        {
+            return items.size();
+        }
+        size_t mask = items.size()-1;
+        size_t i = slot_of(key);
+        while (used[i])
+        {
+            if (items[i].first == key)
+            {
+                return i;
+            }
+            i = (i+1) & mask;
+        }
+        return items.size();
+    }
+
+    void rehash(unsigned new_bits)
+    {
+        std::vector<value_type> old_items;
+        std::vector<uint8_t> old_used;
+        old_items.swap(items);
+        old_used.swap(used);
+        bits = new_bits;
+        items.resize((size_t)1 << bits);
+        used.resize((size_t)1 << bits);
+        size_t mask = items.size()-1;
+        for (size_t j = 0; j < old_items.size(); j++)
+        {
+            if (old_used[j])
+            {
+                size_t i = slot_of(old_items[j].first);
+                while (used[i])
+                    i = (i+1) & mask;
+                used[i] = 1;
+                items[i] = std::move(old_items[j]);
+            }
+        }
+    }
+
+public:
+    class iterator
+    {
+        friend class open_hash_map_t;
+        open_hash_map_t *map;
+        size_t pos;
+
+        inline void skip_free()
+        {
+            while (pos < map->items.size() && !map->used[pos])
+                pos++;
+        }
+
+    public:
+        inline iterator(open_hash_map_t *map, size_t pos): map(map), pos(pos)
+        {
+            skip_free();
+        }
+        inline value_type & operator * () const
+        {
+            return map->items[pos];
+        }
+        inline value_type* operator -> () const
+        {
+            return &map->items[pos];
+        }
+        inline iterator & operator ++ ()
+        {
+            pos++;
+            skip_free();
+            return *this;
+        }
+        inline iterator operator ++ (int)
+        {
+            iterator prev = *this;
+            ++*this;
+            return prev;
+        }
+        inline bool operator == (const iterator & other) const
+        {
+            return pos == other.pos;
+        }
+        inline bool operator != (const iterator & other) const
+        {
+            return pos != other.pos;
+        }
+    };
+
+    inline size_t size() const
+    {
+        return count;
+    }
+
+    inline iterator begin()
+    {
+        return iterator(this, 0);
+    }
+
+    inline iterator end()
+    {
+        return iterator(this, items.size());
+    }
+
+    inline iterator find(const K & key)
+    {
+        return iterator(this, find_slot(key));
+    }
+
+    V & at(const K & key)
+    {
+        size_t i = find_slot(key);
+        if (i >= items.size())
+        {
+            throw std::out_of_range("open_hash_map_t::at");
+        }
+        return items[i].second;
+    }
+
+    V & operator [] (const K & key)
+    {
+        size_t i = find_slot(key);
+        if (i < items.size())
+        {
+            return items[i].second;
+        }
+        // Keep load factor <= 1/2
+        if ((count+1)*2 > items.size())
+        {
+            rehash(bits ? bits+1 : 4);
+        }
+        size_t mask = items.size()-1;
+        i = slot_of(key);
+        while (used[i])
+            i = (i+1) & mask;
+        used[i] = 1;
+        items[i] = value_type(key, V());
+        count++;
+        return items[i].second;
+    }
+
+    void erase(iterator it)
+    {
+        // Backward shift deletion, no tombstones
+        size_t mask = items.size()-1;
+        size_t i = it.pos, j = i;
+        while (true)
+        {
+            j = (j+1) & mask;
+            if (!used[j])
+                break;
+            size_t k = slot_of(items[j].first);
+            // Move items[j] to the hole if its home slot is not in (i, j]
+            if (i <= j ? (i >= k || k > j) : (i >= k && k > j))
+            {
+                items[i] = std::move(items[j]);
+                i = j;
+            }
+        }
+        used[i] = 0;
+        items[i] = value_type();
+        count--;
+    }
+
+    size_t erase(const K & key)
+    {
+        size_t i = find_slot(key);
+        if (i >= items.size())
+        {
+            return 0;
+        }
+        erase(iterator(this, i));
+        return 1;
+    }
+
+    void clear()
+    {
+        items.clear();
+        used.clear();
+        count = 0;
+        bits = 0;
+    }
+};
@@ -40,6 +40,13 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
         this->config["log_level"] = 1;
     parse_config(this->config, true);
 
+    {
+        // Modification logs aren't persisted, so they're valid only within the same OSD process
+        timespec tv;
+        clock_gettime(CLOCK_REALTIME, &tv);
+        pg_log_instance = (((uint64_t)tv.tv_sec << 32) ^ tv.tv_nsec ^ ((uint64_t)getpid() << 16)) | 1;
+    }
+
     epmgr = new epoll_manager_t(ringloop);
     // FIXME: Use timerfd_interval based directly on io_uring
     this->tfd = epmgr->tfd;
@@ -75,6 +82,7 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
     {
         print_slow();
     });
+    set_recovery_tune_timer();
 
     msgr.tfd = this->tfd;
     msgr.ringloop = this->ringloop;
@@ -109,6 +117,7 @@ void osd_t::parse_config(const json11::Json & config, bool allow_disk_params)
         if (!osd_num)
             throw std::runtime_error("osd_num is required in the configuration");
         msgr.osd_num = osd_num;
+        msgr.tracer.node = osd_num;
         // Vital Blockstore parameters
         bs_block_size = config["block_size"].uint64_value();
         if (!bs_block_size)
@@ -169,6 +178,23 @@ void osd_t::parse_config(const json11::Json & config, bool allow_disk_params)
     recovery_sync_batch = config["recovery_sync_batch"].uint64_value();
     if (recovery_sync_batch < 1 || recovery_sync_batch > MAX_RECOVERY_QUEUE)
         recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
+    recovery_bandwidth = config["recovery_bandwidth"].uint64_value();
+    recovery_iops = config["recovery_iops"].uint64_value();
+    recovery_target_latency = config["recovery_target_latency"].uint64_value();
+    recovery_batch_size = config["recovery_batch_size"].uint64_value();
+    if (recovery_batch_size < 1 || recovery_batch_size > MAX_RECOVERY_BATCH_SIZE)
+        recovery_batch_size = 1;
+    int prev_tune_interval = recovery_tune_interval;
+    recovery_tune_interval = config["recovery_tune_interval"].uint64_value();
+    if (!recovery_tune_interval)
+        recovery_tune_interval = DEFAULT_RECOVERY_TUNE_INTERVAL;
+    if (recovery_tune_timer_id >= 0 && recovery_tune_interval != prev_tune_interval)
+    {
+        // Re-arm the periodic timer with the new interval
+        set_recovery_tune_timer();
+    }
+    if (!recovery_target_latency)
+        recovery_tune_factor = 1;
     print_stats_interval = config["print_stats_interval"].uint64_value();
     if (!print_stats_interval)
         print_stats_interval = 3;
@@ -178,6 +204,20 @@ void osd_t::parse_config(const json11::Json & config, bool allow_disk_params)
     inode_vanish_time = config["inode_vanish_time"].uint64_value();
     if (!inode_vanish_time)
         inode_vanish_time = 60;
+    pg_log_size = config["pg_log_size"].uint64_value();
+    busy_poll_us = config["busy_poll_us"].uint64_value();
+    if (busy_poll_us > 1000000)
+        busy_poll_us = 1000000;
+    ringloop->set_busy_poll(busy_poll_us);
+    if (!config["read_lease_ms"].is_null())
+    {
+        // Allow to set it to 0 to disable read leases
+        read_lease_ms = config["read_lease_ms"].uint64_value();
+        // Lease must expire before the OSD's etcd lease, otherwise a new primary
+        // may activate the PG while clients still read from the old OSD set
+        if (read_lease_ms > etcd_report_interval*1000)
+            read_lease_ms = etcd_report_interval*1000;
+    }
 }
 
 void osd_t::bind_socket()
@@ -213,6 +253,8 @@ void osd_t::bind_socket()
     listen_fd = create_and_bind_socket(bind_address, bind_port, listen_backlog, &listening_port);
     fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
 
+    msgr.listen_shm();
+
     epmgr->set_fd_handler(listen_fd, false, [this](int fd, int events)
     {
         msgr.accept_connections(listen_fd);
@@ -259,6 +301,8 @@ void osd_t::exec_op(osd_op_t *cur_op)
             cur_op->req.sec_rw.offset % bs_bitmap_granularity)) ||
         ((cur_op->req.hdr.opcode == OSD_OP_READ ||
             cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+            cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES ||
+            cur_op->req.hdr.opcode == OSD_OP_DISCARD ||
             cur_op->req.hdr.opcode == OSD_OP_DELETE) &&
             (cur_op->req.rw.len > OSD_RW_MAX ||
             cur_op->req.rw.len % bs_bitmap_granularity ||
@@ -279,12 +323,22 @@ void osd_t::exec_op(osd_op_t *cur_op)
         cur_op->req.hdr.opcode != OSD_OP_SEC_LIST &&
         cur_op->req.hdr.opcode != OSD_OP_READ &&
         cur_op->req.hdr.opcode != OSD_OP_SEC_READ_BMP &&
+        cur_op->req.hdr.opcode != OSD_OP_SEC_READ_MULTI &&
         cur_op->req.hdr.opcode != OSD_OP_SHOW_CONFIG)
     {
         // Readonly mode
         finish_op(cur_op, -EROFS);
         return;
     }
+    uint64_t trace_id = osd_trace_id(cur_op->req);
+    if (trace_id)
+    {
+        bool primary = cur_op->req.hdr.opcode == OSD_OP_READ || cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+            cur_op->req.hdr.opcode == OSD_OP_SYNC || cur_op->req.hdr.opcode == OSD_OP_DELETE ||
+            cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES || cur_op->req.hdr.opcode == OSD_OP_DISCARD;
+        msgr.tracer.record(trace_id, primary ? OSD_TRACE_PRIMARY_RECV : OSD_TRACE_SEC_RECV, cur_op->req.hdr.opcode,
+            0, cur_op->tv_begin.tv_sec*1000000ul + cur_op->tv_begin.tv_nsec/1000);
+    }
     if (cur_op->req.hdr.opcode == OSD_OP_TEST_SYNC_STAB_ALL)
     {
         exec_sync_stab_all(cur_op);
@@ -297,7 +351,8 @@ void osd_t::exec_op(osd_op_t *cur_op)
     {
         continue_primary_read(cur_op);
     }
-    else if (cur_op->req.hdr.opcode == OSD_OP_WRITE)
+    else if (cur_op->req.hdr.opcode == OSD_OP_WRITE || cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES ||
+        cur_op->req.hdr.opcode == OSD_OP_DISCARD)
     {
         continue_primary_write(cur_op);
     }
@@ -325,6 +380,8 @@ void osd_t::reset_stats()
 
 void osd_t::print_stats()
 {
+    // Save trace spans regularly even if there are few of them
+    msgr.tracer.flush();
     for (int i = OSD_OP_MIN; i <= OSD_OP_MAX; i++)
     {
         if (msgr.stats.op_stat_count[i] != prev_stats.op_stat_count[i] && i != OSD_OP_PING)
@@ -395,8 +452,9 @@ void osd_t::print_slow()
     clock_gettime(CLOCK_REALTIME, &now);
     for (auto & kv: msgr.clients)
     {
-        for (auto op: kv.second->received_ops)
+        for (auto & op_p: kv.second->received_ops)
         {
+            auto op = op_p.first;
             if ((now.tv_sec - op->tv_begin.tv_sec) >= slow_log_interval)
             {
                 int l = sizeof(alloc), n;
@@ -412,6 +470,10 @@ void osd_t::print_slow()
                     bufprintf(" from client %d", kv.second->peer_fd);
                 }
                 bufprintf(": %s id=%lu", osd_op_names[op->req.hdr.opcode], op->req.hdr.id);
+                if (osd_trace_id(op->req))
+                {
+                    bufprintf(" trace=%lx", osd_trace_id(op->req));
+                }
                 if (op->req.hdr.opcode == OSD_OP_SEC_READ || op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
                     op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE || op->req.hdr.opcode == OSD_OP_SEC_DELETE)
                 {
@@ -447,7 +509,8 @@ void osd_t::print_slow()
                     );
                 }
                 else if (op->req.hdr.opcode == OSD_OP_READ || op->req.hdr.opcode == OSD_OP_WRITE ||
-                    op->req.hdr.opcode == OSD_OP_DELETE)
+                    op->req.hdr.opcode == OSD_OP_DELETE || op->req.hdr.opcode == OSD_OP_WRITE_ZEROES ||
+                    op->req.hdr.opcode == OSD_OP_DISCARD)
                 {
                     bufprintf(" inode=%lx offset=%lx len=%x", op->req.rw.inode, op->req.rw.offset, op->req.rw.len);
                 }
@@ -465,7 +528,8 @@ void osd_t::print_slow()
                     }
                 }
                 else if (op->req.hdr.opcode == OSD_OP_READ || op->req.hdr.opcode == OSD_OP_WRITE ||
-                    op->req.hdr.opcode == OSD_OP_SYNC || op->req.hdr.opcode == OSD_OP_DELETE)
+                    op->req.hdr.opcode == OSD_OP_SYNC || op->req.hdr.opcode == OSD_OP_DELETE ||
+                    op->req.hdr.opcode == OSD_OP_WRITE_ZEROES || op->req.hdr.opcode == OSD_OP_DISCARD)
                 {
                     bufprintf(" state=%d", !op->op_data ? -1 : op->op_data->st);
                 }
@@ -36,6 +36,10 @@
 #define DEFAULT_RECOVERY_QUEUE 4
 #define DEFAULT_RECOVERY_PG_SWITCH 128
 #define DEFAULT_RECOVERY_BATCH 16
+#define DEFAULT_RECOVERY_TUNE_INTERVAL 1
+#define MAX_RECOVERY_BATCH_SIZE 64
+#define MIN_RECOVERY_TUNE_FACTOR (1.0/64)
+#define DEFAULT_READ_LEASE_MS 1000
 
 //#define OSD_STUB
 
@@ -45,12 +49,24 @@ struct osd_object_id_t
     object_id oid;
 };
 
+// Result of a batched recovery read, shared by all objects of the batch
+struct osd_recovery_prefetch_t
+{
+    int refs = 0;
+    uint8_t *buf = NULL;
+    uint64_t count = 0;
+};
+
 struct osd_recovery_op_t
 {
     int st = 0;
     bool degraded = false;
     object_id oid = { 0 };
     osd_op_t *osd_op = NULL;
+    // object data read in advance by a batched read
+    bool prefetch_wait = false;
+    osd_recovery_prefetch_t *prefetch = NULL;
+    uint64_t prefetch_idx = 0;
 };
 
 // Posted as /osd/inodestats/$osd, then accumulated by the monitor
@@ -84,6 +100,17 @@ struct osd_chain_read_t
     uint32_t offset, len;
 };
 
+// Bounded in-memory log of objects modified in a PG on this OSD. Primary OSDs
+// use it to only re-list changed objects when peering the PG again
+struct osd_pg_log_t
+{
+    // PG mapping used to assign objects to this log
+    uint64_t pg_count = 0, pg_stripe_size = 0;
+    // position of the first entry of <oids>
+    uint64_t first_pos = 0;
+    std::deque<object_id> oids;
+};
+
 struct osd_rmw_stripe_t;
 
 class osd_t
@@ -111,7 +138,14 @@ class osd_t
     int recovery_queue_depth = DEFAULT_RECOVERY_QUEUE;
     int recovery_pg_switch = DEFAULT_RECOVERY_PG_SWITCH;
     int recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
+    uint64_t recovery_bandwidth = 0, recovery_iops = 0;
+    uint64_t recovery_target_latency = 0;
+    int recovery_tune_interval = DEFAULT_RECOVERY_TUNE_INTERVAL;
+    int recovery_batch_size = 1;
     int inode_vanish_time = 60;
+    uint64_t busy_poll_us = 0;
+    int read_lease_ms = DEFAULT_READ_LEASE_MS;
+    uint64_t pg_log_size = 0;
     int log_level = 0;
 
     // cluster state
@@ -141,6 +175,18 @@ class osd_t
     pool_pg_num_t recovery_last_pg;
     object_id recovery_last_oid;
     int recovery_pg_done = 0, recovery_done = 0;
+    // recovery QoS state
+    double recovery_tune_factor = 1;
+    double recovery_op_budget = 0, recovery_byte_budget = 0;
+    uint64_t recovery_budget_time = 0, recovery_budget_bytes = 0;
+    int recovery_throttle_timer_id = -1;
+    int recovery_tune_timer_id = -1;
+    bool recovery_was_throttled = false, recovery_throttle_state = false;
+    uint64_t recovery_tune_prev_count = 0, recovery_tune_prev_bytes = 0;
+    uint64_t recovery_tune_prev_lat_sum = 0, recovery_tune_prev_lat_count = 0;
+    uint64_t recovery_cur_iops = 0, recovery_cur_bps = 0, recovery_client_lat = 0;
+    // peer OSDs supporting OSD_OP_SEC_READ_MULTI
+    std::set<osd_num_t> read_multi_osds;
     osd_op_t *autosync_op = NULL;
 
     // Unstable writes
@@ -172,6 +218,10 @@ class osd_t
     uint64_t recovery_stat_count[2][2] = {};
     uint64_t recovery_stat_bytes[2][2] = {};
 
+    // modification logs for incremental peering
+    uint64_t pg_log_instance = 0;
+    std::map<pool_pg_num_t, osd_pg_log_t> pg_logs;
+
     // cluster connection
     void parse_config(const json11::Json & config, bool allow_disk_params);
     void init_cluster();
@@ -211,6 +261,14 @@ class osd_t
     void reset_pg(pg_t & pg);
     void finish_stop_pg(pg_t & pg);
 
+    // modification log
+    void log_pg_modification(blockstore_op_t *bs_op);
+    void append_pg_log(object_id oid);
+    void clear_pg_logs();
+    bool get_pg_log_pos(pool_id_t pool_id, pg_num_t pg_num, uint64_t pg_count, uint64_t pg_stripe_size, uint64_t *log_pos);
+    bool list_pg_delta(pool_id_t pool_id, pg_num_t pg_num, uint64_t pg_count, uint64_t pg_stripe_size,
+        uint64_t log_pos, pg_list_result_t & res);
+
     // flushing, recovery and backfill
     void submit_pg_flush_ops(pg_t & pg);
     void handle_flush_op(bool rollback, pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t *fb, osd_num_t peer_osd, int retval);
@@ -218,6 +276,13 @@ class osd_t
     bool pick_next_recovery(osd_recovery_op_t &op);
     void submit_recovery_op(osd_recovery_op_t *op);
     bool continue_recovery();
+    bool recovery_throttled();
+    void set_recovery_tune_timer();
+    void tune_recovery();
+    osd_num_t get_recovery_batch_source(osd_recovery_op_t *op);
+    void submit_recovery_batch(osd_num_t source_osd, std::vector<object_id> & batch);
+    bool take_recovery_prefetch(osd_op_t *cur_op);
+    void drop_recovery_prefetch(osd_recovery_op_t *op);
     pg_osd_set_state_t* change_osd_set(pg_osd_set_state_t *st, pg_t *pg);
 
     // op execution
@@ -227,6 +292,8 @@ class osd_t
     // secondary ops
     void exec_sync_stab_all(osd_op_t *cur_op);
     void exec_show_config(osd_op_t *cur_op);
+    void exec_sec_read_multi(osd_op_t *cur_op);
+    uint64_t read_multi_max_objects();
     void exec_secondary(osd_op_t *cur_op);
     void secondary_op_callback(osd_op_t *cur_op);
 
@@ -234,6 +301,7 @@ class osd_t
     void autosync();
     bool prepare_primary_rw(osd_op_t *cur_op);
     void continue_primary_read(osd_op_t *cur_op);
+    void grant_read_lease(osd_op_t *cur_op, pg_t & pg);
     void continue_primary_write(osd_op_t *cur_op);
     void cancel_primary_write(osd_op_t *cur_op);
     void continue_primary_sync(osd_op_t *cur_op);
@@ -244,6 +312,7 @@ class osd_t
     bool remember_unstable_write(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t & loc_set, int base_state);
     void handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op);
     void handle_primary_bs_subop(osd_op_t *subop);
+    void trace_subop(osd_op_t *cur_op, osd_op_t *subop, osd_num_t peer_osd);
     void add_bs_subop_stats(osd_op_t *subop);
     void pg_cancel_write_queue(pg_t & pg, osd_op_t *first_op, object_id oid, int retval);
 
@@ -265,6 +334,13 @@ class osd_t
     int submit_bitmap_subops(osd_op_t *cur_op, pg_t & pg);
     int read_bitmaps(osd_op_t *cur_op, pg_t & pg, int base_state);
 
+    inline uint64_t get_time_ms()
+    {
+        timespec tv;
+        clock_gettime(CLOCK_REALTIME, &tv);
+        return tv.tv_sec*1000 + tv.tv_nsec/1000000;
+    }
+
     inline pg_num_t map_to_pg(object_id oid, uint64_t pg_stripe_size)
     {
         uint64_t pg_count = pg_counts[INODE_POOL(oid.inode)];
@@ -110,6 +110,10 @@ void osd_t::parse_test_peer(std::string peer)
 
 bool osd_t::check_peer_config(osd_client_t *cl, json11::Json conf)
 {
+    if (conf["sec_read_multi"].bool_value())
+        read_multi_osds.insert(cl->osd_num);
+    else
+        read_multi_osds.erase(cl->osd_num);
     // Check block_size, bitmap_granularity and immediate_commit of the peer
     if (conf["block_size"].is_null() ||
         conf["bitmap_granularity"].is_null() ||
@@ -169,6 +173,12 @@ json11::Json osd_t::get_osd_state()
         st["addresses"] = getifaddr_list();
     st["host"] = std::string(hostname.data(), hostname.size());
     st["port"] = listening_port;
+    if (msgr.shm_socket_name != "")
+    {
+        // Clients on the same host check that the socket is owned by this process
+        st["shm_socket"] = msgr.shm_socket_name;
+        st["pid"] = (uint64_t)getpid();
+    }
     st["primary_enabled"] = run_primary;
     st["blockstore_enabled"] = bs ? true : false;
     return st;
@@ -218,6 +228,29 @@ json11::Json osd_t::get_statistics()
             { "bytes", recovery_stat_bytes[0][1] },
         } },
     };
+    st["recovery_qos"] = json11::Json::object {
+        { "bps", recovery_cur_bps },
+        { "iops", recovery_cur_iops },
+        { "client_latency", recovery_client_lat },
+        { "tune_factor", recovery_tune_factor },
+        { "throttled", recovery_throttle_state },
+    };
+    st["poll_stats"] = json11::Json::object {
+        { "spin_hits", ringloop->poll_stats.spin_hits },
+        { "spin_misses", ringloop->poll_stats.spin_misses },
+        { "sleeps", ringloop->poll_stats.sleeps },
+        { "spin_usec", ringloop->poll_stats.spin_usec },
+        { "sleep_usec", ringloop->poll_stats.sleep_usec },
+    };
+    st["zerocopy_stats"] = json11::Json::object {
+        { "bytes", msgr.stats.zerocopy_bytes },
+        { "copied_bytes", msgr.stats.zerocopy_copied_bytes },
+    };
+    st["pool_stats"] = json11::Json::object {
+        { "op", json11::Json::object { { "alloc", op_pool_stats.op_alloc }, { "hit", op_pool_stats.op_hit } } },
+        { "op_data", json11::Json::object { { "alloc", op_pool_stats.op_data_alloc }, { "hit", op_pool_stats.op_data_hit } } },
+        { "buffer", json11::Json::object { { "alloc", op_pool_stats.buf_alloc }, { "hit", op_pool_stats.buf_hit } } },
+    };
     return st;
 }
 
@@ -177,6 +177,7 @@ bool osd_t::submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t
             .callback = [this, op, pool_id, pg_num, fb](blockstore_op_t *bs_op)
             {
                 add_bs_subop_stats(op);
+                log_pg_modification(bs_op);
                 handle_flush_op(bs_op->opcode == BS_OP_ROLLBACK, pool_id, pg_num, fb, this->osd_num, bs_op->retval);
                 delete op->bs_op;
                 op->bs_op = NULL;
@@ -316,6 +317,7 @@ void osd_t::submit_recovery_op(osd_recovery_op_t *op)
         }
         // CAREFUL! op = &recovery_ops[op->oid]. Don't access op->* after recovery_ops.erase()
         op->osd_op = NULL;
+        drop_recovery_prefetch(op);
         recovery_ops.erase(op->oid);
         delete osd_op;
         if (immediate_commit != IMMEDIATE_ALL)
@@ -337,16 +339,316 @@ void osd_t::submit_recovery_op(osd_recovery_op_t *op)
 // Just trigger write requests for degraded objects. They'll be recovered during writing
 bool osd_t::continue_recovery()
 {
-    while (recovery_ops.size() < recovery_queue_depth)
+    int queue_depth = recovery_queue_depth * recovery_tune_factor;
+    if (queue_depth < 1)
+        queue_depth = 1;
+    if (recovery_batch_size > 1 && recovery_ops.size() > 0 &&
+        queue_depth - recovery_ops.size() < (recovery_batch_size < queue_depth ? recovery_batch_size : queue_depth))
     {
+        // Wait until a whole batch may be submitted
+        return true;
+    }
+    std::vector<object_id> batch;
+    osd_num_t batch_osd = 0;
+    uint64_t max_batch = recovery_batch_size;
+    if (max_batch > 1 && max_batch > read_multi_max_objects())
+        max_batch = read_multi_max_objects();
+    bool more = true;
+    while (recovery_ops.size() < queue_depth)
+    {
+        if (recovery_throttled())
+        {
+            // Recovery will be resumed by the timer
+            break;
+        }
         osd_recovery_op_t op;
-        if (pick_next_recovery(op))
+        if (!pick_next_recovery(op))
         {
-            recovery_ops[op.oid] = op;
-            submit_recovery_op(&recovery_ops[op.oid]);
+            more = false;
+            break;
+        }
+        if (recovery_iops)
+            recovery_op_budget--;
+        recovery_ops[op.oid] = op;
+        osd_num_t source_osd = recovery_batch_size > 1 ? get_recovery_batch_source(&recovery_ops[op.oid]) : 0;
+        if (batch.size() && (source_osd != batch_osd || batch.size() >= max_batch))
+        {
+            submit_recovery_batch(batch_osd, batch);
+        }
+        if (source_osd)
+        {
+            batch_osd = source_osd;
+            batch.push_back(op.oid);
         }
         else
-            return false;
+            submit_recovery_op(&recovery_ops[op.oid]);
+    }
+    if (batch.size())
+    {
+        submit_recovery_batch(batch_osd, batch);
+    }
+    return more;
+}
+
+// Objects of replicated pools which would be read from a single remote OSD
+// may be read in batches using OSD_OP_SEC_READ_MULTI
+osd_num_t osd_t::get_recovery_batch_source(osd_recovery_op_t *op)
+{
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->oid.inode));
+    if (pool_it == st_cli.pool_config.end() || pool_it->second.scheme != POOL_SCHEME_REPLICATED)
+    {
+        return 0;
+    }
+    auto pg_it = pgs.find({ .pool_id = pool_it->first, .pg_num = map_to_pg(op->oid, pool_it->second.pg_stripe_size) });
+    if (pg_it == pgs.end() || !(pg_it->second.state & PG_ACTIVE) || pg_it->second.flush_actions.size() > 0 ||
+        pg_it->second.write_queue.find(op->oid) != pg_it->second.write_queue.end())
+    {
+        // Object may be modified during the read
+        return 0;
+    }
+    auto & pg = pg_it->second;
+    pg_osd_set_state_t *object_state = NULL;
+    uint64_t *read_target = get_object_osd_set(pg, op->oid, pg.cur_set.data(), &object_state);
+    if (!object_state)
+    {
+        return 0;
+    }
+    osd_num_t source_osd = 0;
+    for (int role = 0; role < pg.pg_size; role++)
+    {
+        if (read_target[role] == this->osd_num)
+        {
+            // Local reads are cheap anyway
+            return 0;
+        }
+        if (read_target[role] != 0 && !source_osd)
+        {
+            source_osd = read_target[role];
+        }
+    }
+    if (!source_osd || read_multi_osds.find(source_osd) == read_multi_osds.end() ||
+        msgr.osd_peer_fds.find(source_osd) == msgr.osd_peer_fds.end())
+    {
+        return 0;
+    }
+    return source_osd;
+}
+
+// Read all objects of the batch from <source_osd> in one request, then submit recovery
+// operations which take the data from the batch instead of reading it again
+void osd_t::submit_recovery_batch(osd_num_t source_osd, std::vector<object_id> & batch)
+{
+    auto peer_fd_it = msgr.osd_peer_fds.find(source_osd);
+    if (batch.size() < 2 || peer_fd_it == msgr.osd_peer_fds.end())
+    {
+        for (auto & oid: batch)
+        {
+            submit_recovery_op(&recovery_ops[oid]);
+        }
+        batch.clear();
+        return;
+    }
+    osd_op_t *subop = new osd_op_t();
+    subop->op_type = OSD_OP_OUT;
+    subop->peer_fd = peer_fd_it->second;
+    subop->buf = malloc_or_die(sizeof(obj_ver_id) * batch.size());
+    for (int i = 0; i < batch.size(); i++)
+    {
+        ((obj_ver_id*)subop->buf)[i] = { .oid = batch[i], .version = UINT64_MAX };
+        recovery_ops[batch[i]].prefetch_wait = true;
+    }
+    subop->req.sec_read_multi = {
+        .header = {
+            .magic = SECONDARY_OSD_OP_MAGIC,
+            .id = msgr.next_subop_id++,
+            .opcode = OSD_OP_SEC_READ_MULTI,
+        },
+        .len = sizeof(obj_ver_id) * batch.size(),
+    };
+    subop->callback = [this, source_osd, batch](osd_op_t *subop)
+    {
+        uint64_t n = batch.size();
+        osd_recovery_prefetch_t *pf = NULL;
+        if (subop->reply.hdr.retval == n * (bs_block_size + 8 + clean_entry_bitmap_size))
+        {
+            pf = new osd_recovery_prefetch_t();
+            pf->buf = (uint8_t*)subop->buf;
+            pf->count = n;
+            subop->buf = NULL;
+        }
+        else if (subop->reply.hdr.retval != -EPIPE)
+        {
+            printf(
+                "[OSD %lu] Batched recovery read of %lu objects from OSD %lu failed: retval = %ld\n",
+                osd_num, n, source_osd, subop->reply.hdr.retval
+            );
+        }
+        delete subop;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            // Recovery operations are only removed after submitting them
+            auto & op = recovery_ops.at(batch[i]);
+            if (pf && op.prefetch_wait)
+            {
+                op.prefetch = pf;
+                op.prefetch_idx = i;
+                pf->refs++;
+            }
+            op.prefetch_wait = false;
+            submit_recovery_op(&op);
+        }
+        if (pf && !pf->refs)
+        {
+            free(pf->buf);
+            delete pf;
+        }
+    };
+    msgr.outbox_push(subop);
+    batch.clear();
+}
+
+void osd_t::drop_recovery_prefetch(osd_recovery_op_t *op)
+{
+    op->prefetch_wait = false;
+    if (op->prefetch)
+    {
+        op->prefetch->refs--;
+        if (!op->prefetch->refs)
+        {
+            free(op->prefetch->buf);
+            delete op->prefetch;
+        }
+        op->prefetch = NULL;
+    }
+}
+
+// Check recovery byte/s and op/s budgets. Budgets are refilled according to the elapsed time
+// and scaled by recovery_tune_factor. Bytes are charged after the fact from recovery statistics
+bool osd_t::recovery_throttled()
+{
+    if (!recovery_bandwidth && !recovery_iops)
+    {
+        return false;
+    }
+    uint64_t now = get_time_ms();
+    uint64_t bytes = recovery_stat_bytes[0][0] + recovery_stat_bytes[0][1];
+    double bps = recovery_bandwidth * recovery_tune_factor;
+    double iops = recovery_iops * recovery_tune_factor;
+    if (!recovery_budget_time || bytes < recovery_budget_bytes)
+    {
+        // Start with 1/10 second of budget
+        recovery_budget_time = now;
+        recovery_budget_bytes = bytes;
+        recovery_byte_budget = bps / 10;
+        recovery_op_budget = iops / 10 < 1 ? 1 : iops / 10;
+    }
+    else if (now > recovery_budget_time)
+    {
+        // Allow bursts of at most 1/10 second
+        recovery_byte_budget += bps * (now - recovery_budget_time) / 1000;
+        if (recovery_byte_budget > bps / 10)
+            recovery_byte_budget = bps / 10;
+        recovery_op_budget += iops * (now - recovery_budget_time) / 1000;
+        if (recovery_op_budget > (iops / 10 < 1 ? 1 : iops / 10))
+            recovery_op_budget = (iops / 10 < 1 ? 1 : iops / 10);
+        recovery_budget_time = now;
+    }
+    recovery_byte_budget -= (bytes - recovery_budget_bytes);
+    recovery_budget_bytes = bytes;
+    uint64_t wait_ms = 0;
+    if (recovery_bandwidth && recovery_byte_budget < 0)
+        wait_ms = -recovery_byte_budget * 1000 / bps + 1;
+    if (recovery_iops && recovery_op_budget < 1 && wait_ms < (1 - recovery_op_budget) * 1000 / iops + 1)
+        wait_ms = (1 - recovery_op_budget) * 1000 / iops + 1;
+    if (!wait_ms)
+    {
+        return false;
+    }
+    recovery_was_throttled = true;
+    if (recovery_throttle_timer_id < 0)
+    {
+        recovery_throttle_timer_id = tfd->set_timer(wait_ms, false, [this](int timer_id)
+        {
+            recovery_throttle_timer_id = -1;
+            if (peering_state & OSD_RECOVERING)
+            {
+                continue_recovery();
+            }
+        });
     }
     return true;
 }
+
+void osd_t::set_recovery_tune_timer()
+{
+    if (recovery_tune_timer_id >= 0)
+    {
+        tfd->clear_timer(recovery_tune_timer_id);
+    }
+    recovery_tune_timer_id = tfd->set_timer(recovery_tune_interval*1000, true, [this](int timer_id)
+    {
+        tune_recovery();
+    });
+}
+
+// Calculate current recovery rate and adapt recovery speed to client op latency:
+// back off twice when it exceeds recovery_target_latency, speed up gradually when
+// it's below the half of the target and return to full speed when there are no client ops
+void osd_t::tune_recovery()
+{
+    uint64_t count = recovery_stat_count[0][0] + recovery_stat_count[0][1];
+    uint64_t bytes = recovery_stat_bytes[0][0] + recovery_stat_bytes[0][1];
+    recovery_cur_iops = count >= recovery_tune_prev_count ? (count - recovery_tune_prev_count) / recovery_tune_interval : 0;
+    recovery_cur_bps = bytes >= recovery_tune_prev_bytes ? (bytes - recovery_tune_prev_bytes) / recovery_tune_interval : 0;
+    recovery_tune_prev_count = count;
+    recovery_tune_prev_bytes = bytes;
+    uint64_t lat_sum = 0, lat_count = 0;
+    for (int opcode: { OSD_OP_READ, OSD_OP_WRITE, OSD_OP_SYNC, OSD_OP_DELETE, OSD_OP_WRITE_ZEROES, OSD_OP_DISCARD })
+    {
+        lat_sum += msgr.stats.op_stat_sum[opcode];
+        lat_count += msgr.stats.op_stat_count[opcode];
+    }
+    uint64_t client_ops = lat_count > recovery_tune_prev_lat_count ? lat_count - recovery_tune_prev_lat_count : 0;
+    recovery_client_lat = client_ops && lat_sum >= recovery_tune_prev_lat_sum
+        ? (lat_sum - recovery_tune_prev_lat_sum) / client_ops : 0;
+    recovery_tune_prev_lat_sum = lat_sum;
+    recovery_tune_prev_lat_count = lat_count;
+    recovery_throttle_state = recovery_was_throttled;
+    recovery_was_throttled = false;
+    if (!recovery_target_latency)
+    {
+        return;
+    }
+    double prev_factor = recovery_tune_factor;
+    if (!client_ops)
+    {
+        // OSD is idle
+        recovery_tune_factor = 1;
+    }
+    else if (recovery_client_lat > recovery_target_latency)
+    {
+        recovery_tune_factor /= 2;
+        if (recovery_tune_factor < MIN_RECOVERY_TUNE_FACTOR)
+            recovery_tune_factor = MIN_RECOVERY_TUNE_FACTOR;
+    }
+    else if (recovery_client_lat < recovery_target_latency/2)
+    {
+        recovery_tune_factor *= 1.25;
+        if (recovery_tune_factor > 1)
+            recovery_tune_factor = 1;
+    }
+    if (recovery_tune_factor != prev_factor)
+    {
+        if (log_level > 0)
+        {
+            printf(
+                "[OSD %lu] Recovery speed set to %.1f%% (client op latency %lu us, target %lu us)\n",
+                osd_num, recovery_tune_factor*100, recovery_client_lat, recovery_target_latency
+            );
+        }
+        if (recovery_tune_factor > prev_factor && (peering_state & OSD_RECOVERING))
+        {
+            continue_recovery();
+        }
+    }
+}
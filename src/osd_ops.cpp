@@ -21,4 +21,7 @@ const char* osd_op_names[] = {
     "primary_delete",
     "ping",
     "sec_read_bmp",
+    "sec_read_multi",
+    "primary_write_zeroes",
+    "primary_discard",
 };
@@ -9,6 +9,9 @@
 // Magic numbers
 #define SECONDARY_OSD_OP_MAGIC      0x2bd7b10325434553l
 #define SECONDARY_OSD_REPLY_MAGIC   0xbaa699b87b434553l
+#define SECONDARY_OSD_BATCH_MAGIC   0x5f1c3e9a2d434553l
+// RDMA rendezvous: release the payload buffer, hdr.id is the descriptor cookie
+#define SECONDARY_OSD_RDV_FIN_MAGIC 0x7e3a91c4d6434553l
 // Operation request / reply headers have fixed size after which comes data
 #define OSD_PACKET_SIZE             0x80
 // Opcodes
@@ -29,10 +32,27 @@
 #define OSD_OP_DELETE               14
 #define OSD_OP_PING                 15
 #define OSD_OP_SEC_READ_BMP         16
-#define OSD_OP_MAX                  16
+#define OSD_OP_SEC_READ_MULTI       17
+#define OSD_OP_WRITE_ZEROES         18
+#define OSD_OP_DISCARD              19
+#define OSD_OP_MAX                  19
 #define OSD_RW_MAX                  64*1024*1024
 #define OSD_PROTOCOL_VERSION        1
 
+// Flags for OSD_OP_READ/WRITE/DELETE (osd_op_rw_t.flags)
+// Client asks the primary OSD for a clean read lease of the PG
+#define OSD_OP_FLAG_READ_LEASE      0x01
+// Maximum number of OSDs in a read lease (fits into the reply header)
+#define OSD_READ_LEASE_MAX_OSDS     8
+
+// Flags for OSD_OP_SEC_LIST replies (osd_reply_sec_list_t.flags)
+#define OSD_LIST_DELTA              0x01
+
+// Trace IDs of sampled operations (see osd_trace.h) are tagged to not confuse
+// them with garbage in the unused part of request headers
+#define OSD_TRACE_ID_TAG            0x7ace000000000000ul
+#define OSD_TRACE_ID_TAG_MASK       0xffff000000000000ul
+
 // Memory alignment for direct I/O (usually 512 bytes)
 #ifndef DIRECT_IO_ALIGNMENT
 #define DIRECT_IO_ALIGNMENT 512
@@ -150,6 +170,20 @@ struct __attribute__((__packed__)) osd_reply_sec_read_bmp_t
     osd_reply_header_t header;
 };
 
+// bulk read whole objects from a secondary OSD (used by recovery)
+struct __attribute__((__packed__)) osd_op_sec_read_multi_t
+{
+    osd_op_header_t header;
+    // obj_ver_id array length in bytes
+    uint64_t len;
+};
+
+struct __attribute__((__packed__)) osd_reply_sec_read_multi_t
+{
+    // retval is payload length in bytes. payload is data[n][block_size], then version[n], then bitmap[n]
+    osd_reply_header_t header;
+};
+
 // show configuration
 struct __attribute__((__packed__)) osd_op_show_config_t
 {
@@ -173,6 +207,9 @@ struct __attribute__((__packed__)) osd_op_sec_list_t
     uint64_t pg_stripe_size;
     // inode range (used to select pools)
     uint64_t min_inode, max_inode;
+    // modification log instance and position of the previous listing.
+    // if they're set and the log still covers this position, only changed objects are listed
+    uint64_t log_instance, log_pos;
 };
 
 struct __attribute__((__packed__)) osd_reply_sec_list_t
@@ -181,9 +218,20 @@ struct __attribute__((__packed__)) osd_reply_sec_list_t
     // stable object version count. header.retval = total object version count
     // FIXME: maybe change to the number of bytes in the reply...
     uint64_t stable_count;
+    // modification log instance and position at the moment of listing (0 if log is disabled)
+    uint64_t log_instance, log_pos;
+    // OSD_LIST_DELTA if the reply only contains changed objects. In that case the stable
+    // part contains exactly one entry for each changed object, with version 0 if it's deleted
+    uint32_t flags;
 };
 
 // read or write to the primary OSD (must be within individual stripe)
+// also used by OSD_OP_WRITE_ZEROES and OSD_OP_DISCARD which don't carry data:
+// - WRITE_ZEROES makes the range read as zeroes
+// - DISCARD makes the range read as zeroes or as data of the parent layer, if any
+// whole objects are deleted when it's allowed, other ranges are overwritten with zeroes
+// by the primary OSD itself, DISCARD also clears their bitmap bits in replicated pools.
+// OSDs supporting them report "write_zeroes" in OSD_OP_SHOW_CONFIG
 struct __attribute__((__packed__)) osd_op_rw_t
 {
     osd_op_header_t header;
@@ -193,7 +241,7 @@ struct __attribute__((__packed__)) osd_op_rw_t
     uint64_t offset;
     // length
     uint32_t len;
-    // flags (for future)
+    // flags (OSD_OP_FLAG_*)
     uint32_t flags;
     // inode metadata revision
     uint64_t meta_revision;
@@ -210,6 +258,13 @@ struct __attribute__((__packed__)) osd_reply_rw_t
     uint32_t pad0;
     // for reads: object version
     uint64_t version;
+    // for reads with OSD_OP_FLAG_READ_LEASE: clean read lease duration in milliseconds
+    // (0 if not granted), counted from the moment when the request was sent.
+    // While the lease is valid, the client may read any object of the PG
+    // directly from any of lease_osds using OSD_OP_SEC_READ
+    uint32_t lease_ms;
+    uint32_t lease_osd_count;
+    osd_num_t lease_osds[OSD_READ_LEASE_MAX_OSDS];
 };
 
 // sync to the primary OSD
@@ -223,6 +278,27 @@ struct __attribute__((__packed__)) osd_reply_sync_t
     osd_reply_header_t header;
 };
 
+// batch of requests and/or replies without data, sent only to peers which
+// report "msg_batch" support in OSD_OP_SHOW_CONFIG. followed by <len> bytes
+// of <count> entries, each entry is 1 byte of header length and the header
+// itself with trailing zero bytes removed
+struct __attribute__((__packed__)) osd_op_batch_t
+{
+    osd_op_header_t header;
+    // number of entries
+    uint32_t count;
+    // length of entries in bytes
+    uint32_t len;
+};
+
+// trace ID of a sampled operation, placed at the end of any request header.
+// the end of the header must not be used by other request types
+struct __attribute__((__packed__)) osd_op_trace_t
+{
+    uint8_t pad0[OSD_PACKET_SIZE-8];
+    uint64_t trace_id;
+};
+
 // FIXME it would be interesting to try to unify blockstore_op and osd_op formats
 union osd_any_op_t
 {
@@ -232,10 +308,13 @@ union osd_any_op_t
     osd_op_sec_sync_t sec_sync;
     osd_op_sec_stab_t sec_stab;
     osd_op_sec_read_bmp_t sec_read_bmp;
+    osd_op_sec_read_multi_t sec_read_multi;
     osd_op_sec_list_t sec_list;
     osd_op_show_config_t show_conf;
     osd_op_rw_t rw;
     osd_op_sync_t sync;
+    osd_op_batch_t batch;
+    osd_op_trace_t trace;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
@@ -247,6 +326,7 @@ union osd_any_reply_t
     osd_reply_sec_sync_t sec_sync;
     osd_reply_sec_stab_t sec_stab;
     osd_reply_sec_read_bmp_t sec_read_bmp;
+    osd_reply_sec_read_multi_t sec_read_multi;
     osd_reply_sec_list_t sec_list;
     osd_reply_show_config_t show_conf;
     osd_reply_rw_t rw;
@@ -162,7 +162,18 @@ void osd_t::reset_pg(pg_t & pg)
 void osd_t::start_pg_peering(pg_t & pg)
 {
     pg.state = PG_PEERING;
+    // Clients may still read from the old OSD set until their read leases expire
+    pg.write_fence_until = pg.read_lease_until;
     this->peering_state |= OSD_PEERING_PGS;
+    // Data from batched recovery reads may become outdated
+    for (auto & rp: recovery_ops)
+    {
+        if (INODE_POOL(rp.first.inode) == pg.pool_id &&
+            map_to_pg(rp.first, st_cli.pool_config.at(pg.pool_id).pg_stripe_size) == pg.pg_num)
+        {
+            drop_recovery_prefetch(&rp.second);
+        }
+    }
     reset_pg(pg);
     report_pg_state(pg);
     // Drop connections of clients who have this PG in dirty_pgs
@@ -296,6 +307,7 @@ void osd_t::start_pg_peering(pg_t & pg)
         pg.peering_state->pool_id = pg.pool_id;
         pg.peering_state->pg_num = pg.pg_num;
     }
+    pg.peering_state->keep_lists = pg_log_size > 0;
     for (osd_num_t peer_osd: cur_peers)
     {
         if (pg.peering_state->list_ops.find(peer_osd) != pg.peering_state->list_ops.end() ||
@@ -310,9 +322,34 @@ void osd_t::start_pg_peering(pg_t & pg)
 
 void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
 {
+    // Object list of this OSD saved during the previous peering, if any
+    pg_prev_list_t *prev = NULL;
+    if (ps->keep_lists)
+    {
+        auto & pg = pgs.at({ .pool_id = ps->pool_id, .pg_num = ps->pg_num });
+        auto prev_it = pg.prev_lists.find(role_osd);
+        if (prev_it != pg.prev_lists.end())
+            prev = &prev_it->second;
+    }
     if (role_osd == this->osd_num)
     {
         // Self
+        pg_list_result_t delta;
+        if (prev && prev->log_instance == pg_log_instance &&
+            list_pg_delta(ps->pool_id, ps->pg_num, pg_counts[ps->pool_id],
+                st_cli.pool_config[ps->pool_id].pg_stripe_size, prev->log_pos, delta))
+        {
+            printf(
+                "[PG %u/%u] Got changed object list from OSD %lu (local): %lu object versions\n",
+                ps->pool_id, ps->pg_num, role_osd, delta.total_count
+            );
+            pg_apply_list_delta(*prev, delta, ps->list_results[role_osd]);
+            pgs.at({ .pool_id = ps->pool_id, .pg_num = ps->pg_num }).prev_lists.erase(role_osd);
+            return;
+        }
+        uint64_t log_pos = 0;
+        bool has_log = get_pg_log_pos(ps->pool_id, ps->pg_num, pg_counts[ps->pool_id],
+            st_cli.pool_config[ps->pool_id].pg_stripe_size, &log_pos);
         osd_op_t *op = new osd_op_t();
         op->op_type = 0;
         op->peer_fd = SELF_FD;
@@ -324,7 +361,7 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
         op->bs_op->version = ((uint64_t)(ps->pool_id+1) << (64 - POOL_ID_BITS)) - 1;
         op->bs_op->len = pg_counts[ps->pool_id];
         op->bs_op->offset = ps->pg_num-1;
-        op->bs_op->callback = [this, ps, op, role_osd](blockstore_op_t *bs_op)
+        op->bs_op->callback = [this, ps, op, role_osd, has_log, log_pos](blockstore_op_t *bs_op)
         {
             if (op->bs_op->retval < 0)
             {
@@ -341,6 +378,8 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 .buf = (obj_ver_id*)op->bs_op->buf,
                 .total_count = (uint64_t)op->bs_op->retval,
                 .stable_count = op->bs_op->version,
+                .log_instance = has_log ? pg_log_instance : 0,
+                .log_pos = log_pos,
             };
             ps->list_ops.erase(role_osd);
             delete op->bs_op;
@@ -368,6 +407,8 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 .pg_stripe_size = st_cli.pool_config[ps->pool_id].pg_stripe_size,
                 .min_inode = ((uint64_t)(ps->pool_id) << (64 - POOL_ID_BITS)),
                 .max_inode = ((uint64_t)(ps->pool_id+1) << (64 - POOL_ID_BITS)) - 1,
+                .log_instance = prev ? prev->log_instance : 0,
+                .log_pos = prev ? prev->log_pos : 0,
             },
         };
         op->callback = [this, ps, role_osd](osd_op_t *op)
@@ -381,15 +422,43 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 msgr.stop_client(fail_fd);
                 return;
             }
-            printf(
-                "[PG %u/%u] Got object list from OSD %lu: %ld object versions (%lu of them stable)\n",
-                ps->pool_id, ps->pg_num, role_osd, op->reply.hdr.retval, op->reply.sec_list.stable_count
-            );
-            ps->list_results[role_osd] = {
+            pg_list_result_t res = {
                 .buf = (obj_ver_id*)op->buf,
                 .total_count = (uint64_t)op->reply.hdr.retval,
                 .stable_count = op->reply.sec_list.stable_count,
+                .log_instance = op->reply.sec_list.log_instance,
+                .log_pos = op->reply.sec_list.log_pos,
             };
+            auto & pg = pgs.at({ .pool_id = ps->pool_id, .pg_num = ps->pg_num });
+            auto prev_it = pg.prev_lists.find(role_osd);
+            if (op->reply.sec_list.flags & OSD_LIST_DELTA)
+            {
+                if (prev_it == pg.prev_lists.end() || prev_it->second.log_instance != op->reply.sec_list.log_instance)
+                {
+                    printf("Got unexpected incremental object list from OSD %lu, disconnecting peer\n", role_osd);
+                    int fail_fd = op->peer_fd;
+                    ps->list_ops.erase(role_osd);
+                    delete op;
+                    msgr.stop_client(fail_fd);
+                    return;
+                }
+                printf(
+                    "[PG %u/%u] Got changed object list from OSD %lu: %ld object versions\n",
+                    ps->pool_id, ps->pg_num, role_osd, op->reply.hdr.retval
+                );
+                pg_apply_list_delta(prev_it->second, res, ps->list_results[role_osd]);
+                pg.prev_lists.erase(prev_it);
+            }
+            else
+            {
+                if (prev_it != pg.prev_lists.end())
+                    pg.prev_lists.erase(prev_it);
+                printf(
+                    "[PG %u/%u] Got object list from OSD %lu: %ld object versions (%lu of them stable)\n",
+                    ps->pool_id, ps->pg_num, role_osd, op->reply.hdr.retval, op->reply.sec_list.stable_count
+                );
+                ps->list_results[role_osd] = res;
+            }
             // set op->buf to NULL so it doesn't get freed
             op->buf = NULL;
             ps->list_ops.erase(role_osd);
@@ -466,6 +535,35 @@ bool osd_t::stop_pg(pg_t & pg)
 
 void osd_t::finish_stop_pg(pg_t & pg)
 {
+    uint64_t now = get_time_ms();
+    if (pg.read_lease_until > now)
+    {
+        // Don't release the PG until all read leases expire, otherwise another
+        // primary could accept writes while clients still read from our OSD set
+        pg.state = PG_STOPPING;
+        if (!pg.stop_on_lease_expiry)
+        {
+            pg.stop_on_lease_expiry = true;
+            report_pg_state(pg);
+            pool_pg_num_t pg_id = { .pool_id = pg.pool_id, .pg_num = pg.pg_num };
+            tfd->set_timer(pg.read_lease_until - now, false, [this, pg_id](int timer_id)
+            {
+                auto pg_it = pgs.find(pg_id);
+                if (pg_it != pgs.end() && pg_it->second.stop_on_lease_expiry)
+                {
+                    pg_it->second.stop_on_lease_expiry = false;
+                    if ((pg_it->second.state & PG_STOPPING) && pg_it->second.inflight == 0 &&
+                        !pg_it->second.flush_batch)
+                    {
+                        finish_stop_pg(pg_it->second);
+                    }
+                }
+            });
+        }
+        return;
+    }
+    pg.stop_on_lease_expiry = false;
+    pg.read_lease_until = 0;
     pg.state = PG_OFFLINE;
     reset_pg(pg);
     report_pg_state(pg);
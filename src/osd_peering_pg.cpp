@@ -1,7 +1,9 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+#include <string.h>
 #include <unordered_map>
+#include "malloc_or_die.h"
 #include "osd_peering_pg.h"
 
 struct obj_ver_role
@@ -27,6 +29,114 @@ inline bool operator < (const obj_ver_role & a, const obj_ver_role & b)
     );
 }
 
+// Listings are merged without copying them into one big array. Each part of each
+// listing (stable or unstable) is split into runs already sorted in the order above
+// which are then merged using a heap. A part with too many runs is just sorted in place
+#define PG_LIST_MAX_RUNS 16
+
+struct pg_list_run_t
+{
+    obj_ver_id *pos, *end;
+    osd_num_t osd_num;
+    bool is_stable;
+    obj_ver_role cur;
+};
+
+struct pg_list_merger_t
+{
+    std::vector<pg_list_run_t> runs;
+    std::vector<int> heap;
+    uint64_t max_epoch = 0;
+
+    void add_part(obj_ver_id *start, obj_ver_id *end, osd_num_t osd_num, bool is_stable);
+    void start();
+    bool next(obj_ver_role & ov);
+};
+
+static inline obj_ver_role to_role(obj_ver_id *ov, osd_num_t osd_num, bool is_stable)
+{
+    return (obj_ver_role){
+        .oid = ov->oid,
+        .version = ov->version,
+        .osd_num = osd_num,
+        .is_stable = is_stable,
+    };
+}
+
+void pg_list_merger_t::add_part(obj_ver_id *start, obj_ver_id *end, osd_num_t osd_num, bool is_stable)
+{
+    if (start >= end)
+    {
+        return;
+    }
+    std::vector<obj_ver_id*> run_starts;
+    run_starts.push_back(start);
+    for (obj_ver_id *ov = start; ov < end; ov++)
+    {
+        if ((ov->version >> (64-PG_EPOCH_BITS)) > max_epoch)
+        {
+            max_epoch = (ov->version >> (64-PG_EPOCH_BITS));
+        }
+        if (ov > start && to_role(ov, osd_num, is_stable) < to_role(ov-1, osd_num, is_stable))
+        {
+            run_starts.push_back(ov);
+        }
+    }
+    if (run_starts.size() > PG_LIST_MAX_RUNS)
+    {
+        // Listing buffers belong to us, so it's OK to reorder them
+        std::sort(start, end, [osd_num, is_stable](obj_ver_id & a, obj_ver_id & b)
+        {
+            return to_role(&a, osd_num, is_stable) < to_role(&b, osd_num, is_stable);
+        });
+        run_starts.resize(1);
+    }
+    for (int i = 0; i < run_starts.size(); i++)
+    {
+        runs.push_back((pg_list_run_t){
+            .pos = run_starts[i],
+            .end = i < run_starts.size()-1 ? run_starts[i+1] : end,
+            .osd_num = osd_num,
+            .is_stable = is_stable,
+        });
+    }
+}
+
+void pg_list_merger_t::start()
+{
+    auto cmp = [this](int a, int b) { return runs[b].cur < runs[a].cur; };
+    heap.clear();
+    for (int i = 0; i < runs.size(); i++)
+    {
+        runs[i].cur = to_role(runs[i].pos, runs[i].osd_num, runs[i].is_stable);
+        heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), cmp);
+}
+
+bool pg_list_merger_t::next(obj_ver_role & ov)
+{
+    if (!heap.size())
+    {
+        return false;
+    }
+    auto cmp = [this](int a, int b) { return runs[b].cur < runs[a].cur; };
+    std::pop_heap(heap.begin(), heap.end(), cmp);
+    auto & run = runs[heap.back()];
+    ov = run.cur;
+    run.pos++;
+    if (run.pos < run.end)
+    {
+        run.cur = to_role(run.pos, run.osd_num, run.is_stable);
+        std::push_heap(heap.begin(), heap.end(), cmp);
+    }
+    else
+    {
+        heap.pop_back();
+    }
+    return true;
+}
+
 struct obj_piece_ver_t
 {
     uint64_t max_ver = 0;
@@ -38,6 +148,8 @@ struct pg_obj_state_check_t
 {
     pg_t *pg;
     bool replicated = false;
+    pg_list_merger_t merger;
+    // versions of the current object
     std::vector<obj_ver_role> list;
     int list_pos;
     int obj_start = 0, obj_end = 0, ver_start = 0, ver_end = 0;
@@ -48,6 +160,7 @@ struct pg_obj_state_check_t
     uint64_t n_copies = 0, has_roles = 0, n_roles = 0, n_stable = 0, n_mismatched = 0;
     uint64_t n_unstable = 0, n_invalid = 0;
     pg_osd_set_t osd_set;
+    std::map<pg_osd_set_t, pg_osd_set_state_t>::iterator last_it;
     int log_level;
 
     void walk();
@@ -61,23 +174,32 @@ void pg_obj_state_check_t::walk()
     pg->clean_count = 0;
     pg->total_count = 0;
     pg->state = 0;
-    for (list_pos = 0; list_pos < list.size(); list_pos++)
+    merger.start();
+    obj_ver_role ov;
+    bool has_next;
+    do
     {
-        if (oid.inode != list[list_pos].oid.inode ||
-            oid.stripe != (list[list_pos].oid.stripe & ~STRIPE_MASK))
+        has_next = merger.next(ov);
+        if (list.size() && (!has_next || list[0].oid.inode != ov.oid.inode ||
+            (list[0].oid.stripe & ~STRIPE_MASK) != (ov.oid.stripe & ~STRIPE_MASK)))
         {
-            if (oid.inode != 0)
+            // Only versions of one object are kept in memory at a time
+            for (list_pos = 0; list_pos < list.size(); list_pos++)
             {
-                finish_object();
+                if (!list_pos)
+                {
+                    start_object();
+                }
+                handle_version();
             }
-            start_object();
+            finish_object();
+            list.clear();
         }
-        handle_version();
-    }
-    if (oid.inode != 0)
-    {
-        finish_object();
-    }
+        if (has_next)
+        {
+            list.push_back(ov);
+        }
+    } while (has_next);
     if (pg->state & PG_HAS_INVALID)
     {
         // Stop PGs with "invalid" objects
@@ -314,7 +436,7 @@ void pg_obj_state_check_t::finish_object()
     }
     if (target_ver < max_ver)
     {
-        pg->ver_override[oid] = target_ver;
+        pg->ver_override.insert(pg->ver_override.end(), { oid, target_ver });
     }
     if (state == 0)
     {
@@ -322,7 +444,9 @@ void pg_obj_state_check_t::finish_object()
     }
     else
     {
-        auto it = pg->state_dict.find(osd_set);
+        // Objects with the same OSD set usually come in series, so check the last one first
+        auto it = last_it != pg->state_dict.end() && !(last_it->first < osd_set) && !(osd_set < last_it->first)
+            ? last_it : pg->state_dict.find(osd_set);
         if (it == pg->state_dict.end())
         {
             std::vector<uint64_t> read_target;
@@ -368,17 +492,19 @@ void pg_obj_state_check_t::finish_object()
         {
             it->second.object_count++;
         }
+        last_it = it;
+        // Objects come in ascending order, so always insert them at the end
         if (state & OBJ_INCOMPLETE)
         {
-            pg->incomplete_objects[oid] = &it->second;
+            pg->incomplete_objects.insert(pg->incomplete_objects.end(), { oid, &it->second });
         }
         else if (state & OBJ_DEGRADED)
         {
-            pg->degraded_objects[oid] = &it->second;
+            pg->degraded_objects.insert(pg->degraded_objects.end(), { oid, &it->second });
         }
         else
         {
-            pg->misplaced_objects[oid] = &it->second;
+            pg->misplaced_objects.insert(pg->misplaced_objects.end(), { oid, &it->second });
         }
     }
 }
@@ -386,42 +512,50 @@ void pg_obj_state_check_t::finish_object()
 // FIXME: Write at least some tests for this function
 void pg_t::calc_object_states(int log_level)
 {
-    // Copy all object lists into one array
+    // Merge all object lists
     pg_obj_state_check_t st;
     st.log_level = log_level;
     st.pg = this;
     st.replicated = (this->scheme == POOL_SCHEME_REPLICATED);
+    st.last_it = state_dict.end();
     auto ps = peering_state;
-    epoch = 0;
-    for (auto it: ps->list_results)
+    for (auto & it: ps->list_results)
     {
         auto nstab = it.second.stable_count;
         auto n = it.second.total_count;
-        auto osd_num = it.first;
-        uint64_t start = st.list.size();
-        st.list.resize(start + n);
-        obj_ver_id *ov = it.second.buf;
-        for (uint64_t i = 0; i < n; i++, ov++)
+        if (ps->keep_lists && it.second.log_instance)
         {
-            if ((ov->version >> (64-PG_EPOCH_BITS)) > epoch)
-            {
-                epoch = (ov->version >> (64-PG_EPOCH_BITS));
-            }
-            st.list[start+i] = {
-                .oid = ov->oid,
-                .version = ov->version,
-                .osd_num = osd_num,
-                .is_stable = i < nstab,
-            };
+            // Remember the list to only re-list changed objects during the next peering
+            auto & prev = prev_lists[it.first];
+            prev.list.assign(it.second.buf, it.second.buf + n);
+            prev.stable_count = nstab;
+            prev.log_instance = it.second.log_instance;
+            prev.log_pos = it.second.log_pos;
         }
+        else
+        {
+            prev_lists.erase(it.first);
+        }
+        st.merger.add_part(it.second.buf, it.second.buf + nstab, it.first, true);
+        st.merger.add_part(it.second.buf + nstab, it.second.buf + n, it.first, false);
+    }
+    for (auto prev_it = prev_lists.begin(); prev_it != prev_lists.end(); )
+    {
+        // Forget lists of OSDs which are no longer peers of this PG
+        if (!ps->keep_lists || std::find(all_peers.begin(), all_peers.end(), prev_it->first) == all_peers.end())
+            prev_lists.erase(prev_it++);
+        else
+            prev_it++;
+    }
+    // Walk over merged lists and check object states
+    st.walk();
+    epoch = st.merger.max_epoch;
+    for (auto & it: ps->list_results)
+    {
         free(it.second.buf);
         it.second.buf = NULL;
     }
     ps->list_results.clear();
-    // Sort
-    std::sort(st.list.begin(), st.list.end());
-    // Walk over it and check object states
-    st.walk();
     if (this->state != PG_ACTIVE)
     {
         assert(epoch != (((uint64_t)1 << PG_EPOCH_BITS)-1));
@@ -474,3 +608,54 @@ void pg_t::print_state()
         total_count
     );
 }
+
+// Apply an incremental object list (OSD_LIST_DELTA) to the list from the previous peering
+// Delta's stable part contains exactly one entry for each changed object, with version 0
+// if the object has no stable version. <prev> is consumed, <delta> buffer is freed
+void pg_apply_list_delta(pg_prev_list_t & prev, pg_list_result_t & delta, pg_list_result_t & result)
+{
+    std::vector<object_id> changed;
+    changed.reserve(delta.stable_count);
+    for (uint64_t i = 0; i < delta.stable_count; i++)
+    {
+        changed.push_back(delta.buf[i].oid);
+    }
+    std::sort(changed.begin(), changed.end());
+    std::vector<obj_ver_id> stable, unstable;
+    stable.reserve(prev.stable_count + delta.stable_count);
+    for (uint64_t i = 0; i < prev.list.size(); i++)
+    {
+        auto & ov = prev.list[i];
+        if (!std::binary_search(changed.begin(), changed.end(), ov.oid))
+        {
+            if (i < prev.stable_count)
+                stable.push_back(ov);
+            else
+                unstable.push_back(ov);
+        }
+    }
+    for (uint64_t i = 0; i < delta.total_count; i++)
+    {
+        auto & ov = delta.buf[i];
+        if (i >= delta.stable_count)
+            unstable.push_back(ov);
+        else if (ov.version != 0)
+            stable.push_back(ov);
+    }
+    std::sort(stable.begin(), stable.end());
+    std::sort(unstable.begin(), unstable.end());
+    result.total_count = stable.size() + unstable.size();
+    result.stable_count = stable.size();
+    result.buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * (result.total_count ? result.total_count : 1));
+    memcpy(result.buf, stable.data(), sizeof(obj_ver_id) * stable.size());
+    memcpy(result.buf + stable.size(), unstable.data(), sizeof(obj_ver_id) * unstable.size());
+    result.log_instance = delta.log_instance;
+    result.log_pos = delta.log_pos;
+    prev.list.clear();
+    prev.list.shrink_to_fit();
+    if (delta.buf)
+    {
+        free(delta.buf);
+        delta.buf = NULL;
+    }
+}
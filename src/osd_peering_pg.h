@@ -37,6 +37,16 @@ struct pg_list_result_t
     obj_ver_id *buf = NULL;
     uint64_t total_count;
     uint64_t stable_count;
+    // modification log instance and position of the listing on the peer OSD, 0 if unknown
+    uint64_t log_instance = 0, log_pos = 0;
+};
+
+// Object list of a peer OSD saved after peering to make the next peering incremental
+struct pg_prev_list_t
+{
+    std::vector<obj_ver_id> list;
+    uint64_t stable_count = 0;
+    uint64_t log_instance = 0, log_pos = 0;
 };
 
 struct osd_op_t;
@@ -48,6 +58,8 @@ struct pg_peering_state_t
     std::map<osd_num_t, pg_list_result_t> list_results;
     pool_id_t pool_id = 0;
     pg_num_t pg_num = 0;
+    // save object lists into pg_t::prev_lists after peering
+    bool keep_lists = false;
 };
 
 struct obj_piece_id_t
@@ -112,6 +124,13 @@ struct pg_t
     btree::btree_map<object_id, uint64_t> ver_override;
     pg_peering_state_t *peering_state = NULL;
     pg_flush_batch_t *flush_batch = NULL;
+    // object lists from the previous peering, for incremental peering
+    std::map<osd_num_t, pg_prev_list_t> prev_lists;
+
+    // clean read lease expiration time (ms). clients holding the lease may read
+    // directly from replicas, so writes are fenced until it expires if the PG is repeered
+    uint64_t read_lease_until = 0, write_fence_until = 0;
+    bool stop_on_lease_expiry = false;
 
     int inflight = 0; // including write_queue
     std::multimap<object_id, osd_op_t*> write_queue;
@@ -120,6 +139,8 @@ struct pg_t
     void print_state();
 };
 
+void pg_apply_list_delta(pg_prev_list_t & prev, pg_list_result_t & delta, pg_list_result_t & result);
+
 inline bool operator < (const pg_obj_loc_t &a, const pg_obj_loc_t &b)
 {
     return a.outdated < b.outdated ||
@@ -3,10 +3,150 @@
 
 #define _LARGEFILE64_SOURCE
 
+#include <assert.h>
+#include <string.h>
+#include <time.h>
 #include "malloc_or_die.h"
 #include "osd_peering_pg.h"
 #define STRIPE_SHIFT 12
 
+void test_list_delta()
+{
+    // Previous list: objects 1..4 stable, object 3 also has an unstable version
+    pg_prev_list_t prev = {
+        .list = {
+            { .oid = { .inode = 1, .stripe = 1 << STRIPE_SHIFT }, .version = 1 },
+            { .oid = { .inode = 1, .stripe = 2 << STRIPE_SHIFT }, .version = 1 },
+            { .oid = { .inode = 1, .stripe = 3 << STRIPE_SHIFT }, .version = 1 },
+            { .oid = { .inode = 1, .stripe = 4 << STRIPE_SHIFT }, .version = 1 },
+            { .oid = { .inode = 1, .stripe = 3 << STRIPE_SHIFT }, .version = 2 },
+        },
+        .stable_count = 4,
+        .log_instance = 1,
+        .log_pos = 10,
+    };
+    // Delta: object 2 deleted, object 3 stabilized, object 5 created as unstable
+    pg_list_result_t delta = {
+        .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * 4),
+        .total_count = 4,
+        .stable_count = 3,
+        .log_instance = 1,
+        .log_pos = 15,
+    };
+    delta.buf[0] = { .oid = { .inode = 1, .stripe = 5 << STRIPE_SHIFT }, .version = 0 };
+    delta.buf[1] = { .oid = { .inode = 1, .stripe = 2 << STRIPE_SHIFT }, .version = 0 };
+    delta.buf[2] = { .oid = { .inode = 1, .stripe = 3 << STRIPE_SHIFT }, .version = 2 };
+    delta.buf[3] = { .oid = { .inode = 1, .stripe = 5 << STRIPE_SHIFT }, .version = 1 };
+    pg_list_result_t r;
+    pg_apply_list_delta(prev, delta, r);
+    assert(!delta.buf);
+    assert(r.total_count == 4 && r.stable_count == 3 && r.log_pos == 15);
+    assert(r.buf[0].oid.stripe == (1 << STRIPE_SHIFT) && r.buf[0].version == 1);
+    assert(r.buf[1].oid.stripe == (3 << STRIPE_SHIFT) && r.buf[1].version == 2);
+    assert(r.buf[2].oid.stripe == (4 << STRIPE_SHIFT) && r.buf[2].version == 1);
+    assert(r.buf[3].oid.stripe == (5 << STRIPE_SHIFT) && r.buf[3].version == 1);
+    free(r.buf);
+    printf("OK test_list_delta\n");
+}
+
+static pg_list_result_t make_list(std::vector<obj_ver_id> stable, std::vector<obj_ver_id> unstable)
+{
+    pg_list_result_t r = {
+        .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * (stable.size() + unstable.size() + 1)),
+        .total_count = stable.size() + unstable.size(),
+        .stable_count = stable.size(),
+    };
+    memcpy(r.buf, stable.data(), sizeof(obj_ver_id) * stable.size());
+    memcpy(r.buf + stable.size(), unstable.data(), sizeof(obj_ver_id) * unstable.size());
+    return r;
+}
+
+void test_object_states()
+{
+    pg_t pg = {
+        .state = PG_PEERING,
+        .scheme = POOL_SCHEME_REPLICATED,
+        .pg_cursize = 3,
+        .pg_size = 3,
+        .pg_minsize = 2,
+        .pg_data_size = 1,
+        .pg_num = 1,
+        .target_set = { 1, 2, 3 },
+        .cur_set = { 1, 2, 3 },
+        .peering_state = new pg_peering_state_t(),
+    };
+    // Objects 1..4, object 0 is listed after them like a dirty stable entry
+    object_id o[5];
+    for (int i = 0; i < 5; i++)
+        o[i] = { .inode = 1, .stripe = (uint64_t)i << STRIPE_SHIFT };
+    // 0 and 1 are clean, 2 is degraded, 3 is misplaced, 4 has an unstable version on OSD 1
+    pg.peering_state->list_results[1] = make_list(
+        { { o[1], 1 }, { o[2], 1 }, { o[3], 1 }, { o[4], 1 }, { o[0], 1 } }, { { o[4], 2 } });
+    pg.peering_state->list_results[2] = make_list(
+        { { o[1], 1 }, { o[2], 1 }, { o[3], 1 }, { o[4], 1 }, { o[0], 1 } }, {});
+    pg.peering_state->list_results[3] = make_list({ { o[1], 1 }, { o[4], 1 }, { o[0], 1 } }, {});
+    pg.peering_state->list_results[4] = make_list({ { o[3], 1 } }, {});
+    pg.calc_object_states(0);
+    assert(pg.total_count == 5 && pg.clean_count == 3);
+    assert(pg.degraded_objects.size() == 1 && pg.degraded_objects.begin()->first == o[2]);
+    assert(pg.misplaced_objects.size() == 1 && pg.misplaced_objects.begin()->first == o[3]);
+    assert(pg.incomplete_objects.size() == 0);
+    assert(pg.state_dict.size() == 2);
+    assert(pg.ver_override.size() == 1 && pg.ver_override[o[4]] == 1);
+    assert(pg.flush_actions.size() == 1);
+    auto & act = pg.flush_actions.begin()->second;
+    assert(pg.flush_actions.begin()->first.osd_num == 1 && act.rollback && act.rollback_to == 1);
+    assert(pg.state == (PG_ACTIVE | PG_HAS_DEGRADED | PG_HAS_MISPLACED | PG_HAS_UNCLEAN));
+    delete pg.peering_state;
+    printf("OK test_object_states\n");
+}
+
+// Synthetic benchmark: <count> objects on 3 OSDs, every 1000th object is degraded,
+// last 1/64 of each listing is appended out of order like dirty stable entries
+void bench_object_states(uint64_t count)
+{
+    pg_t pg = {
+        .state = PG_PEERING,
+        .scheme = POOL_SCHEME_REPLICATED,
+        .pg_cursize = 3,
+        .pg_size = 3,
+        .pg_minsize = 2,
+        .pg_data_size = 1,
+        .pg_num = 1,
+        .target_set = { 1, 2, 3 },
+        .cur_set = { 1, 2, 3 },
+        .peering_state = new pg_peering_state_t(),
+    };
+    uint64_t tail = count/64;
+    for (uint64_t osd_num = 1; osd_num <= 3; osd_num++)
+    {
+        pg_list_result_t r = {
+            .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * count),
+        };
+        uint64_t n = 0;
+        for (uint64_t j = 0; j < count; j++)
+        {
+            uint64_t i = j < count-tail ? tail+j : j-(count-tail);
+            if (osd_num == 3 && !(i % 1000))
+                continue;
+            r.buf[n++] = { .oid = { .inode = 1, .stripe = i << STRIPE_SHIFT }, .version = 1 };
+        }
+        r.total_count = r.stable_count = n;
+        pg.peering_state->list_results[osd_num] = r;
+    }
+    timespec tv_begin, tv_end;
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+    pg.calc_object_states(0);
+    clock_gettime(CLOCK_MONOTONIC, &tv_end);
+    printf(
+        "calc_object_states: %lu objects in %.3f s, clean=%lu degraded=%lu\n", pg.total_count,
+        (tv_end.tv_sec - tv_begin.tv_sec) + (tv_end.tv_nsec - tv_begin.tv_nsec) / 1000000000.0,
+        pg.clean_count, pg.degraded_objects.size()
+    );
+    assert(pg.total_count == count && pg.degraded_objects.size() == (count+999)/1000);
+    delete pg.peering_state;
+}
+
 /**
  * TODO tests for object & pg state calculation.
  *
@@ -22,6 +162,14 @@
  */
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        // osd_peering_pg_test bench [objects]
+        bench_object_states(argc > 2 ? strtoull(argv[2], NULL, 10) : 32*1024*1024);
+        return 0;
+    }
+    test_list_delta();
+    test_object_states();
     pg_t pg = {
         .state = PG_PEERING,
         .pg_num = 1,
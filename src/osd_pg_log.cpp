@@ -0,0 +1,148 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "osd.h"
+
+// Per-PG modification logs. Each OSD remembers which objects were changed in each PG
+// in its local blockstore. A primary OSD which saved the object list of a peer during
+// the previous peering then only asks the peer for objects changed since that listing.
+// Logs are kept in memory, so the first peering after an OSD restart is always full.
+
+void osd_t::log_pg_modification(blockstore_op_t *bs_op)
+{
+    if (!pg_log_size)
+    {
+        return;
+    }
+    if (bs_op->opcode == BS_OP_WRITE || bs_op->opcode == BS_OP_WRITE_STABLE || bs_op->opcode == BS_OP_DELETE)
+    {
+        append_pg_log(bs_op->oid);
+    }
+    else if (bs_op->opcode == BS_OP_STABLE || bs_op->opcode == BS_OP_ROLLBACK)
+    {
+        obj_ver_id *ov = (obj_ver_id*)bs_op->buf;
+        for (uint32_t i = 0; i < bs_op->len; i++)
+        {
+            append_pg_log(ov[i].oid);
+        }
+    }
+    else if (bs_op->opcode == BS_OP_SYNC_STAB_ALL)
+    {
+        // Changes all objects at once
+        clear_pg_logs();
+    }
+}
+
+void osd_t::append_pg_log(object_id oid)
+{
+    pool_id_t pool_id = INODE_POOL(oid.inode);
+    auto pool_it = st_cli.pool_config.find(pool_id);
+    if (pool_it == st_cli.pool_config.end())
+    {
+        return;
+    }
+    uint64_t pg_stripe_size = pool_it->second.pg_stripe_size;
+    uint64_t pg_count = pg_counts[pool_id];
+    pg_num_t pg_num = map_to_pg(oid, pg_stripe_size);
+    auto log_it = pg_logs.find({ .pool_id = pool_id, .pg_num = pg_num });
+    if (log_it == pg_logs.end())
+    {
+        // New log of the current PG mapping
+        log_it = pg_logs.emplace((pool_pg_num_t){ .pool_id = pool_id, .pg_num = pg_num }, (osd_pg_log_t){}).first;
+        log_it->second.pg_count = pg_count;
+        log_it->second.pg_stripe_size = pg_stripe_size;
+    }
+    auto & log = log_it->second;
+    if (log.pg_count != pg_count || log.pg_stripe_size != pg_stripe_size)
+    {
+        // PG mapping has changed - objects were assigned to different logs before, so
+        // invalidate all logs of this pool without reusing their positions
+        for (auto log_it = pg_logs.lower_bound({ .pool_id = pool_id, .pg_num = 0 });
+            log_it != pg_logs.end() && log_it->first.pool_id == pool_id; log_it++)
+        {
+            log_it->second.first_pos += log_it->second.oids.size() + 1;
+            log_it->second.oids.clear();
+            log_it->second.pg_count = pg_count;
+            log_it->second.pg_stripe_size = pg_stripe_size;
+        }
+    }
+    log.oids.push_back(oid);
+    while (log.oids.size() > pg_log_size)
+    {
+        log.oids.pop_front();
+        log.first_pos++;
+    }
+}
+
+void osd_t::clear_pg_logs()
+{
+    for (auto & lp: pg_logs)
+    {
+        lp.second.first_pos += lp.second.oids.size() + 1;
+        lp.second.oids.clear();
+    }
+}
+
+// Get current position of the PG log to be returned with a full listing
+bool osd_t::get_pg_log_pos(pool_id_t pool_id, pg_num_t pg_num, uint64_t pg_count, uint64_t pg_stripe_size, uint64_t *log_pos)
+{
+    auto pool_it = st_cli.pool_config.find(pool_id);
+    if (!pg_log_size || pool_it == st_cli.pool_config.end() ||
+        pool_it->second.pg_stripe_size != pg_stripe_size || pg_counts[pool_id] != pg_count)
+    {
+        return false;
+    }
+    auto & log = pg_logs[{ .pool_id = pool_id, .pg_num = pg_num }];
+    if (log.pg_count != pg_count || log.pg_stripe_size != pg_stripe_size)
+    {
+        // New log
+        log.first_pos += log.oids.size() + 1;
+        log.oids.clear();
+        log.pg_count = pg_count;
+        log.pg_stripe_size = pg_stripe_size;
+    }
+    *log_pos = log.first_pos + log.oids.size();
+    return true;
+}
+
+// List objects changed since <log_pos> in the same format as OSD_OP_SEC_LIST with OSD_LIST_DELTA
+bool osd_t::list_pg_delta(pool_id_t pool_id, pg_num_t pg_num, uint64_t pg_count, uint64_t pg_stripe_size,
+    uint64_t log_pos, pg_list_result_t & res)
+{
+    auto pool_it = st_cli.pool_config.find(pool_id);
+    auto log_it = pg_logs.find({ .pool_id = pool_id, .pg_num = pg_num });
+    if (!pg_log_size || log_it == pg_logs.end() || pool_it == st_cli.pool_config.end() ||
+        pool_it->second.pg_stripe_size != pg_stripe_size)
+    {
+        return false;
+    }
+    auto & log = log_it->second;
+    if (log.pg_count != pg_count || log.pg_stripe_size != pg_stripe_size ||
+        pg_counts[pool_id] != pg_count || log_pos < log.first_pos || log_pos > log.first_pos + log.oids.size())
+    {
+        // Log is truncated or belongs to a different PG mapping
+        return false;
+    }
+    std::vector<object_id> changed(log.oids.begin() + (log_pos - log.first_pos), log.oids.end());
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    std::vector<obj_ver_id> unstable;
+    res.stable_count = changed.size();
+    res.buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * (changed.size() ? changed.size() : 1));
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        res.buf[i] = {
+            .oid = changed[i],
+            .version = bs->list_object(changed[i], unstable),
+        };
+    }
+    res.total_count = changed.size() + unstable.size();
+    if (unstable.size())
+    {
+        res.buf = (obj_ver_id*)realloc_or_die(res.buf, sizeof(obj_ver_id) * res.total_count);
+        memcpy(res.buf + changed.size(), unstable.data(), sizeof(obj_ver_id) * unstable.size());
+    }
+    res.log_instance = pg_log_instance;
+    res.log_pos = log.first_pos + log.oids.size();
+    return true;
+}
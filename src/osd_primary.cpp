@@ -52,6 +52,14 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
         finish_op(cur_op, -EINVAL);
         return false;
     }
+    if (cur_op->req.hdr.opcode != OSD_OP_READ && pg_it->second.write_fence_until &&
+        pg_it->second.write_fence_until > get_time_ms())
+    {
+        // Clients may still read from replicas of the previous epoch using their
+        // read leases, so writes are not allowed until all leases expire
+        finish_op(cur_op, -EPIPE);
+        return false;
+    }
     int stripe_count = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pg_it->second.pg_size);
     int chain_size = 0;
     if (cur_op->req.hdr.opcode == OSD_OP_READ && cur_op->req.rw.meta_revision > 0)
@@ -80,10 +88,10 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
             chain_size++;
         }
     }
-    osd_primary_op_data_t *op_data = (osd_primary_op_data_t*)calloc_or_die(
+    osd_primary_op_data_t *op_data = (osd_primary_op_data_t*)op_data_alloc(
         // Allocate:
         // - op_data
-        1, sizeof(osd_primary_op_data_t) +
+        sizeof(osd_primary_op_data_t) +
         // - stripes
         // - resulting bitmap buffers
         stripe_count * (clean_entry_bitmap_size + sizeof(osd_rmw_stripe_t)) +
@@ -203,7 +211,7 @@ void osd_t::continue_primary_read(osd_op_t *cur_op)
         if (pg.state == PG_ACTIVE || op_data->scheme == POOL_SCHEME_REPLICATED)
         {
             // Fast happy-path
-            cur_op->buf = alloc_read_buffer(op_data->stripes, op_data->pg_data_size, 0);
+            cur_op->buf = alloc_read_buffer(op_data->stripes, op_data->pg_data_size, 0, op_buf_alloc);
             submit_primary_subops(SUBMIT_RMW_READ, op_data->target_ver, op_data->prev_set, cur_op);
             op_data->st = 1;
         }
@@ -218,7 +226,7 @@ void osd_t::continue_primary_read(osd_op_t *cur_op)
             op_data->pg_size = pg.pg_size;
             op_data->scheme = pg.scheme;
             op_data->degraded = 1;
-            cur_op->buf = alloc_read_buffer(op_data->stripes, pg.pg_size, 0);
+            cur_op->buf = alloc_read_buffer(op_data->stripes, pg.pg_size, 0, op_buf_alloc);
             submit_primary_subops(SUBMIT_RMW_READ, op_data->target_ver, op_data->prev_set, cur_op);
             op_data->st = 1;
         }
@@ -263,9 +271,40 @@ resume_2:
         cur_op->iov.push_back(op_data->stripes[0].bmp_buf, cur_op->reply.rw.bitmap_len);
         cur_op->iov.push_back(cur_op->buf, cur_op->req.rw.len);
     }
+    if (cur_op->req.rw.flags & OSD_OP_FLAG_READ_LEASE)
+    {
+        auto pg_it = pgs.find({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
+        if (pg_it != pgs.end())
+            grant_read_lease(cur_op, pg_it->second);
+    }
     finish_op(cur_op, cur_op->req.rw.len);
 }
 
+// Allow the client to read from any OSD of a clean replicated PG for read_lease_ms
+// The lease is only granted when all OSDs of the PG are guaranteed to have the same data
+void osd_t::grant_read_lease(osd_op_t *cur_op, pg_t & pg)
+{
+    if (!read_lease_ms || pg.state != PG_ACTIVE || pg.scheme != POOL_SCHEME_REPLICATED ||
+        pg.ver_override.size() > 0 || pg.cur_set.size() > OSD_READ_LEASE_MAX_OSDS)
+    {
+        return;
+    }
+    int n = 0;
+    for (auto osd_num: pg.cur_set)
+    {
+        if (!osd_num)
+            return;
+        cur_op->reply.rw.lease_osds[n++] = osd_num;
+    }
+    cur_op->reply.rw.lease_osd_count = n;
+    cur_op->reply.rw.lease_ms = read_lease_ms;
+    // The client counts the lease from the moment it sent the request,
+    // so the OSD-side expiration time is always later than the client-side one
+    uint64_t until = get_time_ms() + read_lease_ms;
+    if (pg.read_lease_until < until)
+        pg.read_lease_until = until;
+}
+
 // Decrement pg_osd_set_state_t's object_count and change PG state accordingly
 void osd_t::remove_object_from_state(object_id & oid, pg_osd_set_state_t *object_state, pg_t & pg)
 {
@@ -332,6 +371,13 @@ void osd_t::continue_primary_del(osd_op_t *cur_op)
     // Delete is forbidden even in active PGs if they're also degraded or have previous dead OSDs
     if (pg.state & (PG_DEGRADED | PG_LEFT_ON_DEAD))
     {
+        if (op_data->zero_delete)
+        {
+            // Write zeroes instead
+            op_data->zero_delete = false;
+            continue_primary_write(cur_op);
+            return;
+        }
         finish_op(cur_op, -EBUSY);
         return;
     }
@@ -387,7 +433,7 @@ resume_5:
         free_object_state(pg, &op_data->object_state);
     }
     pg.total_count--;
-    cur_op->reply.hdr.retval = 0;
+    cur_op->reply.hdr.retval = op_data->zero_delete ? cur_op->req.rw.len : 0;
 continue_others:
     osd_op_t *next_op = NULL;
     auto next_it = pg.write_queue.find(op_data->oid);
@@ -30,6 +30,8 @@ struct osd_primary_op_data_t
     osd_op_t *subops = NULL;
     uint64_t *prev_set = NULL;
     pg_osd_set_state_t *object_state = NULL;
+    // WRITE_ZEROES or DISCARD of the whole object executed as a delete
+    bool zero_delete = false;
 
     union
     {
@@ -286,6 +286,7 @@ int osd_t::submit_bitmap_subops(osd_op_t *cur_op, pg_t & pg)
                     }
                     handle_primary_subop(subop, cur_op);
                 };
+                trace_subop(cur_op, subop, subop_osd_num);
                 auto peer_fd_it = msgr.osd_peer_fds.find(subop_osd_num);
                 if (peer_fd_it != msgr.osd_peer_fds.end())
                 {
@@ -433,7 +434,7 @@ int osd_t::submit_chained_read_requests(pg_t & pg, osd_op_t *cur_op)
             }
         }
     }
-    cur_op->buf = memalign_or_die(MEM_ALIGNMENT, read_buffer_size);
+    cur_op->buf = op_buf_alloc(read_buffer_size);
     void *cur_buf = cur_op->buf;
     for (int cri = 0; cri < chain_reads.size(); cri++)
     {
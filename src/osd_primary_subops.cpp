@@ -36,6 +36,8 @@ void osd_t::finish_op(osd_op_t *cur_op, int retval)
     inflight_ops--;
     if (cur_op->req.hdr.opcode == OSD_OP_READ ||
         cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+        cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES ||
+        cur_op->req.hdr.opcode == OSD_OP_DISCARD ||
         cur_op->req.hdr.opcode == OSD_OP_DELETE)
     {
         // Track inode statistics
@@ -74,9 +76,17 @@ void osd_t::finish_op(osd_op_t *cur_op, int retval)
             }
         }
         assert(!cur_op->op_data->subops);
-        free(cur_op->op_data);
+        op_data_free(cur_op->op_data);
         cur_op->op_data = NULL;
     }
+    uint64_t trace_id = osd_trace_id(cur_op->req);
+    if (trace_id)
+    {
+        bool primary = cur_op->req.hdr.opcode == OSD_OP_READ || cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+            cur_op->req.hdr.opcode == OSD_OP_SYNC || cur_op->req.hdr.opcode == OSD_OP_DELETE ||
+            cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES || cur_op->req.hdr.opcode == OSD_OP_DISCARD;
+        msgr.tracer.record(trace_id, primary ? OSD_TRACE_PRIMARY_REPLY : OSD_TRACE_SEC_REPLY, cur_op->req.hdr.opcode);
+    }
     if (!cur_op->peer_fd)
     {
         // Copy lambda to be unaffected by `delete op`
@@ -177,6 +187,7 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                     subop->bs_op->offset, subop->bs_op->len
                 );
 #endif
+                trace_subop(cur_op, subop, role_osd_num);
                 bs->enqueue_op(subop->bs_op);
             }
             else
@@ -224,10 +235,11 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                 {
                     handle_primary_subop(subop, cur_op);
                 };
+                trace_subop(cur_op, subop, role_osd_num);
                 auto peer_fd_it = msgr.osd_peer_fds.find(role_osd_num);
                 if (peer_fd_it != msgr.osd_peer_fds.end())
                 {
-                    subop->peer_fd = peer_fd_it->second;
+                    subop->peer_fd = msgr.object_peer_fd(role_osd_num, peer_fd_it->second, subop->req.sec_rw.oid);
                     msgr.outbox_push(subop);
                 }
                 else
@@ -257,6 +269,23 @@ static uint64_t bs_op_to_osd_op[] = {
     OSD_OP_TEST_SYNC_STAB_ALL,  // BS_OP_SYNC_STAB_ALL = 9
 };
 
+void osd_t::trace_subop(osd_op_t *cur_op, osd_op_t *subop, osd_num_t peer_osd)
+{
+    uint64_t trace_id = osd_trace_id(cur_op->req);
+    if (!subop->bs_op)
+    {
+        // Always overwrite the trace ID, subops aren't zero-initialized
+        subop->req.trace.trace_id = trace_id;
+        msgr.tracer.record(trace_id, OSD_TRACE_SUBOP_SEND, subop->req.hdr.opcode, peer_osd);
+    }
+    else if (trace_id && msgr.tracer.enabled())
+    {
+        subop->bs_op->trace_submit = true;
+        msgr.tracer.record(trace_id, OSD_TRACE_SUBOP_SEND, bs_op_to_osd_op[subop->bs_op->opcode], peer_osd);
+        msgr.tracer.record(trace_id, OSD_TRACE_BS_QUEUE, bs_op_to_osd_op[subop->bs_op->opcode]);
+    }
+}
+
 void osd_t::handle_primary_bs_subop(osd_op_t *subop)
 {
     osd_op_t *cur_op = (osd_op_t*)subop->op_type;
@@ -274,6 +303,13 @@ void osd_t::handle_primary_bs_subop(osd_op_t *subop)
         );
     }
     add_bs_subop_stats(subop);
+    log_pg_modification(bs_op);
+    uint64_t trace_id = osd_trace_id(cur_op->req);
+    if (trace_id && bs_op->submit_time_us)
+    {
+        msgr.tracer.record(trace_id, OSD_TRACE_BS_SUBMIT, bs_op_to_osd_op[bs_op->opcode], 0, bs_op->submit_time_us);
+    }
+    msgr.tracer.record(trace_id, OSD_TRACE_BS_COMPLETE, bs_op_to_osd_op[bs_op->opcode]);
     subop->req.hdr.opcode = bs_op_to_osd_op[bs_op->opcode];
     subop->reply.hdr.retval = bs_op->retval;
     if (bs_op->opcode == BS_OP_READ || bs_op->opcode == BS_OP_WRITE || bs_op->opcode == BS_OP_WRITE_STABLE)
@@ -316,6 +352,12 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
 {
     uint64_t opcode = subop->req.hdr.opcode;
     int retval = subop->reply.hdr.retval;
+    uint64_t trace_id = osd_trace_id(cur_op->req);
+    if (trace_id && msgr.tracer.enabled())
+    {
+        auto cl_it = msgr.clients.find(subop->peer_fd);
+        msgr.tracer.record(trace_id, OSD_TRACE_SUBOP_REPLY, opcode, cl_it != msgr.clients.end() ? cl_it->second->osd_num : osd_num);
+    }
     int expected;
     if (opcode == OSD_OP_SEC_READ || opcode == OSD_OP_SEC_WRITE || opcode == OSD_OP_SEC_WRITE_STABLE)
         expected = subop->req.sec_rw.len;
@@ -388,7 +430,8 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
         {
             continue_primary_read(cur_op);
         }
-        else if (cur_op->req.hdr.opcode == OSD_OP_WRITE)
+        else if (cur_op->req.hdr.opcode == OSD_OP_WRITE || cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES ||
+            cur_op->req.hdr.opcode == OSD_OP_DISCARD)
         {
             continue_primary_write(cur_op);
         }
@@ -491,6 +534,7 @@ void osd_t::submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_
                 .oid = chunk.oid,
                 .version = chunk.version,
             });
+            trace_subop(cur_op, &subops[i], chunk.osd_num);
             bs->enqueue_op(subops[i].bs_op);
         }
         else
@@ -509,10 +553,11 @@ void osd_t::submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_
             {
                 handle_primary_subop(subop, cur_op);
             };
+            trace_subop(cur_op, &subops[i], chunk.osd_num);
             auto peer_fd_it = msgr.osd_peer_fds.find(chunk.osd_num);
             if (peer_fd_it != msgr.osd_peer_fds.end())
             {
-                subops[i].peer_fd = peer_fd_it->second;
+                subops[i].peer_fd = msgr.object_peer_fd(chunk.osd_num, peer_fd_it->second, chunk.oid);
                 msgr.outbox_push(&subops[i]);
             }
             else
@@ -549,6 +594,7 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
                     handle_primary_bs_subop(subop);
                 },
             });
+            trace_subop(cur_op, &subops[i], sync_osd);
             bs->enqueue_op(subops[i].bs_op);
         }
         else if ((peer_it = msgr.osd_peer_fds.find(sync_osd)) != msgr.osd_peer_fds.end())
@@ -566,6 +612,7 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
             {
                 handle_primary_subop(subop, cur_op);
             };
+            trace_subop(cur_op, &subops[i], sync_osd);
             msgr.outbox_push(&subops[i]);
         }
         else
@@ -606,6 +653,7 @@ void osd_t::submit_primary_stab_subops(osd_op_t *cur_op)
                 .len = (uint32_t)stab_osd.len,
                 .buf = (void*)(op_data->unstable_writes + stab_osd.start),
             });
+            trace_subop(cur_op, &subops[i], stab_osd.osd_num);
             bs->enqueue_op(subops[i].bs_op);
         }
         else
@@ -624,6 +672,7 @@ void osd_t::submit_primary_stab_subops(osd_op_t *cur_op)
             {
                 handle_primary_subop(subop, cur_op);
             };
+            trace_subop(cur_op, &subops[i], stab_osd.osd_num);
             auto peer_fd_it = msgr.osd_peer_fds.find(stab_osd.osd_num);
             if (peer_fd_it != msgr.osd_peer_fds.end())
             {
@@ -8,7 +8,7 @@ void osd_t::continue_primary_sync(osd_op_t *cur_op)
 {
     if (!cur_op->op_data)
     {
-        cur_op->op_data = (osd_primary_op_data_t*)calloc_or_die(1, sizeof(osd_primary_op_data_t));
+        cur_op->op_data = (osd_primary_op_data_t*)op_data_alloc(sizeof(osd_primary_op_data_t));
     }
     osd_primary_op_data_t *op_data = cur_op->op_data;
     if (op_data->st == 1)      goto resume_1;
@@ -249,7 +249,18 @@ finish:
         {
             auto it = msgr.clients.find(cur_op->peer_fd);
             if (it != msgr.clients.end())
+            {
                 it->second->dirty_pgs.clear();
+                if (it->second->conn_group)
+                {
+                    // Writes may come through any of the client's parallel connections
+                    for (auto & cp: msgr.clients)
+                    {
+                        if (cp.second->conn_group == it->second->conn_group)
+                            cp.second->dirty_pgs.clear();
+                    }
+                }
+            }
         }
         finish_op(cur_op, 0);
     }
@@ -7,6 +7,12 @@
 bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
+    auto rec_it = recovery_ops.find(op_data->oid);
+    if (rec_it != recovery_ops.end() && rec_it->second.osd_op != cur_op)
+    {
+        // Object is modified, so data from a batched recovery read becomes outdated
+        drop_recovery_prefetch(&rec_it->second);
+    }
     // Check if actions are pending for this object
     auto act_it = pg.flush_actions.lower_bound((obj_piece_id_t){
         .oid = op_data->oid,
@@ -31,6 +37,25 @@ bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
     return true;
 }
 
+// Use object data from a batched recovery read instead of reading it in a recovery write
+bool osd_t::take_recovery_prefetch(osd_op_t *cur_op)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    auto rec_it = recovery_ops.find(op_data->oid);
+    if (rec_it == recovery_ops.end() || rec_it->second.osd_op != cur_op || !rec_it->second.prefetch)
+    {
+        return false;
+    }
+    auto pf = rec_it->second.prefetch;
+    uint64_t i = rec_it->second.prefetch_idx;
+    memcpy(op_data->stripes[0].read_buf, pf->buf + i*bs_block_size, bs_block_size);
+    memcpy(op_data->stripes[0].bmp_buf, pf->buf + pf->count*(bs_block_size + 8) + i*clean_entry_bitmap_size, clean_entry_bitmap_size);
+    op_data->fact_ver = ((uint64_t*)(pf->buf + pf->count*bs_block_size))[i];
+    op_data->done = op_data->errors = op_data->errcode = 0;
+    drop_recovery_prefetch(&rec_it->second);
+    return true;
+}
+
 void osd_t::continue_primary_write(osd_op_t *cur_op)
 {
     if (!cur_op->op_data && !prepare_primary_rw(cur_op))
@@ -38,6 +63,12 @@ void osd_t::continue_primary_write(osd_op_t *cur_op)
         return;
     }
     osd_primary_op_data_t *op_data = cur_op->op_data;
+    if (cur_op->req.hdr.opcode == OSD_OP_DELETE || op_data->zero_delete)
+    {
+        // Deletes are also continued from the write queue
+        continue_primary_del(cur_op);
+        return;
+    }
     auto & pg = pgs.at({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
     if (op_data->st == 1)      goto resume_1;
     else if (op_data->st == 2) goto resume_2;
@@ -50,6 +81,25 @@ void osd_t::continue_primary_write(osd_op_t *cur_op)
     else if (op_data->st == 9) goto resume_9;
     else if (op_data->st == 10) goto resume_10;
     assert(op_data->st == 0);
+    if ((cur_op->req.hdr.opcode == OSD_OP_WRITE_ZEROES || cur_op->req.hdr.opcode == OSD_OP_DISCARD) && !cur_op->buf)
+    {
+        auto inode_it = st_cli.inode_config.find(op_data->oid.inode);
+        bool has_parent = inode_it != st_cli.inode_config.end() && inode_it->second.parent_id;
+        if (cur_op->req.rw.offset == op_data->oid.stripe &&
+            cur_op->req.rw.len == (uint64_t)bs_block_size*op_data->pg_data_size &&
+            !(pg.state & (PG_DEGRADED | PG_LEFT_ON_DEAD)) &&
+            (cur_op->req.hdr.opcode == OSD_OP_DISCARD || !has_parent))
+        {
+            // The whole object is zeroed or discarded, just delete it.
+            // Zeroed objects of layered inodes can't be deleted because it would expose parent data
+            op_data->zero_delete = true;
+            continue_primary_del(cur_op);
+            return;
+        }
+        // Zero the range here instead of receiving zeroes over the network
+        cur_op->buf = op_buf_alloc(cur_op->req.rw.len);
+        memset(cur_op->buf, 0, cur_op->req.rw.len);
+    }
     if (!check_write_queue(cur_op, pg))
     {
         return;
@@ -86,6 +136,12 @@ resume_1:
         }
     }
     // Read required blocks
+    if (op_data->scheme == POOL_SCHEME_REPLICATED && op_data->stripes[0].read_end == bs_block_size &&
+        take_recovery_prefetch(cur_op))
+    {
+        // Object data is already read by a batched recovery read
+        goto resume_3;
+    }
     submit_primary_subops(SUBMIT_RMW_READ, UINT64_MAX, op_data->prev_set, cur_op);
 resume_2:
     op_data->st = 2;
@@ -105,9 +161,18 @@ resume_3:
     }
     if (op_data->scheme == POOL_SCHEME_REPLICATED)
     {
-        // Set bitmap bits
-        bitmap_set(op_data->stripes[0].bmp_buf, op_data->stripes[0].write_start,
-            op_data->stripes[0].write_end-op_data->stripes[0].write_start, bs_bitmap_granularity);
+        // Set bitmap bits, discard clears them to make the range read from the parent layer again.
+        // EC/XOR pools protect bitmaps with parity, so discard just writes zeroes there
+        if (cur_op->req.hdr.opcode == OSD_OP_DISCARD)
+        {
+            bitmap_clear(op_data->stripes[0].bmp_buf, op_data->stripes[0].write_start,
+                op_data->stripes[0].write_end-op_data->stripes[0].write_start, bs_bitmap_granularity);
+        }
+        else
+        {
+            bitmap_set(op_data->stripes[0].bmp_buf, op_data->stripes[0].write_start,
+                op_data->stripes[0].write_end-op_data->stripes[0].write_start, bs_bitmap_granularity);
+        }
         // Possibly copy new data from the request into the recovery buffer
         if (pg.cur_set.data() != op_data->prev_set && (op_data->stripes[0].write_start != 0 ||
             op_data->stripes[0].write_end != bs_block_size))
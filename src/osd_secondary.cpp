@@ -1,12 +1,15 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+#include <sys/random.h>
+
 #include "osd.h"
 
 #include "json11/json11.hpp"
 
 void osd_t::secondary_op_callback(osd_op_t *op)
 {
+    log_pg_modification(op->bs_op);
     if (op->req.hdr.opcode == OSD_OP_SEC_READ ||
         op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
         op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE)
@@ -36,6 +39,12 @@ void osd_t::secondary_op_callback(osd_op_t *op)
         }
         op->reply.sec_list.stable_count = op->bs_op->version;
     }
+    uint64_t trace_id = osd_trace_id(op->req);
+    if (trace_id && op->bs_op->submit_time_us)
+    {
+        msgr.tracer.record(trace_id, OSD_TRACE_BS_SUBMIT, op->req.hdr.opcode, 0, op->bs_op->submit_time_us);
+    }
+    msgr.tracer.record(trace_id, OSD_TRACE_BS_COMPLETE, op->req.hdr.opcode);
     int retval = op->bs_op->retval;
     delete op->bs_op;
     op->bs_op = NULL;
@@ -63,6 +72,11 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         finish_op(cur_op, n * (8 + clean_entry_bitmap_size));
         return;
     }
+    if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ_MULTI)
+    {
+        exec_sec_read_multi(cur_op);
+        return;
+    }
     cur_op->bs_op = new blockstore_op_t();
     cur_op->bs_op->callback = [this, cur_op](blockstore_op_t* bs_op) { secondary_op_callback(cur_op); };
     cur_op->bs_op->opcode = (cur_op->req.hdr.opcode == OSD_OP_SEC_READ ? BS_OP_READ
@@ -81,12 +95,17 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ)
         {
             // Allocate memory for the read operation
+            // Bitmap is zeroed because blockstore doesn't fill it for non-existing objects
+            // and clients may read from secondary OSDs directly under a read lease
             if (clean_entry_bitmap_size > sizeof(unsigned))
-                cur_op->bitmap = cur_op->rmw_buf = malloc_or_die(clean_entry_bitmap_size);
+                cur_op->bitmap = cur_op->rmw_buf = calloc_or_die(1, clean_entry_bitmap_size);
             else
+            {
+                cur_op->bmp_data = 0;
                 cur_op->bitmap = &cur_op->bmp_data;
+            }
             if (cur_op->req.sec_rw.len > 0)
-                cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_rw.len);
+                cur_op->buf = op_buf_alloc(cur_op->req.sec_rw.len);
         }
         cur_op->bs_op->oid = cur_op->req.sec_rw.oid;
         cur_op->bs_op->version = cur_op->req.sec_rw.version;
@@ -130,11 +149,44 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         cur_op->bs_op->offset = cur_op->req.sec_list.list_pg - 1;
         cur_op->bs_op->oid.inode = cur_op->req.sec_list.min_inode;
         cur_op->bs_op->version = cur_op->req.sec_list.max_inode;
+        pool_id_t pool_id = INODE_POOL(cur_op->req.sec_list.min_inode);
+        if (pool_id && INODE_POOL(cur_op->req.sec_list.max_inode) == pool_id)
+        {
+            pg_list_result_t delta;
+            if (cur_op->req.sec_list.log_instance == pg_log_instance &&
+                list_pg_delta(pool_id, cur_op->req.sec_list.list_pg, cur_op->req.sec_list.pg_count,
+                    cur_op->req.sec_list.pg_stripe_size, cur_op->req.sec_list.log_pos, delta))
+            {
+                // Only list objects changed since the previous listing
+                cur_op->reply.sec_list.log_instance = delta.log_instance;
+                cur_op->reply.sec_list.log_pos = delta.log_pos;
+                cur_op->reply.sec_list.flags = OSD_LIST_DELTA;
+                cur_op->bs_op->buf = delta.buf;
+                cur_op->bs_op->version = delta.stable_count;
+                cur_op->bs_op->retval = delta.total_count;
+                secondary_op_callback(cur_op);
+                return;
+            }
+            // Remember log position before listing so that no changes are lost
+            uint64_t log_pos = 0;
+            if (get_pg_log_pos(pool_id, cur_op->req.sec_list.list_pg, cur_op->req.sec_list.pg_count,
+                cur_op->req.sec_list.pg_stripe_size, &log_pos))
+            {
+                cur_op->reply.sec_list.log_instance = pg_log_instance;
+                cur_op->reply.sec_list.log_pos = log_pos;
+            }
+        }
 #ifdef OSD_STUB
         cur_op->bs_op->retval = 0;
         cur_op->bs_op->buf = NULL;
 #endif
     }
+    uint64_t trace_id = osd_trace_id(cur_op->req);
+    if (trace_id && msgr.tracer.enabled())
+    {
+        cur_op->bs_op->trace_submit = true;
+        msgr.tracer.record(trace_id, OSD_TRACE_BS_QUEUE, cur_op->req.hdr.opcode);
+    }
 #ifdef OSD_STUB
     secondary_op_callback(cur_op);
 #else
@@ -142,6 +194,69 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
 #endif
 }
 
+// Maximum number of objects in one OSD_OP_SEC_READ_MULTI so that the reply doesn't exceed OSD_RW_MAX
+uint64_t osd_t::read_multi_max_objects()
+{
+    uint64_t n = OSD_RW_MAX / (bs_block_size + 8 + clean_entry_bitmap_size);
+    return n < MAX_RECOVERY_BATCH_SIZE ? n : MAX_RECOVERY_BATCH_SIZE;
+}
+
+// Read several whole objects at once. Reply payload is data of all objects
+// (aligned for direct I/O), then their versions, then their bitmaps
+void osd_t::exec_sec_read_multi(osd_op_t *cur_op)
+{
+    uint64_t n = cur_op->req.sec_read_multi.len / sizeof(obj_ver_id);
+    if (!n || (cur_op->req.sec_read_multi.len % sizeof(obj_ver_id)) || !bs || n > read_multi_max_objects())
+    {
+        finish_op(cur_op, -EINVAL);
+        return;
+    }
+    obj_ver_id *ov = (obj_ver_id*)cur_op->buf;
+    uint64_t reply_size = n * (bs_block_size + 8 + clean_entry_bitmap_size);
+    uint8_t *reply_buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, reply_size);
+    uint64_t *versions = (uint64_t*)(reply_buf + n*bs_block_size);
+    uint8_t *bitmaps = reply_buf + n*(bs_block_size + 8);
+    memset(bitmaps, 0, n*clean_entry_bitmap_size);
+    // Last element is the number of reads in progress
+    int *results = (int*)malloc_or_die(sizeof(int) * (n+1));
+    results[n] = n;
+    for (uint64_t i = 0; i < n; i++)
+    {
+        bs->enqueue_op(new blockstore_op_t({
+            .opcode = BS_OP_READ,
+            .callback = [this, cur_op, i, n, versions, results, reply_buf, reply_size](blockstore_op_t *bs_op)
+            {
+                results[i] = bs_op->retval;
+                versions[i] = bs_op->version;
+                delete bs_op;
+                if (--results[n] > 0)
+                {
+                    return;
+                }
+                int retval = reply_size;
+                for (uint64_t j = 0; j < n; j++)
+                {
+                    if (results[j] != bs_block_size)
+                    {
+                        retval = results[j] < 0 ? results[j] : -EIO;
+                        break;
+                    }
+                }
+                free(results);
+                free(cur_op->buf);
+                cur_op->buf = reply_buf;
+                finish_op(cur_op, retval);
+            },
+            .oid = ov[i].oid,
+            .version = ov[i].version,
+            .offset = 0,
+            .len = bs_block_size,
+            .buf = reply_buf + i*bs_block_size,
+            .bitmap = bitmaps + i*clean_entry_bitmap_size,
+        }));
+    }
+}
+
 void osd_t::exec_show_config(osd_op_t *cur_op)
 {
     std::string json_err;
@@ -160,7 +275,62 @@ void osd_t::exec_show_config(osd_op_t *cur_op)
         { "immediate_commit", (immediate_commit == IMMEDIATE_ALL ? "all" :
             (immediate_commit == IMMEDIATE_SMALL ? "small" : "none")) },
         { "lease_timeout", etcd_report_interval+(st_cli.max_etcd_attempts*(2*st_cli.etcd_quick_timeout)+999)/1000 },
+        { "sec_read_multi", true },
+        // OSD_OP_WRITE_ZEROES and OSD_OP_DISCARD are supported
+        { "write_zeroes", true },
     };
+    if (req_json["conn_group"].uint64_value())
+    {
+        // Only a peer which knows the token of the group may join it,
+        // otherwise its SYNC would clear dirty PGs of another client
+        auto cl = msgr.clients.at(cur_op->peer_fd);
+        uint64_t group = req_json["conn_group"].uint64_value();
+        const std::string & token = req_json["conn_group_token"].string_value();
+        bool valid = false;
+        for (auto & cp: msgr.clients)
+        {
+            if (cp.second->conn_group == group)
+            {
+                valid = token != "" && cp.second->conn_group_token == token;
+                break;
+            }
+        }
+        if (!valid)
+        {
+            finish_op(cur_op, -EPERM);
+            return;
+        }
+        cl->conn_group = group;
+        cl->conn_group_token = token;
+        wire_config["conn_group"] = cl->conn_group;
+    }
+    else if (req_json["peer_connections"].uint64_value() > 1)
+    {
+        // Peer uses multiple parallel connections, group them to track dirty PGs together.
+        // Without random bytes for the token the peer just uses a single connection
+        uint8_t rnd[16];
+        if (getrandom(rnd, sizeof(rnd), 0) == sizeof(rnd))
+        {
+            char token[2*sizeof(rnd)+1];
+            for (int i = 0; i < sizeof(rnd); i++)
+                snprintf(token+2*i, 3, "%02x", rnd[i]);
+            auto cl = msgr.clients.at(cur_op->peer_fd);
+            cl->conn_group = ++msgr.last_conn_group;
+            cl->conn_group_token = token;
+            wire_config["conn_group"] = cl->conn_group;
+            wire_config["conn_group_token"] = cl->conn_group_token;
+        }
+    }
+    if (req_json["msg_batch"].bool_value() && msgr.accept_msg_batch(cur_op->peer_fd))
+    {
+        wire_config["msg_batch"] = true;
+    }
+    if (req_json["connect_shm"].is_string() &&
+        msgr.connect_shm(cur_op->peer_fd, req_json["connect_shm"].string_value(), req_json["shm_ring_size"].uint64_value()))
+    {
+        // Peer is on the same host and its shared memory is mapped
+        wire_config["shm_ok"] = true;
+    }
 #ifdef WITH_RDMA
     if (msgr.is_rdma_enabled())
     {
@@ -169,12 +339,15 @@ void osd_t::exec_show_config(osd_op_t *cur_op)
         if (req_json["connect_rdma"].is_string())
         {
             // Peer is trying to connect using RDMA, try to satisfy him
-            bool ok = msgr.connect_rdma(cur_op->peer_fd, req_json["connect_rdma"].string_value(), req_json["rdma_max_msg"].uint64_value());
+            bool ok = msgr.connect_rdma(cur_op->peer_fd, req_json["connect_rdma"].string_value(),
+                req_json["rdma_max_msg"].uint64_value(), req_json["rdma_rdv_threshold"].uint64_value());
             if (ok)
             {
                 auto rc = msgr.clients.at(cur_op->peer_fd)->rdma_conn;
                 wire_config["rdma_address"] = rc->addr.to_string();
                 wire_config["rdma_max_msg"] = rc->max_msg;
+                if (rc->rdv_threshold)
+                    wire_config["rdma_rdv_threshold"] = rc->rdv_threshold;
             }
         }
     }
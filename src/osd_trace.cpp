@@ -0,0 +1,171 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "osd_trace.h"
+
+const char* osd_trace_stage_names[] = {
+    "",
+    "client_submit",
+    "client_send",
+    "primary_recv",
+    "subop_send",
+    "sec_recv",
+    "bs_queue",
+    "bs_submit",
+    "bs_complete",
+    "sec_reply",
+    "subop_reply",
+    "primary_reply",
+    "client_reply",
+    "client_done",
+};
+
+uint64_t osd_trace_now_us()
+{
+    timespec tv;
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return tv.tv_sec*1000000ul + tv.tv_nsec/1000;
+}
+
+// Don't keep more formatted data in memory if the file can't be written fast enough
+#define OSD_TRACE_MAX_QUEUE_BYTES 64*1024*1024
+
+osd_tracer_t::~osd_tracer_t()
+{
+    flush();
+    if (writer_thread.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(writer_mutex);
+            writer_stop = true;
+        }
+        writer_cond.notify_all();
+        writer_thread.join();
+    }
+}
+
+void osd_tracer_t::parse_config(const json11::Json & config)
+{
+    sample_rate = config["trace_sample"].uint64_value();
+    trace_file = config["trace_file"].string_value();
+    uint64_t buffer_size = config["trace_buffer_size"].uint64_value();
+    if (!buffer_size)
+        buffer_size = 65536;
+    if (trace_file != "" && ring.size() != buffer_size)
+    {
+        flush();
+        ring.clear();
+        ring.resize(buffer_size);
+        ring_pos = flushed_pos = 0;
+    }
+    else if (trace_file == "" && ring.size())
+    {
+        ring.clear();
+        ring_pos = flushed_pos = 0;
+    }
+}
+
+uint64_t osd_tracer_t::new_trace_id()
+{
+    if (!next_trace_id)
+    {
+        // Random start to make IDs of different clients distinct
+        next_trace_id = (osd_trace_now_us() ^ ((uint64_t)getpid() << 24)) * 0x9E3779B97F4A7C15ull;
+    }
+    next_trace_id++;
+    return OSD_TRACE_ID_TAG | (next_trace_id & ~OSD_TRACE_ID_TAG_MASK);
+}
+
+void osd_tracer_t::add_span(uint64_t trace_id, int stage, uint64_t opcode, uint64_t peer, uint64_t time_us)
+{
+    ring[ring_pos % ring.size()] = (osd_trace_span_t){
+        .trace_id = trace_id,
+        .time_us = time_us ? time_us : osd_trace_now_us(),
+        .peer = peer,
+        .stage = (uint16_t)stage,
+        .opcode = (uint16_t)opcode,
+    };
+    ring_pos++;
+    if (ring_pos - flushed_pos >= ring.size()/2)
+    {
+        flush();
+    }
+}
+
+void osd_tracer_t::flush()
+{
+    if (ring_pos == flushed_pos || trace_file == "")
+    {
+        return;
+    }
+    if (ring_pos - flushed_pos > ring.size())
+    {
+        // Oldest spans are already overwritten
+        flushed_pos = ring_pos - ring.size();
+    }
+    // Spans are written with a single append so that multiple processes may share a file
+    std::string buf;
+    char line[256];
+    for (; flushed_pos < ring_pos; flushed_pos++)
+    {
+        auto & span = ring[flushed_pos % ring.size()];
+        int len = snprintf(
+            line, sizeof(line), "{\"trace\":\"%lx\",\"time\":%lu,\"stage\":\"%s\",\"node\":%lu,\"op\":\"%s\",\"peer\":%lu}\n",
+            span.trace_id, span.time_us, span.stage <= OSD_TRACE_STAGE_MAX ? osd_trace_stage_names[span.stage] : "",
+            node, span.opcode <= OSD_OP_MAX ? osd_op_names[span.opcode] : "", span.peer
+        );
+        buf.append(line, len < (int)sizeof(line) ? len : sizeof(line)-1);
+    }
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    if (writer_queue_bytes + buf.size() > OSD_TRACE_MAX_QUEUE_BYTES)
+    {
+        fprintf(stderr, "Trace file %s is written too slowly, dropping %lu bytes of spans\n", trace_file.c_str(), buf.size());
+        return;
+    }
+    writer_queue_bytes += buf.size();
+    writer_queue.push_back({ trace_file, std::move(buf) });
+    if (!writer_thread.joinable())
+    {
+        writer_thread = std::thread(&osd_tracer_t::run_writer, this);
+    }
+    lock.unlock();
+    writer_cond.notify_one();
+}
+
+void osd_tracer_t::run_writer()
+{
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    while (true)
+    {
+        writer_cond.wait(lock, [this]() { return writer_stop || writer_queue.size() > 0; });
+        if (!writer_queue.size())
+        {
+            // Stopped and everything is written
+            break;
+        }
+        std::vector<std::pair<std::string, std::string>> queue;
+        queue.swap(writer_queue);
+        writer_queue_bytes = 0;
+        lock.unlock();
+        for (auto & item: queue)
+        {
+            int fd = open(item.first.c_str(), O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+            if (fd < 0 || write(fd, item.second.data(), item.second.size()) != (ssize_t)item.second.size())
+            {
+                fprintf(stderr, "Failed to write trace file %s: %s\n", item.first.c_str(), strerror(errno));
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+        lock.lock();
+    }
+}
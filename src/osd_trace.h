@@ -0,0 +1,120 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Sampled end-to-end operation tracing.
+// The client marks every N-th operation with a random trace ID which is carried
+// in the last 8 bytes of request headers to the primary OSD and further to the
+// secondary OSDs. Each node records timestamps of processing stages ("spans")
+// into a ring buffer and appends them to a local file as JSON lines.
+// vitastor-cli trace-merge combines these files into a per-operation breakdown.
+// Timestamps use the real-time clock, so clocks of nodes should be synchronized.
+
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json11/json11.hpp"
+#include "osd_ops.h"
+
+// Client: operation is submitted by the user
+#define OSD_TRACE_CLIENT_SUBMIT  1
+// Client: request is sent to an OSD
+#define OSD_TRACE_CLIENT_SEND    2
+// Primary: request is received
+#define OSD_TRACE_PRIMARY_RECV   3
+// Primary: sub-operation is sent to a secondary OSD or to the local blockstore
+#define OSD_TRACE_SUBOP_SEND     4
+// Secondary: request is received
+#define OSD_TRACE_SEC_RECV       5
+// Secondary: operation is put into the blockstore queue
+#define OSD_TRACE_BS_QUEUE       6
+// Secondary: blockstore starts to submit operation to the disk
+#define OSD_TRACE_BS_SUBMIT      7
+// Secondary: blockstore operation is completed
+#define OSD_TRACE_BS_COMPLETE    8
+// Secondary: reply is queued for sending
+#define OSD_TRACE_SEC_REPLY      9
+// Primary: sub-operation reply is received
+#define OSD_TRACE_SUBOP_REPLY    10
+// Primary: reply is queued for sending
+#define OSD_TRACE_PRIMARY_REPLY  11
+// Client: reply is received
+#define OSD_TRACE_CLIENT_REPLY   12
+// Client: operation is completed and the user callback is called
+#define OSD_TRACE_CLIENT_DONE    13
+#define OSD_TRACE_STAGE_MAX      13
+
+extern const char* osd_trace_stage_names[];
+
+// Return the trace ID of a request or 0 if it isn't sampled
+static inline uint64_t osd_trace_id(const osd_any_op_t & req)
+{
+    return (req.trace.trace_id & OSD_TRACE_ID_TAG_MASK) == OSD_TRACE_ID_TAG ? req.trace.trace_id : 0;
+}
+
+struct osd_trace_span_t
+{
+    uint64_t trace_id;
+    uint64_t time_us;
+    // Peer OSD for CLIENT_SEND and SUBOP_SEND/REPLY, 0 if not applicable
+    uint64_t peer;
+    uint16_t stage;
+    uint16_t opcode;
+};
+
+struct osd_tracer_t
+{
+    // Trace every <sample_rate>-th client operation, 0 = don't start traces
+    uint64_t sample_rate = 0;
+    // Spans are only recorded when the file is set
+    std::string trace_file;
+    // Node ID written to the file, OSD number or 0 for clients
+    uint64_t node = 0;
+
+    std::vector<osd_trace_span_t> ring;
+    uint64_t ring_pos = 0, flushed_pos = 0;
+    uint64_t sample_counter = 0, next_trace_id = 0;
+
+    // Formatted spans are appended to the file by a helper thread to not block the event loop
+    std::thread writer_thread;
+    std::mutex writer_mutex;
+    std::condition_variable writer_cond;
+    std::vector<std::pair<std::string, std::string>> writer_queue;
+    uint64_t writer_queue_bytes = 0;
+    bool writer_stop = false;
+
+    ~osd_tracer_t();
+    void parse_config(const json11::Json & config);
+    // Return a new trace ID for every <sample_rate>-th call, 0 otherwise
+    inline uint64_t sample()
+    {
+        if (!sample_rate || ++sample_counter < sample_rate)
+            return 0;
+        sample_counter = 0;
+        return new_trace_id();
+    }
+    inline bool enabled()
+    {
+        return ring.size() > 0;
+    }
+    // Record a span of a sampled operation, <time_us> = 0 means "now"
+    inline void record(uint64_t trace_id, int stage, uint64_t opcode, uint64_t peer = 0, uint64_t time_us = 0)
+    {
+        if (trace_id && ring.size())
+            add_span(trace_id, stage, opcode, peer, time_us);
+    }
+    // Append unsaved spans to the trace file in the background
+    void flush();
+
+protected:
+    void run_writer();
+    uint64_t new_trace_id();
+    void add_span(uint64_t trace_id, int stage, uint64_t opcode, uint64_t peer, uint64_t time_us);
+};
+
+uint64_t osd_trace_now_us();
@@ -426,6 +426,11 @@ static int vitastor_refresh_limits(BlockDriverState *bs)
     bs->bl.min_mem_alignment = 4096;
 #endif
     bs->bl.opt_mem_alignment = 4096;
+#if defined VITASTOR_C_API_VERSION && VITASTOR_C_API_VERSION >= 6 && \
+    (QEMU_VERSION_MAJOR >= 3 || QEMU_VERSION_MAJOR == 2 && QEMU_VERSION_MINOR >= 7)
+    bs->bl.pwrite_zeroes_alignment = 4096;
+    bs->bl.pdiscard_alignment = 4096;
+#endif
 #if QEMU_VERSION_MAJOR < 2 || QEMU_VERSION_MAJOR == 2 && QEMU_VERSION_MINOR == 0
     return 0;
 #endif
@@ -524,6 +529,62 @@ static int coroutine_fn vitastor_co_pwritev(BlockDriverState *bs,
     return task.ret;
 }
 
+#if defined VITASTOR_C_API_VERSION && VITASTOR_C_API_VERSION >= 6
+#if QEMU_VERSION_MAJOR >= 3 || QEMU_VERSION_MAJOR == 2 && QEMU_VERSION_MINOR >= 7
+// Zeroes and discards are executed by OSDs without transferring any data
+static int coroutine_fn vitastor_co_zero(BlockDriverState *bs, int64_t offset, int64_t bytes, int discard)
+{
+    VitastorClient *client = bs->opaque;
+    VitastorRPC task;
+    vitastor_co_init_task(bs, &task);
+
+    if (client->last_bitmap)
+    {
+        // Invalidate last bitmap on write
+        free(client->last_bitmap);
+        client->last_bitmap = NULL;
+    }
+
+    uint64_t inode = client->watch ? vitastor_c_inode_get_num(client->watch) : client->inode;
+    qemu_mutex_lock(&client->mutex);
+    if (discard)
+        vitastor_c_discard(client->proxy, inode, offset, bytes, vitastor_co_generic_bh_cb, &task);
+    else
+        vitastor_c_write_zeroes(client->proxy, inode, offset, bytes, vitastor_co_generic_bh_cb, &task);
+    qemu_mutex_unlock(&client->mutex);
+
+    while (!task.complete)
+    {
+        qemu_coroutine_yield();
+    }
+
+    return task.ret < 0 ? task.ret : 0;
+}
+
+static int coroutine_fn vitastor_co_pwrite_zeroes(BlockDriverState *bs,
+#if QEMU_VERSION_MAJOR >= 7 || QEMU_VERSION_MAJOR == 6 && QEMU_VERSION_MINOR >= 2
+    int64_t offset, int64_t bytes, BdrvRequestFlags flags
+#else
+    int64_t offset, int bytes, BdrvRequestFlags flags
+#endif
+)
+{
+    return vitastor_co_zero(bs, offset, bytes, 0);
+}
+
+static int coroutine_fn vitastor_co_pdiscard(BlockDriverState *bs,
+#if QEMU_VERSION_MAJOR >= 7 || QEMU_VERSION_MAJOR == 6 && QEMU_VERSION_MINOR >= 2
+    int64_t offset, int64_t bytes
+#else
+    int64_t offset, int bytes
+#endif
+)
+{
+    return vitastor_co_zero(bs, offset, bytes, 1);
+}
+#endif
+#endif
+
 #if defined VITASTOR_C_API_VERSION && VITASTOR_C_API_VERSION >= 1
 #if QEMU_VERSION_MAJOR >= 2 || QEMU_VERSION_MAJOR == 1 && QEMU_VERSION_MINOR >= 7
 static void vitastor_co_read_bitmap_cb(void *opaque, long retval, uint8_t *bitmap)
@@ -784,6 +845,12 @@ static BlockDriver bdrv_vitastor = {
 
     .bdrv_co_flush_to_disk          = vitastor_co_flush,
 
+#if defined VITASTOR_C_API_VERSION && VITASTOR_C_API_VERSION >= 6 && \
+    (QEMU_VERSION_MAJOR >= 3 || QEMU_VERSION_MAJOR == 2 && QEMU_VERSION_MINOR >= 7)
+    .bdrv_co_pwrite_zeroes          = vitastor_co_pwrite_zeroes,
+    .bdrv_co_pdiscard               = vitastor_co_pdiscard,
+#endif
+
 #if QEMU_VERSION_MAJOR >= 4
     .strong_runtime_opts            = vitastor_strong_runtime_opts,
 #endif
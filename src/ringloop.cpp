@@ -2,6 +2,7 @@
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
 #include <stdlib.h>
+#include <time.h>
 
 #include <stdexcept>
 
@@ -14,7 +15,7 @@ ring_loop_t::ring_loop_t(int qd)
     {
         throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-ret));
     }
-    free_ring_data_ptr = *ring.cq.kring_entries;
+    free_ring_data_ptr = ring_data_count = *ring.cq.kring_entries;
     ring_datas = (struct ring_data_t*)calloc(free_ring_data_ptr, sizeof(ring_data_t));
     free_ring_data = (int*)malloc(sizeof(int) * free_ring_data_ptr);
     if (!ring_datas || !free_ring_data)
@@ -63,7 +64,14 @@ void ring_loop_t::loop()
     while (!io_uring_peek_cqe(&ring, &cqe))
     {
         struct ring_data_t *d = (struct ring_data_t*)cqe->user_data;
-        if (d->callback)
+        if (d->callback && (cqe->flags & IORING_CQE_F_MORE))
+        {
+            // Multi-shot or zero-copy operation, more CQEs will follow
+            d->res = cqe->res;
+            d->flags = cqe->flags;
+            d->callback(d);
+        }
+        else if (d->callback)
         {
             // First free ring_data item, then call the callback
             // so it has at least 1 free slot for the next event
@@ -71,14 +79,15 @@ void ring_loop_t::loop()
             struct ring_data_t dl;
             dl.iov = d->iov;
             dl.res = cqe->res;
+            dl.flags = cqe->flags;
             dl.callback.swap(d->callback);
-            free_ring_data[free_ring_data_ptr++] = d - ring_datas;
+            free_ring_data_item(d);
             dl.callback(&dl);
         }
         else
         {
             printf("Warning: empty callback in SQE\n");
-            free_ring_data[free_ring_data_ptr++] = d - ring_datas;
+            free_ring_data_item(d);
         }
         io_uring_cqe_seen(&ring, cqe);
     }
@@ -99,6 +108,80 @@ void ring_loop_t::loop()
     } while (loop_again);
 }
 
+static inline uint64_t clock_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ul + ts.tv_nsec;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+void ring_loop_t::set_busy_poll(uint64_t max_us)
+{
+    if (busy_poll_max_ns != max_us*1000)
+    {
+        // Start with the full budget, it adapts after the first waits
+        busy_poll_max_ns = max_us*1000;
+        busy_poll_ns = busy_poll_max_ns;
+    }
+}
+
+int ring_loop_t::wait()
+{
+    struct io_uring_cqe *cqe;
+    if (!busy_poll_max_ns)
+    {
+        poll_stats.sleeps++;
+        return io_uring_wait_cqe(&ring, &cqe);
+    }
+    // Sockets and RDMA completions also arrive through the ring (epoll fd is polled
+    // with POLL_ADD), so spinning on the CQ covers all event sources
+    uint64_t start = clock_ns(), now = start;
+    if (busy_poll_ns > 0)
+    {
+        while (now-start < busy_poll_ns)
+        {
+            if (!io_uring_peek_cqe(&ring, &cqe))
+            {
+                poll_stats.spin_hits++;
+                poll_stats.spin_usec += (now-start)/1000;
+                return 0;
+            }
+            cpu_relax();
+            now = clock_ns();
+        }
+        poll_stats.spin_misses++;
+        poll_stats.spin_usec += (now-start)/1000;
+    }
+    poll_stats.sleeps++;
+    int r = io_uring_wait_cqe(&ring, &cqe);
+    uint64_t slept = clock_ns()-now;
+    poll_stats.sleep_usec += slept/1000;
+    // Adapt the budget like haltpoll does: if the event came soon after going
+    // to sleep, spinning longer would have caught it, otherwise spin less
+    if (now-start+slept < busy_poll_max_ns)
+    {
+        busy_poll_ns = busy_poll_ns < 1000 ? 1000 : busy_poll_ns*2;
+        if (busy_poll_ns > busy_poll_max_ns)
+            busy_poll_ns = busy_poll_max_ns;
+    }
+    else
+    {
+        busy_poll_ns /= 2;
+        if (busy_poll_ns < 1000)
+            busy_poll_ns = 0;
+    }
+    return r;
+}
+
 unsigned ring_loop_t::save()
 {
     return ring.sq.sqe_tail;
@@ -109,11 +192,40 @@ void ring_loop_t::restore(unsigned sqe_tail)
     assert(ring.sq.sqe_tail >= sqe_tail);
     for (unsigned i = sqe_tail; i < ring.sq.sqe_tail; i++)
     {
-        free_ring_data[free_ring_data_ptr++] = ((ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data) - ring_datas;
+        free_ring_data_item((ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data);
     }
     ring.sq.sqe_tail = sqe_tail;
 }
 
+#ifdef IORING_RECV_MULTISHOT
+int ring_loop_t::register_buf_ring(struct io_uring_buf_ring *br, unsigned entries, int bgid)
+{
+    struct io_uring_buf_reg reg = { 0 };
+    reg.ring_addr = (uint64_t)br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    io_uring_buf_ring_init(br);
+    return io_uring_register_buf_ring(&ring, &reg, 0);
+}
+
+void ring_loop_t::unregister_buf_ring(int bgid)
+{
+    io_uring_unregister_buf_ring(&ring, bgid);
+}
+#endif
+
+bool ring_loop_t::has_opcode(int opcode)
+{
+    struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    if (!probe)
+    {
+        return false;
+    }
+    bool supported = io_uring_opcode_supported(probe, opcode);
+    io_uring_free_probe(probe);
+    return supported;
+}
+
 int ring_loop_t::sqes_left()
 {
     struct io_uring_sq *sq = &ring.sq;
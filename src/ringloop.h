@@ -11,6 +11,10 @@
 #include <assert.h>
 #include <liburing.h>
 
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+
 #include <string>
 #include <functional>
 #include <vector>
@@ -59,6 +63,31 @@ static inline void my_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const
     sqe->msg_flags = flags;
 }
 
+#ifdef IORING_RECV_MULTISHOT
+static inline void my_uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, int buf_group, unsigned flags)
+{
+    // Multishot recv into buffers selected from the provided buffer ring <buf_group>
+    my_uring_prep_rw(IORING_OP_RECV, sqe, fd, NULL, 0, 0);
+    sqe->msg_flags = flags;
+    sqe->ioprio |= IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buf_group;
+}
+#endif
+
+#ifdef IORING_CQE_F_NOTIF
+static inline void my_uring_prep_sendmsg_zc(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned flags, unsigned zc_flags)
+{
+    // Zero-copy sendmsg posts 2 CQEs: the result with IORING_CQE_F_MORE and then
+    // the notification with IORING_CQE_F_NOTIF when buffers are released by the kernel.
+    // zc_flags are IORING_RECVSEND_* and IORING_SEND_ZC_* flags, Linux 6.1 rejects
+    // IORING_SEND_ZC_REPORT_USAGE with -EINVAL, it's only supported since 6.2
+    my_uring_prep_rw(IORING_OP_SENDMSG_ZC, sqe, fd, msg, 1, 0);
+    sqe->msg_flags = flags;
+    sqe->ioprio = zc_flags;
+}
+#endif
+
 static inline void my_uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, short poll_mask)
 {
     my_uring_prep_rw(IORING_OP_POLL_ADD, sqe, fd, NULL, 0, 0);
@@ -109,6 +138,9 @@ struct ring_data_t
 {
     struct iovec iov; // for single-entry read/write operations
     int res;
+    // CQE flags. ring_data_t stays allocated and callback is called again
+    // for the next CQE while IORING_CQE_F_MORE is set
+    unsigned flags;
     std::function<void(ring_data_t*)> callback;
 };
 
@@ -117,15 +149,35 @@ struct ring_consumer_t
     std::function<void(void)> loop;
 };
 
+struct ring_poll_stats_t
+{
+    // Busy-poll rounds which found a completion
+    uint64_t spin_hits = 0;
+    // Busy-poll rounds which ran out of budget
+    uint64_t spin_misses = 0;
+    // Waits which went to sleep in the kernel
+    uint64_t sleeps = 0;
+    uint64_t spin_usec = 0;
+    uint64_t sleep_usec = 0;
+};
+
 class ring_loop_t
 {
     std::vector<std::function<void()>> immediate_queue, immediate_queue2;
     std::vector<ring_consumer_t*> consumers;
     struct ring_data_t *ring_datas;
     int *free_ring_data;
-    unsigned free_ring_data_ptr;
+    unsigned free_ring_data_ptr, ring_data_count;
     bool loop_again;
     struct io_uring ring;
+    // Busy-poll budget in nanoseconds: maximum and current (adaptive)
+    uint64_t busy_poll_max_ns = 0, busy_poll_ns = 0;
+    inline void free_ring_data_item(ring_data_t *d)
+    {
+        // Items allocated by the caller for multishot operations aren't returned to the pool
+        if (d >= ring_datas && d < ring_datas+ring_data_count)
+            free_ring_data[free_ring_data_ptr++] = d - ring_datas;
+    }
 public:
     ring_loop_t(int qd);
     ~ring_loop_t();
@@ -144,6 +196,18 @@ public:
         }
         return sqe;
     }
+    // Get an SQE for a long-living (multishot) operation which uses caller-allocated <data>
+    // instead of the internal pool so it doesn't hold a pool item for the whole time
+    inline struct io_uring_sqe* get_sqe(ring_data_t *data)
+    {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (sqe)
+        {
+            *sqe = { 0 };
+            io_uring_sqe_set_data(sqe, data);
+        }
+        return sqe;
+    }
     inline void set_immediate(const std::function<void()> cb)
     {
         immediate_queue.push_back(cb);
@@ -152,12 +216,16 @@ public:
     {
         return io_uring_submit(&ring);
     }
-    inline int wait()
-    {
-        struct io_uring_cqe *cqe;
-        return io_uring_wait_cqe(&ring, &cqe);
-    }
+    int wait();
+    // Spin on the completion queue for up to <max_us> microseconds before sleeping, 0 = never
+    void set_busy_poll(uint64_t max_us);
+    ring_poll_stats_t poll_stats;
     int sqes_left();
+    bool has_opcode(int opcode);
+#ifdef IORING_RECV_MULTISHOT
+    int register_buf_ring(struct io_uring_buf_ring *br, unsigned entries, int bgid);
+    void unregister_buf_ring(int bgid);
+#endif
     inline unsigned space_left()
     {
         return free_ring_data_ptr;
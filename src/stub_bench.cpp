@@ -3,6 +3,10 @@
 
 /**
  * Stub benchmarker
+ *
+ * With IODEPTH > 1, sends 4k reads with up to IODEPTH requests in flight and
+ * reports IOPS. Run it against stub_uring_osd to benchmark the messenger itself,
+ * i.e. lookups of clients and in-flight operations with many parallel requests.
  */
 
 #include <sys/types.h>
@@ -20,6 +24,7 @@
 #include <signal.h>
 
 #include <stdexcept>
+#include <map>
 
 #include "addr_util.h"
 #include "rw_blocking.h"
@@ -29,6 +34,9 @@ int connect_stub(const char *server_address, int server_port);
 
 void run_bench(int peer_fd);
 
+void run_bench_iodepth(int peer_fd, int iodepth);
+
+static timespec bench_start;
 static uint64_t read_sum = 0, read_count = 0;
 static uint64_t write_sum = 0, write_count = 0;
 static uint64_t sync_sum = 0, sync_count = 0;
@@ -38,6 +46,11 @@ void handle_sigint(int sig)
     printf("4k randread: %lu us avg\n", read_count ? read_sum/read_count : 0);
     printf("4k randwrite: %lu us avg\n", write_count ? write_sum/write_count : 0);
     printf("sync: %lu us avg\n", sync_count ? sync_sum/sync_count : 0);
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t total_us = (now.tv_sec - bench_start.tv_sec)*1000000 + now.tv_nsec/1000 - bench_start.tv_nsec/1000;
+    printf("total: %lu ops, %lu iops\n", read_count+write_count+sync_count,
+        total_us ? (read_count+write_count+sync_count)*1000000/total_us : 0);
     exit(0);
 }
 
@@ -45,7 +58,7 @@ int main(int narg, char *args[])
 {
     if (narg < 2)
     {
-        printf("USAGE: %s SERVER_IP [PORT]\n", args[0]);
+        printf("USAGE: %s SERVER_IP [PORT [IODEPTH]]\n", args[0]);
         return 1;
     }
     int port = 11203;
@@ -58,9 +71,23 @@ int main(int narg, char *args[])
             return 1;
         }
     }
+    int iodepth = 1;
+    if (narg >= 4)
+    {
+        iodepth = atoi(args[3]);
+        if (iodepth <= 0)
+        {
+            printf("Bad iodepth\n");
+            return 1;
+        }
+    }
     signal(SIGINT, handle_sigint);
     int peer_fd = connect_stub(args[1], port);
-    run_bench(peer_fd);
+    clock_gettime(CLOCK_REALTIME, &bench_start);
+    if (iodepth > 1)
+        run_bench_iodepth(peer_fd, iodepth);
+    else
+        run_bench(peer_fd);
     close(peer_fd);
     return 0;
 }
@@ -194,3 +221,66 @@ void run_bench(int peer_fd)
         tv_begin = tv_end;
     }
 }
+
+void run_bench_iodepth(int peer_fd, int iodepth)
+{
+    osd_any_op_t op;
+    osd_any_reply_t reply;
+    uint64_t next_id = 1;
+    // Replies may come in any order, remember send time by request id
+    std::map<uint64_t, timespec> inflight;
+    void *buf = malloc(4096);
+    int r;
+    while (1)
+    {
+        while (inflight.size() < iodepth)
+        {
+            op.hdr.magic = SECONDARY_OSD_OP_MAGIC;
+            op.hdr.id = next_id++;
+            op.hdr.opcode = OSD_OP_SEC_READ;
+            op.sec_rw.oid.inode = 3;
+            op.sec_rw.oid.stripe = (rand() << 17) % (1 << 29); // 512 MB
+            op.sec_rw.version = 0;
+            op.sec_rw.len = 4096;
+            op.sec_rw.offset = (rand() * op.sec_rw.len) % (1 << 17);
+            op.sec_rw.attr_len = 0;
+            clock_gettime(CLOCK_REALTIME, &inflight[op.hdr.id]);
+            r = write_blocking(peer_fd, op.buf, OSD_PACKET_SIZE) == OSD_PACKET_SIZE;
+            if (!r)
+                goto out;
+        }
+        r = read_blocking(peer_fd, reply.buf, OSD_PACKET_SIZE);
+        if (r != OSD_PACKET_SIZE || reply.hdr.magic != SECONDARY_OSD_REPLY_MAGIC ||
+            reply.hdr.opcode != OSD_OP_SEC_READ || reply.hdr.retval != 4096)
+        {
+            printf("bad reply\n");
+            goto out;
+        }
+        auto it = inflight.find(reply.hdr.id);
+        if (it == inflight.end())
+        {
+            printf("bad reply: unknown id %lu\n", reply.hdr.id);
+            goto out;
+        }
+        // Skip the bitmap and read data
+        for (uint32_t bmp_len = reply.sec_rw.attr_len; bmp_len > 0; )
+        {
+            uint32_t n = bmp_len < 4096 ? bmp_len : 4096;
+            if (read_blocking(peer_fd, buf, n) != n)
+                goto out;
+            bmp_len -= n;
+        }
+        if (read_blocking(peer_fd, buf, 4096) != 4096)
+            goto out;
+        timespec tv_end;
+        clock_gettime(CLOCK_REALTIME, &tv_end);
+        read_count++;
+        read_sum += (
+            (tv_end.tv_sec - it->second.tv_sec)*1000000 +
+            tv_end.tv_nsec/1000 - it->second.tv_nsec/1000
+        );
+        inflight.erase(it);
+    }
+out:
+    free(buf);
+}
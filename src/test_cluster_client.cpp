@@ -4,11 +4,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
 #include "cluster_client.h"
+#include "vitastor_c_impl.h"
 
-void configure_single_pg_pool(cluster_client_t *cli)
+void configure_single_pg_pool(etcd_state_client_t *st_cli)
 {
-    cli->st_cli.parse_state((etcd_kv_t){
+    st_cli->parse_state((etcd_kv_t){
         .key = "/config/pools",
         .value = json11::Json::object {
             { "1", json11::Json::object {
@@ -21,7 +24,7 @@ void configure_single_pg_pool(cluster_client_t *cli)
             } }
         },
     });
-    cli->st_cli.parse_state((etcd_kv_t){
+    st_cli->parse_state((etcd_kv_t){
         .key = "/config/pgs",
         .value = json11::Json::object {
             { "items", json11::Json::object {
@@ -34,7 +37,7 @@ void configure_single_pg_pool(cluster_client_t *cli)
             } }
         },
     });
-    cli->st_cli.parse_state((etcd_kv_t){
+    st_cli->parse_state((etcd_kv_t){
         .key = "/pg/state/1/1",
         .value = json11::Json::object {
             { "peers", json11::Json::array { 1, 2 } },
@@ -42,9 +45,14 @@ void configure_single_pg_pool(cluster_client_t *cli)
             { "state", json11::Json::array { "active" } },
         },
     });
-    cli->st_cli.on_load_pgs_hook(true);
+    st_cli->on_load_pgs_hook(true);
     std::map<std::string, etcd_kv_t> changes;
-    cli->st_cli.on_change_hook(changes);
+    st_cli->on_change_hook(changes);
+}
+
+void configure_single_pg_pool(cluster_client_t *cli)
+{
+    configure_single_pg_pool(&cli->st_cli);
 }
 
 int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c, std::function<void()> cb = NULL)
@@ -111,11 +119,17 @@ void check_completed(int *r)
 void pretend_connected(cluster_client_t *cli, osd_num_t osd_num)
 {
     printf("OSD %lu connected\n", osd_num);
-    int peer_fd = cli->msgr.clients.size() ? std::prev(cli->msgr.clients.end())->first+1 : 10;
+    int peer_fd = 10;
+    for (auto & cp: cli->msgr.clients)
+    {
+        if (cp.first >= peer_fd)
+            peer_fd = cp.first+1;
+    }
     cli->msgr.osd_peer_fds[osd_num] = peer_fd;
     cli->msgr.clients[peer_fd] = new osd_client_t();
     cli->msgr.clients[peer_fd]->osd_num = osd_num;
     cli->msgr.clients[peer_fd]->peer_state = PEER_CONNECTED;
+    cli->msgr.clients[peer_fd]->write_zeroes = true;
     cli->msgr.wanted_peers.erase(osd_num);
     cli->msgr.repeer_pgs(osd_num);
 }
@@ -163,11 +177,8 @@ osd_op_t *find_op(cluster_client_t *cli, osd_num_t osd_num, uint64_t opcode, uin
     return NULL;
 }
 
-void pretend_op_completed(cluster_client_t *cli, osd_op_t *op, int64_t retval)
+void reply_op(cluster_client_t *cli, osd_op_t *op, int64_t retval)
 {
-    assert(op);
-    printf("Pretend completed %s %lx+%x\n", op->req.hdr.opcode == OSD_OP_SYNC
-        ? "sync" : (op->req.hdr.opcode == OSD_OP_WRITE ? "write" : "read"), op->req.rw.offset, op->req.rw.len);
     uint64_t op_id = op->req.hdr.id;
     int peer_fd = op->peer_fd;
     cli->msgr.clients[peer_fd]->sent_ops.erase(op_id);
@@ -179,6 +190,14 @@ void pretend_op_completed(cluster_client_t *cli, osd_op_t *op, int64_t retval)
     std::function<void(osd_op_t*)>(op->callback)(op);
 }
 
+void pretend_op_completed(cluster_client_t *cli, osd_op_t *op, int64_t retval)
+{
+    assert(op);
+    printf("Pretend completed %s %lx+%x\n", op->req.hdr.opcode == OSD_OP_SYNC
+        ? "sync" : (op->req.hdr.opcode == OSD_OP_WRITE ? "write" : "read"), op->req.rw.offset, op->req.rw.len);
+    reply_op(cli, op, retval);
+}
+
 void test1()
 {
     json11::Json config;
@@ -321,9 +340,9 @@ void test1()
     check_disconnected(cli, 1);
     pretend_connected(cli, 1);
     cli->continue_ops(true);
-    check_op_count(cli, 1, 2);
-    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
-    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
+    // Both dirty buffers are merged and repeated as a single write
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x2000), 0);
     check_op_count(cli, 1, 1);
     can_complete(r2);
     pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
@@ -346,36 +365,27 @@ void test2()
     op->iov.push_back(malloc_or_die(4096*1024), 4096);
     // 0-4k = 0x55
     memset(op->iov.buf[0].iov_base, 0x55, op->iov.buf[0].iov_len);
-    cluster_client_t::copy_write(op, unsynced_writes);
+    cluster_client_t::copy_write(op, unsynced_writes, 128*1024);
     // 8k-12k = 0x66
     op->offset = 8192;
     memset(op->iov.buf[0].iov_base, 0x66, op->iov.buf[0].iov_len);
-    cluster_client_t::copy_write(op, unsynced_writes);
+    cluster_client_t::copy_write(op, unsynced_writes, 128*1024);
+    assert(unsynced_writes.size() == 2);
     // 4k-1M+4k = 0x77
     op->len = op->iov.buf[0].iov_len = 1048576;
     op->offset = 4096;
     memset(op->iov.buf[0].iov_base, 0x77, op->iov.buf[0].iov_len);
-    cluster_client_t::copy_write(op, unsynced_writes);
-    // check it
-    assert(unsynced_writes.size() == 4);
+    cluster_client_t::copy_write(op, unsynced_writes, 128*1024);
+    // check it: 0-12k are merged because they're in the same object, 12k-1M+4k crosses objects
+    assert(unsynced_writes.size() == 2);
     auto uit = unsynced_writes.begin();
     int i;
     assert(uit->first.inode == 1);
     assert(uit->first.stripe == 0);
-    assert(uit->second.len == 4096);
-    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x55; i++) {}
-    assert(i == uit->second.len);
-    uit++;
-    assert(uit->first.inode == 1);
-    assert(uit->first.stripe == 4096);
-    assert(uit->second.len == 4096);
-    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
-    assert(i == uit->second.len);
-    uit++;
-    assert(uit->first.inode == 1);
-    assert(uit->first.stripe == 8192);
-    assert(uit->second.len == 4096);
-    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
+    assert(uit->second.len == 12*1024);
+    for (i = 0; i < 4096 && ((uint8_t*)uit->second.buf)[i] == 0x55; i++) {}
+    assert(i == 4096);
+    for (; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
     assert(i == uit->second.len);
     uit++;
     assert(uit->first.inode == 1);
@@ -384,6 +394,18 @@ void test2()
     for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
     assert(i == uit->second.len);
     uit++;
+    // sequential writes are merged up to the object boundary
+    op->len = op->iov.buf[0].iov_len = 64*1024;
+    for (int j = 0; j < 4; j++)
+    {
+        op->offset = 2*1024*1024 + j*64*1024;
+        cluster_client_t::copy_write(op, unsynced_writes, 128*1024);
+    }
+    assert(unsynced_writes.size() == 4);
+    uit = unsynced_writes.find((object_id){ .inode = 1, .stripe = 2*1024*1024 });
+    assert(uit != unsynced_writes.end() && uit->second.len == 128*1024);
+    uit++;
+    assert(uit != unsynced_writes.end() && uit->first.stripe == 2*1024*1024+128*1024 && uit->second.len == 128*1024);
     // free memory
     free(op->iov.buf[0].iov_base);
     delete op;
@@ -394,9 +416,853 @@ void test2()
     printf("[ok] copy_write test\n");
 }
 
+void test3()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+
+    // Write(1) -> Sync(1) -> Write(2) -> Write(3) -> Sync(2) -> Write(4)
+    // Sync(1) must wait for Write(1), Write(2) and Write(3) must wait for Sync(1),
+    // Sync(2) must wait for both Write(2) and Write(3), Write(4) must wait for Sync(2)
+    int *w1 = test_write(cli, 0, 0x1000, 0x61);
+    int *s1 = test_sync(cli);
+    int *w2 = test_write(cli, 0x1000, 0x1000, 0x62);
+    int *w3 = test_write(cli, 0x2000, 0x1000, 0x63);
+    int *s2 = test_sync(cli);
+    int *w4 = test_write(cli, 0x3000, 0x1000, 0x64);
+    check_op_count(cli, 1, 1);
+    can_complete(w1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
+    check_completed(w1);
+    check_op_count(cli, 1, 1);
+    can_complete(s1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(s1);
+    check_op_count(cli, 1, 2);
+    can_complete(w3);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x2000, 0x1000), 0);
+    check_completed(w3);
+    check_op_count(cli, 1, 1);
+    can_complete(w2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
+    check_completed(w2);
+    check_op_count(cli, 1, 1);
+    can_complete(s2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(s2);
+    check_op_count(cli, 1, 1);
+    can_complete(w4);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x3000, 0x1000), 0);
+    check_completed(w4);
+    check_op_count(cli, 1, 0);
+
+    s1 = test_sync(cli);
+    can_complete(s1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(s1);
+
+    // Replayed writes (flushes) must block following writes and syncs
+    w1 = test_write(cli, 0, 0x1000, 0x65);
+    check_op_count(cli, 1, 1);
+    pretend_disconnected(cli, 1);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+    w2 = test_write(cli, 0x1000, 0x1000, 0x66);
+    s1 = test_sync(cli);
+    // Only the flush of the unsynced buffer is sent
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
+    check_op_count(cli, 1, 2);
+    can_complete(w1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
+    check_completed(w1);
+    check_op_count(cli, 1, 1);
+    can_complete(w2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
+    check_completed(w2);
+    check_op_count(cli, 1, 1);
+    can_complete(s1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(s1);
+    check_op_count(cli, 1, 0);
+
+    delete cli;
+    delete tfd;
+    printf("[ok] write/sync ordering test\n");
+}
+
+void test4()
+{
+    cluster_read_cache_t cache;
+    cache.set_max_size(8*4096);
+    uint8_t *buf = (uint8_t*)malloc_or_die(8*4096);
+    uint8_t *out = (uint8_t*)malloc_or_die(8*4096);
+    for (int i = 0; i < 8*4096; i++)
+        buf[i] = i % 251;
+    // 6 blocks crossing the object boundary, split into 2 iovecs
+    osd_op_buf_list_t iov;
+    iov.push_back(buf, 3*4096);
+    iov.push_back(buf+3*4096, 3*4096);
+    uint8_t bitmap[8] = { 0x15 }, out_bitmap[8] = { 0 };
+    cache.insert(1, 0x20000-0x2000, 0x6000, 0x20000, 4096, iov, bitmap, 0, 0);
+    osd_op_buf_list_t out_iov;
+    out_iov.push_back(out, 6*4096);
+    uint64_t version = 1;
+    assert(cache.read(1, 0x20000-0x2000, 0x6000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    assert(out_bitmap[0] == 0x15 && version == 0 && !memcmp(out, buf, 0x6000));
+    // Partially cached range is a miss
+    assert(!cache.read(1, 0x20000-0x3000, 0x2000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    // Writes invalidate only the overlapping blocks
+    cache.invalidate(1, 0x21000, 0x1000);
+    assert(!cache.read(1, 0x20000-0x2000, 0x6000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    assert(cache.read(1, 0x20000-0x2000, 0x3000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    // Least recently used blocks are evicted
+    iov.reset();
+    iov.push_back(buf, 0x8000);
+    cache.insert(2, 0, 0x8000, 0x20000, 4096, iov, bitmap, 0, 5);
+    assert(!cache.read(1, 0x20000-0x2000, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    assert(cache.read(2, 0, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version) && version == 5);
+    // Changed object version drops the object
+    cache.check_version(2, 0, 6);
+    assert(!cache.read(2, 0, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    // Single-object reads with unknown version are not served
+    cache.insert(3, 0, 0x1000, 0x20000, 4096, iov, bitmap, 0, UINT64_MAX);
+    assert(!cache.read(3, 0, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    // Objects with tracked versions expire after the TTL until their version is checked again
+    cache.version_ttl_ms = 10;
+    cache.insert(4, 0, 0x1000, 0x20000, 4096, iov, bitmap, 0, 7);
+    cache.insert(5, 0, 0x1000, 0x20000, 4096, iov, bitmap, 0, 0);
+    assert(cache.read(4, 0, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version) && version == 7);
+    usleep(20000);
+    assert(!cache.read(4, 0, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    cache.check_version(4, 0, 7);
+    assert(cache.read(4, 0, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version) && version == 7);
+    // Objects of read-only inodes don't expire
+    assert(cache.read(5, 0, 0x1000, 0x20000, 4096, out_iov, out_bitmap, &version));
+    free(buf);
+    free(out);
+    printf("[ok] read cache test\n");
+}
+
+static cluster_op_t *wb_test_op(uint64_t opcode, uint64_t offset, uint64_t len, uint8_t c, int *done)
+{
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = opcode;
+    op->inode = 0x1000000000001;
+    op->offset = offset;
+    op->len = len;
+    if (len)
+    {
+        op->iov.push_back(malloc_or_die(len), len);
+        memset(op->iov.buf[0].iov_base, c, len);
+    }
+    op->callback = [done](cluster_op_t *op)
+    {
+        *done = op->retval == (op->opcode == OSD_OP_SYNC ? 0 : op->len) ? 1 : 0;
+    };
+    return op;
+}
+
+static void wb_test_free(cluster_op_t *op)
+{
+    if (op->iov.count)
+        free(op->iov.buf[0].iov_base);
+    delete op;
+}
+
+static bool check_buf(void *buf, uint64_t len, uint8_t c)
+{
+    for (uint64_t i = 0; i < len; i++)
+        if (((uint8_t*)buf)[i] != c)
+            return false;
+    return true;
+}
+
+// Write-back cache: writes and syncs complete without OSDs, journal is replayed after a "crash"
+void test5()
+{
+    const char *path = "/tmp/test_cluster_client_wb.bin";
+    unlink(path);
+    json11::Json config = json11::Json::object {
+        { "client_writeback_cache", path },
+        { "client_writeback_cache_size", 1024*1024 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    int r1 = -1, r2 = -1, r3 = -1;
+    cluster_op_t *op1 = wb_test_op(OSD_OP_WRITE, 0, 4096, 0x55, &r1);
+    cluster_op_t *op2 = wb_test_op(OSD_OP_WRITE, 4096, 4096, 0x66, &r2);
+    cluster_op_t *op3 = wb_test_op(OSD_OP_SYNC, 0, 0, 0, &r3);
+    cli->execute(op1);
+    cli->execute(op2);
+    cli->execute(op3);
+    assert(r1 == 1 && r2 == 1 && r3 == 1);
+    wb_test_free(op1);
+    wb_test_free(op2);
+    wb_test_free(op3);
+    // Crash before destaging anything
+    delete cli;
+    cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    // Both writes are destaged as a single one
+    check_op_count(cli, 1, 1);
+    osd_op_t *wr = find_op(cli, 1, OSD_OP_WRITE, 0, 8192);
+    assert(wr);
+    assert(wr->iov.count == 1 && wr->iov.buf[0].iov_len == 8192);
+    assert(check_buf(wr->iov.buf[0].iov_base, 4096, 0x55));
+    assert(check_buf((uint8_t*)wr->iov.buf[0].iov_base + 4096, 4096, 0x66));
+    // Reads return dirty data
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 0, 8192, 0, &r1);
+    cli->execute(op1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 8192), 0);
+    assert(r1 == 1);
+    assert(check_buf(op1->iov.buf[0].iov_base, 4096, 0x55));
+    assert(check_buf((uint8_t*)op1->iov.buf[0].iov_base + 4096, 4096, 0x66));
+    wb_test_free(op1);
+    pretend_op_completed(cli, wr, 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_op_count(cli, 1, 0);
+    delete cli;
+    // Nothing is replayed after destaging
+    cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    check_op_count(cli, 1, 0);
+    delete cli;
+    // Destaging sends a limited number of writes at a time
+    cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    for (int i = 0; i < 20; i++)
+    {
+        r1 = -1;
+        op1 = wb_test_op(OSD_OP_WRITE, i*8192, 4096, 0x10+i, &r1);
+        cli->execute(op1);
+        assert(r1 == 1);
+        wb_test_free(op1);
+    }
+    delete cli;
+    cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    check_op_count(cli, 1, 16);
+    for (int i = 0; i < 20; i++)
+    {
+        wr = find_op(cli, 1, OSD_OP_WRITE, i*8192, 4096);
+        assert(wr && check_buf(wr->iov.buf[0].iov_base, 4096, 0x10+i));
+        pretend_op_completed(cli, wr, 0);
+    }
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_op_count(cli, 1, 0);
+    delete cli;
+    delete tfd;
+    unlink(path);
+    printf("[ok] write-back cache test\n");
+}
+
+static void fill_read(osd_op_t *op, uint8_t c)
+{
+    assert(op);
+    for (int i = 0; i < op->iov.count; i++)
+        memset(op->iov.buf[i].iov_base, c, op->iov.buf[i].iov_len);
+}
+
+// Sequential read-ahead: hits, waiting for data in progress and invalidation by writes
+void test6()
+{
+    json11::Json config = json11::Json::object {
+        { "client_readahead_size", 1024*1024 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    // The first read starts a stream with a window of 4 reads
+    int r1 = -1;
+    cluster_op_t *op1 = wb_test_op(OSD_OP_READ, 0, 4096, 0, &r1);
+    cli->execute(op1);
+    check_op_count(cli, 1, 2);
+    osd_op_t *ra_op = find_op(cli, 1, OSD_OP_READ, 4096, 16384);
+    fill_read(ra_op, 0x77);
+    pretend_op_completed(cli, ra_op, 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 4096), 0);
+    assert(r1 == 1);
+    wb_test_free(op1);
+    // The next read is a hit and starts the next read-ahead with a doubled window
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 4096, 4096, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == 1 && check_buf(op1->iov.buf[0].iov_base, 4096, 0x77));
+    wb_test_free(op1);
+    assert(cli->readahead_stats.hits == 1 && cli->readahead_stats.misses == 1);
+    check_op_count(cli, 1, 1);
+    ra_op = find_op(cli, 1, OSD_OP_READ, 20480, 20480);
+    assert(ra_op);
+    // Writes discard read-ahead data, the gap is read again
+    int w1 = -1;
+    cluster_op_t *wr1 = wb_test_op(OSD_OP_WRITE, 8192, 4096, 0x55, &w1);
+    cli->execute(wr1);
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 8192, 4096, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == -1 && find_op(cli, 1, OSD_OP_READ, 8192, 4096));
+    check_op_count(cli, 1, 4);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 8192, 4096), 0);
+    assert(r1 == 1);
+    wb_test_free(op1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 8192, 4096), 0);
+    assert(w1 == 1);
+    wb_test_free(wr1);
+    // Reads of data in progress wait for it
+    int r2 = -1;
+    cluster_op_t *op2 = wb_test_op(OSD_OP_READ, 12288, 8192, 0, &r2);
+    cli->execute(op2);
+    assert(r2 == -1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 12288, 8192), 0);
+    assert(r2 == 1);
+    wb_test_free(op2);
+    r2 = -1;
+    op2 = wb_test_op(OSD_OP_READ, 20480, 4096, 0, &r2);
+    cli->execute(op2);
+    assert(r2 == -1);
+    fill_read(ra_op, 0x88);
+    pretend_op_completed(cli, ra_op, 0);
+    assert(r2 == 1 && check_buf(op2->iov.buf[0].iov_base, 4096, 0x88));
+    wb_test_free(op2);
+    delete cli;
+    delete tfd;
+    printf("[ok] read-ahead test\n");
+}
+
+// Read-ahead of a client owning only even objects, like an I/O thread of the multi-threaded client
+void test6_owned()
+{
+    json11::Json config = json11::Json::object {
+        { "client_readahead_size", 1024*1024 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    cli->readahead_object_owned = [](uint64_t inode, uint64_t object_num) { return object_num % 2 == 0; };
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    // Read-ahead of the second sequential read stops at the end of object 2
+    int r1 = -1;
+    cluster_op_t *op1 = wb_test_op(OSD_OP_READ, 256*1024, 32768, 0, &r1);
+    cli->execute(op1);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 256*1024, 32768), 0);
+    assert(r1 == 1);
+    wb_test_free(op1);
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 288*1024, 32768, 0, &r1);
+    cli->execute(op1);
+    check_op_count(cli, 1, 2);
+    osd_op_t *ra_op = find_op(cli, 1, OSD_OP_READ, 320*1024, 64*1024);
+    fill_read(ra_op, 0x77);
+    pretend_op_completed(cli, ra_op, 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 288*1024, 32768), 0);
+    assert(r1 == 1);
+    wb_test_free(op1);
+    // Hits move the window, read-ahead skips object 3 owned by another client and continues
+    // with object 4, and a read of object 4 continues the stream
+    for (uint64_t offset = 320*1024; offset < 384*1024; offset += 32768)
+    {
+        r1 = -1;
+        op1 = wb_test_op(OSD_OP_READ, offset, 32768, 0, &r1);
+        cli->execute(op1);
+        assert(r1 == 1 && check_buf(op1->iov.buf[0].iov_base, 32768, 0x77));
+        wb_test_free(op1);
+    }
+    assert(cli->readahead_stats.hits == 2);
+    check_op_count(cli, 1, 1);
+    ra_op = find_op(cli, 1, OSD_OP_READ, 512*1024, 128*1024);
+    assert(ra_op);
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 512*1024, 4096, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == -1);
+    fill_read(ra_op, 0x88);
+    pretend_op_completed(cli, ra_op, 0);
+    assert(r1 == 1 && check_buf(op1->iov.buf[0].iov_base, 4096, 0x88));
+    wb_test_free(op1);
+    delete cli;
+    delete tfd;
+    printf("[ok] read-ahead of owned objects test\n");
+}
+
+// In-memory commit: writes complete before OSDs reply, reads of such data are served from memory
+void test7()
+{
+    json11::Json config = json11::Json::object {
+        { "client_inmemory_flush_interval", 0 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/config/inode/1/1",
+        .value = json11::Json::object {
+            { "name", "scratch" },
+            { "size", 1024*1024 },
+            { "meta", json11::Json::object { { "inmemory_commit", true } } },
+        },
+    });
+    pretend_connected(cli, 1);
+    int w1 = -1;
+    cluster_op_t *wr1 = wb_test_op(OSD_OP_WRITE, 0, 8192, 0x55, &w1);
+    cli->execute(wr1);
+    assert(w1 == 1);
+    wb_test_free(wr1);
+    osd_op_t *bg_op = find_op(cli, 1, OSD_OP_WRITE, 0, 8192);
+    assert(bg_op);
+    // Fully covered reads don't go to OSDs
+    int r1 = -1;
+    cluster_op_t *op1 = wb_test_op(OSD_OP_READ, 0, 4096, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == 1 && check_buf(op1->iov.buf[0].iov_base, 4096, 0x55));
+    wb_test_free(op1);
+    check_op_count(cli, 1, 1);
+    // Partially covered reads are overlaid with acknowledged data
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 4096, 8192, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == -1);
+    osd_op_t *rd = find_op(cli, 1, OSD_OP_READ, 4096, 8192);
+    fill_read(rd, 0x11);
+    pretend_op_completed(cli, rd, 0);
+    assert(r1 == 1);
+    assert(check_buf(op1->iov.buf[0].iov_base, 4096, 0x55));
+    assert(check_buf((uint8_t*)op1->iov.buf[0].iov_base + 4096, 4096, 0x11));
+    wb_test_free(op1);
+    // SYNC waits for the background write, writes after it are blocked, but still readable
+    int s1 = -1;
+    cluster_op_t *sync1 = wb_test_op(OSD_OP_SYNC, 0, 0, 0, &s1);
+    cli->execute(sync1);
+    int w2 = -1;
+    cluster_op_t *wr2 = wb_test_op(OSD_OP_WRITE, 0, 4096, 0x77, &w2);
+    cli->execute(wr2);
+    assert(w2 == 1 && s1 == -1);
+    wb_test_free(wr2);
+    check_op_count(cli, 1, 1);
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 0, 8192, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == 1 && check_buf(op1->iov.buf[0].iov_base, 4096, 0x77));
+    assert(check_buf((uint8_t*)op1->iov.buf[0].iov_base + 4096, 4096, 0x55));
+    wb_test_free(op1);
+    pretend_op_completed(cli, bg_op, 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    assert(s1 == 1);
+    wb_test_free(sync1);
+    // The old data is freed after SYNC, the new one is written
+    bg_op = find_op(cli, 1, OSD_OP_WRITE, 0, 4096);
+    assert(bg_op);
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 4096, 4096, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == -1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 4096, 4096), 0);
+    assert(r1 == 1);
+    wb_test_free(op1);
+    pretend_op_completed(cli, bg_op, 0);
+    check_op_count(cli, 1, 0);
+    // Errors of background writes are returned by the next SYNC
+    w1 = -1;
+    wr1 = wb_test_op(OSD_OP_WRITE, 0, 4096, 0x99, &w1);
+    cli->execute(wr1);
+    assert(w1 == 1);
+    wb_test_free(wr1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 4096), -EIO);
+    s1 = -1;
+    sync1 = wb_test_op(OSD_OP_SYNC, 0, 0, 0, &s1);
+    cli->execute(sync1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    assert(s1 == 0 && sync1->retval == -EIO);
+    wb_test_free(sync1);
+    s1 = -1;
+    sync1 = wb_test_op(OSD_OP_SYNC, 0, 0, 0, &s1);
+    cli->execute(sync1);
+    assert(s1 == 1);
+    wb_test_free(sync1);
+    // Reads in progress keep acknowledged data synced and freed before they complete,
+    // and aren't restarted by SYNCs
+    w1 = -1;
+    wr1 = wb_test_op(OSD_OP_WRITE, 0, 4096, 0x66, &w1);
+    cli->execute(wr1);
+    assert(w1 == 1);
+    wb_test_free(wr1);
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_READ, 0, 8192, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == -1);
+    rd = find_op(cli, 1, OSD_OP_READ, 0, 8192);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 4096), 0);
+    s1 = -1;
+    sync1 = wb_test_op(OSD_OP_SYNC, 0, 0, 0, &s1);
+    cli->execute(sync1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    assert(s1 == 1);
+    wb_test_free(sync1);
+    fill_read(rd, 0x11);
+    pretend_op_completed(cli, rd, 0);
+    assert(r1 == 1);
+    assert(check_buf(op1->iov.buf[0].iov_base, 4096, 0x66));
+    assert(check_buf((uint8_t*)op1->iov.buf[0].iov_base + 4096, 4096, 0x11));
+    wb_test_free(op1);
+    check_op_count(cli, 1, 0);
+    delete cli;
+    delete tfd;
+    printf("[ok] in-memory commit test\n");
+}
+
+void test8()
+{
+    std::map<object_id, cluster_buffer_t> unsynced_writes;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_WRITE;
+    op->inode = 1;
+    op->offset = 0;
+    op->len = 8192;
+    op->iov.push_back(malloc_or_die(8192), 8192);
+    // 0-8k = 0x55
+    memset(op->iov.buf[0].iov_base, 0x55, op->iov.buf[0].iov_len);
+    cluster_client_t::copy_write(op, unsynced_writes, 128*1024);
+    // zero 4k-64k: data is zeroed in place and a range without data is added after it
+    cluster_op_t *zop = new cluster_op_t();
+    zop->opcode = OSD_OP_WRITE_ZEROES;
+    zop->inode = 1;
+    zop->offset = 4096;
+    zop->len = 60*1024;
+    cluster_client_t::copy_write(zop, unsynced_writes, 128*1024);
+    assert(unsynced_writes.size() == 2);
+    auto uit = unsynced_writes.begin();
+    assert(uit->first.stripe == 0 && uit->second.len == 8192 && uit->second.buf);
+    int i;
+    for (i = 0; i < 4096 && ((uint8_t*)uit->second.buf)[i] == 0x55; i++) {}
+    assert(i == 4096);
+    for (; i < 8192 && ((uint8_t*)uit->second.buf)[i] == 0; i++) {}
+    assert(i == 8192);
+    uit++;
+    assert(uit->first.stripe == 8192 && uit->second.len == 56*1024 && !uit->second.buf);
+    // 16k-20k = 0x66 splits the zeroed range
+    op->offset = 16384;
+    op->len = op->iov.buf[0].iov_len = 4096;
+    memset(op->iov.buf[0].iov_base, 0x66, op->iov.buf[0].iov_len);
+    cluster_client_t::copy_write(op, unsynced_writes, 128*1024);
+    assert(unsynced_writes.size() == 4);
+    uit = unsynced_writes.find((object_id){ .inode = 1, .stripe = 8192 });
+    assert(uit != unsynced_writes.end() && uit->second.len == 8192 && !uit->second.buf);
+    uit++;
+    assert(uit->first.stripe == 16384 && uit->second.len == 4096 && uit->second.buf);
+    for (i = 0; i < 4096 && ((uint8_t*)uit->second.buf)[i] == 0x66; i++) {}
+    assert(i == 4096);
+    uit++;
+    assert(uit->first.stripe == 20480 && uit->second.len == 44*1024 && !uit->second.buf);
+    // adjacent zeroed ranges are merged without allocating memory
+    zop->opcode = OSD_OP_DISCARD;
+    zop->offset = 64*1024;
+    zop->len = 32*1024;
+    cluster_client_t::copy_write(zop, unsynced_writes, 128*1024);
+    assert(unsynced_writes.size() == 4);
+    uit = unsynced_writes.find((object_id){ .inode = 1, .stripe = 20480 });
+    assert(uit != unsynced_writes.end() && uit->second.len == 76*1024 && !uit->second.buf);
+    // free memory
+    free(op->iov.buf[0].iov_base);
+    delete op;
+    delete zop;
+    for (auto p: unsynced_writes)
+    {
+        free(p.second.buf);
+    }
+    printf("[ok] write_zeroes copy_write test\n");
+}
+
+// WRITE_ZEROES and DISCARD sent to an OSD which doesn't support them
+void test8_old_osd()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    cli->msgr.clients.at(cli->msgr.osd_peer_fds.at(1))->write_zeroes = false;
+    // WRITE_ZEROES is sent as a usual write of zeroes
+    int r1 = -1;
+    cluster_op_t *op1 = wb_test_op(OSD_OP_WRITE_ZEROES, 4096, 8192, 0x55, &r1);
+    cli->execute(op1);
+    check_op_count(cli, 1, 1);
+    osd_op_t *wr = find_op(cli, 1, OSD_OP_WRITE, 4096, 8192);
+    assert(wr && wr->iov.count == 1 && wr->iov.buf[0].iov_len == 8192 && check_buf(wr->iov.buf[0].iov_base, 8192, 0));
+    pretend_op_completed(cli, wr, 0);
+    assert(r1 == 1);
+    wb_test_free(op1);
+    // DISCARD fails without being sent
+    r1 = -1;
+    op1 = wb_test_op(OSD_OP_DISCARD, 4096, 8192, 0, &r1);
+    cli->execute(op1);
+    assert(r1 == 0 && op1->retval == -EOPNOTSUPP);
+    wb_test_free(op1);
+    check_op_count(cli, 1, 0);
+    assert(cli->msgr.osd_peer_fds.find(1) != cli->msgr.osd_peer_fds.end());
+    delete cli;
+    delete tfd;
+    printf("[ok] WRITE_ZEROES and DISCARD with an old OSD test\n");
+}
+
+// Post <depth> writes, a sync and <depth> more writes, then complete everything
+// and check that the writes following the sync only complete after it
+void bench_queue_depth(int depth)
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    // Dirty limits are taken from the global configuration
+    json11::Json::object global_config = {
+        { "client_max_dirty_ops", 1000000 },
+        { "client_max_dirty_bytes", 1ul << 40 },
+    };
+    cli->st_cli.on_load_config_hook(global_config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    void *buf = malloc_or_die(0x1000);
+    int syncs_done = 0, ops_done = 0;
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 2*depth+1; i++)
+    {
+        cluster_op_t *op = new cluster_op_t();
+        if (i == depth)
+        {
+            op->opcode = OSD_OP_SYNC;
+        }
+        else
+        {
+            op->opcode = OSD_OP_WRITE;
+            op->inode = 0x1000000000001;
+            op->offset = i*0x1000;
+            op->len = 0x1000;
+            op->iov.push_back(buf, 0x1000);
+        }
+        int gen = i > depth ? 1 : 0;
+        op->callback = [&syncs_done, &ops_done, gen](cluster_op_t *op)
+        {
+            assert(op->retval == (op->opcode == OSD_OP_SYNC ? 0 : op->len));
+            assert(syncs_done >= gen);
+            if (op->opcode == OSD_OP_SYNC)
+                syncs_done++;
+            ops_done++;
+            delete op;
+        };
+        cli->execute(op);
+    }
+    check_op_count(cli, 1, depth);
+    auto osd_cl = cli->msgr.clients.at(cli->msgr.osd_peer_fds.at(1));
+    while (osd_cl->sent_ops.size())
+    {
+        reply_op(cli, osd_cl->sent_ops.begin()->second, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(ops_done == 2*depth+1 && syncs_done == 1);
+    uint64_t ns = (end.tv_sec-start.tv_sec)*1000000000ul + end.tv_nsec - start.tv_nsec;
+    printf("queue depth %d: %lu ns per operation\n", depth, ns/(2*depth+1));
+    free(buf);
+    delete cli;
+    delete tfd;
+}
+
+static void test_c_set_fd_handler(void *ctx, int fd, int is_external, IOHandler *fd_read, IOHandler *fd_write, void *poll_fn, void *opaque)
+{
+}
+
+static void test_c_io_cb(void *opaque, long retval)
+{
+    *(long*)opaque = retval;
+}
+
+static void test_c_read_cb(void *opaque, long retval, uint64_t version)
+{
+    *(long*)opaque = retval;
+}
+
+// C API with the single-threaded client
+void test9()
+{
+    vitastor_c *client = vitastor_c_create_qemu(test_c_set_fd_handler, NULL, NULL, NULL, NULL, -1, NULL, 0, 0, 0, 0);
+    cluster_client_t *cli = client->cli;
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    assert(vitastor_c_is_ready(client));
+    uint8_t *buf = (uint8_t*)malloc_or_die(8192);
+    iovec iov = { .iov_base = buf, .iov_len = 8192 };
+    // Callback API
+    long w = -1;
+    memset(buf, 0x55, 8192);
+    vitastor_c_write(client, 0x1000000000001, 0, 8192, 0, &iov, 1, test_c_io_cb, &w);
+    assert(w == -1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 8192), 0);
+    assert(w == 8192);
+    long r = -1;
+    vitastor_c_read(client, 0x1000000000001, 0, 8192, &iov, 1, test_c_read_cb, &r);
+    osd_op_t *rd = find_op(cli, 1, OSD_OP_READ, 0, 8192);
+    fill_read(rd, 0x66);
+    pretend_op_completed(cli, rd, 0);
+    assert(r == 8192 && check_buf(buf, 8192, 0x66));
+    long z = -1;
+    vitastor_c_write_zeroes(client, 0x1000000000001, 8192, 4096, test_c_io_cb, &z);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE_ZEROES, 8192, 4096), 0);
+    assert(z == 4096);
+    long s = -1;
+    vitastor_c_sync(client, test_c_io_cb, &s);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    assert(s == 0);
+    // Batched API
+    vitastor_c_op wr_op = { .opcode = VITASTOR_OP_WRITE, .inode = 0x1000000000001, .offset = 16384, .len = 8192, .iov = &iov, .iovcnt = 1 };
+    vitastor_c_op bad_op = { .opcode = 100 };
+    vitastor_c_op sync_op = { .opcode = VITASTOR_OP_SYNC };
+    vitastor_c_op *ops[] = { &wr_op, &bad_op, &sync_op };
+    vitastor_c_op *done[4];
+    vitastor_c_submit(client, ops, 3);
+    assert(vitastor_c_get_completions(client, done, 4) == 1 && done[0] == &bad_op && bad_op.retval == -EINVAL);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 16384, 8192), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    assert(vitastor_c_get_completions(client, done, 4) == 2);
+    assert(done[0] == &wr_op && wr_op.retval == 8192);
+    assert(done[1] == &sync_op && sync_op.retval == 0);
+    check_op_count(cli, 1, 0);
+    free(buf);
+    vitastor_c_destroy(client);
+    printf("[ok] C API test\n");
+}
+
+// Complete all operations sent to OSD 1 by I/O threads of the multi-threaded client
+static void complete_mt_ops(cluster_client_mt_t *mt)
+{
+    std::mutex mu;
+    std::condition_variable cv;
+    int left = mt->thread_count();
+    mt->run_in_threads([&](cluster_client_t *cli)
+    {
+        std::vector<osd_op_t*> sent;
+        for (auto & op_p: cli->msgr.clients.at(cli->msgr.osd_peer_fds.at(1))->sent_ops)
+        {
+            sent.push_back(op_p.second);
+        }
+        for (auto op: sent)
+        {
+            if (op->req.hdr.opcode == OSD_OP_READ)
+                fill_read(op, 0x77);
+            pretend_op_completed(cli, op, 0);
+        }
+        std::lock_guard<std::mutex> lock(mu);
+        left--;
+        cv.notify_all();
+    });
+    std::unique_lock<std::mutex> lock(mu);
+    cv.wait(lock, [&]() { return left == 0; });
+}
+
+// C API with the multi-threaded client
+void test10()
+{
+    vitastor_c *client = vitastor_c_create_mt(NULL, 0, 2);
+    {
+        std::lock_guard<std::mutex> lock(client->mt->state_mutex);
+        configure_single_pg_pool(client->mt->st_cli);
+    }
+    vitastor_c_uring_wait_ready(client);
+    assert(vitastor_c_is_ready(client));
+    assert(vitastor_c_inode_get_block_size(client, 0x1000000000001) == 128*1024);
+    client->mt->run_in_threads([](cluster_client_t *cli) { pretend_connected(cli, 1); });
+    uint8_t *buf = (uint8_t*)malloc_or_die(8192);
+    iovec iov = { .iov_base = buf, .iov_len = 8192 };
+    memset(buf, 0x55, 8192);
+    // The write and the read cross the object boundary, so they're split between both threads
+    vitastor_c_op wr_op = { .opcode = VITASTOR_OP_WRITE, .inode = 0x1000000000001, .offset = 124*1024, .len = 8192, .iov = &iov, .iovcnt = 1 };
+    vitastor_c_op zero_op = { .opcode = VITASTOR_OP_WRITE_ZEROES, .inode = 0x1000000000001, .offset = 0, .len = 4096 };
+    vitastor_c_op sync_op = { .opcode = VITASTOR_OP_SYNC };
+    vitastor_c_op *ops[] = { &wr_op, &zero_op, &sync_op };
+    vitastor_c_submit(client, ops, 3);
+    vitastor_c_op *done[4];
+    int done_count = 0;
+    for (int i = 0; i < 10 && done_count < 3; i++)
+    {
+        complete_mt_ops(client->mt);
+        done_count += vitastor_c_get_completions(client, done+done_count, 4-done_count);
+    }
+    assert(done_count == 3);
+    assert(wr_op.retval == 8192 && zero_op.retval == 4096 && sync_op.retval == 0);
+    vitastor_c_op rd_op = { .opcode = VITASTOR_OP_READ, .inode = 0x1000000000001, .offset = 124*1024, .len = 8192, .iov = &iov, .iovcnt = 1 };
+    vitastor_c_op *rd_ops[] = { &rd_op };
+    vitastor_c_submit(client, rd_ops, 1);
+    done_count = 0;
+    for (int i = 0; i < 10 && !done_count; i++)
+    {
+        complete_mt_ops(client->mt);
+        done_count = vitastor_c_get_completions(client, done, 4);
+    }
+    assert(done_count == 1 && done[0] == &rd_op && rd_op.retval == 8192 && check_buf(buf, 8192, 0x77));
+    // Callbacks are called in I/O threads
+    long s = -1;
+    vitastor_c_sync(client, test_c_io_cb, &s);
+    for (int i = 0; i < 10 && s == -1; i++)
+    {
+        complete_mt_ops(client->mt);
+    }
+    assert(s == 0);
+    // Changes are parsed by every thread
+    {
+        std::lock_guard<std::mutex> lock(client->mt->state_mutex);
+        std::map<std::string, etcd_kv_t> changes;
+        changes["/config/inode/1/2"] = (etcd_kv_t){
+            .key = "/config/inode/1/2",
+            .value = json11::Json::object { { "name", "testimg" }, { "size", 1048576 } },
+        };
+        client->mt->st_cli->parse_state(changes["/config/inode/1/2"]);
+        client->mt->st_cli->on_change_hook(changes);
+    }
+    std::mutex mu;
+    std::condition_variable cv;
+    int found = 0, left = client->mt->thread_count();
+    client->mt->run_in_threads([&](cluster_client_t *cli)
+    {
+        auto ino_it = cli->st_cli.inode_config.find(0x1000000000002);
+        std::lock_guard<std::mutex> lock(mu);
+        found += ino_it != cli->st_cli.inode_config.end() && ino_it->second.size == 1048576 &&
+            cli->st_cli.inode_by_name.at("testimg") == 0x1000000000002;
+        left--;
+        cv.notify_all();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&]() { return left == 0; });
+    }
+    assert(found == 2);
+    free(buf);
+    vitastor_c_destroy(client);
+    printf("[ok] multi-threaded C API test\n");
+}
+
 int main(int narg, char *args[])
 {
     test1();
     test2();
+    test3();
+    test4();
+    test5();
+    test6();
+    test6_owned();
+    test7();
+    test8();
+    test8_old_osd();
+    test9();
+    test10();
+    for (int depth = 16; depth <= 4096; depth *= 4)
+        bench_queue_depth(depth);
     return 0;
 }
@@ -6,29 +6,7 @@
 
 #include <sys/epoll.h>
 
-#include "ringloop.h"
-#include "epoll_manager.h"
-#include "cluster_client.h"
-
-#include "vitastor_c.h"
-
-struct vitastor_qemu_fd_t
-{
-    int fd;
-    std::function<void(int, int)> callback;
-};
-
-struct vitastor_c
-{
-    std::map<int, vitastor_qemu_fd_t> handlers;
-    ring_loop_t *ringloop = NULL;
-    epoll_manager_t *epmgr = NULL;
-    timerfd_manager_t *tfd = NULL;
-    cluster_client_t *cli = NULL;
-
-    QEMUSetFDHandler *aio_set_fd_handler = NULL;
-    void *aio_ctx = NULL;
-};
+#include "vitastor_c_impl.h"
 
 extern "C" {
 
@@ -58,6 +36,24 @@ static json11::Json vitastor_c_common_config(const char *config_path, const char
     return json11::Json(cfg);
 }
 
+static json11::Json vitastor_c_json_config(const char **options, int options_len)
+{
+    json11::Json::object cfg;
+    for (int i = 0; i < options_len-1; i += 2)
+    {
+        cfg[options[i]] = std::string(options[i+1]);
+    }
+    return json11::Json(cfg);
+}
+
+static void vitastor_c_execute(vitastor_c *client, cluster_op_t *op)
+{
+    if (client->mt)
+        client->mt->execute(op);
+    else
+        client->cli->execute(op);
+}
+
 static void vitastor_c_read_handler(void *opaque)
 {
     vitastor_qemu_fd_t *data = (vitastor_qemu_fd_t *)opaque;
@@ -115,12 +111,7 @@ vitastor_c *vitastor_c_create_uring(const char *config_path, const char *etcd_ho
 
 vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len)
 {
-    json11::Json::object cfg;
-    for (int i = 0; i < options_len-1; i += 2)
-    {
-        cfg[options[i]] = std::string(options[i+1]);
-    }
-    json11::Json cfg_json(cfg);
+    json11::Json cfg_json = vitastor_c_json_config(options, options_len);
     vitastor_c *self = new vitastor_c;
     self->ringloop = new ring_loop_t(512);
     self->epmgr = new epoll_manager_t(self->ringloop);
@@ -128,8 +119,22 @@ vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len)
     return self;
 }
 
+vitastor_c *vitastor_c_create_mt(const char **options, int options_len, int threads)
+{
+    json11::Json cfg_json = vitastor_c_json_config(options, options_len);
+    vitastor_c *self = new vitastor_c;
+    self->mt = new cluster_client_mt_t(cfg_json, threads);
+    return self;
+}
+
 void vitastor_c_destroy(vitastor_c *client)
 {
+    if (client->mt)
+    {
+        delete client->mt;
+        delete client;
+        return;
+    }
     delete client->cli;
     if (client->epmgr)
         delete client->epmgr;
@@ -142,11 +147,18 @@ void vitastor_c_destroy(vitastor_c *client)
 
 int vitastor_c_is_ready(vitastor_c *client)
 {
+    if (client->mt)
+        return client->mt->is_ready();
     return client->cli->is_ready();
 }
 
 void vitastor_c_uring_wait_ready(vitastor_c *client)
 {
+    if (client->mt)
+    {
+        client->mt->wait_ready();
+        return;
+    }
     while (!client->cli->is_ready())
     {
         client->ringloop->loop();
@@ -158,12 +170,15 @@ void vitastor_c_uring_wait_ready(vitastor_c *client)
 
 void vitastor_c_uring_handle_events(vitastor_c *client)
 {
-    client->ringloop->loop();
+    // The multi-threaded client handles events in its own threads
+    if (client->ringloop)
+        client->ringloop->loop();
 }
 
 void vitastor_c_uring_wait_events(vitastor_c *client)
 {
-    client->ringloop->wait();
+    if (client->ringloop)
+        client->ringloop->wait();
 }
 
 void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
@@ -183,7 +198,7 @@ void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64
         cb(opaque, op->retval, op->version);
         delete op;
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
 }
 
 void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, uint64_t check_version,
@@ -204,7 +219,35 @@ void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint6
         cb(opaque, op->retval);
         delete op;
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
+}
+
+static void vitastor_c_zero(vitastor_c *client, uint64_t opcode, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque)
+{
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = opcode;
+    op->inode = inode;
+    op->offset = offset;
+    op->len = len;
+    op->callback = [cb, opaque](cluster_op_t *op)
+    {
+        cb(opaque, op->retval);
+        delete op;
+    };
+    vitastor_c_execute(client, op);
+}
+
+void vitastor_c_write_zeroes(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque)
+{
+    vitastor_c_zero(client, OSD_OP_WRITE_ZEROES, inode, offset, len, cb, opaque);
+}
+
+void vitastor_c_discard(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque)
+{
+    vitastor_c_zero(client, OSD_OP_DISCARD, inode, offset, len, cb, opaque);
 }
 
 void vitastor_c_read_bitmap(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
@@ -226,7 +269,7 @@ void vitastor_c_read_bitmap(vitastor_c *client, uint64_t inode, uint64_t offset,
         cb(opaque, op->retval, bitmap);
         delete op;
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
 }
 
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque)
@@ -238,11 +281,115 @@ void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque)
         cb(opaque, op->retval);
         delete op;
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
+}
+
+static void vitastor_c_complete(vitastor_c *client, vitastor_c_op *cop, long retval)
+{
+    cop->retval = retval;
+    if (client->mt)
+    {
+        std::lock_guard<std::mutex> lock(client->completed_mutex);
+        client->completed.push_back(cop);
+        client->completed_cond.notify_all();
+    }
+    else
+        client->completed.push_back(cop);
+}
+
+void vitastor_c_submit(vitastor_c *client, vitastor_c_op **ops, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        vitastor_c_op *cop = ops[i];
+        if (cop->opcode != VITASTOR_OP_READ && cop->opcode != VITASTOR_OP_WRITE &&
+            cop->opcode != VITASTOR_OP_SYNC && cop->opcode != VITASTOR_OP_WRITE_ZEROES &&
+            cop->opcode != VITASTOR_OP_DISCARD)
+        {
+            vitastor_c_complete(client, cop, -EINVAL);
+            continue;
+        }
+        cluster_op_t *op = new cluster_op_t;
+        if (cop->opcode == VITASTOR_OP_SYNC)
+        {
+            op->opcode = OSD_OP_SYNC;
+        }
+        else
+        {
+            op->opcode = cop->opcode == VITASTOR_OP_READ ? OSD_OP_READ
+                : (cop->opcode == VITASTOR_OP_WRITE_ZEROES ? OSD_OP_WRITE_ZEROES
+                : (cop->opcode == VITASTOR_OP_DISCARD ? OSD_OP_DISCARD : OSD_OP_WRITE));
+            op->inode = cop->inode;
+            op->offset = cop->offset;
+            op->len = cop->len;
+            op->version = cop->opcode == VITASTOR_OP_WRITE ? cop->version : 0;
+            for (int j = 0; j < cop->iovcnt; j++)
+            {
+                op->iov.push_back(cop->iov[j].iov_base, cop->iov[j].iov_len);
+            }
+        }
+        op->callback = [client, cop](cluster_op_t *op)
+        {
+            if (op->opcode == OSD_OP_READ)
+                cop->version = op->version;
+            vitastor_c_complete(client, cop, op->retval);
+            delete op;
+        };
+        vitastor_c_execute(client, op);
+    }
+}
+
+static int vitastor_c_take_completions(vitastor_c *client, vitastor_c_op **done, int max)
+{
+    int n = 0;
+    while (n < max && client->completed.size())
+    {
+        done[n++] = client->completed.front();
+        client->completed.pop_front();
+    }
+    return n;
+}
+
+int vitastor_c_get_completions(vitastor_c *client, vitastor_c_op **done, int max)
+{
+    if (client->mt)
+    {
+        std::lock_guard<std::mutex> lock(client->completed_mutex);
+        return vitastor_c_take_completions(client, done, max);
+    }
+    return vitastor_c_take_completions(client, done, max);
+}
+
+int vitastor_c_uring_wait_completions(vitastor_c *client, vitastor_c_op **done, int min, int max)
+{
+    if (client->mt)
+    {
+        std::unique_lock<std::mutex> lock(client->completed_mutex);
+        client->completed_cond.wait(lock, [&]() { return client->completed.size() >= (size_t)min; });
+        return vitastor_c_take_completions(client, done, max);
+    }
+    while (true)
+    {
+        client->ringloop->loop();
+        if (client->completed.size() >= (size_t)min)
+            break;
+        client->ringloop->wait();
+    }
+    return vitastor_c_take_completions(client, done, max);
 }
 
 void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler cb, void *opaque)
 {
+    if (client->mt)
+    {
+        // Called in the control thread or in the current thread
+        client->mt->on_ready([=]()
+        {
+            auto watch = client->mt->st_cli->watch_inode(std::string(image));
+            cb(opaque, (long)watch);
+        });
+        return;
+    }
     client->cli->on_ready([=]()
     {
         auto watch = client->cli->st_cli.watch_inode(std::string(image));
@@ -252,6 +399,12 @@ void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler c
 
 void vitastor_c_close_watch(vitastor_c *client, void *handle)
 {
+    if (client->mt)
+    {
+        std::lock_guard<std::mutex> lock(client->mt->state_mutex);
+        client->mt->st_cli->close_watch((inode_watch_t*)handle);
+        return;
+    }
     client->cli->st_cli.close_watch((inode_watch_t*)handle);
 }
 
@@ -269,8 +422,12 @@ uint64_t vitastor_c_inode_get_num(void *handle)
 
 uint32_t vitastor_c_inode_get_block_size(vitastor_c *client, uint64_t inode_num)
 {
-    auto pool_it = client->cli->st_cli.pool_config.find(INODE_POOL(inode_num));
-    if (pool_it == client->cli->st_cli.pool_config.end())
+    std::unique_lock<std::mutex> lock;
+    if (client->mt)
+        lock = std::unique_lock<std::mutex>(client->mt->state_mutex);
+    auto & st_cli = client->mt ? *client->mt->st_cli : client->cli->st_cli;
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(inode_num));
+    if (pool_it == st_cli.pool_config.end())
         return 0;
     auto & pool_cfg = pool_it->second;
     uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
@@ -279,8 +436,12 @@ uint32_t vitastor_c_inode_get_block_size(vitastor_c *client, uint64_t inode_num)
 
 uint32_t vitastor_c_inode_get_bitmap_granularity(vitastor_c *client, uint64_t inode_num)
 {
-    auto pool_it = client->cli->st_cli.pool_config.find(INODE_POOL(inode_num));
-    if (pool_it == client->cli->st_cli.pool_config.end())
+    std::unique_lock<std::mutex> lock;
+    if (client->mt)
+        lock = std::unique_lock<std::mutex>(client->mt->state_mutex);
+    auto & st_cli = client->mt ? *client->mt->st_cli : client->cli->st_cli;
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(inode_num));
+    if (pool_it == st_cli.pool_config.end())
         return 0;
     // FIXME: READ_BITMAP may fails if parent bitmap granularity differs from inode bitmap granularity
     return pool_it->second.bitmap_granularity;
@@ -292,4 +453,59 @@ int vitastor_c_inode_get_readonly(void *handle)
     return watch->cfg.readonly;
 }
 
+void vitastor_c_get_read_cache_stats(vitastor_c *client, uint64_t *hits, uint64_t *misses, uint64_t *hit_bytes)
+{
+    cluster_read_cache_stats_t stats;
+    if (client->mt)
+    {
+        // Sum of all threads, may be slightly out of date
+        for (int i = 0; i < client->mt->thread_count(); i++)
+        {
+            auto & thr_stats = client->mt->get_thread_client(i)->read_cache.stats;
+            stats.hits += thr_stats.hits;
+            stats.misses += thr_stats.misses;
+            stats.hit_bytes += thr_stats.hit_bytes;
+        }
+    }
+    else
+        stats = client->cli->read_cache.stats;
+    if (hits)
+        *hits = stats.hits;
+    if (misses)
+        *misses = stats.misses;
+    if (hit_bytes)
+        *hit_bytes = stats.hit_bytes;
+}
+
+void vitastor_c_set_readahead(vitastor_c *client, uint64_t max_size)
+{
+    if (client->mt)
+        client->mt->run_in_threads([max_size](cluster_client_t *cli) { cli->set_readahead_size(max_size); });
+    else
+        client->cli->set_readahead_size(max_size);
+}
+
+void vitastor_c_get_readahead_stats(vitastor_c *client, uint64_t *hits, uint64_t *misses, uint64_t *read_bytes)
+{
+    cluster_readahead_stats_t stats;
+    if (client->mt)
+    {
+        for (int i = 0; i < client->mt->thread_count(); i++)
+        {
+            auto & thr_stats = client->mt->get_thread_client(i)->readahead_stats;
+            stats.hits += thr_stats.hits;
+            stats.misses += thr_stats.misses;
+            stats.read_bytes += thr_stats.read_bytes;
+        }
+    }
+    else
+        stats = client->cli->readahead_stats;
+    if (hits)
+        *hits = stats.hits;
+    if (misses)
+        *misses = stats.misses;
+    if (read_bytes)
+        *read_bytes = stats.read_bytes;
+}
+
 }
@@ -7,7 +7,7 @@
 #define VITASTOR_QEMU_PROXY_H
 
 // C API wrapper version
-#define VITASTOR_C_API_VERSION 1
+#define VITASTOR_C_API_VERSION 6
 
 #ifndef POOL_ID_BITS
 #define POOL_ID_BITS 16
@@ -26,6 +26,30 @@ typedef void VitastorReadHandler(void *opaque, long retval, uint64_t version);
 typedef void VitastorIOHandler(void *opaque, long retval);
 typedef void VitastorReadBitmapHandler(void *opaque, long retval, uint8_t *bitmap);
 
+#define VITASTOR_OP_READ 1
+#define VITASTOR_OP_WRITE 2
+#define VITASTOR_OP_SYNC 3
+#define VITASTOR_OP_WRITE_ZEROES 4
+#define VITASTOR_OP_DISCARD 5
+
+// Operation for batched submission, owned by the caller until it's returned by
+// vitastor_c_get_completions() or vitastor_c_uring_wait_completions()
+struct vitastor_c_op
+{
+    int opcode;
+    uint64_t inode;
+    uint64_t offset;
+    uint64_t len;
+    // check version for writes, current object version is returned here by reads
+    uint64_t version;
+    struct iovec *iov;
+    int iovcnt;
+    void *opaque;
+    // filled on completion, same as in callbacks
+    long retval;
+};
+typedef struct vitastor_c_op vitastor_c_op;
+
 // QEMU
 typedef void IOHandler(void *opaque);
 // is_external and poll_fn are not required, but are here for compatibility
@@ -37,6 +61,11 @@ vitastor_c *vitastor_c_create_qemu(QEMUSetFDHandler *aio_set_fd_handler, void *a
 vitastor_c *vitastor_c_create_uring(const char *config_path, const char *etcd_host, const char *etcd_prefix,
     int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level);
 vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len);
+// Multi-threaded client with <threads> I/O threads sharing one connection to etcd.
+// Operations may be submitted from any thread, callbacks are called from I/O threads.
+// Events are handled internally, so vitastor_c_uring_handle_events() and
+// vitastor_c_uring_wait_events() do nothing for it
+vitastor_c *vitastor_c_create_mt(const char **options, int options_len, int threads);
 void vitastor_c_destroy(vitastor_c *client);
 int vitastor_c_is_ready(vitastor_c *client);
 void vitastor_c_uring_wait_ready(vitastor_c *client);
@@ -46,9 +75,23 @@ void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64
     struct iovec *iov, int iovcnt, VitastorReadHandler cb, void *opaque);
 void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, uint64_t check_version,
     struct iovec *iov, int iovcnt, VitastorIOHandler cb, void *opaque);
+// Make the range read as zeroes without sending any data. Zeroes are written as usual data
+// to OSDs of older versions which don't support it
+void vitastor_c_write_zeroes(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque);
+// Make the range read as zeroes or as data of the parent layer, free space when possible.
+// Fails with -EOPNOTSUPP if OSDs are of older versions which don't support it
+void vitastor_c_discard(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque);
 void vitastor_c_read_bitmap(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
     int with_parents, VitastorReadBitmapHandler cb, void *opaque);
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque);
+// Submit <count> operations at once, without callbacks
+void vitastor_c_submit(vitastor_c *client, vitastor_c_op **ops, int count);
+// Move up to <max> completed operations to <done> without waiting, returns their number
+int vitastor_c_get_completions(vitastor_c *client, vitastor_c_op **done, int max);
+// Handle events until at least <min> operations are completed, then get up to <max> of them
+int vitastor_c_uring_wait_completions(vitastor_c *client, vitastor_c_op **done, int min, int max);
 void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler cb, void *opaque);
 void vitastor_c_close_watch(vitastor_c *client, void *handle);
 uint64_t vitastor_c_inode_get_size(void *handle);
@@ -56,6 +99,12 @@ uint64_t vitastor_c_inode_get_num(void *handle);
 uint32_t vitastor_c_inode_get_block_size(vitastor_c *client, uint64_t inode_num);
 uint32_t vitastor_c_inode_get_bitmap_granularity(vitastor_c *client, uint64_t inode_num);
 int vitastor_c_inode_get_readonly(void *handle);
+// Client read cache statistics (see client_read_cache_size), any pointer may be NULL
+void vitastor_c_get_read_cache_stats(vitastor_c *client, uint64_t *hits, uint64_t *misses, uint64_t *hit_bytes);
+// Set the maximum sequential read-ahead window (overrides client_readahead_size), 0 disables read-ahead
+void vitastor_c_set_readahead(vitastor_c *client, uint64_t max_size);
+// Read-ahead statistics, any pointer may be NULL
+void vitastor_c_get_readahead_stats(vitastor_c *client, uint64_t *hits, uint64_t *misses, uint64_t *read_bytes);
 
 #ifdef __cplusplus
 }
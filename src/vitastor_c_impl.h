@@ -0,0 +1,42 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Internals of the C client library, shared with tests
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+
+#include <ringloop.h>
+#include <epoll_manager.h>
+#include "cluster_client.h"
+#include "cluster_client_mt.h"
+
+#include "vitastor_c.h"
+
+struct vitastor_qemu_fd_t
+{
+    int fd;
+    std::function<void(int, int)> callback;
+};
+
+struct vitastor_c
+{
+    std::map<int, vitastor_qemu_fd_t> handlers;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    timerfd_manager_t *tfd = NULL;
+    cluster_client_t *cli = NULL;
+    // multi-threaded client, cli is NULL then
+    cluster_client_mt_t *mt = NULL;
+
+    // completed operations submitted by vitastor_c_submit()
+    // mutex and cond are only used with the multi-threaded client
+    std::deque<vitastor_c_op*> completed;
+    std::mutex completed_mutex;
+    std::condition_variable completed_cond;
+
+    QEMUSetFDHandler *aio_set_fd_handler = NULL;
+    void *aio_ctx = NULL;
+};
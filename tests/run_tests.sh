@@ -14,6 +14,8 @@ SCHEME=ec ./test_change_pg_count.sh
 
 ./test_create_nomaxid.sh
 
+./test_discard.sh
+
 ./test_etcd_fail.sh
 
 ./test_failure_domain.sh
@@ -27,6 +29,8 @@ SCHEME=ec IMMEDIATE_COMMIT=1 ./test_interrupted_rebalance.sh
 
 ./test_move_reappear.sh
 
+./test_rdma_rxe.sh
+
 ./test_rebalance_verify.sh
 IMMEDIATE_COMMIT=1 ./test_rebalance_verify.sh
 SCHEME=ec ./test_rebalance_verify.sh
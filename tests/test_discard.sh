@@ -0,0 +1,94 @@
+#!/bin/bash -ex
+
+# WRITE_ZEROES and DISCARD handling by primary OSDs: partial discards of layered images
+# expose parent data, zeroed objects of clones aren't deleted, and degraded PGs write
+# zeroes instead of deleting whole objects
+
+SCHEME=replicated
+PG_SIZE=3
+PG_MINSIZE=2
+
+. `dirname $0`/run_3osds.sh
+check_qemu
+
+IMG_SIZE=$((1024*1024))
+$ETCDCTL put /vitastor/config/inode/1/2 '{"name":"testimg@0","size":'$IMG_SIZE'}'
+$ETCDCTL put /vitastor/config/inode/1/3 '{"parent_id":2,"name":"testimg","size":'$IMG_SIZE'}'
+$ETCDCTL put /vitastor/config/inode/1/4 '{"name":"flatimg","size":'$IMG_SIZE'}'
+
+# Run qemu-io commands, "discard" is only passed to the driver with -d unmap
+qemu_io()
+{
+    local img=$1
+    shift
+    local out
+    out=$(qemu-io -d unmap -f raw "$@" "vitastor:etcd_host=127.0.0.1\:$ETCD_PORT/v3:image=$img" 2>&1)
+    echo "$out"
+    if echo "$out" | grep -qi "fail\|error"; then
+        format_error "qemu-io $* failed on $img"
+    fi
+}
+
+# Fill <len> bytes of the expected image at <offset> with <byte>
+fill()
+{
+    head -c $3 /dev/zero | tr '\0' "\\$(printf %o $4)" | dd of=./testdata/$1.expected oflag=seek_bytes seek=$2 conv=notrunc status=none
+}
+
+check_image()
+{
+    qemu-img convert -S 4096 -f raw "vitastor:etcd_host=127.0.0.1\:$ETCD_PORT/v3:image=$1" -O raw ./testdata/$1.bin
+    if ! cmp ./testdata/$1.bin ./testdata/$1.expected; then
+        format_error "$1 data differs from the expected data"
+    fi
+}
+
+rm -f ./testdata/testimg.expected ./testdata/flatimg.expected
+qemu_io testimg@0 -c "write -P 0xaa 0 1M"
+fill testimg 0 $IMG_SIZE 0xaa
+qemu_io testimg -c "write -P 0xbb 0 256k" -c "write -P 0xbb 512k 256k"
+fill testimg 0 $((256*1024)) 0xbb
+fill testimg $((512*1024)) $((256*1024)) 0xbb
+qemu_io flatimg -c "write -P 0xcc 0 1M"
+fill flatimg 0 $IMG_SIZE 0xcc
+
+# Partial discard of a layered image clears bitmap bits and reads parent data again
+qemu_io testimg -c "discard 64k 32k"
+fill testimg $((64*1024)) $((32*1024)) 0xaa
+# Whole-object WRITE_ZEROES of a clone writes zeroes, both over its own data and over parent data
+qemu_io testimg -c "write -z 128k 128k" -c "write -z 256k 128k"
+fill testimg $((128*1024)) $((256*1024)) 0
+# Whole-object discard of a clone deletes the object
+qemu_io testimg -c "discard 384k 128k"
+# Whole-object WRITE_ZEROES without a parent deletes the object, partial discard zeroes the range
+qemu_io flatimg -c "write -z 0 128k" -c "discard 192k 32k"
+fill flatimg 0 $((128*1024)) 0
+fill flatimg $((192*1024)) $((32*1024)) 0
+
+check_image testimg
+check_image flatimg
+
+# Objects can't be deleted in degraded PGs, zeroes are written instead
+kill -INT $OSD3_PID
+for i in $(seq 1 30); do
+    if $ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -e '(.state | index("active")) != null and (.state | index("degraded")) != null'; then
+        break
+    fi
+    if [[ $i -eq 30 ]]; then
+        format_error "PG didn't become active+degraded"
+    fi
+    sleep 1
+done
+
+# Discard written as zeroes still clears bitmap bits of a layered image
+qemu_io testimg -c "discard 512k 128k"
+fill testimg $((512*1024)) $((128*1024)) 0xaa
+qemu_io testimg -c "write -z 640k 128k"
+fill testimg $((640*1024)) $((128*1024)) 0
+qemu_io flatimg -c "write -z 384k 128k" -c "discard 512k 128k"
+fill flatimg $((384*1024)) $((256*1024)) 0
+
+check_image testimg
+check_image flatimg
+
+format_green OK
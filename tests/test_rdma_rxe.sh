@@ -0,0 +1,58 @@
+#!/bin/bash -ex
+
+# Run OSDs and fio over SoftRoCE (rdma_rxe) with payloads above the RDMA rendezvous
+# threshold and verify the data. Requires root or sudo to set up the rxe device
+
+RXE_NAME=${RXE_NAME:-rxe_vitastor}
+RXE_NETDEV=${RXE_NETDEV:-vitastor_rxe}
+RXE_IP=${RXE_IP:-10.254.254.1}
+# GID 1 of an rxe device is usually the IPv4-mapped address of the interface
+RXE_GID_INDEX=${RXE_GID_INDEX:-1}
+
+if ! rdma link show | grep -q "$RXE_NAME"; then
+    sudo modprobe rdma_rxe
+    if ! ip link show $RXE_NETDEV &>/dev/null; then
+        # rxe delivers packets to local addresses internally, so a dummy interface is enough
+        sudo ip link add $RXE_NETDEV type dummy
+        sudo ip addr add $RXE_IP/24 dev $RXE_NETDEV
+        sudo ip link set $RXE_NETDEV up
+    fi
+    sudo rdma link add $RXE_NAME type rxe netdev $RXE_NETDEV
+fi
+
+RDMA_OPTS="--use_rdma 1 --rdma_device $RXE_NAME --rdma_gid_index $RXE_GID_INDEX --rdma_mtu 1024 --rdma_rdv_threshold 65536"
+OSD_ARGS="$RDMA_OPTS $OSD_ARGS"
+
+. `dirname $0`/run_3osds.sh
+
+FIO_RDMA="-use_rdma=1 -rdma_device=$RXE_NAME -rdma_gid_index=$RXE_GID_INDEX -rdma_mtu=1024"
+
+# Writes larger than the threshold go through rendezvous reads from clients to primary OSDs and
+# from primary OSDs to secondary ones, reads go through rendezvous reads of replies by clients
+LD_PRELOAD="build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=1M -direct=1 -iodepth=16 \
+        -rw=write -etcd=$ETCD_URL -pool=1 -inode=1 -size=128M $FIO_RDMA \
+        -verify=crc32c -verify_fatal=1 -do_verify=1
+
+# Mixed sizes around the threshold and random offsets. Overlapping parallel writes
+# also check that rendezvous operations complete in the order of receiving
+LD_PRELOAD="build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bsrange=4k-512k -direct=1 -iodepth=32 \
+        -rw=randwrite -etcd=$ETCD_URL -pool=1 -inode=1 -size=128M -number_ios=4096 $FIO_RDMA \
+        -verify=crc32c -verify_fatal=1 -do_verify=1
+
+# Sequential read of everything with large blocks
+LD_PRELOAD="build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4M -direct=1 -iodepth=4 \
+        -rw=read -etcd=$ETCD_URL -pool=1 -inode=1 -size=128M $FIO_RDMA
+
+for i in $(seq 1 $OSD_COUNT); do
+    if ! grep -q "RDMA initialized successfully" ./testdata/osd$i.log; then
+        format_error "OSD $i didn't initialize RDMA"
+    fi
+    if grep -q "rendezvous\|RDMA work request failed" ./testdata/osd$i.log; then
+        format_error "OSD $i reported RDMA rendezvous errors"
+    fi
+done
+
+format_green OK